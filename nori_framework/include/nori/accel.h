@@ -0,0 +1,531 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2012 by Wenzel Jakob and Steve Marschner.
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#if !defined(__ACCEL_H)
+#define __ACCEL_H
+
+#include <nori/mesh.h>
+#include <nori/bbox.h>
+#include <QThreadStorage>
+#include <QMutex>
+
+#define NORI_DEFAULT_ACCELERATOR "kdtree" /* Used when the scene does not specify an accelerator */
+#define NORI_PACKED_FLOATS 9 /* Floats per packed triangle: first vertex and two edges */
+#define NORI_PACKET_SIZE 16 /* Max. number of rays that are traced together as a packet */
+#define NORI_STREAM_CHUNK 256 /* Rays of a stream are sorted by direction octant in chunks of this size */
+#define NORI_NO_OCCLUDER 0xFFFFFFFFu /* Packed triangle slot denoting "no cached occluder" */
+
+class QCryptographicHash;
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Ray traversal counters (see \ref Accelerator::setStatistics())
+ */
+struct RayStatistics {
+	/// Number of closest-hit and shadow ray queries
+	uint64_t closestHitRays, shadowRays;
+	/// Number of queries that found an intersection or occluder
+	uint64_t hits;
+	/// Number of visited inner nodes and leaves
+	uint64_t innerNodes, leaves;
+	/// Number of ray-triangle intersection tests
+	uint64_t triangleTests;
+
+	/// Create a record with all counters set to zero
+	inline RayStatistics() { reset(); }
+
+	/// Set all counters to zero
+	void reset();
+
+	/// Add the counters of another record
+	RayStatistics &operator+=(const RayStatistics &stats);
+
+	/// Return the cost of the counted work (visited nodes plus triangle tests)
+	inline uint64_t getCost() const { return innerNodes + leaves + triangleTests; }
+
+	/// Return a human-readable report including per-ray averages
+	QString toString() const;
+};
+
+/**
+ * \brief Reference to a triangle found by a spatial query
+ * (see \ref Accelerator::trianglesInRadius())
+ */
+struct TriangleRef {
+	/// Mesh containing the triangle
+	const Mesh *mesh;
+	/// Index of the triangle within the mesh
+	uint32_t index;
+
+	inline TriangleRef() { }
+	inline TriangleRef(const Mesh *mesh, uint32_t index) : mesh(mesh), index(index) { }
+
+	inline bool operator<(const TriangleRef &ref) const {
+		return mesh < ref.mesh || (mesh == ref.mesh && index < ref.index);
+	}
+
+	inline bool operator==(const TriangleRef &ref) const {
+		return mesh == ref.mesh && index == ref.index;
+	}
+};
+
+/**
+ * \brief Abstract ray intersection acceleration data structure
+ *
+ * An accelerator references the triangles of a set of meshes and
+ * answers ray intersection queries against them. The meshes are
+ * owned by the scene.
+ *
+ * Triangles are identified by a single global primitive index, which
+ * enumerates the triangles of all registered meshes in the order in
+ * which the meshes were added (see \ref findMesh()).
+ */
+class Accelerator {
+public:
+	/// Create a new and empty accelerator
+	Accelerator();
+
+	/// Release all memory
+	virtual ~Accelerator();
+
+	/**
+	 * \brief Register a triangle mesh for inclusion in the accelerator.
+	 *
+	 * This function can only be used before \ref build() is called
+	 */
+	virtual void addMesh(Mesh *mesh);
+
+	/// Build the acceleration data structure
+	virtual void build() = 0;
+
+	/**
+	 * \brief Update the acceleration data structure after registered
+	 * meshes have moved or deformed
+	 *
+	 * The triangle count of every mesh must stay the same. The default
+	 * implementation builds the data structure again.
+	 *
+	 * \param mesh
+	 *     The mesh that has changed (this may also be an \ref Instance
+	 *     whose transformation was set), or \c NULL if any of them may
+	 *     have changed
+	 */
+	virtual void refit(const Mesh *mesh = NULL);
+
+	/**
+	 * \brief Intersect a ray against all registered triangle meshes
+	 *
+	 * Detailed information about the intersection, if any, will be
+	 * stored in the provided \ref Intersection data record.
+	 *
+	 * The <tt>shadowRay</tt> parameter specifies whether this detailed
+	 * information is really needed. When set to \c true, the
+	 * function just checks whether or not there is occlusion, but without
+	 * providing any more detail (i.e. \c its will not be filled with
+	 * contents). This is usually much faster.
+	 *
+	 * \return \c true If an intersection was found
+	 */
+	virtual bool rayIntersect(const Ray3f &ray, Intersection &its,
+		bool shadowRay = false) const = 0;
+
+	/**
+	 * \brief Intersect a ray that starts on a previously found surface
+	 *
+	 * Same as \ref rayIntersect(), except that accelerators which support
+	 * it begin the traversal in the given leaf instead of the root. The
+	 * default implementation ignores the leaf.
+	 *
+	 * \param leaf
+	 *     \ref Intersection::leaf of the intersection at the ray origin
+	 */
+	virtual bool rayIntersectFrom(uint32_t leaf, const Ray3f &ray,
+		Intersection &its) const;
+
+	/**
+	 * \brief Check whether a shadow ray is occluded
+	 *
+	 * Equivalent to <tt>rayIntersect(ray, its, true)</tt>, but routed
+	 * through the any-hit traversal of \ref findOccluder(). When the
+	 * shadow cache is enabled (see \ref setShadowCache()), the triangle
+	 * that blocked the previous shadow ray of the calling thread is
+	 * tested before any traversal takes place.
+	 *
+	 * \param leaf
+	 *     \ref Intersection::leaf of the intersection at the ray origin
+	 *     (see \ref rayIntersectFrom()), if known
+	 */
+	bool occluded(const Ray3f &ray, uint32_t leaf = NORI_NO_LEAF) const;
+
+	/**
+	 * \brief Find the \c k closest intersections along a ray
+	 *
+	 * Accelerators that support it collect the intersections during a
+	 * single traversal (see \ref findHits()). A triangle is reported at
+	 * most once, even when several leaves reference it.
+	 *
+	 * \param its
+	 *     Array with room for \c k records, which receives the
+	 *     intersections sorted by distance
+	 * \return The number of intersections found (at most \c k)
+	 */
+	uint32_t rayIntersectK(const Ray3f &ray, uint32_t k, Intersection *its) const;
+
+	/**
+	 * \brief Find all intersections within <tt>[ray.mint, ray.maxt]</tt>
+	 *
+	 * \param its
+	 *     Is cleared and receives the intersections sorted by distance
+	 */
+	void rayIntersectAll(const Ray3f &ray, std::vector<Intersection> &its) const;
+
+	/**
+	 * \brief Find the point on the triangles that is closest to \c p
+	 *
+	 * The point-triangle distances are computed exactly. The default
+	 * implementation tests every triangle, while accelerators that
+	 * support it only visit the part of the data structure within
+	 * \c maxDist. Queries are thread-safe and do not allocate memory.
+	 *
+	 * \param maxDist
+	 *     Triangles farther away from \c p are ignored
+	 * \param its
+	 *     Receives the closest point (\c its.p) along with its triangle,
+	 *     texture coordinates and frames as for a ray intersection.
+	 *     \c its.t receives the distance to \c p.
+	 * \return \c true if a triangle within \c maxDist was found
+	 */
+	virtual bool closestPoint(const Point3f &p, float maxDist, Intersection &its) const;
+
+	/**
+	 * \brief Find all triangles within distance \c radius of \c p
+	 *
+	 * Like \ref closestPoint(), this uses exact point-triangle distances.
+	 * When the vector is reused across queries, no memory is allocated
+	 * once it has grown large enough.
+	 *
+	 * \param triangles
+	 *     Is cleared and receives the triangles (in no particular order)
+	 */
+	virtual void trianglesInRadius(const Point3f &p, float radius,
+		std::vector<TriangleRef> &triangles) const;
+
+	/// Enable or disable the per-thread last occluder cache (enabled by default)
+	inline void setShadowCache(bool enabled) { m_shadowCache = enabled; }
+
+	/**
+	 * \brief Enable or disable the ray traversal counters (disabled by default)
+	 *
+	 * Every thread counts into a private \ref RayStatistics record, hence
+	 * no synchronization is needed during traversal. Shadow rays traced
+	 * using \ref occluded() are counted by all accelerators, while
+	 * closest-hit rays, visited nodes and triangle tests are currently
+	 * only counted by the kd-tree.
+	 */
+	virtual void setStatistics(bool enabled);
+
+	/// Are the ray traversal counters enabled?
+	inline bool hasStatistics() const { return m_statistics; }
+
+	/// Add the counters of all threads to \c stats
+	virtual void getStatistics(RayStatistics &stats) const;
+
+	/**
+	 * \brief Add the counters of the calling thread to \c stats
+	 *
+	 * Comparing the result before and after some work attributes
+	 * its traversal cost (e.g. to a pixel)
+	 */
+	virtual void getThreadStatistics(RayStatistics &stats) const;
+
+	/// Set the counters of all threads to zero
+	virtual void resetStatistics();
+
+	/**
+	 * \brief Intersect a packet of up to \ref NORI_PACKET_SIZE rays
+	 *
+	 * For each ray, the result matches that of \ref rayIntersect():
+	 * \c hits[i] records whether ray \c i hit anything, and unless
+	 * \c shadowRay is set, \c its[i] describes the closest intersection.
+	 * Accelerators that support packet traversal process coherent rays
+	 * together. The default implementation traces them one by one.
+	 */
+	virtual void rayIntersectPacket(const Ray3f *rays, uint32_t count,
+		Intersection *its, bool *hits, bool shadowRay = false) const;
+
+	/// Intersect a packet of 4 rays (see \ref rayIntersectPacket())
+	inline void rayIntersect4(const Ray3f *rays, Intersection *its,
+			bool *hits, bool shadowRay = false) const {
+		rayIntersectPacket(rays, 4, its, hits, shadowRay);
+	}
+
+	/// Intersect a packet of 8 rays (see \ref rayIntersectPacket())
+	inline void rayIntersect8(const Ray3f *rays, Intersection *its,
+			bool *hits, bool shadowRay = false) const {
+		rayIntersectPacket(rays, 8, its, hits, shadowRay);
+	}
+
+	/// Intersect a packet of 16 rays (see \ref rayIntersectPacket())
+	inline void rayIntersect16(const Ray3f *rays, Intersection *its,
+			bool *hits, bool shadowRay = false) const {
+		rayIntersectPacket(rays, 16, its, hits, shadowRay);
+	}
+
+	/**
+	 * \brief Intersect an arbitrary number of rays
+	 *
+	 * The rays are grouped by the signs of their direction components
+	 * and traced as packets of up to \ref NORI_PACKET_SIZE rays.
+	 *
+	 * \param its
+	 *    Receives the intersections. May be \c NULL for shadow rays.
+	 * \param hits
+	 *    Receives whether each ray hit anything (for shadow rays: whether
+	 *    it is occluded)
+	 */
+	void rayIntersectStream(const Ray3f *rays, size_t count, Intersection *its,
+		bool *hits, bool shadowRay = false) const;
+
+	/// Return an axis-aligned bounding box containing all triangles
+	virtual const BoundingBox3f &getBoundingBox() const = 0;
+
+	/// Return the size of the built data structure in bytes
+	virtual size_t getMemoryUsage() const = 0;
+
+	/// Return a human-readable name (e.g. "SAH kd-tree")
+	virtual QString getName() const = 0;
+
+	/// Return the total number of triangles
+	inline uint32_t getPrimitiveCount() const { return m_primitiveCount; }
+
+	/// Return the total number of registered meshes
+	inline uint32_t getMeshCount() const { return (uint32_t) m_meshes.size(); }
+
+	/// Return one of the registered meshes
+	inline Mesh *getMesh(uint32_t idx) { return m_meshes[idx]; }
+
+	/// Return one of the registered meshes (const version)
+	inline const Mesh *getMesh(uint32_t idx) const { return m_meshes[idx]; }
+
+	/**
+	 * \brief Set a directory where accelerators that support it cache
+	 * their built data structures across runs
+	 *
+	 * An empty string (the default) disables caching.
+	 */
+	inline void setCacheDirectory(const QString &directory) { m_cacheDirectory = directory; }
+
+	/// Return the cache directory (see \ref setCacheDirectory())
+	inline const QString &getCacheDirectory() const { return m_cacheDirectory; }
+
+	/**
+	 * \brief Create an accelerator by name
+	 *
+	 * Supported names are "kdtree" (SAH kd-tree), "bvh" (binned SAH
+	 * bounding volume hierarchy) and "bvh4" (the same with 4-wide nodes)
+	 */
+	static Accelerator *create(const QString &name);
+
+	/**
+	 * \brief Build every supported accelerator over the meshes of a scene
+	 * and print their build time, memory usage and single-threaded
+	 * throughput for primary rays and ambient occlusion shadow rays.
+	 * Then compare the closest point and radius queries of the kd-tree
+	 * against brute force. Afterwards, time the kd-tree construction with 1, 2, 4, .. threads
+	 * up to the number of worker threads.
+	 */
+	static void benchmark(const Scene *scene);
+protected:
+	/**
+	 * \brief Compute the mesh and triangle indices corresponding to
+	 * a global primitive index
+	 *
+	 * \param idx
+	 *     The global primitive index. Is replaced by the index of
+	 *     the triangle within its mesh.
+	 * \return The index of the mesh
+	 */
+	inline uint32_t findMesh(uint32_t &idx) const {
+		std::vector<uint32_t>::const_iterator it = std::lower_bound(
+				m_sizeMap.begin(), m_sizeMap.end(), idx+1) - 1;
+		idx -= *it;
+		return (uint32_t) (it - m_sizeMap.begin());
+	}
+
+	/**
+	 * \brief Fill in the position, texture coordinates and frames of
+	 * an intersection
+	 *
+	 * \param primIndex
+	 *     Index of the triangle within <tt>its.mesh</tt>
+	 * \param its
+	 *     Intersection record, whose \c mesh, \c t and \c uv (the
+	 *     barycentric coordinates) fields have already been set
+	 */
+	void fillIntersection(uint32_t primIndex, Intersection &its) const;
+
+	/**
+	 * \brief Precompute the triangles referenced by an index array
+	 *
+	 * The first vertex and both edges of every referenced triangle are
+	 * stored as a structure of arrays in the order of \c indices, along
+	 * with the mesh and triangle index. Subclasses call this from
+	 * \ref build() once the final (leaf-ordered) index array is known,
+	 * so that \ref intersectPacked() can intersect a leaf without
+	 * touching the meshes.
+	 *
+	 * \param indices
+	 *     Global primitive indices (see \ref findMesh())
+	 */
+	void packTriangles(const uint32_t *indices, uint32_t count);
+
+	/**
+	 * \brief Intersect a ray against the packed triangles
+	 * <tt>[start, end)</tt>, four at a time when SSE is available
+	 *
+	 * Whenever a closer intersection is found, \c maxt, \c its.t,
+	 * \c its.uv (barycentric), \c its.mesh and \c primIndex (the index
+	 * of the triangle within its mesh) are updated.
+	 *
+	 * \return \c true if a closer intersection was found
+	 */
+	bool intersectPacked(uint32_t start, uint32_t end, const Ray3f &ray,
+		float mint, float &maxt, Intersection &its, uint32_t &primIndex) const;
+
+	/**
+	 * \brief Check whether any of the packed triangles <tt>[start, end)</tt>
+	 * blocks the ray within <tt>[mint, maxt]</tt>
+	 *
+	 * Unlike \ref intersectPacked(), this stops at the first hit and
+	 * stores its packed triangle index in \c slot.
+	 */
+	bool occludedPacked(uint32_t start, uint32_t end, const Ray3f &ray,
+		float mint, float maxt, uint32_t &slot) const;
+
+	/**
+	 * \brief Any-hit traversal used by \ref occluded()
+	 *
+	 * \c mint already includes the adaptive ray epsilon, and \c leaf is
+	 * the leaf at the ray origin passed to \ref occluded(). On success,
+	 * \c slot should receive the packed index of the occluding triangle
+	 * (or \ref NORI_NO_OCCLUDER). The default implementation calls
+	 * \ref rayIntersect() with <tt>shadowRay=true</tt>.
+	 */
+	virtual bool findOccluder(const Ray3f &ray, float mint, float maxt,
+		uint32_t leaf, uint32_t &slot) const;
+
+	/**
+	 * \brief Multi-hit query used by \ref rayIntersectK() and \ref rayIntersectAll()
+	 *
+	 * Appends the (up to) \c k closest intersections to \c its, sorted
+	 * by distance. The default implementation calls \ref rayIntersect()
+	 * repeatedly, moving the start of the ray just past the previous
+	 * hit. Hence it traverses the structure once per intersection and
+	 * reports only one of several triangles hit at exactly the same
+	 * distance.
+	 */
+	virtual void findHits(const Ray3f &ray, uint32_t k,
+		std::vector<Intersection> &its) const;
+
+	/// Intersection with a packed triangle (see \ref collectPacked())
+	struct PackedHit {
+		/// Distance along the ray
+		float t;
+		/// Barycentric coordinates
+		Point2f uv;
+		/// Packed index of the triangle
+		uint32_t slot;
+
+		inline bool operator<(const PackedHit &hit) const { return t < hit.t; }
+	};
+
+	/**
+	 * \brief Add the intersections of a ray with the packed triangles
+	 * <tt>[start, end)</tt> to a list of at most \c k hits sorted by distance
+	 *
+	 * Triangles that are already part of the list (since an earlier
+	 * leaf also references them) are skipped. Once the list holds \c k
+	 * hits, \c maxt is lowered to the distance of the farthest one.
+	 */
+	void collectPacked(uint32_t start, uint32_t end, const Ray3f &ray,
+		float mint, float &maxt, uint32_t k, std::vector<PackedHit> &hits) const;
+
+	/**
+	 * \brief Find the point on the packed triangles <tt>[start, end)</tt>
+	 * that is closest to \c p
+	 *
+	 * Whenever a triangle closer than <tt>sqrt(maxDist2)</tt> is found,
+	 * \c maxDist2, \c slot (its packed index) and \c uv (the barycentric
+	 * coordinates of the closest point) are updated.
+	 *
+	 * \return \c true if a closer triangle was found
+	 */
+	bool closestPacked(uint32_t start, uint32_t end, const Point3f &p,
+		float &maxDist2, uint32_t &slot, Point2f &uv) const;
+
+	/// Append the packed triangles <tt>[start, end)</tt> within distance <tt>sqrt(radius2)</tt> of \c p to \c triangles
+	void collectPackedInRadius(uint32_t start, uint32_t end, const Point3f &p,
+		float radius2, std::vector<TriangleRef> &triangles) const;
+
+	/// Convert the hits found by \ref collectPacked() into intersection records and append them to \c its
+	void fillHits(const std::vector<PackedHit> &hits, std::vector<Intersection> &its) const;
+
+	/**
+	 * \brief Feed the vertex positions and indices of all registered
+	 * meshes into a hash
+	 *
+	 * Mesh transformations are already applied to the vertex positions,
+	 * hence the result identifies the geometry an accelerator is built
+	 * over (e.g. to key a cache).
+	 */
+	void hashGeometry(QCryptographicHash &hash) const;
+
+	/// Return the counter record of the calling thread (see \ref setStatistics())
+	RayStatistics *getStatisticsRecord() const;
+
+	/// Return the size of the packed triangle data in bytes
+	inline size_t getPackedMemoryUsage() const {
+		return (size_t) m_packedStride * (NORI_PACKED_FLOATS * sizeof(float) + 2 * sizeof(uint32_t));
+	}
+protected:
+	std::vector<Mesh *> m_meshes;
+	std::vector<uint32_t> m_sizeMap;
+	uint32_t m_primitiveCount;
+	QString m_cacheDirectory;
+	bool m_shadowCache;
+	/// Packed index of the triangle that blocked the last shadow ray of each thread
+	mutable QThreadStorage<uint32_t *> m_lastOccluder;
+	bool m_statistics;
+	/* Counter record of each thread. The records are owned by
+	   m_statisticsRecords and outlive the threads */
+	mutable QThreadStorage<RayStatistics **> m_threadStatistics;
+	mutable std::vector<RayStatistics *> m_statisticsRecords;
+	mutable QMutex m_statisticsMutex;
+
+	/* Packed triangles: NORI_PACKED_FLOATS float arrays (v0.x, v0.y, v0.z,
+	   edge1.x, .., edge2.z) followed by the mesh and triangle index arrays,
+	   each with m_packedStride entries */
+	float *m_packed;
+	uint32_t *m_packedIds;
+	uint32_t m_packedStride;
+};
+
+NORI_NAMESPACE_END
+
+#endif /* __ACCEL_H */
@@ -27,9 +27,17 @@
 #include <nori/vector.h>
 #include <QMutex>
 #include <QThread>
+#include <QAtomicInt>
+#include <QWaitCondition>
 #include <QElapsedTimer>
+#include <deque>
 
-#define NORI_BLOCK_SIZE 32 /* Block size used for parallelization */
+class QDataStream;
+
+#define NORI_BLOCK_SIZE 32 /* Default block size used for parallelization */
+#define NORI_MIN_BLOCK_SIZE 8 /* Blocks are never split below this size */
+#define NORI_LOCK_STRIPE_SIZE 8 /* Number of image block rows protected by one mutex */
+#define NORI_ADAPTIVE_EPSILON 1e-3f /* Lower bound on the mean in the relative error */
 
 NORI_NAMESPACE_BEGIN
 
@@ -46,6 +54,14 @@ NORI_NAMESPACE_BEGIN
  * this region. For that reason, this class also stores information about
  * a small border region around the rectangle, whose size depends on the
  * properties of the reconstruction filter.
+ *
+ * For adaptive sampling, an image block can optionally also keep track
+ * of the first and second moments of the luminance of the samples taken
+ * in each pixel (see \ref enableMoments()). These are not filtered and
+ * don't extend into the border region.
+ *
+ * Similarly, the ray traversal cost of the samples taken in each pixel
+ * can be recorded to produce a heatmap (see \ref enableCosts()).
  */
 class ImageBlock : public Eigen::Array<Color4f, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> {
 public:
@@ -91,24 +107,138 @@ public:
 	Bitmap *toBitmap() const;
 
 	/// Clear all contents
-	void clear() { setConstant(Color4f()); }
+	void clear();
 
 	/// Record a sample with the given position and radiance value
 	void put(const Point2f &pos, const Color3f &value);
 
+	/// Allocate storage for per-pixel sample moments (see \ref putMoments())
+	void enableMoments();
+
+	/// Does this block keep track of per-pixel sample moments?
+	inline bool hasMoments() const { return !m_moments.empty(); }
+
+	/**
+	 * \brief Record the luminance moments of a set of samples 
+	 * that were taken within a pixel
+	 *
+	 * \param pixel
+	 *     Integer pixel coordinates within the main image
+	 * \param sum
+	 *     Sum of the sample luminances
+	 * \param sumSq
+	 *     Sum of the squared sample luminances
+	 * \param count
+	 *     Number of samples
+	 */
+	void putMoments(const Point2i &pixel, float sum, float sumSq, int count);
+
+	/**
+	 * \brief Determine which pixels of a region of this block have
+	 * converged, i.e. have a relative standard error below \c threshold
+	 *
+	 * The stripes overlapping the region are locked while reading
+	 * the moments, hence this can be called while other threads
+	 * merge image blocks.
+	 *
+	 * \param region
+	 *     Specifies the region (offset and size) in the main image
+	 * \param threshold
+	 *     Relative error threshold
+	 * \param converged
+	 *     Receives one entry per pixel of the region (in row-major order)
+	 * \return The number of converged pixels
+	 */
+	int getConverged(const ImageBlock &region, float threshold,
+		std::vector<bool> &converged) const;
+
+	/// Return the average number of samples per pixel recorded in the moments
+	float getAverageSampleCount() const;
+
+	/**
+	 * \brief Allocate storage for the per-pixel traversal cost
+	 * (see \ref putCost())
+	 *
+	 * The costs are not part of checkpoints, raw images or the
+	 * blocks exchanged with remote workers.
+	 */
+	void enableCosts();
+
+	/// Does this block keep track of per-pixel traversal costs?
+	inline bool hasCosts() const { return !m_costs.empty(); }
+
+	/**
+	 * \brief Record the ray traversal cost of a set of samples
+	 * that were taken within a pixel
+	 *
+	 * \param pixel
+	 *     Integer pixel coordinates within the main image
+	 * \param cost
+	 *     Traversal cost of all samples (see \ref RayStatistics::getCost())
+	 * \param count
+	 *     Number of samples
+	 */
+	void putCost(const Point2i &pixel, float cost, int count);
+
+	/// Return a bitmap with the average traversal cost per sample of each pixel
+	Bitmap *toCostBitmap() const;
+
+	/**
+	 * \brief Save the raw (unnormalized) weighted pixel sums and weights 
+	 * as an OpenEXR file with R, G, B and W channels
+	 *
+	 * The border region is not stored. Raw images of several renderings
+	 * of the same frame (e.g. with disjoint crop windows or sample sets)
+	 * can be combined exactly by adding them up (see \ref loadRaw()).
+	 */
+	void saveRaw(const QString &filename) const;
+
+	/**
+	 * \brief Load a raw image written by \ref saveRaw()
+	 *
+	 * The returned image block has no border and no reconstruction
+	 * filter. It can be merged with other blocks of the same size
+	 * using \ref put(ImageBlock &) and then normalized using 
+	 * \ref toBitmap(). The caller is responsible for deleting it.
+	 */
+	static ImageBlock *loadRaw(const QString &filename);
+
+	/// Write the raw (unnormalized) contents and moments to a binary stream
+	void serialize(QDataStream &stream) const;
+
+	/// Restore the contents written by \ref serialize()
+	void unserialize(QDataStream &stream);
+
 	/**
 	 * \brief Merge another image block into this one
 	 *
-	 * During the merge operation, this function locks 
-	 * the destination block using a mutex.
+	 * The destination block is protected by one mutex per
+	 * stripe of \ref NORI_LOCK_STRIPE_SIZE rows. During the merge
+	 * operation, this function visits the overlapped stripes in
+	 * order and holds only one stripe lock at a time. Threads
+	 * merging blocks whose filter borders overlap are therefore
+	 * correctly serialized, while unrelated blocks are merged
+	 * concurrently.
 	 */
 	void put(ImageBlock &b);
 
-	/// Lock the image block (using an internal mutex)
-	inline void lock() const { m_mutex.lock(); }
+	/**
+	 * \brief Stress test of \ref put(ImageBlock &)
+	 *
+	 * Merges half-overlapping tiles with a known weight into a shared
+	 * block from the specified number of threads. Checks that the total
+	 * weight equals the number of merged tile pixels and that every
+	 * pixel matches a single-threaded reference merge.
+	 *
+	 * \return \c true if the test passed
+	 */
+	static bool stressTest(int threadCount);
+
+	/// Lock the entire image block (i.e. all stripes, in order)
+	void lock() const;
 	
-	/// Unlock the image block
-	inline void unlock() const { m_mutex.unlock(); }
+	/// Unlock the entire image block
+	void unlock() const;
 
 	/// Return a human-readable string summary
 	QString toString() const;
@@ -119,48 +249,339 @@ protected:
 	float *m_filter, m_filterRadius;
 	float *m_weightsX, *m_weightsY;
 	float m_lookupFactor;
-	mutable QMutex m_mutex;
+	std::vector<QMutex *> m_stripes;
+	/* Per pixel: luminance sum, squared luminance sum and sample count */
+	std::vector<Vector3f> m_moments;
+	int m_momentsWidth;
+	/* Per pixel: traversal cost sum and sample count */
+	std::vector<Vector2f> m_costs;
+private:
+	/// Create a block without border or reconstruction filter (used by \ref loadRaw())
+	ImageBlock(const Vector2i &size);
+
+	/// Allocate one mutex per stripe of rows
+	void allocateStripes();
 };
 
 /**
- * \brief Spiraling block generator
+ * \brief Work-stealing block generator
  *
  * This class can be used to chop up an image into many small
- * rectangular blocks suitable for parallel rendering. The blocks
- * are ordered in spiraling pattern so that the center is
- * rendered first.
+ * rectangular blocks suitable for parallel rendering. The blocks are
+ * first arranged according to a configurable order (by default, a
+ * spiraling pattern so that the center is rendered first) and then
+ * dealt out round-robin to one work queue per render thread.
+ *
+ * Each thread takes blocks from the front of its own queue, which is
+ * protected by a private mutex that is almost never contended. When a
+ * queue runs dry, its owner steals blocks from the back of the other
+ * queues. Once fewer blocks remain than there are threads, the blocks
+ * that are taken out of a queue are split into quadrants so that idle
+ * threads can help out with expensive regions at the end of a render.
+ *
+ * For progressive rendering, the pixel samples can be divided into
+ * several passes over the entire image (see \ref setPasses()). The
+ * generator starts handing out the blocks of the next pass once the
+ * previous pass has been completely handed out. An optional time limit
+ * (see \ref setTimeLimit()) is only checked at these pass boundaries,
+ * hence a render that is stopped early still has the same number of
+ * samples in every pixel.
+ *
+ * The render threads are kept alive across several frames (e.g. of
+ * an animation): after running out of blocks, they wait in
+ * \ref waitForFrame() until the next frame is started using
+ * \ref startFrame().
  */
 class BlockGenerator {
 public:
+	/// Order in which the blocks are handed out
+	enum EBlockOrder {
+		/// Spiral starting from the center of the image
+		ESpiral = 0,
+		/// Z-order curve (good memory locality among concurrent blocks)
+		EMorton,
+		/// Hilbert curve (like Morton, but without large jumps)
+		EHilbert,
+		/**
+		 * Most expensive blocks first, based on the timings recorded
+		 * by \ref finished() during a previous pass. Falls back to
+		 * \ref ESpiral when no timings are available yet.
+		 */
+		ECost
+	};
+
 	/**
 	 * \brief Create a block generator with
 	 * \param size
 	 *      Size of the image that should be split into blocks
 	 * \param blockSize
 	 *      Maximum size of the individual blocks
+	 * \param threadCount
+	 *      Number of render threads that will fetch blocks
+	 * \param order
+	 *      Order in which the blocks should be handed out
 	 */
-	BlockGenerator(const Vector2i &size, int blockSize);
-	
+	BlockGenerator(const Vector2i &size, int blockSize,
+		int threadCount = 1, EBlockOrder order = ESpiral);
+
+	/// Release all memory
+	~BlockGenerator();
+
 	/**
 	 * \brief Return the next block to be rendered
 	 *
 	 * This function is thread-safe
 	 *
+	 * \param block
+	 *      Image block, whose offset and size will be set
+	 * \param thread
+	 *      Index of the calling render thread (in <tt>[0, threadCount)</tt>)
+	 * \param pass
+	 *      If not \c NULL, the index of the pass that the block
+	 *      belongs to is written here
 	 * \return \c false if there were no more blocks
 	 */
-	bool next(ImageBlock &block);
+	bool next(ImageBlock &block, int thread = 0, int *pass = NULL);
+
+	/**
+	 * \brief Notify the generator that a block returned by \ref next()
+	 * has been rendered and merged into the output image
+	 *
+	 * This function is thread-safe
+	 *
+	 * \param block
+	 *      The finished block
+	 * \param pass
+	 *      Pass of the block (as returned by \ref next())
+	 * \param time
+	 *      Time spent rendering the block (in milliseconds). This
+	 *      is recorded and used by the \ref ECost block order. Blocks
+	 *      of an earlier pass that finish after the current pass has
+	 *      started are not recorded.
+	 */
+	void finished(const ImageBlock &block, int pass, float time = 0.0f);
+
+	/**
+	 * \brief Return a block obtained from \ref next() that could not 
+	 * be rendered (e.g. because a remote worker was lost), so that
+	 * it is handed out again
+	 *
+	 * This function is thread-safe
+	 */
+	void requeue(const ImageBlock &block, int pass);
+
+	/**
+	 * \brief Refill the work queues so that the entire image 
+	 * is rendered once more (starting again from the first pass)
+	 *
+	 * Must not be called while render threads are fetching blocks
+	 */
+	void reset();
+
+	/**
+	 * \brief Split the pixel samples into several passes
+	 *
+	 * Must not be called while render threads are fetching blocks
+	 *
+	 * \param sampleCount
+	 *      Total number of samples per pixel
+	 * \param samplesPerPass
+	 *      Number of samples per pixel that are taken in each pass.
+	 *      The last pass may have fewer samples.
+	 */
+	void setPasses(int sampleCount, int samplesPerPass);
+
+	/**
+	 * \brief Stop starting new passes after the given amount of 
+	 * time (in milliseconds) has passed. The first pass is 
+	 * always rendered completely.
+	 */
+	inline void setTimeLimit(qint64 timeLimit) { m_timeLimit = timeLimit; }
+
+	/**
+	 * \brief Restrict rendering to a rectangular crop window
+	 *
+	 * Only the parts of the blocks overlapping the window are handed
+	 * out. Must be followed by a call to \ref reset().
+	 */
+	void setCropWindow(const Point2i &offset, const Vector2i &size);
+
+	/**
+	 * \brief Return the number of pixel samples that are taken in pass \c pass
+	 *
+	 * Returns -1 if \ref setPasses() was never called. In that case, 
+	 * there is a single pass using the sample count of the sampler.
+	 */
+	int getSampleCount(int pass) const;
+
+	/**
+	 * \brief Return the number of pixel samples of all passes 
+	 * that have been handed out so far
+	 *
+	 * Once rendering has finished, this is the sample count of the image.
+	 * Returns -1 if \ref setPasses() was never called.
+	 */
+	int getSampleCount() const;
+
+	/// Return the number of passes
+	inline int getPassCount() const { return m_passCount; }
+
+	/**
+	 * \brief Enable adaptive sampling
+	 *
+	 * Starting with pass \c minPasses, pixels whose estimated relative
+	 * error is below \c threshold are skipped by the render threads.
+	 * This requires that the output image block keeps track of
+	 * per-pixel moments (see \ref ImageBlock::enableMoments()).
+	 */
+	void setAdaptive(float threshold, int minPasses);
+
+	/**
+	 * \brief Return the relative error threshold that should be used
+	 * in pass \c pass, or a negative value if all pixels should be sampled
+	 */
+	inline float getAdaptiveThreshold(int pass) const {
+		return pass >= m_minAdaptivePasses ? m_adaptiveThreshold : -1.0f;
+	}
+
+	/**
+	 * \brief Return the fraction of the work that has been completed
+	 *
+	 * With a time limit, the estimate assumes that all passes will be
+	 * rendered, i.e. the render may finish before reaching 100%.
+	 */
+	float getProgress() const;
+
+	/// Return the maximum size of the blocks
+	inline int getBlockSize() const { return m_blockSize; }
+
+	/// Return the number of blocks per row and column
+	inline const Vector2i &getBlockCount() const { return m_numBlocks; }
+
+	/// Return the configured block order
+	inline EBlockOrder getOrder() const { return m_order; }
+
+	/**
+	 * \brief Stop handing out blocks and wait until all blocks 
+	 * that are currently being rendered have been finished
+	 *
+	 * Afterwards, the output image and the state of the generator
+	 * are consistent and can e.g. be checkpointed.
+	 */
+	void pause();
+
+	/// Continue handing out blocks after a call to \ref pause()
+	void resume();
+
+	/// Discard all remaining blocks, e.g. to terminate rendering early
+	void stop();
+
+	/**
+	 * \brief Let the render threads start working on a new frame
+	 *
+	 * The generator must have been \ref reset() before, and all 
+	 * threads must have finished the previous frame.
+	 */
+	void startFrame();
+
+	/**
+	 * \brief Wait until a new frame is started or \ref shutdown() is 
+	 * called (used by the render threads between frames)
+	 *
+	 * \param frame
+	 *      Index of the last frame rendered by the calling thread.
+	 *      Is set to the index of the new frame.
+	 * \return \c false if the calling thread should terminate
+	 */
+	bool waitForFrame(int &frame);
+
+	/// Notify the generator that a render thread has run out of blocks
+	void frameFinished();
+
+	/// Return whether all render threads have finished the current frame
+	bool isFrameFinished() const;
+
+	/// Let all render threads terminate once they are done with the current frame
+	void shutdown();
+
+	/**
+	 * \brief Write the state of the generator (remaining blocks, current
+	 * pass, timings) to a binary stream
+	 *
+	 * Must only be called while paused or before rendering starts
+	 */
+	void serialize(QDataStream &stream) const;
+
+	/**
+	 * \brief Restore the state written by \ref serialize()
+	 *
+	 * Throws an exception if the configuration (image and block size,
+	 * passes) does not match.
+	 */
+	void unserialize(QDataStream &stream);
+
+	/// Parse a block order name ("spiral", "morton", "hilbert" or "cost")
+	static EBlockOrder parseOrder(const QString &name);
 protected:
-	enum EDirection { ERight = 0, EDown, ELeft, EUp };
+	/// A rectangular region of the image that is waiting to be rendered
+	struct Block {
+		Point2i offset;
+		Vector2i size;
+		int pass;
+
+		inline Block() { }
+		inline Block(const Point2i &offset, const Vector2i &size, int pass)
+			: offset(offset), size(size), pass(pass) { }
+	};
+
+	/// Per-thread double-ended work queue
+	struct WorkQueue {
+		std::deque<Block> blocks;
+		QMutex mutex;
+	};
+
+	/// Generate the list of blocks in the configured order
+	void generateBlocks(std::vector<Point2i> &blocks) const;
+
+	/// Refill the work queues with the blocks of the next pass
+	void fill();
 
-	Point2i m_block;
+	/// Start the next pass if there is one. Returns \c false when done.
+	bool nextPass();
+
+	/// Try to take a block from the front of the queue of \c thread
+	bool pop(int thread, Block &block);
+
+	/// Try to move a block from the back of any other thread's queue to the front of that of \c thread
+	bool steal(int thread);
+
+	/// Wake the threads that wait for blocks in \ref next()
+	void wakeIdle();
+protected:
 	Vector2i m_numBlocks;
 	Vector2i m_size;
+	Point2i m_cropOffset;
+	Vector2i m_cropSize;
 	int m_blockSize;
-	int m_numSteps;
-	int m_blocksLeft;
-	int m_stepsLeft;
-	int m_direction;
-	QMutex m_mutex;
+	int m_threadCount;
+	EBlockOrder m_order;
+	std::vector<WorkQueue *> m_queues;
+	QAtomicInt m_blocksQueued;
+	std::vector<float> m_costs;
+	qint64 m_pixelsDone;
+	mutable QMutex m_mutex;
+	QMutex m_passMutex;
+	int m_pass, m_passCount;
+	int m_sampleCount, m_samplesPerPass;
+	qint64 m_timeLimit;
+	float m_adaptiveThreshold;
+	int m_minAdaptivePasses;
+	QWaitCondition m_cond;
+	int m_inFlight;
+	bool m_paused, m_stopped;
+	int m_frame, m_threadsDone;
+	bool m_shutdown;
+	qint64 m_timeOffset;
 	QElapsedTimer m_timer;
 };
 
@@ -180,18 +601,41 @@ public:
 	 * \ref ImageBlock instance that represents the entire image
 	 */
 	BlockRenderThread(const Scene *scene, Sampler *sampler,
-		BlockGenerator *blockGenerator, ImageBlock *output);
+		BlockGenerator *blockGenerator, ImageBlock *output, int id = 0);
 
 	/// Release all memory
 	virtual ~BlockRenderThread();
 
-	/// Main rendering thread loop
+	/// Main rendering thread loop (renders frames until the generator is shut down)
 	void run();
-private:
+
+	/// Return the sample generator of this thread
+	inline Sampler *getSampler() { return m_sampler; }
+protected:
+	/**
+	 * \brief Render all samples of a single block
+	 *
+	 * \param block
+	 *     The block to be rendered (its previous contents are discarded)
+	 * \param sampleCount
+	 *     Number of samples per pixel
+	 * \param converged
+	 *     Optional per-pixel flags (in row-major order) that specify 
+	 *     pixels that should be skipped
+	 */
+	void renderBlock(ImageBlock &block, int sampleCount,
+		const std::vector<bool> *converged = NULL);
+protected:
 	const Scene *m_scene;
 	BlockGenerator *m_blockGenerator;
 	ImageBlock *m_output;
 	Sampler *m_sampler;
+	int m_id;
+	std::vector<Point2f> m_cameraSamples;
+	/* Rays, positions, weights and radiance values of the samples of the current pixel */
+	std::vector<Ray3f> m_rays;
+	std::vector<Point2f> m_pixelSamples;
+	std::vector<Color3f> m_weights, m_values;
 };
 
 NORI_NAMESPACE_END
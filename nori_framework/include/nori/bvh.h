@@ -0,0 +1,160 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2012 by Wenzel Jakob and Steve Marschner.
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#if !defined(__BVH_H)
+#define __BVH_H
+
+#include <nori/accel.h>
+
+#define NORI_BVH_BINS 16 /* Number of bins used to evaluate the SAH along each axis */
+#define NORI_BVH_MAX_LEAF_SIZE 8 /* Leaves with more triangles are always split */
+#define NORI_BVH_TRAVERSAL_COST 1.0f /* Cost of a node traversal relative to a ray-triangle intersection */
+#define NORI_BVH_MAXDEPTH 64 /* Max. depth of the hierarchy (beyond half of it, object median splits are used) */
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Bounding volume hierarchy over the triangles of a set of meshes
+ *
+ * The hierarchy is built top-down using the surface area heuristic,
+ * which is evaluated at \ref NORI_BVH_BINS bin boundaries per axis
+ * ("On fast Construction of SAH-based Bounding Volume Hierarchies"
+ * by Ingo Wald). Compared to the \ref KDTree, this builds much faster
+ * and needs less memory, since every triangle is referenced exactly once.
+ *
+ * Optionally, the binary hierarchy is collapsed into a 4-wide tree whose
+ * nodes store the bounding boxes of all children in a structure of arrays
+ * layout, so that a ray can be tested against them using SSE instructions.
+ */
+class BVH : public Accelerator {
+public:
+	/**
+	 * \brief Create a new and empty BVH
+	 *
+	 * \param wide
+	 *     Collapse the binary hierarchy into 4-wide nodes after the build
+	 */
+	BVH(bool wide = false);
+
+	/// Release all memory
+	virtual ~BVH();
+
+	/// Build the hierarchy
+	void build();
+
+	/**
+	 * \brief Recompute the bounding boxes of all nodes and repack the
+	 * triangles after the meshes have moved or deformed
+	 *
+	 * The structure of the hierarchy is kept. This is much cheaper than
+	 * \ref build(), but traversal slows down when triangles move far
+	 * from their original neighbors.
+	 */
+	void refit(const Mesh *mesh = NULL);
+
+	/// Intersect a ray against all triangle meshes registered with the BVH
+	bool rayIntersect(const Ray3f &ray, Intersection &its, bool shadowRay = false) const;
+
+	/// Return an axis-aligned bounding box containing all triangles
+	const BoundingBox3f &getBoundingBox() const { return m_bbox; }
+
+	/// Return the size of the built hierarchy in bytes
+	size_t getMemoryUsage() const;
+
+	/// Return a human-readable name
+	QString getName() const { return m_wide ? "binned SAH BVH4" : "binned SAH BVH"; }
+protected:
+	/**
+	 * \brief Node of the binary hierarchy (32 bytes)
+	 *
+	 * Nodes are stored in depth-first order, i.e. the first child of
+	 * an inner node directly follows it in memory.
+	 */
+	struct Node {
+		/// Bounding box of all triangles below this node
+		BoundingBox3f bbox;
+		/// Inner node: index of the second child. Leaf: index of the first triangle in \c m_indices
+		uint32_t offset;
+		/// Number of triangles (0 for inner nodes)
+		uint32_t count;
+
+		inline bool isLeaf() const { return count > 0; }
+	};
+
+	/**
+	 * \brief Node of the 4-wide hierarchy (128 bytes)
+	 *
+	 * The bounding boxes of the children are stored as a structure of
+	 * arrays. Unused slots have child index and triangle count 0 (the
+	 * root is never a child) and empty bounds.
+	 */
+	struct Node4 {
+		float minX[4], minY[4], minZ[4];
+		float maxX[4], maxY[4], maxZ[4];
+		/// Inner child: index of its node. Leaf child: index of its first triangle in \c m_indices
+		uint32_t child[4];
+		/// Number of triangles of a leaf child (0 for inner children and unused slots)
+		uint32_t count[4];
+
+		inline bool isUnused(int i) const { return child[i] == 0 && count[i] == 0; }
+	};
+
+	/// Triangle record used during the build
+	struct BuildPrim {
+		BoundingBox3f bbox;
+		Point3f centroid;
+		uint32_t index;
+	};
+
+	/// Recursively build the subtree over <tt>prims[start..end)</tt> and return its node index
+	uint32_t buildRecursive(std::vector<BuildPrim> &prims, uint32_t start,
+		uint32_t end, int depth);
+
+	/// Return the bounding box of the triangles <tt>m_indices[start..end)</tt>
+	BoundingBox3f getTriangleBounds(uint32_t start, uint32_t end) const;
+
+	/// Convert the binary subtree rooted at \c node into 4-wide nodes and return the index of its root
+	uint32_t collapse(uint32_t node, std::vector<Node4> &nodes4) const;
+
+	/// Any-hit traversal for shadow rays (see \ref Accelerator::findOccluder())
+	bool findOccluder(const Ray3f &ray, float mint, float maxt, uint32_t leaf, uint32_t &slot) const;
+
+	/**
+	 * \brief Traversal of the binary hierarchy
+	 *
+	 * When \c shadowRay is set, the traversal stops at the first hit,
+	 * and \c foundPrimIndex receives the packed index of the occluder.
+	 */
+	bool rayIntersectBinary(const Ray3f &ray, float mint, float maxt,
+		Intersection &its, bool shadowRay, uint32_t &foundPrimIndex) const;
+
+	/// Traversal of the 4-wide hierarchy (see \ref rayIntersectBinary())
+	bool rayIntersectWide(const Ray3f &ray, float mint, float maxt,
+		Intersection &its, bool shadowRay, uint32_t &foundPrimIndex) const;
+private:
+	bool m_wide;
+	BoundingBox3f m_bbox;
+	std::vector<Node> m_nodes;
+	Node4 *m_nodes4;
+	uint32_t m_node4Count;
+	std::vector<uint32_t> m_indices;
+};
+
+NORI_NAMESPACE_END
+
+#endif /* __BVH_H */
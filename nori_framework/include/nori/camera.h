@@ -75,6 +75,16 @@ public:
                 return Transform();
         }
 
+	/**
+	 * \brief Replace the camera-to-world transform, e.g. to render
+	 * the frames of a camera animation
+	 *
+	 * Must not be called while rendering
+	 */
+	virtual void setTransform(const Transform &) {
+		throw NoriException("This camera does not support changing its transform!");
+	}
+
 	/**
 	 * \brief Return the type of object (i.e. Mesh/Camera/etc.) 
 	 * provided by this instance
@@ -140,6 +140,7 @@ typedef TRay<Point3f, Vector3f> Ray3f;
 class NoriObject;
 class NoriObjectFactory;
 class Mesh;
+class Instance;
 class BSDF;
 class Bitmap;
 class BlockGenerator;
@@ -148,6 +149,7 @@ class Camera;
 class Integrator;
 class Sampler;
 class Luminaire;
+class Accelerator;
 class KDTree;
 class Scene;
 class ReconstructionFilter;
@@ -262,9 +264,74 @@ extern void *allocAligned(size_t size);
 /// Free an aligned region of memory
 extern void freeAligned(void *ptr);
 
-/// Return the number of cores (real and virtual)
+/**
+ * \brief Return the number of cores (real and virtual) that are 
+ * available to this process
+ *
+ * On Linux, this takes the CPU affinity mask of the process and any 
+ * CPU bandwidth quota of its control group (i.e. container limits) 
+ * into account.
+ */
 extern int getCoreCount();
 
+/**
+ * \brief Return the number of worker threads that should be used
+ * for parallel work (rendering, kd-tree construction)
+ *
+ * This is \ref getCoreCount() unless overridden via \ref setThreadCount().
+ */
+extern int getThreadCount();
+
+/// Override the number of worker threads (0 = automatic)
+extern void setThreadCount(int count);
+
+/// Policy for pinning worker threads to CPUs
+enum EThreadPinning {
+	/// Let the operating system schedule the threads
+	ENoPinning = 0,
+	/// Thread \c i runs on the i-th available CPU (fills up one NUMA node first)
+	ECompactPinning,
+	/// Distribute consecutive threads round-robin over the NUMA nodes
+	EScatterPinning
+};
+
+/// Policy for the placement of memory on NUMA machines
+enum EMemoryPlacement {
+	/// Pages are allocated on the node of the thread that touches them first
+	EFirstTouch = 0,
+	/// Pages are distributed round-robin over all NUMA nodes
+	EInterleave
+};
+
+/// Set the pinning policy used by \ref pinCurrentThread()
+extern void setThreadPinning(EThreadPinning pinning);
+
+/// Return the current thread pinning policy
+extern EThreadPinning getThreadPinning();
+
+/**
+ * \brief Pin the calling thread to a CPU according to the 
+ * configured pinning policy
+ *
+ * \param index
+ *     Index of the thread among the worker threads
+ * \return \c false if the thread could not be pinned
+ */
+extern bool pinCurrentThread(int index);
+
+/**
+ * \brief Set the memory placement policy of the calling thread 
+ *
+ * Threads that are started afterwards inherit the policy. Only 
+ * supported on Linux; does nothing on other platforms.
+ *
+ * \return \c false if the policy could not be applied
+ */
+extern bool setMemoryPlacement(EMemoryPlacement placement);
+
+/// Return the number of NUMA nodes (1 if unknown)
+extern int getNumaNodeCount();
+
 NORI_NAMESPACE_END
 
 #endif /* __COMMON_H */
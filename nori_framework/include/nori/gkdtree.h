@@ -38,6 +38,7 @@
 #include <QMutex>
 #include <QThread>
 #include <stack>
+#include <deque>
 #include <map>
 
 /** Compile-time KD-tree depth limit. Allows to put certain
@@ -54,6 +55,9 @@
 #define NORI_KD_BLOCKSIZE_KD  (512*1024/sizeof(KDNode))
 #define NORI_KD_BLOCKSIZE_IDX (512*1024/sizeof(uint32_t))
 
+/// Parallel builds split the primitives of large nodes into chunks of at least this size
+#define NORI_KD_PARALLEL_GRAIN 16384
+
 /**
  * \brief To avoid numerical issues, the size of the scene 
  * bounding box is increased by this amount
@@ -662,7 +666,7 @@ public:
 		m_exactPrimThreshold = 65536;
 		m_maxDepth = 0;
 		m_retract = true;
-		m_parallelBuild = true;
+		m_parallelBuild = m_parallelBuildRequested = true;
 		m_minMaxBins = 128;
 	}
 
@@ -670,10 +674,23 @@ public:
 	 * \brief Release all memory
 	 */
 	virtual ~GenericKDTree() {
-		if (m_indices)
+		clear();
+	}
+
+	/**
+	 * \brief Release the nodes and indices, so that the tree
+	 * can be built again (e.g. after the primitives have moved)
+	 */
+	void clear() {
+		if (m_indices) {
 			delete[] m_indices;
-		if (m_nodes)
+			m_indices = NULL;
+		}
+		if (m_nodes) {
 			freeAligned(m_nodes-1); // undo alignment shift
+			m_nodes = NULL;
+		}
+		m_nodeCount = m_indexCount = 0;
 	}
 
 	/**
@@ -819,7 +836,7 @@ public:
 	 * should run in parallel.
 	 */
 	inline void setParallelBuild(bool parallel) {
-		m_parallelBuild = parallel;
+		m_parallelBuildRequested = parallel;
 	}
 
 	/**
@@ -827,7 +844,7 @@ public:
 	 * will run in parallel.
 	 */
 	inline bool getParallelBuild() const {
-		return m_parallelBuild;
+		return m_parallelBuildRequested;
 	}
 
 	/**
@@ -865,6 +882,9 @@ protected:
 			throw NoriException("The empty space bonus must be in [0, 1]");
 		if (m_minMaxBins <= 1)
 			throw NoriException("The number of min-max bins must be > 2");
+
+		/* Forget the jobs and worker assignments of a previous build */
+		m_interface.reset();
 		
 		SizeType primCount = cast()->getPrimitiveCount();
 		if (primCount == 0) {
@@ -875,11 +895,22 @@ protected:
 			return;
 		}
 
-		if (primCount <= m_exactPrimThreshold)
-			m_parallelBuild = false;
+		/* Decided per build, so that a small or single-threaded
+		   build does not disable parallelism for later ones */
+		m_parallelBuild = m_parallelBuildRequested
+			&& primCount > m_exactPrimThreshold && getThreadCount() > 1;
 
 		BuildContext ctx(primCount, m_minMaxBins);
 
+		if (m_parallelBuild) {
+			SizeType procCount = getThreadCount();
+			m_builders.resize(procCount);
+			for (SizeType i=0; i<procCount; ++i) {
+				m_builders[i] = new TreeBuilder(i, this);
+				m_builders[i]->start();
+			}
+		}
+
 		/* Establish an ad-hoc depth cutoff value (Formula from PBRT) */
 		if (m_maxDepth == 0)
 			m_maxDepth = (int) (8 + 1.3f * std::log((float) primCount)/std::log(2.0f));
@@ -892,11 +923,11 @@ protected:
 		timer.start();
 
 		BoundingBoxType &bbox = m_bbox;
+		BoundsTask boundsTask(cast(), indices, getChunkCount(primCount));
+		parallelFor(boundsTask, primCount);
 		bbox.reset();
-		for (IndexType i=0; i<primCount; ++i) {
-			bbox.expandBy(cast()->getBoundingBox(i));
-			indices[i] = i;
-		}
+		for (SizeType i=0; i<boundsTask.bounds.size(); ++i)
+			bbox.expandBy(boundsTask.bounds[i]);
 
 		#if NORI_KD_VERBOSE == 1
 			cout << "kd-tree configuration" << endl
@@ -914,18 +945,6 @@ protected:
 				<< "  Build tree in parallel     : " << m_parallelBuild << endl << endl;
 		#endif
 
-		SizeType procCount = getCoreCount();
-		if (procCount == 1)
-			m_parallelBuild = false;
-
-		if (m_parallelBuild) {
-			m_builders.resize(procCount);
-			for (SizeType i=0; i<procCount; ++i) {
-				m_builders[i] = new TreeBuilder(i, this);
-				m_builders[i]->start();
-			}
-		}
-
 		KDNode *prelimRoot = ctx.nodes.allocate(1);
 		buildTreeMinMax(ctx, 1, prelimRoot, bbox, bbox, 
 				indices, primCount, true, 0);
@@ -936,6 +955,12 @@ protected:
 			m_interface.done = true;
 			m_interface.cond.wakeAll();
 			m_interface.mutex.unlock();
+
+			/* Help the workers with the remaining subtrees */
+			SubtreeJob job;
+			while (takeSubtreeJob(job, (IndexType) m_builders.size()))
+				buildSubtree(ctx, job);
+
 			for (SizeType i=0; i<m_builders.size(); ++i) 
 				m_builders[i]->wait();
 		}
@@ -990,7 +1015,8 @@ protected:
 				= m_interface.threadMap.find(node);
 			// Check if we're switching to a subtree built by a worker thread
 			if (it != m_interface.threadMap.end()) 
-				context = &m_builders[(*it).second]->getContext();
+				context = (*it).second < m_builders.size()
+					? &m_builders[(*it).second]->getContext() : &ctx;
 
 			if (node->isLeaf()) {
 				SizeType primStart = node->getPrimStart(),
@@ -1217,6 +1243,29 @@ protected:
 		}
 	};
 
+	/**
+	 * \brief Job for a worker thread: build the subtree below a node
+	 * using the O(n log n) optimization
+	 */
+	struct SubtreeJob {
+		int depth;
+		KDNode *node;
+		BoundingBoxType nodeBoundingBox;
+		std::vector<IndexType> indices;
+		SizeType badRefines;
+	};
+
+	/**
+	 * \brief Loop body that is run in parallel over chunks of the
+	 * primitives of a node (see \ref parallelFor())
+	 */
+	struct RangeTask {
+		virtual ~RangeTask() { }
+
+		/// Process the primitives <tt>[start, end)</tt>, which make up chunk \c chunk
+		virtual void run(SizeType chunk, SizeType start, SizeType end) = 0;
+	};
+
 	/**
 	 * \brief Communication data structure used to pass jobs to
 	 * kd-tree builder threads
@@ -1224,26 +1273,56 @@ protected:
 	struct BuildInterface {
 		/* Communcation */
 		QMutex mutex;
-		QWaitCondition cond, condJobTaken;
+		QWaitCondition cond, condRangeDone;
 		std::map<const KDNode *, IndexType> threadMap;
 		bool done;
 
-		/* Job description for building a subtree */
-		int depth;
-		KDNode *node;
-		BoundingBoxType nodeBoundingBox;
-		EdgeEvent *eventStart, *eventEnd;
-		SizeType primCount;
-		int badRefines;
+		/* Pending subtrees */
+		std::deque<SubtreeJob> jobs;
+
+		/* Parallel loop issued by the main thread (at most one at a time) */
+		RangeTask *rangeTask;
+		SizeType rangeSize, rangeChunkCount;
+		SizeType rangeNextChunk, rangeChunksDone;
 
 		inline BuildInterface() {
-			node = NULL;
+			reset();
+		}
+
+		/// Prepare for a new build (no worker threads may be running)
+		void reset() {
+			threadMap.clear();
+			jobs.clear();
 			done = false;
+			rangeTask = NULL;
+		}
+
+		/// Is there an unclaimed chunk of a parallel loop? (requires the lock)
+		inline bool hasRangeChunk() const {
+			return rangeTask && rangeNextChunk < rangeChunkCount;
+		}
+
+		/// Claim and run chunks of the current parallel loop (requires the lock)
+		void runRangeChunks() {
+			while (hasRangeChunk()) {
+				RangeTask *task = rangeTask;
+				SizeType chunk = rangeNextChunk++,
+					start = (SizeType) (((uint64_t) rangeSize * chunk) / rangeChunkCount),
+					end = (SizeType) (((uint64_t) rangeSize * (chunk+1)) / rangeChunkCount);
+				mutex.unlock();
+				task->run(chunk, start, end);
+				mutex.lock();
+				if (++rangeChunksDone == rangeChunkCount)
+					condRangeDone.wakeAll();
+			}
 		}
 	};
 
 	/**
 	 * \brief kd-tree builder thread
+	 *
+	 * Builds subtrees handed over by the main thread, and helps it
+	 * with the per-primitive loops of large nodes near the root.
 	 */
 	class TreeBuilder : public QThread {
 	public:
@@ -1256,34 +1335,26 @@ protected:
 		}
 
 		void run() {
-			OrderedChunkAllocator &leftAlloc = m_context.leftAlloc;
+			SubtreeJob job;
 			while (true) {
 				m_interface.mutex.lock();
-				while (!m_interface.done && !m_interface.node)
+				while (!m_interface.done && !m_interface.hasRangeChunk()
+						&& m_interface.jobs.empty())
 					m_interface.cond.wait(&m_interface.mutex);
-				if (m_interface.done) {
+
+				/* Parallel loops take precedence, since the main thread waits for them */
+				if (m_interface.hasRangeChunk()) {
+					m_interface.runRangeChunks();
 					m_interface.mutex.unlock();
-					break;
+					continue;
 				}
-				int depth = m_interface.depth;
-				KDNode *node = m_interface.node;
-				BoundingBoxType nodeBoundingBox = m_interface.nodeBoundingBox;
-				size_t eventCount = m_interface.eventEnd - m_interface.eventStart;
-				SizeType primCount = m_interface.primCount;
-				int badRefines = m_interface.badRefines;
-				EdgeEvent *eventStart = leftAlloc.allocate<EdgeEvent>(eventCount),
-						  *eventEnd = eventStart + eventCount;
-				memcpy(eventStart, m_interface.eventStart, 
-						eventCount * sizeof(EdgeEvent));
-				m_interface.threadMap[node] = m_id;
-				m_interface.node = NULL;
-				m_interface.condJobTaken.wakeOne();
+				bool finished = m_interface.done && m_interface.jobs.empty();
 				m_interface.mutex.unlock();
+				if (finished)
+					break;
 
-				std::sort(eventStart, eventEnd, EdgeEventOrdering());
-				m_parent->buildTree(m_context, depth, node,
-					nodeBoundingBox, eventStart, eventEnd, primCount, true, badRefines);
-				leftAlloc.release(eventStart);
+				if (m_parent->takeSubtreeJob(job, m_id))
+					m_parent->buildSubtree(m_context, job);
 			}
 		}
 
@@ -1298,6 +1369,94 @@ protected:
 		BuildInterface &m_interface;
 	};
 
+	/// Computes the bounding boxes of chunks of primitives and initializes the index list
+	struct BoundsTask : public RangeTask {
+		const Derived *derived;
+		IndexType *indices;
+		std::vector<BoundingBoxType> bounds;
+
+		BoundsTask(const Derived *derived, IndexType *indices, SizeType chunkCount)
+			: derived(derived), indices(indices), bounds(chunkCount) { }
+
+		void run(SizeType chunk, SizeType start, SizeType end) {
+			BoundingBoxType &bbox = bounds[chunk];
+			for (SizeType i=start; i<end; ++i) {
+				bbox.expandBy(derived->getBoundingBox(i));
+				indices[i] = i;
+			}
+		}
+	};
+
+	/**
+	 * \brief Return the number of chunks that a loop over \c count
+	 * primitives is split into by \ref parallelFor()
+	 */
+	inline SizeType getChunkCount(SizeType count) const {
+		if (!m_parallelBuild)
+			return 1;
+		return std::max((SizeType) 1, std::min((SizeType) m_builders.size() + 1,
+			count / NORI_KD_PARALLEL_GRAIN));
+	}
+
+	/**
+	 * \brief Run a task over \c count primitives, split into
+	 * <tt>getChunkCount(count)</tt> chunks
+	 *
+	 * During a parallel build, idle worker threads process some of
+	 * the chunks. Must only be called from the main thread.
+	 */
+	void parallelFor(RangeTask &task, SizeType count) {
+		SizeType chunkCount = getChunkCount(count);
+		if (chunkCount == 1) {
+			task.run(0, 0, count);
+			return;
+		}
+
+		m_interface.mutex.lock();
+		m_interface.rangeTask = &task;
+		m_interface.rangeSize = count;
+		m_interface.rangeChunkCount = chunkCount;
+		m_interface.rangeNextChunk = 0;
+		m_interface.rangeChunksDone = 0;
+		m_interface.cond.wakeAll();
+
+		m_interface.runRangeChunks();
+		while (m_interface.rangeChunksDone < chunkCount)
+			m_interface.condRangeDone.wait(&m_interface.mutex);
+		m_interface.rangeTask = NULL;
+		m_interface.mutex.unlock();
+	}
+
+	/// Take the oldest pending subtree job, if any, on behalf of thread \c id
+	bool takeSubtreeJob(SubtreeJob &job, IndexType id) {
+		QMutexLocker locker(&m_interface.mutex);
+		if (m_interface.jobs.empty())
+			return false;
+		SubtreeJob &front = m_interface.jobs.front();
+		job.depth = front.depth;
+		job.node = front.node;
+		job.nodeBoundingBox = front.nodeBoundingBox;
+		job.badRefines = front.badRefines;
+		job.indices.swap(front.indices);
+		m_interface.jobs.pop_front();
+		m_interface.threadMap[job.node] = id;
+		return true;
+	}
+
+	/// Build the subtree of a job using the O(n log n) optimization
+	void buildSubtree(BuildContext &ctx, SubtreeJob &job) {
+		OrderedChunkAllocator &alloc = ctx.leftAlloc;
+		boost::tuple<EdgeEvent *, EdgeEvent *, SizeType> events = createEventList(
+			alloc, job.nodeBoundingBox, &job.indices[0], (SizeType) job.indices.size());
+		std::vector<IndexType>().swap(job.indices);
+
+		std::sort(boost::get<0>(events), boost::get<1>(events), EdgeEventOrdering());
+		buildTree(ctx, job.depth, job.node, job.nodeBoundingBox,
+			boost::get<0>(events), boost::get<1>(events), boost::get<2>(events),
+			true, job.badRefines);
+		alloc.release(boost::get<0>(events));
+	}
+
 	/// Cast to the derived class
 	inline Derived *cast() {
 		return static_cast<Derived *>(this);
@@ -1492,37 +1651,36 @@ protected:
 	inline float transitionToNLogN(BuildContext &ctx, unsigned int depth, KDNode *node, 
 			const BoundingBoxType &nodeBoundingBox, IndexType *indices,
 			SizeType primCount, bool isLeftChild, SizeType badRefines) {
-		OrderedChunkAllocator &alloc = isLeftChild 
-				? ctx.leftAlloc : ctx.rightAlloc;
-		boost::tuple<EdgeEvent *, EdgeEvent *, SizeType> events  
-				= createEventList(alloc, nodeBoundingBox, indices, primCount);
-		float cost;
 		if (m_parallelBuild) {
+			/* Queue the subtree for the worker threads, which also
+			   create and sort the edge events */
 			m_interface.mutex.lock();
-			m_interface.depth = depth;
-			m_interface.node = node;
-			m_interface.nodeBoundingBox = nodeBoundingBox;
-			m_interface.eventStart = boost::get<0>(events);
-			m_interface.eventEnd = boost::get<1>(events);
-			m_interface.primCount = boost::get<2>(events);
-			m_interface.badRefines = badRefines;
+			m_interface.jobs.push_back(SubtreeJob());
+			SubtreeJob &job = m_interface.jobs.back();
+			job.depth = depth;
+			job.node = node;
+			job.nodeBoundingBox = nodeBoundingBox;
+			job.indices.assign(indices, indices + primCount);
+			job.badRefines = badRefines;
 			m_interface.cond.wakeOne();
-
-			/* Wait for a worker thread to take this job */
-			while (m_interface.node)
-				m_interface.condJobTaken.wait(&m_interface.mutex);
 			m_interface.mutex.unlock();
 
 			// Never tear down this subtree (return a cost of -infinity)
-			cost = -std::numeric_limits<float>::infinity();
-		} else {
-			std::sort(boost::get<0>(events), boost::get<1>(events), 
-					EdgeEventOrdering());
-
-			cost = buildTree(ctx, depth, node, nodeBoundingBox,
-				boost::get<0>(events), boost::get<1>(events), 
-				boost::get<2>(events), isLeftChild, badRefines);
+			return -std::numeric_limits<float>::infinity();
 		}
+
+		OrderedChunkAllocator &alloc = isLeftChild 
+				? ctx.leftAlloc : ctx.rightAlloc;
+		boost::tuple<EdgeEvent *, EdgeEvent *, SizeType> events  
+				= createEventList(alloc, nodeBoundingBox, indices, primCount);
+
+		std::sort(boost::get<0>(events), boost::get<1>(events), 
+				EdgeEventOrdering());
+
+		float cost = buildTree(ctx, depth, node, nodeBoundingBox,
+			boost::get<0>(events), boost::get<1>(events), 
+			boost::get<2>(events), isLeftChild, badRefines);
+
 		alloc.release(boost::get<0>(events));
 		return cost;
 	}
@@ -1575,7 +1733,7 @@ protected:
 	    /* ==================================================================== */
 
 		ctx.minMaxBins.setBoundingBox(tightBBox);
-		ctx.minMaxBins.bin(cast(), indices, primCount);
+		ctx.minMaxBins.bin(this, indices, primCount);
 
 		/* ==================================================================== */
 	    /*                        Split candidate search                        */
@@ -1611,7 +1769,7 @@ protected:
 	    /* ==================================================================== */
 
 		boost::tuple<BoundingBoxType, IndexType *, BoundingBoxType, IndexType *> partition = 
-			ctx.minMaxBins.partition(ctx, cast(), indices, bestSplit, 
+			ctx.minMaxBins.partition(ctx, this, indices, bestSplit, 
 				isLeftChild, m_traversalCost, m_queryCost);
 
 		/* ==================================================================== */
@@ -2159,30 +2317,27 @@ protected:
 		/**
 		 * \brief Run min-max binning
 		 *
-		 * \param derived Derived class to be used to determine the BoundingBox for
-		 *     a given list of primitives
+		 * \param tree kd-tree under construction. Determines the bounding
+		 *     boxes of primitives and runs large loops in parallel.
 		 * \param indices Primitive indirection list
 		 * \param primCount Specifies the length of \a indices
 		 */
-		void bin(const Derived *derived, IndexType *indices, 
+		void bin(GenericKDTree *tree, IndexType *indices, 
 				SizeType primCount) {
 			m_primCount = primCount;
-			memset(m_minBins, 0, sizeof(SizeType) * PointType::Dimension * m_binCount);
-			memset(m_maxBins, 0, sizeof(SizeType) * PointType::Dimension * m_binCount);
-			const int64_t maxBin = m_binCount-1;
-
-			for (SizeType i=0; i<m_primCount; ++i) {
-				const BoundingBoxType bbox = derived->getBoundingBox(indices[i]);
-				for (int axis=0; axis<PointType::Dimension; ++axis) {
-					int64_t minIdx = (int64_t) ((bbox.min[axis] - m_bbox.min[axis]) 
-							* m_invBinSize[axis]);
-					int64_t maxIdx = (int64_t) ((bbox.max[axis] - m_bbox.min[axis]) 
-							* m_invBinSize[axis]);
-					m_maxBins[axis * m_binCount 
-						+ std::max((int64_t) 0, std::min(maxIdx, maxBin))]++;
-					m_minBins[axis * m_binCount 
-						+ std::max((int64_t) 0, std::min(minIdx, maxBin))]++;
+			BinTask task(this, tree->cast(), indices, tree->getChunkCount(primCount));
+			tree->parallelFor(task, primCount);
+
+			/* Accumulate the bins of all chunks */
+			const SizeType binsPerChunk = PointType::Dimension * m_binCount;
+			for (SizeType i=0; i<binsPerChunk; ++i) {
+				SizeType minSum = 0, maxSum = 0;
+				for (SizeType chunk=0; chunk<task.chunkCount; ++chunk) {
+					minSum += task.minBins[chunk * binsPerChunk + i];
+					maxSum += task.maxBins[chunk * binsPerChunk + i];
 				}
+				m_minBins[i] = minSum;
+				m_maxBins[i] = maxSum;
 			}
 		}
 
@@ -2302,9 +2457,10 @@ protected:
 		 * primitive lists.
 		 */
 		boost::tuple<BoundingBoxType, IndexType *, BoundingBoxType, IndexType *> partition(
-				BuildContext &ctx, const Derived *derived, IndexType *primIndices,
+				BuildContext &ctx, GenericKDTree *tree, IndexType *primIndices,
 				SplitCandidate &split, bool isLeftChild, float traversalCost, 
 				float queryCost) {
+			const Derived *derived = tree->cast();
 			const float splitPos = split.pos;
 			const int axis = split.axis;
 			SizeType numLeft = 0, numRight = 0;
@@ -2321,22 +2477,42 @@ protected:
 				rightIndices = primIndices;
 			}
 
-			for (SizeType i=0; i<m_primCount; ++i) {
-				const IndexType primIndex = primIndices[i];
-				const BoundingBoxType bbox = derived->getBoundingBox(primIndex);
-
-				if (bbox.max[axis] <= splitPos) {
-					leftBounds.expandBy(bbox);
-					leftIndices[numLeft++] = primIndex;
-				} else if (bbox.min[axis] > splitPos) {
-					rightBounds.expandBy(bbox);
-					rightIndices[numRight++] = primIndex;
-				} else {
-					leftBounds.expandBy(bbox);
-					rightBounds.expandBy(bbox);
-					leftIndices[numLeft++] = primIndex;
-					rightIndices[numRight++] = primIndex;
+			SizeType chunkCount = tree->getChunkCount(m_primCount);
+			if (chunkCount == 1) {
+				for (SizeType i=0; i<m_primCount; ++i) {
+					const IndexType primIndex = primIndices[i];
+					const BoundingBoxType bbox = derived->getBoundingBox(primIndex);
+
+					if (bbox.max[axis] <= splitPos) {
+						leftBounds.expandBy(bbox);
+						leftIndices[numLeft++] = primIndex;
+					} else if (bbox.min[axis] > splitPos) {
+						rightBounds.expandBy(bbox);
+						rightIndices[numRight++] = primIndex;
+					} else {
+						leftBounds.expandBy(bbox);
+						rightBounds.expandBy(bbox);
+						leftIndices[numLeft++] = primIndex;
+						rightIndices[numRight++] = primIndex;
+					}
 				}
+			} else {
+				/* Classify chunks of primitives in parallel, then compute where each
+				   chunk goes and copy the indices. The result matches the serial loop. */
+				ClassifyTask classify(derived, primIndices, m_primCount, axis, splitPos, chunkCount);
+				tree->parallelFor(classify, m_primCount);
+
+				ScatterTask scatter(primIndices, m_primCount, classify.sides,
+					leftIndices, rightIndices, chunkCount);
+				for (SizeType chunk=0; chunk<chunkCount; ++chunk) {
+					scatter.leftOffset[chunk] = numLeft;
+					scatter.rightOffset[chunk] = numRight;
+					numLeft += classify.numLeft[chunk];
+					numRight += classify.numRight[chunk];
+					leftBounds.expandBy(classify.leftBounds[chunk]);
+					rightBounds.expandBy(classify.rightBounds[chunk]);
+				}
+				tree->parallelFor(scatter, m_primCount);
 			}
 
 			leftBounds.clip(m_bbox);
@@ -2386,6 +2562,114 @@ protected:
 					rightBounds, rightIndices);
 		}
 	private:
+		/// Min-max binning of chunks of primitives into separate bins
+		struct BinTask : public RangeTask {
+			const MinMaxBins *parent;
+			const Derived *derived;
+			const IndexType *indices;
+			SizeType chunkCount;
+			std::vector<SizeType> minBins, maxBins;
+
+			BinTask(const MinMaxBins *parent, const Derived *derived,
+					const IndexType *indices, SizeType chunkCount)
+				: parent(parent), derived(derived), indices(indices), chunkCount(chunkCount),
+				  minBins(chunkCount * PointType::Dimension * parent->m_binCount, 0),
+				  maxBins(chunkCount * PointType::Dimension * parent->m_binCount, 0) { }
+
+			void run(SizeType chunk, SizeType start, SizeType end) {
+				const int binCount = parent->m_binCount;
+				const int64_t maxBin = binCount-1;
+				const BoundingBoxType &binBBox = parent->m_bbox;
+				const VectorType &invBinSize = parent->m_invBinSize;
+				SizeType *minBinsChunk = &minBins[chunk * PointType::Dimension * binCount];
+				SizeType *maxBinsChunk = &maxBins[chunk * PointType::Dimension * binCount];
+
+				for (SizeType i=start; i<end; ++i) {
+					const BoundingBoxType bbox = derived->getBoundingBox(indices[i]);
+					for (int axis=0; axis<PointType::Dimension; ++axis) {
+						int64_t minIdx = (int64_t) ((bbox.min[axis] - binBBox.min[axis]) 
+								* invBinSize[axis]);
+						int64_t maxIdx = (int64_t) ((bbox.max[axis] - binBBox.min[axis]) 
+								* invBinSize[axis]);
+						maxBinsChunk[axis * binCount 
+							+ std::max((int64_t) 0, std::min(maxIdx, maxBin))]++;
+						minBinsChunk[axis * binCount 
+							+ std::max((int64_t) 0, std::min(minIdx, maxBin))]++;
+					}
+				}
+			}
+		};
+
+		/// Determines the side(s) of a split plane on which each primitive of a chunk lies
+		struct ClassifyTask : public RangeTask {
+			const Derived *derived;
+			const IndexType *indices;
+			int axis;
+			float splitPos;
+			std::vector<uint8_t> sides;
+			std::vector<SizeType> numLeft, numRight;
+			std::vector<BoundingBoxType> leftBounds, rightBounds;
+
+			ClassifyTask(const Derived *derived, const IndexType *indices, SizeType primCount,
+					int axis, float splitPos, SizeType chunkCount)
+				: derived(derived), indices(indices), axis(axis), splitPos(splitPos),
+				  sides(primCount), numLeft(chunkCount, 0), numRight(chunkCount, 0),
+				  leftBounds(chunkCount), rightBounds(chunkCount) { }
+
+			void run(SizeType chunk, SizeType start, SizeType end) {
+				BoundingBoxType &left = leftBounds[chunk], &right = rightBounds[chunk];
+				SizeType nLeft = 0, nRight = 0;
+				for (SizeType i=start; i<end; ++i) {
+					const BoundingBoxType bbox = derived->getBoundingBox(indices[i]);
+					uint8_t side;
+					if (bbox.max[axis] <= splitPos) {
+						left.expandBy(bbox);
+						side = ELeftSide;
+						++nLeft;
+					} else if (bbox.min[axis] > splitPos) {
+						right.expandBy(bbox);
+						side = ERightSide;
+						++nRight;
+					} else {
+						left.expandBy(bbox);
+						right.expandBy(bbox);
+						side = EBothSides;
+						++nLeft; ++nRight;
+					}
+					sides[i] = side;
+				}
+				numLeft[chunk] = nLeft;
+				numRight[chunk] = nRight;
+			}
+		};
+
+		/// Copies the indices of a chunk of classified primitives to the child lists
+		struct ScatterTask : public RangeTask {
+			std::vector<IndexType> indices;
+			const std::vector<uint8_t> &sides;
+			IndexType *leftIndices, *rightIndices;
+			std::vector<SizeType> leftOffset, rightOffset;
+
+			/* The input is copied, since one of the outputs overwrites it */
+			ScatterTask(const IndexType *primIndices, SizeType primCount,
+					const std::vector<uint8_t> &sides, IndexType *leftIndices,
+					IndexType *rightIndices, SizeType chunkCount)
+				: indices(primIndices, primIndices + primCount), sides(sides),
+				  leftIndices(leftIndices), rightIndices(rightIndices),
+				  leftOffset(chunkCount), rightOffset(chunkCount) { }
+
+			void run(SizeType chunk, SizeType start, SizeType end) {
+				IndexType *left = leftIndices + leftOffset[chunk],
+				          *right = rightIndices + rightOffset[chunk];
+				for (SizeType i=start; i<end; ++i) {
+					if (sides[i] != ERightSide)
+						*left++ = indices[i];
+					if (sides[i] != ELeftSide)
+						*right++ = indices[i];
+				}
+			}
+		};
+
 		SizeType *m_minBins;
 		SizeType *m_maxBins;
 		SizeType m_primCount;
@@ -2400,7 +2684,7 @@ protected:
 	float m_traversalCost;
 	float m_queryCost;
 	float m_emptySpaceBonus;
-	bool m_clip, m_retract, m_parallelBuild;
+	bool m_clip, m_retract, m_parallelBuild, m_parallelBuildRequested;
 	SizeType m_maxDepth;
 	SizeType m_stopPrims;
 	SizeType m_maxBadRefines;
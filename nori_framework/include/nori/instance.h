@@ -0,0 +1,91 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2012 by Wenzel Jakob and Steve Marschner.
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#if !defined(__INSTANCE_H)
+#define __INSTANCE_H
+
+#include <nori/mesh.h>
+#include <nori/transform.h>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Placement of a shared triangle mesh in the scene
+ *
+ * An <tt>&lt;instance&gt;</tt> element references a Wavefront OBJ file by
+ * name (property <tt>filename</tt>) and provides a transformation
+ * (<tt>toWorld</tt>) and a material. The scene loads every referenced
+ * file only once in object space and traces it using a separate
+ * bottom-level acceleration data structure (see \ref TwoLevelAccel).
+ *
+ * An instance does not own any triangles. Intersections with instanced
+ * geometry nevertheless report the instance as their mesh, so that the
+ * integrators find the BSDF of the instance. Area luminaires cannot be
+ * attached to instances.
+ */
+class Instance : public Mesh {
+public:
+	/// Create a new instance from a property list
+	Instance(const PropertyList &propList);
+
+	/// Assign a default BSDF if none was specified
+	void activate();
+
+	/// Register a child object (i.e. a BSDF) with the instance
+	void addChild(NoriObject *child);
+
+	/// Return the name of the referenced OBJ file
+	inline const QString &getFilename() const { return m_filename; }
+
+	/// Return the transformation from object to world space
+	inline const Transform &getToWorld() const { return m_toWorld; }
+
+	/**
+	 * \brief Move the instance
+	 *
+	 * Afterwards, the scene must be notified (see \ref Scene::update())
+	 */
+	void setToWorld(const Transform &toWorld);
+
+	/// Return the transformation from world to object space
+	inline const Transform &getWorldToObject() const { return m_worldToObject; }
+
+	/// Does the transformation flip the orientation of triangles (negative determinant)?
+	inline bool flipsOrientation() const { return m_flipsOrientation; }
+
+	/// Return the shared object space mesh (set by the scene)
+	inline Mesh *getShape() const { return m_shape; }
+
+	/// Set the shared object space mesh
+	inline void setShape(Mesh *shape) { m_shape = shape; }
+
+	/// Return a human-readable summary of this instance
+	QString toString() const;
+
+	EClassType getClassType() const { return EInstance; }
+private:
+	QString m_filename;
+	Transform m_toWorld;
+	Transform m_worldToObject;
+	bool m_flipsOrientation;
+	Mesh *m_shape;
+};
+
+NORI_NAMESPACE_END
+
+#endif /* __INSTANCE_H */
@@ -22,6 +22,7 @@
 #include <nori/object.h>
 #include <nori/dpdf.h>
 #include <nori/frame.h>
+#include <nori/sampler.h>
 
 NORI_NAMESPACE_BEGIN
 
@@ -53,6 +54,28 @@ public:
 	 */
 	virtual Color3f Li(const Scene *scene, Sampler *sampler, const Ray3f &ray) const = 0;
 
+	/**
+	 * \brief Sample the incident radiance along the rays of all
+	 * samples of a pixel
+	 *
+	 * Integrators can override this to trace the rays as packets
+	 * (see \ref Scene::rayIntersect()). Implementations must call
+	 * \ref Sampler::advance() after processing each ray, in order,
+	 * so that every ray sees the same sample dimensions as it would
+	 * in a sequence of calls to \ref Li(). The default implementation
+	 * does exactly that.
+	 *
+	 * \param values
+	 *    Receives the radiance estimate of each ray
+	 */
+	virtual void LiBatch(const Scene *scene, Sampler *sampler, const Ray3f *rays,
+			Color3f *values, size_t count) const {
+		for (size_t i=0; i<count; ++i) {
+			values[i] = Li(scene, sampler, rays[i]);
+			sampler->advance();
+		}
+	}
+
 	/**
 	 * \brief Return the type of object (i.e. Mesh/BSDF/etc.) 
 	 * provided by this instance
@@ -22,7 +22,15 @@
 #define __KDTREE_H
 
 #include <nori/gkdtree.h>
-#include <nori/mesh.h>
+#include <nori/accel.h>
+
+#define NORI_KD_CACHE_VERSION 1 /* Increase whenever the layout of the kd-tree cache files changes */
+#define NORI_NO_ROPE 0xFFFFFFFFu /* Rope across a face of the tree's bounding box */
+#define NORI_KD_AUTOTUNE_RESOLUTION 128 /* Camera rays per image row and column in the autotuning pilot set */
+#define NORI_KD_AUTOTUNE_PASSES 3 /* The fastest of this many passes over the pilot rays is taken as a candidate's time */
+#define NORI_KD_AUTOTUNE_GAIN 0.98f /* A candidate must trace the pilot rays at least this much faster to be kept */
+
+class QFile;
 
 NORI_NAMESPACE_BEGIN
 
@@ -37,9 +45,17 @@ NORI_NAMESPACE_BEGIN
  * ray traversal algorithm (TA^B_{rec}), which is explained in Vlastimil 
  * Havran's PhD thesis "Heuristic Ray Shooting Algorithms". 
  *
+ * When a cache directory is set (see \ref Accelerator::setCacheDirectory()),
+ * the finished tree is stored there in a file whose name is a hash of the
+ * geometry and the construction parameters. Later builds over the same
+ * geometry memory-map that file instead of constructing the tree again.
+ *
+ * Optionally, the leaves can be linked by ropes (see \ref setRopes()),
+ * so that rays starting on a surface avoid the descent from the root.
+ *
  * \author Wenzel Jakob
  */
-class KDTree : public GenericKDTree<BoundingBox3f, SurfaceAreaHeuristic3, KDTree> {
+class KDTree : public GenericKDTree<BoundingBox3f, SurfaceAreaHeuristic3, KDTree>, public Accelerator {
 protected:
 	typedef GenericKDTree<BoundingBox3f, SurfaceAreaHeuristic3, KDTree>  Parent;
 	typedef Parent::SizeType                                             SizeType;
@@ -49,6 +65,8 @@ protected:
 	using Parent::m_nodes;
 	using Parent::m_bbox;
 	using Parent::m_indices;
+	using Parent::m_nodeCount;
+	using Parent::m_indexCount;
 
 public:
 	/// Create a new and empty kd-tree
@@ -57,45 +75,117 @@ public:
 	/// Release all memory
 	virtual ~KDTree();
 
+	/// Build the kd-tree, or load it from the cache
+	void build();
+
+	/**
+	 * \brief Build the kd-tree again after meshes have moved
+	 *
+	 * The split planes of a kd-tree cannot be refitted. Since moving
+	 * geometry (e.g. in an animation) would fill the cache with trees
+	 * that are never loaded again, the new tree is not cached.
+	 */
+	void refit(const Mesh *mesh = NULL);
+
+	/**
+	 * \brief Intersect a ray against all triangle meshes registered
+	 * with the kd-tree (see \ref Accelerator::rayIntersect())
+	 */
+	bool rayIntersect(const Ray3f &ray, Intersection &its, 
+		bool shadowRay = false) const;
+
 	/**
-	 * \brief Register a triangle mesh for inclusion in the kd-tree.
+	 * \brief Intersect a ray that starts on a previously found surface
+	 * (see \ref Accelerator::rayIntersectFrom())
+	 *
+	 * When the tree has ropes, the traversal starts in the given leaf and
+	 * follows the ropes from leaf to leaf. Otherwise, or if \c leaf is
+	 * \ref NORI_NO_LEAF, this is the same as \ref rayIntersect().
+	 */
+	bool rayIntersectFrom(uint32_t leaf, const Ray3f &ray, Intersection &its) const;
+
+	/**
+	 * \brief Find the point on the triangles that is closest to \c p
+	 * (see \ref Accelerator::closestPoint())
+	 *
+	 * The tree is traversed depth-first, visiting the child on the side
+	 * of \c p first. Every other child is skipped when its cell lies
+	 * farther away than the closest triangle found so far.
+	 */
+	bool closestPoint(const Point3f &p, float maxDist, Intersection &its) const;
+
+	/// Find all triangles within distance \c radius of \c p (see \ref Accelerator::trianglesInRadius())
+	void trianglesInRadius(const Point3f &p, float radius,
+		std::vector<TriangleRef> &triangles) const;
+
+	/**
+	 * \brief Link the leaves of the tree by ropes (disabled by default)
+	 *
+	 * For each of its six faces, every leaf stores the smallest node that
+	 * contains all leaves adjacent to that face ("Stackless KD-Tree
+	 * Traversal for High Performance GPU Ray Tracing" by Popov et al.).
+	 * Intersections then record the leaf they were found in, and rays
+	 * leaving the surface walk from leaf to leaf without descending from
+	 * the root, which pays off for short rays in enclosed scenes. The
+	 * ropes need 48 bytes per leaf and 4 bytes per node.
 	 *
 	 * This function can only be used before \ref build() is called
 	 */
-	void addMesh(Mesh *mesh);
+	inline void setRopes(bool ropes) { m_useRopes = ropes; }
 
-	/// Build the kd-tree
-	void build();
+	/// Are the leaves linked by ropes?
+	inline bool getRopes() const { return m_useRopes; }
 
 	/**
-	 * \brief Intersect a ray against all triangle meshes registered
-	 * with the kd-tree
+	 * \brief Build the tree using the construction parameters that trace
+	 * a pilot set of rays the fastest
 	 *
-	 * Detailed information about the intersection, if any, will be
-	 * stored in the provided \ref Intersection data record. 
+	 * The pilot set consists of the given camera rays and a diffuse
+	 * bounce ray at every point where they hit the geometry. Starting
+	 * from the current parameters, the traversal cost, the empty space
+	 * bonus and the number of primitives at which leaves are created are
+	 * varied one after the other. Each variation that traces the pilot
+	 * set faster is kept. The candidate trees are not cached.
+	 *
+	 * The chosen parameters are printed as scene properties, so that
+	 * they can be pinned for repeat renders. Afterwards, the tree is
+	 * built using them as in \ref build().
+	 */
+	void autotune(const std::vector<Ray3f> &cameraRays);
+
+	/**
+	 * \brief Self test of building a tree again
 	 *
-	 * The <tt>shadowRay</tt> parameter specifies whether this detailed
-	 * information is really needed. When set to \c true, the 
-	 * function just checks whether or not there is occlusion, but without
-	 * providing any more detail (i.e. \c its will not be filled with
-	 * contents). This is usually much faster.
+	 * Builds a kd-tree over more than 64K random triangles (so that
+	 * subtrees are handed to the builder threads) with several threads,
+	 * moves the triangles and builds it again as in an animation. After
+	 * each build, the tree must report the same hits for a set of rays
+	 * as one built from scratch. Finally, the tree is autotuned (see
+	 * \ref autotune()), and must match a tree that is built once using
+	 * the chosen parameters.
 	 *
-	 * \return \c true If an intersection was found
+	 * \return \c true if the test passed
 	 */
-	bool rayIntersect(const Ray3f &ray, Intersection &its, 
-		bool shadowRay = false) const;
+	static bool selfTest();
 
-	/// Return the total number of internally represented triangles 
-	inline SizeType getPrimitiveCount() const { return m_primitiveCount; }
+#if defined(__SSE__)
+	/**
+	 * \brief Intersect a packet of rays (see \ref Accelerator::rayIntersectPacket())
+	 *
+	 * When the directions of all rays have the same signs, the packet
+	 * traverses the tree together: the split planes are tested against
+	 * four rays at a time, and a subtree is visited whenever at least one
+	 * of the rays overlaps it. Other packets are traced ray by ray.
+	 */
+	void rayIntersectPacket(const Ray3f *rays, uint32_t count,
+		Intersection *its, bool *hits, bool shadowRay = false) const;
+#endif
 
-	/// Return the total number of meshes registered with the kd-tree
-	inline SizeType getMeshCount() const { return (SizeType) m_meshes.size(); }
+	/// Return the size of the node and index arrays in bytes
+	size_t getMemoryUsage() const;
 
-	/// Return one of the registered meshes
-	inline Mesh *getMesh(IndexType idx) { return m_meshes[idx]; }
-	
-	/// Return one of the registered meshes (const version)
-	inline const Mesh *getMesh(IndexType idx) const { return m_meshes[idx]; }
+	/// Return a human-readable name
+	QString getName() const { return "SAH kd-tree"; }
 
 	//// Return an axis-aligned bounding box containing the entire tree
 	inline const BoundingBox3f &getBoundingBox() const {
@@ -120,19 +210,91 @@ public:
 	}
 protected:
 	/**
-	 * \brief Compute the mesh and triangle indices corresponding to 
-	 * a primitive index used by the underlying generic kd-tree implementation. 
+	 * \brief Any-hit traversal for shadow rays (see \ref Accelerator::findOccluder())
+	 *
+	 * Instead of Havran's entry and exit points, only the parametric
+	 * interval of the ray is tracked. The child containing the ray origin
+	 * is visited first, and the first leaf that blocks the ray anywhere
+	 * along its extent terminates the traversal.
 	 */
-	IndexType findMesh(IndexType &idx) const {
-		std::vector<IndexType>::const_iterator it = std::lower_bound(
-				m_sizeMap.begin(), m_sizeMap.end(), idx+1) - 1;
-		idx -= *it;
-		return (IndexType) (it - m_sizeMap.begin());
-	}
+	bool findOccluder(const Ray3f &ray, float mint, float maxt, uint32_t leaf, uint32_t &slot) const;
+
+	/**
+	 * \brief Multi-hit query (see \ref Accelerator::findHits())
+	 *
+	 * Visits the leaves along the ray in front-to-back order (as in
+	 * \ref findOccluder()) and collects the intersections of all of them
+	 * in a single traversal. Once \c k hits were found, the remaining
+	 * subtrees beyond the farthest of them are skipped.
+	 */
+	void findHits(const Ray3f &ray, uint32_t k, std::vector<Intersection> &its) const;
+
+	/**
+	 * \brief Shared traversal of \ref closestPoint() and \ref trianglesInRadius()
+	 *
+	 * Visits the leaves whose cells lie within <tt>sqrt(maxDist2)</tt>
+	 * of \c p. When \c triangles is \c NULL, the closest triangle is
+	 * searched as in \ref closestPacked(), shrinking \c maxDist2 along
+	 * the way. Otherwise, all triangles within the distance are appended
+	 * to \c triangles, possibly more than once.
+	 */
+	bool traversePoint(const Point3f &p, float &maxDist2, std::vector<TriangleRef> *triangles,
+		uint32_t &slot, Point2f &uv) const;
+
+	/// Return the time per ray in nanoseconds to trace a pilot set (see \ref autotune())
+	float tracePilot(const std::vector<Ray3f> &rays) const;
+
+	/// Bounds and neighbors of a leaf (see \ref setRopes())
+	struct Rope {
+		/// Bounds of the leaf
+		BoundingBox3f bbox;
+		/**
+		 * \brief Node index of the neighbor across the lower (<tt>2*axis</tt>)
+		 * and upper (<tt>2*axis+1</tt>) face along each axis, or \ref NORI_NO_ROPE
+		 */
+		uint32_t neighbor[6];
+	};
+
+	/// Recursively attach the ropes to the leaves below \c node, whose bounds are \c bbox
+	void buildRopes(uint32_t node, const BoundingBox3f &bbox, const uint32_t *ropes);
+
+	/**
+	 * \brief Move a rope as far down the tree as possible
+	 *
+	 * Descends from \c node as long as a single child contains all
+	 * leaves adjacent to the given face of \c bbox.
+	 */
+	uint32_t optimizeRope(uint32_t node, int face, const BoundingBox3f &bbox) const;
+
+	/**
+	 * \brief Rope traversal, starting in the leaf containing the ray origin
+	 *
+	 * When \c shadowRay is set, the traversal stops at the first hit, and
+	 * \c primIndex receives the packed index of the occluder. Otherwise,
+	 * \c maxt, \c its and \c primIndex are updated as in \ref intersectPacked(),
+	 * and \c lastLeaf receives the leaf containing the closest intersection.
+	 */
+	bool traverseRopes(uint32_t leaf, const Ray3f &ray, float mint, float &maxt,
+		Intersection &its, bool shadowRay, uint32_t &primIndex, uint32_t &lastLeaf) const;
+
+	/// Return a hash of the geometry and construction parameters, which identifies a cache file
+	QByteArray getCacheKey() const;
+
+	/// Memory-map a cache file written by \ref saveCache(). Returns \c false if it is missing or stale
+	bool loadCache(const QString &filename, const QByteArray &key);
+
+	/// Write the built tree to a cache file
+	void saveCache(const QString &filename, const QByteArray &key) const;
+
+	/// Release the nodes and indices (or the cache file holding them) and the ropes
+	void release();
 private:
-	std::vector<Mesh *> m_meshes;
-	std::vector<SizeType> m_sizeMap;
-	SizeType m_primitiveCount;
+	/* Memory-mapped cache file that holds the nodes and indices (if loaded from the cache) */
+	QFile *m_cacheFile;
+	bool m_useRopes;
+	/* Index into m_ropes for every leaf node */
+	std::vector<uint32_t> m_ropeIndex;
+	std::vector<Rope> m_ropes;
 };
 
 NORI_NAMESPACE_END
@@ -23,6 +23,8 @@
 #include <nori/dpdf.h>
 #include <nori/frame.h>
 
+#define NORI_NO_LEAF 0xFFFFFFFFu /* Intersection::leaf value of intersections without a known kd-tree leaf */
+
 NORI_NAMESPACE_BEGIN
 
 /**
@@ -46,9 +48,16 @@ struct Intersection {
 	Frame geoFrame;
 	/// Pointer to the associated mesh
 	const Mesh *mesh;
+	/**
+	 * \brief Leaf of the scene's kd-tree that contains the intersection
+	 *
+	 * Rays leaving the surface can start their traversal there (see
+	 * \ref KDTree::setRopes()). Equals \ref NORI_NO_LEAF when unknown.
+	 */
+	uint32_t leaf;
 
 	/// Create an uninitialized intersection record
-	inline Intersection() : mesh(NULL) { }
+	inline Intersection() : mesh(NULL), leaf(NORI_NO_LEAF) { }
 
 	/// Transform a direction vector into the local shading frame
 	inline Vector3f toLocal(const Vector3f &d) const {
@@ -80,6 +89,13 @@ public:
 	/// Initialize internal data structures (called once by the XML parser)
 	virtual void activate();
 
+	/**
+	 * \brief Transform the vertex positions and normals in place
+	 *
+	 * Afterwards, the scene must be notified (see \ref Scene::update())
+	 */
+	void applyTransform(const Transform &trafo);
+
 	/// Return the total number of triangles in this hsape
 	inline uint32_t getTriangleCount() const { return m_triangleCount; }
 	
@@ -188,6 +204,9 @@ public:
 protected:
 	/// Create an empty mesh
 	Mesh(const PropertyList& propList);
+
+	/// Recompute the distribution used to sample triangles with respect to surface area
+	void updateDistribution();
 protected:
 	Point3f    *m_vertexPositions;
 	Normal3f   *m_vertexNormals;
@@ -0,0 +1,133 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2012 by Wenzel Jakob and Steve Marschner.
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* =======================================================================
+     This file contains classes for distributing the rendering of image
+     blocks over several processes or machines.
+ * ======================================================================= */
+
+#if !defined(__NETWORK_H)
+#define __NETWORK_H
+
+#include <nori/block.h>
+#include <QMutex>
+
+#define NORI_DEFAULT_PORT 7554 /* Default TCP port of the coordinator */
+#define NORI_REMOTE_TIMEOUT 600000 /* Max. time (in ms) that a worker may spend on one block */
+#define NORI_REMOTE_SEED 0x2545F491 /* Worker connection i seeds its sampler with this value plus i */
+
+NORI_NAMESPACE_BEGIN
+
+class RemoteServer;
+class RemoteConnection;
+
+/**
+ * \brief Hands out image blocks to remote worker processes
+ *
+ * The coordinator owns the block generator and the output image. It
+ * listens on a TCP port, and every connecting worker thread (see
+ * \ref RemoteWorkerThread) repeatedly pulls a block, renders it and
+ * sends back the resulting image block including its border region,
+ * which is then merged into the output image. Fast machines thus
+ * automatically render more blocks than slow ones.
+ *
+ * When a connection is lost or a worker does not deliver its block
+ * within \ref NORI_REMOTE_TIMEOUT milliseconds, the block is requeued
+ * so that it is rendered by someone else.
+ *
+ * The coordinator can render blocks itself at the same time using
+ * ordinary \ref BlockRenderThread instances.
+ */
+class RemoteCoordinator : public QThread {
+public:
+	/**
+	 * \brief Create a new coordinator
+	 *
+	 * \param scene
+	 *     The scene being rendered (workers must load the same scene)
+	 * \param blockGenerator
+	 *     The block generator that is shared with the local render threads
+	 * \param output
+	 *     The output image
+	 * \param port
+	 *     TCP port that should be listened on
+	 */
+	RemoteCoordinator(const Scene *scene, BlockGenerator *blockGenerator,
+		ImageBlock *output, quint16 port);
+
+	/// Release all memory
+	virtual ~RemoteCoordinator();
+
+	/// Stop accepting connections and wait for all connections to be closed
+	void stop();
+
+	/// Main loop: accept connections
+	void run();
+protected:
+	friend class RemoteServer;
+
+	/// Called by the server for every new connection
+	void addConnection(int socketDescriptor);
+private:
+	const Scene *m_scene;
+	BlockGenerator *m_blockGenerator;
+	ImageBlock *m_output;
+	quint16 m_port;
+	std::vector<RemoteConnection *> m_connections;
+	QMutex m_mutex;
+	bool m_stop;
+};
+
+/**
+ * \brief Render thread that pulls blocks from a remote \ref RemoteCoordinator
+ *
+ * Each worker thread uses a separate connection.
+ */
+class RemoteWorkerThread : public BlockRenderThread {
+public:
+	/**
+	 * \brief Create a new worker thread
+	 *
+	 * \param scene
+	 *     Local copy of the scene that is being rendered by the coordinator
+	 * \param sampler
+	 *     Sample generator that will be cloned (and reseeded) for this thread
+	 * \param host
+	 *     Host name or address of the coordinator
+	 * \param port
+	 *     TCP port of the coordinator
+	 * \param id
+	 *     Index of this thread among the threads of the worker process
+	 */
+	RemoteWorkerThread(const Scene *scene, Sampler *sampler,
+		const QString &host, quint16 port, int id);
+
+	/// Main loop: fetch and render blocks until the coordinator is done
+	void run();
+
+	/// Return the number of blocks rendered by this thread
+	inline int getBlockCount() const { return m_blockCount; }
+private:
+	QString m_host;
+	quint16 m_port;
+	int m_blockCount;
+};
+
+NORI_NAMESPACE_END
+
+#endif /* __NETWORK_H */
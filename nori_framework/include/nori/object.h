@@ -47,6 +47,7 @@ public:
 		ETest,
 		EReconstructionFilter,
                 EEvaluator,
+		EInstance,
 		EClassTypeCount
 	};
 
@@ -109,6 +110,7 @@ public:
 			case ESampler:    return "sampler";
 			case ETest:       return "test";
                         case EEvaluator:  return "evaluator";         
+			case EInstance:   return "instance";
 			default:          return "<unknown>";
 		}
 	}
@@ -21,6 +21,8 @@
 
 #include <nori/common.h>
 
+class QDataStream;
+
 NORI_NAMESPACE_BEGIN
 
 /* Period parameters for the Mersenne Twister RNG */
@@ -56,6 +58,23 @@ public:
 
 	/// Generate an uniformly distributed single precision value on [0,1)
 	float nextFloat();
+
+	/**
+	 * \brief Fill an array with uniformly distributed single precision
+	 * values on [0,1)
+	 *
+	 * Produces the same values as \c count calls to \ref nextFloat()
+	 */
+	void nextFloats(float *dest, size_t count);
+
+	/// Write the complete state of the generator to a binary stream
+	void serialize(QDataStream &stream) const;
+
+	/// Restore the state of the generator from a binary stream
+	void unserialize(QDataStream &stream);
+private:
+	/// Generate the next \ref MT_N words of the state vector
+	void refill();
 private:
 	uint32_t m_mt[MT_N];
 	int m_mti;
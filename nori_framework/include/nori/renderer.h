@@ -0,0 +1,191 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2012 by Wenzel Jakob and Steve Marschner.
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#if !defined(__RENDERER_H)
+#define __RENDERER_H
+
+#include <nori/block.h>
+#include <nori/transform.h>
+
+#define NORI_PROGRESS_INTERVAL 1000 /* Interval between two progress reports in headless mode (in ms) */
+#define NORI_ADAPTIVE_PASS_SIZE 4 /* Default number of samples per pass and pixel with adaptive sampling */
+#define NORI_ADAPTIVE_MIN_PASSES 2 /* Default number of passes before adaptive sampling kicks in */
+#define NORI_CHECKPOINT_MAGIC 0x4E4F5249 /* Identifies checkpoint files ("NORI") */
+#define NORI_CHECKPOINT_VERSION 2 /* Version of the checkpoint format */
+#define NORI_SHARD_SEED 5489 /* Shard i of a sample range sharded render seeds its sampler with this value plus i */
+
+class NoriWindow;
+
+NORI_NAMESPACE_BEGIN
+
+/// Settings that can be changed from the command line
+struct RenderOptions {
+	/// Render without opening a preview window
+	bool headless;
+	/// Maximum size of the blocks handed out to the render threads
+	int blockSize;
+	/// Order in which the blocks are rendered
+	BlockGenerator::EBlockOrder blockOrder;
+	/// Samples per pixel and pass (0: render all samples in one pass)
+	int samplesPerPass;
+	/// Total samples per pixel (0: use the sample count of the sampler)
+	int sampleCount;
+	/// Don't start new passes after this many milliseconds (-1: no limit)
+	qint64 timeLimit;
+	/// Relative error threshold for adaptive sampling (0: disabled)
+	float adaptiveThreshold;
+	/// Number of passes before pixels may be considered converged
+	int adaptiveMinPasses;
+	/// Placement of the scene geometry and kd-tree on NUMA machines
+	EMemoryPlacement memoryPlacement;
+	/// Interval between two checkpoints in milliseconds (-1: no checkpoints)
+	qint64 checkpointInterval;
+	/// Continue from an existing checkpoint
+	bool resume;
+	/// Crop window (a size of zero means that the entire image is rendered)
+	Point2i cropOffset;
+	Vector2i cropSize;
+	/// Render the sample range with index \c shardIndex out of \c shardCount
+	int shardIndex, shardCount;
+	/// Write the unnormalized weighted film instead of the final image
+	bool raw;
+	/// Output filename (empty: derive it from the scene filename)
+	QString output;
+	/// Accept remote workers on this TCP port (0: disabled)
+	int coordinatorPort;
+	/// Render blocks for the coordinator at the given "host:port" instead
+	QString worker;
+	/// File with one camera-to-world transform per frame and optional object motion (empty: render a single image)
+	QString animation;
+	/// Count ray traversal steps, print a report and write a per-pixel traversal cost image
+	bool statistics;
+
+	RenderOptions() : headless(false), blockSize(NORI_BLOCK_SIZE),
+		blockOrder(BlockGenerator::ESpiral), samplesPerPass(0),
+		sampleCount(0), timeLimit(-1), adaptiveThreshold(0),
+		adaptiveMinPasses(NORI_ADAPTIVE_MIN_PASSES),
+		memoryPlacement(EFirstTouch), checkpointInterval(-1), resume(false),
+		cropOffset(0, 0), cropSize(0, 0), shardIndex(0), shardCount(1),
+		raw(false), coordinatorPort(0), statistics(false) { }
+};
+
+/// Camera placement and object motion of one frame of an animation (see \ref Renderer::loadAnimation())
+struct AnimationFrame {
+	/// Camera-to-world transformation
+	Transform camera;
+	/// New object-to-world transformations of instances (by index into \ref Scene::getInstances())
+	std::vector<std::pair<int, Transform> > instances;
+	/// Transformations applied to meshes in place (by index into \ref Scene::getMeshes())
+	std::vector<std::pair<int, Transform> > meshes;
+};
+
+/**
+ * \brief Renders one or more frames of a scene
+ *
+ * The renderer owns the block generator, the output image and a pool
+ * of render threads (one per core), which are created once and stay
+ * alive until the renderer is destroyed. Rendering several frames of
+ * an animation thus only pays for loading the scene and building its
+ * kd-tree once.
+ */
+class Renderer {
+public:
+	/**
+	 * \brief Create a renderer and start its render threads
+	 *
+	 * \param scene
+	 *     The scene to be rendered. It must stay alive as long as the renderer.
+	 * \param options
+	 *     Command line settings (passes, time limit, crop window, ..)
+	 */
+	Renderer(Scene *scene, const RenderOptions &options);
+
+	/// Terminate the render threads and release all memory
+	~Renderer();
+
+	/**
+	 * \brief Change the sample count, passes, time limit and crop
+	 * window used by subsequent frames
+	 *
+	 * Adaptive sampling and ray statistics cannot be switched on or off,
+	 * since they determine the layout of the output image.
+	 */
+	void configure(const RenderOptions &options);
+
+	/**
+	 * \brief Render a single frame using the current camera settings
+	 *
+	 * \param baseName
+	 *     Filename of the output without extension. The image is written
+	 *     to <tt>baseName.exr</tt>, checkpoints to <tt>baseName.checkpoint</tt>.
+	 *     With ray statistics, the average traversal cost per sample is
+	 *     written to <tt>baseName_cost.exr</tt>.
+	 * \return \c false if rendering was interrupted by SIGINT or SIGTERM
+	 */
+	bool render(const QString &baseName);
+
+	/**
+	 * \brief Render the frames of an animation
+	 *
+	 * Before rendering a frame, its object motion is applied and the
+	 * acceleration data structure is updated (see \ref Scene::update()).
+	 * Frame \c i is written to <tt>baseName_%04d.exr</tt>. When resuming,
+	 * frames that have already been written are skipped, but their
+	 * object motion is still applied.
+	 *
+	 * \return \c false if rendering was interrupted by SIGINT or SIGTERM
+	 */
+	bool renderAnimation(const QString &baseName, const std::vector<AnimationFrame> &frames);
+
+	/**
+	 * \brief Load an animation, i.e. one camera-to-world transform per
+	 * line in the format of \ref Transform::toLineString()
+	 *
+	 * The object motion of a frame precedes its camera transform:
+	 * <tt>instance &lt;index&gt; &lt;transform&gt;</tt> sets the
+	 * object-to-world transformation of an instance, and
+	 * <tt>mesh &lt;index&gt; &lt;transform&gt;</tt> moves a mesh by
+	 * the given transformation (see \ref Mesh::applyTransform()).
+	 * Empty lines and lines starting with '#' are ignored.
+	 */
+	static void loadAnimation(const QString &filename, std::vector<AnimationFrame> &frames);
+protected:
+	/**
+	 * \brief Write a checkpoint containing the accumulated image, the state
+	 * of the block generator and the sampler state of each render thread
+	 *
+	 * Must be called while the block generator is paused
+	 */
+	void saveCheckpoint(const QString &filename) const;
+
+	/// Restore a checkpoint written by \ref saveCheckpoint()
+	void loadCheckpoint(const QString &filename);
+private:
+	friend class RenderMonitor;
+
+	Scene *m_scene;
+	RenderOptions m_options;
+	BlockGenerator *m_blockGenerator;
+	ImageBlock *m_result;
+	std::vector<BlockRenderThread *> m_threads;
+	NoriWindow *m_window;
+};
+
+NORI_NAMESPACE_END
+
+#endif /* __RENDERER_H */
@@ -21,6 +21,8 @@
 
 #include <nori/object.h>
 
+class QDataStream;
+
 NORI_NAMESPACE_BEGIN
 
 /**
@@ -90,9 +92,73 @@ public:
 	/// Retrieve the next two component values from the current sample
 	virtual Point2f next2D() = 0;
 
+	/**
+	 * \brief Retrieve the next \c count component values from the current
+	 * sample at once
+	 *
+	 * Equivalent to \c count calls to \ref next1D(), but avoids a virtual
+	 * function call per value. The default implementation does just that.
+	 */
+	virtual void fill1D(float *dest, size_t count) {
+		for (size_t i=0; i<count; ++i)
+			dest[i] = next1D();
+	}
+
+	/// Retrieve the next \c count pairs of component values (see \ref fill1D())
+	virtual void fill2D(Point2f *dest, size_t count) {
+		for (size_t i=0; i<count; ++i)
+			dest[i] = next2D();
+	}
+
+	/**
+	 * \brief Retrieve the camera sample vectors of all samples of the
+	 * current pixel
+	 *
+	 * Must be called right after \ref generate(). For each of the \c count
+	 * pixel samples, the film position offset and the aperture position 
+	 * are written to <tt>dest[2*i]</tt> and <tt>dest[2*i+1]</tt>. The
+	 * render loop then only calls \ref advance() between the samples, and
+	 * the integrator continues with the third 2D component of each sample.
+	 *
+	 * The default implementation takes them from \ref fill2D(), which is
+	 * only appropriate for samplers whose components are independent of
+	 * the sample index. Stratified samplers must override it.
+	 */
+	virtual void fillPixel(Point2f *dest, size_t count) {
+		fill2D(dest, 2 * count);
+	}
+
 	/// Return the number of configured pixel samples
 	virtual inline size_t getSampleCount() const { return m_sampleCount; }
 
+	/**
+	 * \brief Deterministically reseed the sampler
+	 *
+	 * Samplers with different seeds produce statistically independent
+	 * sample sets, e.g. when several processes render different sample 
+	 * ranges of the same frame. The default implementation throws an 
+	 * exception.
+	 */
+	virtual void seed(uint32_t) {
+		throw NoriException(QString("%1: seeding is not supported!").arg(toString()));
+	}
+
+	/**
+	 * \brief Write the internal state of the sampler (e.g. the state 
+	 * of a random number generator) to a binary stream
+	 *
+	 * This is used to checkpoint long renderings. The default
+	 * implementation throws an exception.
+	 */
+	virtual void serialize(QDataStream &) const {
+		throw NoriException(QString("%1: checkpointing is not supported!").arg(toString()));
+	}
+
+	/// Restore the state written by \ref serialize()
+	virtual void unserialize(QDataStream &) {
+		throw NoriException(QString("%1: checkpointing is not supported!").arg(toString()));
+	}
+
 	/**
 	 * \brief Return the type of object (i.e. Mesh/Sampler/etc.) 
 	 * provided by this instance
@@ -20,7 +20,7 @@
 #define __SCENE_H
 
 #include <nori/evaluator.h>
-#include <nori/kdtree.h>
+#include <nori/accel.h>
 
 NORI_NAMESPACE_BEGIN
 
@@ -33,14 +33,33 @@ NORI_NAMESPACE_BEGIN
  */
 class Scene : public NoriObject {
 public:
-	/// Construct a new scene object
-	Scene(const PropertyList &);
+	/**
+	 * \brief Construct a new scene object
+	 *
+	 * The property <tt>accelerator</tt> selects the ray intersection
+	 * acceleration data structure (see \ref Accelerator::create()).
+	 * When the scene contains instances, it is also used for the
+	 * bottom level of a \ref TwoLevelAccel. The boolean property
+	 * <tt>ropes</tt> links the leaves of a kd-tree by ropes (see
+	 * \ref KDTree::setRopes()).
+	 *
+	 * The construction parameters of a kd-tree can be set using the
+	 * properties <tt>kdTraversalCost</tt>, <tt>kdQueryCost</tt>,
+	 * <tt>kdEmptySpaceBonus</tt>, <tt>kdStopPrims</tt>, <tt>kdMinMaxBins</tt>
+	 * and <tt>kdExactPrimThreshold</tt> (see \ref GenericKDTree). When
+	 * <tt>kdAutotune</tt> is set, some of them are instead chosen by
+	 * tracing pilot rays from the camera (see \ref KDTree::autotune()).
+	 */
+	Scene(const PropertyList &propList);
 
 	/// Release all memory
 	virtual ~Scene();
 
-	/// Return a pointer to the scene's kd-tree
-	inline const KDTree *getKDTree() const { return m_kdtree; }
+	/// Return a pointer to the scene's acceleration data structure
+	inline const Accelerator *getAccelerator() const { return m_accel; }
+
+	/// Return a pointer to the scene's acceleration data structure
+	inline Accelerator *getAccelerator() { return m_accel; }
 
 	/// Return a pointer to the scene's integrator
 	inline const Integrator *getIntegrator() const { return m_integrator; }
@@ -68,6 +87,9 @@ public:
 
 	/// Return a reference to an array containing all meshes
 	inline const std::vector<Mesh *> &getMeshes() const { return m_meshes; }
+
+	/// Return a reference to an array containing all instances
+	inline const std::vector<Instance *> &getInstances() const { return m_instances; }
         
         /// Return a reference to an array containing all luminaires
         inline const std::vector<Luminaire *> &getLuminaires() const { return m_luminaires; }
@@ -87,7 +109,7 @@ public:
 	 * \return \c true if an intersection was found
 	 */
 	inline bool rayIntersect(const Ray3f &ray, Intersection &its) const {
-		return m_kdtree->rayIntersect(ray, its, false);
+		return m_accel->rayIntersect(ray, its, false);
 	}
 
 	/**
@@ -106,8 +128,107 @@ public:
 	 * \return \c true if an intersection was found
 	 */
 	inline bool rayIntersect(const Ray3f &ray) const {
-		Intersection its; /* Unused */
-		return m_kdtree->rayIntersect(ray, its, true);
+		return m_accel->occluded(ray);
+	}
+
+	/**
+	 * \brief Intersect a ray leaving the surface of a previous intersection
+	 *
+	 * Same as \ref rayIntersect(const Ray3f &, Intersection &), but the
+	 * traversal may start in the kd-tree leaf containing \c origin
+	 * (see \ref Accelerator::rayIntersectFrom()). \c origin and \c its
+	 * may refer to the same record.
+	 */
+	inline bool rayIntersect(const Intersection &origin, const Ray3f &ray, Intersection &its) const {
+		return m_accel->rayIntersectFrom(origin.leaf, ray, its);
+	}
+
+	/**
+	 * \brief Check whether a shadow ray leaving the surface of a previous
+	 * intersection is occluded (see \ref rayIntersect(const Intersection &,
+	 * const Ray3f &, Intersection &))
+	 */
+	inline bool rayIntersect(const Intersection &origin, const Ray3f &ray) const {
+		return m_accel->occluded(ray, origin.leaf);
+	}
+
+	/**
+	 * \brief Find the \c k closest intersections along a ray in a single
+	 * traversal (e.g. to find the boundaries of nested media)
+	 *
+	 * \param its
+	 *    Array with room for \c k records, which receives the
+	 *    intersections sorted by distance
+	 *
+	 * \return The number of intersections found
+	 */
+	inline uint32_t rayIntersect(const Ray3f &ray, uint32_t k, Intersection *its) const {
+		return m_accel->rayIntersectK(ray, k, its);
+	}
+
+	/**
+	 * \brief Find all intersections along a ray, sorted by distance
+	 * (see \ref Accelerator::rayIntersectAll())
+	 */
+	inline void rayIntersect(const Ray3f &ray, std::vector<Intersection> &its) const {
+		m_accel->rayIntersectAll(ray, its);
+	}
+
+	/**
+	 * \brief Intersect a set of rays against all triangles stored in
+	 * the scene and return detailed intersection information
+	 *
+	 * The rays are traced as packets of coherent rays where possible,
+	 * which is most effective when neighboring rays have similar origins
+	 * and directions (e.g. the camera rays of a pixel).
+	 *
+	 * \param hits
+	 *    Records for each ray whether an intersection was found
+	 */
+	inline void rayIntersect(const Ray3f *rays, size_t count,
+			Intersection *its, bool *hits) const {
+		m_accel->rayIntersectStream(rays, count, its, hits, false);
+	}
+
+	/**
+	 * \brief Determine for each of a set of rays whether it intersects
+	 * any triangle stored in the scene (e.g. a batch of shadow rays)
+	 *
+	 * \param occluded
+	 *    Records for each ray whether an intersection was found
+	 */
+	inline void rayIntersect(const Ray3f *rays, size_t count, bool *occluded) const {
+		m_accel->rayIntersectStream(rays, count, NULL, occluded, true);
+	}
+
+	/**
+	 * \brief Find the point on the scene's triangles that is closest to \c p
+	 * (see \ref Accelerator::closestPoint())
+	 *
+	 * \param maxDist
+	 *    Triangles farther away from \c p are ignored
+	 *
+	 * \param its
+	 *    Receives the closest point and its surface information. The
+	 *    distance to \c p is stored in \c its.t.
+	 *
+	 * \return \c true if a triangle within \c maxDist was found
+	 *
+	 * \throws NoriException if the scene contains instances
+	 */
+	inline bool closestPoint(const Point3f &p, float maxDist, Intersection &its) const {
+		return m_accel->closestPoint(p, maxDist, its);
+	}
+
+	/**
+	 * \brief Find all triangles within distance \c radius of \c p
+	 * (see \ref Accelerator::trianglesInRadius())
+	 *
+	 * \throws NoriException if the scene contains instances
+	 */
+	inline void trianglesInRadius(const Point3f &p, float radius,
+			std::vector<TriangleRef> &triangles) const {
+		m_accel->trianglesInRadius(p, radius, triangles);
 	}
 
 	/// Uniformly pick a luminaire and invoke its direct illumination sampling method
@@ -162,7 +283,24 @@ public:
 	 * \brief Return an axis-aligned box that bounds the scene
 	 */
 	inline const BoundingBox3f &getBoundingBox() const {
-		return m_kdtree->getBoundingBox();
+		return m_accel->getBoundingBox();
+	}
+
+	/**
+	 * \brief Update the acceleration data structure after geometry
+	 * has changed
+	 *
+	 * Call this after moving or deforming a mesh (e.g. using
+	 * \ref Mesh::applyTransform()) or after changing the transformation
+	 * of an instance (\ref Instance::setToWorld()). Only the affected
+	 * parts of the data structure are updated (see \ref Accelerator::refit()).
+	 *
+	 * \param mesh
+	 *    The mesh or instance that has changed, or \c NULL if any of
+	 *    them may have
+	 */
+	inline void update(const Mesh *mesh = NULL) {
+		m_accel->refit(mesh);
 	}
 
 	/**
@@ -182,12 +320,17 @@ public:
 	EClassType getClassType() const { return EScene; }
 private:
 	std::vector<Mesh *> m_meshes;
+	std::vector<Instance *> m_instances;
+	/* Shared object space meshes of the instances (by filename) */
+	std::map<QString, Mesh *> m_shapes;
 	std::vector<Luminaire *> m_luminaires;
 	Integrator *m_integrator;
 	Sampler *m_sampler;
 	Camera *m_camera;
 	Medium *m_medium;
-	KDTree *m_kdtree;
+	Accelerator *m_accel;
+	QString m_accelName;
+	bool m_autotune;
 	Luminaire *m_envLuminaire;
         Evaluator *m_evaluator;
 };
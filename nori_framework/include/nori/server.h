@@ -0,0 +1,158 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2012 by Wenzel Jakob and Steve Marschner.
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* =======================================================================
+     This file contains a long-running render server that keeps scenes
+     in memory and renders jobs submitted over a local socket.
+ * ======================================================================= */
+
+#if !defined(__SERVER_H)
+#define __SERVER_H
+
+#include <nori/renderer.h>
+#include <QDateTime>
+#include <QStringList>
+
+#define NORI_SERVER_CACHE_SIZE 4 /* Max. number of scenes kept in memory by the render server */
+#define NORI_SERVER_TIMEOUT 30000 /* Max. time (in ms) that a client may take to send its request */
+
+NORI_NAMESPACE_BEGIN
+
+class ServerListener;
+
+/**
+ * \brief A render request submitted to a \ref RenderServer
+ *
+ * On the wire, a request consists of one "key value" pair per line and
+ * is terminated by an empty line. The supported keys are
+ * <tt>scene</tt> (required), <tt>output</tt>, <tt>spp</tt>,
+ * <tt>progressive</tt> (samples per pass), <tt>time</tt> (in ms),
+ * <tt>camera</tt> (a camera-to-world transform in the format of
+ * \ref Transform::toLineString()) and <tt>priority</tt>.
+ */
+struct RenderJob {
+	/// Sequence number assigned by the server
+	quint64 id;
+	/// Jobs with a higher priority are rendered first
+	int priority;
+	/// Absolute path of the scene file
+	QString scene;
+	/// Output filename (empty: derive it from the scene filename)
+	QString output;
+	/// Samples per pixel, samples per pass and time limit (see \ref RenderOptions)
+	int sampleCount, samplesPerPass;
+	qint64 timeLimit;
+	/// Optional camera-to-world transform that overrides the one of the scene
+	bool hasCamera;
+	Transform camera;
+	/// Set by the server once the job has been processed
+	bool done;
+	/// Reply to the client: "done <output> <time in ms>" or "error <reason>"
+	QString result;
+
+	RenderJob() : id(0), priority(0), sampleCount(0), samplesPerPass(0),
+		timeLimit(-1), hasCamera(false), done(false) { }
+
+	/// Parse the lines of a request (throws an exception if they are invalid)
+	static RenderJob parse(const QStringList &lines);
+};
+
+/**
+ * \brief Long-running render server
+ *
+ * Loading a scene (XML parsing, OBJ loading, building the kd-tree)
+ * often takes longer than rendering a quick preview of it. The
+ * server therefore keeps up to \ref NORI_SERVER_CACHE_SIZE scenes in
+ * memory along with a \ref Renderer and its render threads. A scene
+ * is reloaded when its file has been modified.
+ *
+ * Clients connect to a local socket (a Unix domain socket on Linux
+ * and Mac OS) and send a \ref RenderJob. The jobs are queued by
+ * priority and rendered one after the other, each using all render
+ * threads. The server replies with "queued <id> <position>" right
+ * away and with "done <output> <time in ms>" or "error <reason>" once
+ * the job has been processed.
+ */
+class RenderServer {
+public:
+	/**
+	 * \brief Create a server
+	 *
+	 * \param name
+	 *     Name of the local socket (e.g. <tt>/tmp/nori.sock</tt>)
+	 * \param options
+	 *     Default settings of all jobs (adaptive sampling, block order, ..)
+	 */
+	RenderServer(const QString &name, const RenderOptions &options);
+
+	/// Release all scenes
+	~RenderServer();
+
+	/// Render jobs until the server is interrupted
+	void run();
+
+	/**
+	 * \brief Add a job to the queue
+	 *
+	 * This function is thread-safe
+	 *
+	 * \return The number of jobs that will be rendered before this one
+	 */
+	int enqueue(RenderJob *job);
+
+	/// Wait until \ref run() has processed the given job
+	void waitFor(const RenderJob *job);
+
+	/**
+	 * \brief Send a request to a running server and print its replies
+	 *
+	 * \return \c true if the job was rendered successfully
+	 */
+	static bool submit(const QString &name, const QStringList &request);
+protected:
+	/// A scene that has been loaded along with its renderer
+	struct CachedScene {
+		QString filename;
+		QDateTime lastModified;
+		NoriObject *root;
+		Renderer *renderer;
+		Transform cameraToWorld;
+		bool cameraModified;
+		quint64 lastUsed;
+	};
+
+	/// Return the cache entry of a scene, (re-)loading it if necessary
+	CachedScene &getScene(const QString &filename);
+
+	/// Render a single job. Returns \c false if rendering was interrupted.
+	bool process(RenderJob *job);
+private:
+	QString m_name;
+	RenderOptions m_options;
+	std::vector<CachedScene> m_cache;
+	quint64 m_useCount;
+	std::vector<RenderJob *> m_queue;
+	quint64 m_nextId;
+	QMutex m_mutex;
+	QWaitCondition m_queueCond, m_doneCond;
+	ServerListener *m_listener;
+};
+
+NORI_NAMESPACE_END
+
+#endif /* __SERVER_H */
@@ -96,6 +96,12 @@ public:
 	/// Return a string representation
 	QString toString() const;
         QString toLineString() const;
+
+	/**
+	 * \brief Parse a transform in the format written by \ref toLineString(),
+	 * i.e. four rows separated by semicolons ("a, b, c, d; e, f, ...")
+	 */
+	static Transform fromLineString(const QString &str);
 private:
 	Eigen::Matrix4f m_transform;
 	Eigen::Matrix4f m_inverse;
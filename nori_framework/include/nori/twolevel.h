@@ -0,0 +1,188 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2012 by Wenzel Jakob and Steve Marschner.
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#if !defined(__TWOLEVEL_H)
+#define __TWOLEVEL_H
+
+#include <nori/accel.h>
+#include <map>
+
+#define NORI_TOPLEVEL_MAX_LEAF_SIZE 2 /* Top-level leaves with more objects are always split */
+#define NORI_TOPLEVEL_MAXDEPTH 64 /* Max. depth of the top-level hierarchy */
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Two-level acceleration data structure for instanced geometry
+ *
+ * Every unique shape referenced by an \ref Instance gets its own
+ * bottom-level accelerator, which is built over the shape in object
+ * space. The meshes that are not instanced are kept in a regular
+ * ("flat") accelerator. A small bounding volume hierarchy over the
+ * world space bounds of the instances and the flat accelerator forms
+ * the top level.
+ *
+ * Rays that reach an instance are transformed into its object space and
+ * traced against the shared bottom-level structure, hence memory usage
+ * and build time scale with the amount of unique geometry.
+ *
+ * The shadow cache (see \ref Accelerator::setShadowCache()) is disabled
+ * and has no effect, since the packed triangle slot it stores cannot
+ * tell which instance an occluder belongs to.
+ */
+class TwoLevelAccel : public Accelerator {
+public:
+	/**
+	 * \brief Create a new and empty two-level accelerator
+	 *
+	 * \param flat
+	 *     Accelerator holding the meshes that are not instanced. Its
+	 *     cache directory is also used for the bottom-level structures.
+	 *     The two-level accelerator takes ownership.
+	 * \param bottomLevel
+	 *     Name of the accelerator that is built over every shape
+	 *     (see \ref Accelerator::create())
+	 */
+	TwoLevelAccel(Accelerator *flat, const QString &bottomLevel);
+
+	/// Release all memory
+	virtual ~TwoLevelAccel();
+
+	/// Register a mesh that is not instanced (forwarded to the flat accelerator)
+	void addMesh(Mesh *mesh);
+
+	/**
+	 * \brief Register an instance
+	 *
+	 * This function can only be used before \ref build() is called
+	 */
+	void addInstance(Instance *instance);
+
+	/// Build the flat and bottom-level accelerators and the top-level hierarchy
+	void build();
+
+	/**
+	 * \brief Update the data structure after a mesh or instance has changed
+	 *
+	 * Only the flat or bottom-level accelerator holding \c mesh is
+	 * refitted (none if \c mesh is an instance), followed by a rebuild
+	 * of the top-level hierarchy, which is cheap.
+	 */
+	void refit(const Mesh *mesh = NULL);
+
+	/**
+	 * \brief Enable or disable the ray traversal counters of the flat,
+	 * bottom-level and top-level structures
+	 *
+	 * The bottom-level queries of every instance that a ray reaches are
+	 * counted as rays of their own.
+	 */
+	void setStatistics(bool enabled);
+
+	/// Add the counters of all threads and structures to \c stats
+	void getStatistics(RayStatistics &stats) const;
+
+	/// Add the counters of the calling thread in all structures to \c stats
+	void getThreadStatistics(RayStatistics &stats) const;
+
+	/// Set all counters to zero
+	void resetStatistics();
+
+	/// Intersect a ray against the meshes and all instances
+	bool rayIntersect(const Ray3f &ray, Intersection &its, bool shadowRay = false) const;
+
+	/**
+	 * \brief Find the closest point on the meshes (see \ref Accelerator::closestPoint())
+	 *
+	 * Point queries are not supported for instances, since their
+	 * transformations need not preserve distances, and a \ref TriangleRef
+	 * cannot refer to the triangles of an instance.
+	 *
+	 * \throws NoriException if any instance was registered
+	 */
+	bool closestPoint(const Point3f &p, float maxDist, Intersection &its) const;
+
+	/**
+	 * \brief Find the triangles within distance \c radius of \c p
+	 * (see \ref Accelerator::trianglesInRadius())
+	 *
+	 * \throws NoriException if any instance was registered (see \ref closestPoint())
+	 */
+	void trianglesInRadius(const Point3f &p, float radius,
+		std::vector<TriangleRef> &triangles) const;
+
+	/// Return an axis-aligned bounding box containing all meshes and instances
+	const BoundingBox3f &getBoundingBox() const { return m_bbox; }
+
+	/// Return the size of all flat, bottom- and top-level data structures in bytes
+	size_t getMemoryUsage() const;
+
+	/// Return a human-readable name
+	QString getName() const;
+protected:
+	/**
+	 * \brief Any-hit traversal for shadow rays (see \ref Accelerator::findOccluder())
+	 *
+	 * Never reports an occluder slot, since the shadow cache is disabled
+	 */
+	bool findOccluder(const Ray3f &ray, float mint, float maxt, uint32_t leaf, uint32_t &slot) const;
+
+	/// Entry of the top-level hierarchy: an instance or the flat accelerator
+	struct Object {
+		/// World space bounding box
+		BoundingBox3f bbox;
+		/// Accelerator that is traced when the object is reached
+		const Accelerator *accel;
+		/// Associated instance (\c NULL for the flat accelerator)
+		const Instance *instance;
+	};
+
+	/// Node of the top-level hierarchy (see \ref BVH::Node)
+	struct Node {
+		/// Bounding box of all objects below this node
+		BoundingBox3f bbox;
+		/// Inner node: index of the second child. Leaf: index of the first object in \c m_objects
+		uint32_t offset;
+		/// Number of objects (0 for inner nodes)
+		uint32_t count;
+
+		inline bool isLeaf() const { return count > 0; }
+	};
+
+	/// Build the top-level hierarchy over the current bounds of all objects
+	void buildTopLevel();
+
+	/// Recursively build the subtree over <tt>m_objects[start..end)</tt> and return its node index
+	uint32_t buildRecursive(uint32_t start, uint32_t end);
+
+	/// Shared traversal of \ref rayIntersect() and \ref findOccluder()
+	bool traverse(const Ray3f &ray, Intersection &its, bool shadowRay) const;
+private:
+	Accelerator *m_flat;
+	QString m_bottomLevel;
+	std::vector<Instance *> m_instances;
+	/* Bottom-level accelerator of every unique shape */
+	std::map<const Mesh *, Accelerator *> m_shapes;
+	std::vector<Object> m_objects;
+	std::vector<Node> m_nodes;
+	BoundingBox3f m_bbox;
+};
+
+NORI_NAMESPACE_END
+
+#endif /* __TWOLEVEL_H */
@@ -7,11 +7,18 @@ SOURCES += src/common.cpp \
 	src/ao.cpp \
         src/area.cpp \
 	src/mesh.cpp \
+	src/accel.cpp \
 	src/kdtree.cpp \
+	src/bvh.cpp \
+	src/twolevel.cpp \
+	src/instance.cpp \
 	src/obj.cpp \
 	src/perspective.cpp \
 	src/rfilter.cpp \
 	src/block.cpp \
+	src/renderer.cpp \
+	src/network.cpp \
+	src/server.cpp \
 	src/bitmap.cpp \
 	src/parser.cpp \
 	src/mirror.cpp \
@@ -67,7 +74,7 @@ debug{
         UI_DIR = build_debug
         DESTDIR = bin-debug
 }
-QT += xml xmlpatterns opengl
+QT += xml xmlpatterns opengl network
 
 unix:macx {
         message(Mac OS)
@@ -0,0 +1,28 @@
+#!/bin/sh
+
+# Combines the raw outputs of a sharded rendering into the final image.
+# Each shard must have been rendered with --raw, e.g.
+#   nori --headless --raw --shard 0/4 scene.xml   (on machine 1)
+#   nori --headless --raw --shard 1/4 scene.xml   (on machine 2), etc.
+# or with disjoint --crop windows.
+#
+# Usage: nori-merge.sh <output.exr> <shard1.exr> [<shard2.exr> ..]
+
+# this absolute directory
+SCRIPT_PATH=$( cd $(dirname $0); pwd -P)
+# path to Nori binary
+NORI=$SCRIPT_PATH/bin-debug/nori
+# path to libraries
+LIBS=$SCRIPT_PATH/../lib
+
+if [ $# -lt 2 ]; then
+  echo "Usage: $0 <output.exr> <shard1.exr> [<shard2.exr> ..]"
+  exit 1
+fi
+
+if [ ! -x $NORI ]; then
+  echo "Nori binary not found at $NORI, please build it first!"
+  exit 1
+fi
+
+LD_LIBRARY_PATH=$LIBS $NORI --merge "$@"
@@ -0,0 +1,950 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2012 by Wenzel Jakob and Steve Marschner.
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/kdtree.h>
+#include <nori/bvh.h>
+#include <nori/scene.h>
+#include <nori/camera.h>
+#include <nori/random.h>
+#include <Eigen/Geometry>
+#include <QElapsedTimer>
+#include <QCryptographicHash>
+
+#if defined(__SSE__)
+#include <xmmintrin.h>
+#endif
+
+NORI_NAMESPACE_BEGIN
+
+#if defined(__SSE__)
+/// Dot products of four pairs of vectors given in SoA form
+static inline __m128 dot4(__m128 ax, __m128 ay, __m128 az, __m128 bx, __m128 by, __m128 bz) {
+	return _mm_add_ps(_mm_add_ps(_mm_mul_ps(ax, bx), _mm_mul_ps(ay, by)), _mm_mul_ps(az, bz));
+}
+
+/// Computes a*b - c*d, the building block of the cross products below
+static inline __m128 msub4(__m128 a, __m128 b, __m128 c, __m128 d) {
+	return _mm_sub_ps(_mm_mul_ps(a, b), _mm_mul_ps(c, d));
+}
+#endif
+
+void RayStatistics::reset() {
+	closestHitRays = shadowRays = hits = 0;
+	innerNodes = leaves = triangleTests = 0;
+}
+
+RayStatistics &RayStatistics::operator+=(const RayStatistics &stats) {
+	closestHitRays += stats.closestHitRays;
+	shadowRays += stats.shadowRays;
+	hits += stats.hits;
+	innerNodes += stats.innerNodes;
+	leaves += stats.leaves;
+	triangleTests += stats.triangleTests;
+	return *this;
+}
+
+QString RayStatistics::toString() const {
+	double rays = (double) std::max(closestHitRays + shadowRays, (uint64_t) 1);
+	return QString(
+		"Ray statistics\n"
+		"  Closest-hit rays           : %1\n"
+		"  Shadow rays                : %2\n"
+		"  Hits                       : %3 (%4%)\n"
+		"  Inner nodes / ray          : %5\n"
+		"  Leaves / ray               : %6\n"
+		"  Triangle tests / ray       : %7\n"
+		"  Triangle tests / leaf      : %8")
+		.arg((qulonglong) closestHitRays)
+		.arg((qulonglong) shadowRays)
+		.arg((qulonglong) hits)
+		.arg(100 * hits / rays, 0, 'f', 1)
+		.arg(innerNodes / rays, 0, 'f', 2)
+		.arg(leaves / rays, 0, 'f', 2)
+		.arg(triangleTests / rays, 0, 'f', 2)
+		.arg(triangleTests / (double) std::max(leaves, (uint64_t) 1), 0, 'f', 2);
+}
+
+Accelerator::Accelerator() : m_primitiveCount(0), m_shadowCache(true), m_statistics(false),
+		m_packed(NULL), m_packedIds(NULL), m_packedStride(0) {
+	m_sizeMap.push_back(0);
+}
+
+Accelerator::~Accelerator() {
+	if (m_packed)
+		freeAligned(m_packed);
+	if (m_packedIds)
+		freeAligned(m_packedIds);
+	for (size_t i=0; i<m_statisticsRecords.size(); ++i)
+		delete m_statisticsRecords[i];
+}
+
+void Accelerator::addMesh(Mesh *mesh) {
+	m_primitiveCount += mesh->getTriangleCount();
+	m_meshes.push_back(mesh);
+	m_sizeMap.push_back(m_sizeMap.back() + mesh->getTriangleCount());
+}
+
+void Accelerator::refit(const Mesh * /* unused */) {
+	build();
+}
+
+void Accelerator::setStatistics(bool enabled) {
+	m_statistics = enabled;
+}
+
+void Accelerator::getStatistics(RayStatistics &stats) const {
+	QMutexLocker locker(&m_statisticsMutex);
+	for (size_t i=0; i<m_statisticsRecords.size(); ++i)
+		stats += *m_statisticsRecords[i];
+}
+
+void Accelerator::getThreadStatistics(RayStatistics &stats) const {
+	if (m_statistics)
+		stats += *getStatisticsRecord();
+}
+
+void Accelerator::resetStatistics() {
+	QMutexLocker locker(&m_statisticsMutex);
+	for (size_t i=0; i<m_statisticsRecords.size(); ++i)
+		m_statisticsRecords[i]->reset();
+}
+
+RayStatistics *Accelerator::getStatisticsRecord() const {
+	if (!m_threadStatistics.hasLocalData()) {
+		/* Only the pointer to the record is released when the thread exits */
+		RayStatistics *record = new RayStatistics();
+		m_statisticsMutex.lock();
+		m_statisticsRecords.push_back(record);
+		m_statisticsMutex.unlock();
+		m_threadStatistics.setLocalData(new RayStatistics *(record));
+	}
+	return *m_threadStatistics.localData();
+}
+
+void Accelerator::hashGeometry(QCryptographicHash &hash) const {
+	uint32_t meshCount = getMeshCount();
+	hash.addData((const char *) &meshCount, sizeof(uint32_t));
+
+	for (uint32_t i=0; i<meshCount; ++i) {
+		const Mesh *mesh = m_meshes[i];
+		uint32_t counts[2] = { mesh->getVertexCount(), mesh->getTriangleCount() };
+		hash.addData((const char *) counts, sizeof(counts));
+		hash.addData((const char *) mesh->getVertexPositions(),
+			(int) (counts[0] * sizeof(Point3f)));
+		hash.addData((const char *) mesh->getIndices(),
+			(int) (counts[1] * 3 * sizeof(uint32_t)));
+	}
+}
+
+void Accelerator::fillIntersection(uint32_t primIndex, Intersection &its) const {
+	/* Only accelerators that support it record the leaf */
+	its.leaf = NORI_NO_LEAF;
+
+	/* Find the barycentric coordinates */
+	Vector3f bary;
+	bary << 1-its.uv.sum(), its.uv;
+
+	/* Look up the vertex indices */
+	const Mesh *mesh = its.mesh;
+	const uint32_t *indices = mesh->getIndices(),
+			  idx0 = indices[3*primIndex+0],
+			  idx1 = indices[3*primIndex+1],
+			  idx2 = indices[3*primIndex+2];
+
+	const Point3f  *positions = mesh->getVertexPositions();
+	const Normal3f *normals   = mesh->getVertexNormals();
+	const Point2f  *texCoords = mesh->getVertexTexCoords();
+
+	Point3f p0 = positions[idx0],
+		p1 = positions[idx1],
+		p2 = positions[idx2];
+
+	/* Compute the intersection positon accurately
+	   using barycentric coordinates */
+	its.p = bary.x() * p0 + bary.y() * p1 + bary.z() * p2;
+
+	/* Compute proper texture coordinates if provided by the mesh */
+	if (texCoords)
+		its.uv = bary.x() * texCoords[idx0] +
+			bary.y() * texCoords[idx1] +
+			bary.z() * texCoords[idx2];
+
+	/* Compute the geometry frame */
+	its.geoFrame = Frame((p1-p0).cross(p2-p0).normalized());
+
+	if (normals) {
+		/* Compute the shading frame. Note that for simplicity,
+		   the current implementation doesn't attempt to provide
+		   tangents that are continuous across the surface. That
+		   means that this code will need to be modified to be able
+		   use anisotropic BRDFs, which need tangent continuity */
+
+		its.shFrame = Frame(
+			(bary.x() * normals[idx0] +
+			 bary.y() * normals[idx1] +
+			 bary.z() * normals[idx2]).normalized());
+	} else {
+		its.shFrame = its.geoFrame;
+	}
+}
+
+void Accelerator::packTriangles(const uint32_t *indices, uint32_t count) {
+	if (m_packed)
+		freeAligned(m_packed);
+	if (m_packedIds)
+		freeAligned(m_packedIds);
+
+	/* Pad the arrays so that four entries can be loaded starting at any
+	   index. The padding describes degenerate triangles, which are never hit */
+	m_packedStride = (count + 6) & ~3u;
+	m_packed = static_cast<float *>(allocAligned(
+		sizeof(float) * NORI_PACKED_FLOATS * m_packedStride));
+	m_packedIds = static_cast<uint32_t *>(allocAligned(
+		sizeof(uint32_t) * 2 * m_packedStride));
+	memset(m_packed, 0, sizeof(float) * NORI_PACKED_FLOATS * m_packedStride);
+	memset(m_packedIds, 0, sizeof(uint32_t) * 2 * m_packedStride);
+
+	for (uint32_t i=0; i<count; ++i) {
+		uint32_t primIndex = indices[i];
+		uint32_t meshIndex = findMesh(primIndex);
+		const Mesh *mesh = m_meshes[meshIndex];
+		const uint32_t *idx = mesh->getIndices() + 3*primIndex;
+		const Point3f *positions = mesh->getVertexPositions();
+
+		const Point3f &p0 = positions[idx[0]];
+		Vector3f edge1 = positions[idx[1]] - p0,
+		         edge2 = positions[idx[2]] - p0;
+
+		const float values[NORI_PACKED_FLOATS] = {
+			p0.x(), p0.y(), p0.z(),
+			edge1.x(), edge1.y(), edge1.z(),
+			edge2.x(), edge2.y(), edge2.z()
+		};
+		for (int j=0; j<NORI_PACKED_FLOATS; ++j)
+			m_packed[j * m_packedStride + i] = values[j];
+		m_packedIds[i] = meshIndex;
+		m_packedIds[m_packedStride + i] = primIndex;
+	}
+}
+
+#if defined(__SSE__)
+/**
+ * \brief Moeller-Trumbore test of a ray against four packed triangles,
+ * using the same arithmetic as Mesh::rayIntersect()
+ *
+ * \return A mask of the triangles that are hit within <tt>[mint, maxt]</tt>
+ */
+static inline int intersect4(const float *data, uint32_t stride, const __m128 *o,
+		const __m128 *d, __m128 minT, __m128 maxT, __m128 &t, __m128 &u, __m128 &v) {
+	const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0f),
+		eps = _mm_set1_ps(1e-8f), negEps = _mm_set1_ps(-1e-8f);
+	const __m128
+		v0x = _mm_loadu_ps(data),            v0y = _mm_loadu_ps(data + stride),
+		v0z = _mm_loadu_ps(data + 2*stride), e1x = _mm_loadu_ps(data + 3*stride),
+		e1y = _mm_loadu_ps(data + 4*stride), e1z = _mm_loadu_ps(data + 5*stride),
+		e2x = _mm_loadu_ps(data + 6*stride), e2y = _mm_loadu_ps(data + 7*stride),
+		e2z = _mm_loadu_ps(data + 8*stride);
+
+	__m128 px = msub4(d[1], e2z, d[2], e2y),
+	       py = msub4(d[2], e2x, d[0], e2z),
+	       pz = msub4(d[0], e2y, d[1], e2x);
+	__m128 det = dot4(e1x, e1y, e1z, px, py, pz);
+	__m128 valid = _mm_or_ps(_mm_cmple_ps(det, negEps), _mm_cmpge_ps(det, eps));
+	__m128 invDet = _mm_div_ps(one, det);
+
+	__m128 tx = _mm_sub_ps(o[0], v0x), ty = _mm_sub_ps(o[1], v0y), tz = _mm_sub_ps(o[2], v0z);
+	u = _mm_mul_ps(dot4(tx, ty, tz, px, py, pz), invDet);
+	valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpge_ps(u, zero), _mm_cmple_ps(u, one)));
+
+	__m128 qx = msub4(ty, e1z, tz, e1y),
+	       qy = msub4(tz, e1x, tx, e1z),
+	       qz = msub4(tx, e1y, ty, e1x);
+	v = _mm_mul_ps(dot4(d[0], d[1], d[2], qx, qy, qz), invDet);
+	valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpge_ps(v, zero),
+		_mm_cmple_ps(_mm_add_ps(u, v), one)));
+
+	t = _mm_mul_ps(dot4(e2x, e2y, e2z, qx, qy, qz), invDet);
+	valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpge_ps(t, minT), _mm_cmple_ps(t, maxT)));
+
+	return _mm_movemask_ps(valid);
+}
+#else
+/// Moeller-Trumbore test of a ray against one packed triangle (see Mesh::rayIntersect())
+static inline bool intersect1(const float *data, uint32_t stride, const Ray3f &ray,
+		float mint, float maxt, float &t, float &u, float &v) {
+	Vector3f p0(data[0], data[stride], data[2*stride]),
+		edge1(data[3*stride], data[4*stride], data[5*stride]),
+		edge2(data[6*stride], data[7*stride], data[8*stride]);
+
+	Vector3f pvec = ray.d.cross(edge2);
+	float det = edge1.dot(pvec);
+	if (det > -1e-8f && det < 1e-8f)
+		return false;
+	float invDet = 1.0f / det;
+
+	Vector3f tvec = ray.o - p0;
+	u = tvec.dot(pvec) * invDet;
+	if (u < 0.0f || u > 1.0f)
+		return false;
+
+	Vector3f qvec = tvec.cross(edge1);
+	v = ray.d.dot(qvec) * invDet;
+	if (v < 0.0f || u + v > 1.0f)
+		return false;
+
+	t = edge2.dot(qvec) * invDet;
+	return t >= mint && t <= maxt;
+}
+#endif
+
+bool Accelerator::intersectPacked(uint32_t start, uint32_t end, const Ray3f &ray,
+		float mint, float &maxt, Intersection &its, uint32_t &primIndex) const {
+	const uint32_t stride = m_packedStride;
+	bool foundIntersection = false;
+
+#if defined(__SSE__)
+	const __m128
+		o[3] = { _mm_set1_ps(ray.o.x()), _mm_set1_ps(ray.o.y()), _mm_set1_ps(ray.o.z()) },
+		d[3] = { _mm_set1_ps(ray.d.x()), _mm_set1_ps(ray.d.y()), _mm_set1_ps(ray.d.z()) },
+		minT = _mm_set1_ps(mint);
+
+	for (uint32_t k=start; k<end; k+=4) {
+		__m128 t, u, v;
+		int mask = intersect4(m_packed + k, stride, o, d, minT, _mm_set1_ps(maxt), t, u, v);
+		if (end - k < 4)
+			mask &= (1 << (end - k)) - 1;
+		if (mask == 0)
+			continue;
+
+		float tValues[4], uValues[4], vValues[4];
+		_mm_storeu_ps(tValues, t);
+		_mm_storeu_ps(uValues, u);
+		_mm_storeu_ps(vValues, v);
+		for (int i=0; i<4; ++i) {
+			if ((mask & (1 << i)) && tValues[i] <= maxt) {
+				maxt = its.t = tValues[i];
+				its.uv = Point2f(uValues[i], vValues[i]);
+				its.mesh = m_meshes[m_packedIds[k + i]];
+				primIndex = m_packedIds[stride + k + i];
+				foundIntersection = true;
+			}
+		}
+	}
+#else
+	for (uint32_t k=start; k<end; ++k) {
+		float t, u, v;
+		if (intersect1(m_packed + k, stride, ray, mint, maxt, t, u, v)) {
+			maxt = its.t = t;
+			its.uv = Point2f(u, v);
+			its.mesh = m_meshes[m_packedIds[k]];
+			primIndex = m_packedIds[stride + k];
+			foundIntersection = true;
+		}
+	}
+#endif
+
+	return foundIntersection;
+}
+
+bool Accelerator::occludedPacked(uint32_t start, uint32_t end, const Ray3f &ray,
+		float mint, float maxt, uint32_t &slot) const {
+	const uint32_t stride = m_packedStride;
+
+#if defined(__SSE__)
+	const __m128
+		o[3] = { _mm_set1_ps(ray.o.x()), _mm_set1_ps(ray.o.y()), _mm_set1_ps(ray.o.z()) },
+		d[3] = { _mm_set1_ps(ray.d.x()), _mm_set1_ps(ray.d.y()), _mm_set1_ps(ray.d.z()) },
+		minT = _mm_set1_ps(mint), maxT = _mm_set1_ps(maxt);
+
+	for (uint32_t k=start; k<end; k+=4) {
+		__m128 t, u, v;
+		int mask = intersect4(m_packed + k, stride, o, d, minT, maxT, t, u, v);
+		if (end - k < 4)
+			mask &= (1 << (end - k)) - 1;
+		if (mask != 0) {
+			/* Any hit will do */
+			int i = 0;
+			while (!(mask & (1 << i)))
+				++i;
+			slot = k + i;
+			return true;
+		}
+	}
+#else
+	for (uint32_t k=start; k<end; ++k) {
+		float t, u, v;
+		if (intersect1(m_packed + k, stride, ray, mint, maxt, t, u, v)) {
+			slot = k;
+			return true;
+		}
+	}
+#endif
+
+	return false;
+}
+
+void Accelerator::collectPacked(uint32_t start, uint32_t end, const Ray3f &ray,
+		float mint, float &maxt, uint32_t k, std::vector<PackedHit> &hits) const {
+	const uint32_t stride = m_packedStride;
+
+#if defined(__SSE__)
+	const uint32_t step = 4;
+	const __m128
+		o[3] = { _mm_set1_ps(ray.o.x()), _mm_set1_ps(ray.o.y()), _mm_set1_ps(ray.o.z()) },
+		d[3] = { _mm_set1_ps(ray.d.x()), _mm_set1_ps(ray.d.y()), _mm_set1_ps(ray.d.z()) },
+		minT = _mm_set1_ps(mint);
+#else
+	const uint32_t step = 1;
+#endif
+
+	for (uint32_t j=start; j<end; j+=step) {
+		PackedHit found[4];
+		int foundCount = 0;
+
+#if defined(__SSE__)
+		__m128 t, u, v;
+		int mask = intersect4(m_packed + j, stride, o, d, minT, _mm_set1_ps(maxt), t, u, v);
+		if (end - j < 4)
+			mask &= (1 << (end - j)) - 1;
+		if (mask == 0)
+			continue;
+
+		float tValues[4], uValues[4], vValues[4];
+		_mm_storeu_ps(tValues, t);
+		_mm_storeu_ps(uValues, u);
+		_mm_storeu_ps(vValues, v);
+		for (int i=0; i<4; ++i) {
+			if (mask & (1 << i)) {
+				found[foundCount].t = tValues[i];
+				found[foundCount].uv = Point2f(uValues[i], vValues[i]);
+				found[foundCount].slot = j + i;
+				++foundCount;
+			}
+		}
+#else
+		float t, u, v;
+		if (!intersect1(m_packed + j, stride, ray, mint, maxt, t, u, v))
+			continue;
+		found[0].t = t;
+		found[0].uv = Point2f(u, v);
+		found[0].slot = j;
+		foundCount = 1;
+#endif
+
+		for (int i=0; i<foundCount; ++i) {
+			const PackedHit &hit = found[i];
+			if (hit.t > maxt)
+				continue;
+
+			/* Skip triangles that were already reported by another leaf.
+			   Since the arithmetic is the same, they have exactly the same
+			   distance and can only be found among the entries with equal t */
+			std::vector<PackedHit>::iterator it =
+				std::lower_bound(hits.begin(), hits.end(), hit);
+			bool duplicate = false;
+			for (std::vector<PackedHit>::iterator it2 = it;
+					it2 != hits.end() && it2->t == hit.t; ++it2) {
+				if (m_packedIds[it2->slot] == m_packedIds[hit.slot] &&
+					m_packedIds[stride + it2->slot] == m_packedIds[stride + hit.slot]) {
+					duplicate = true;
+					break;
+				}
+			}
+			if (duplicate)
+				continue;
+
+			hits.insert(it, hit);
+			if (hits.size() > k)
+				hits.pop_back();
+			if (hits.size() == k)
+				maxt = hits.back().t;
+		}
+	}
+}
+
+void Accelerator::fillHits(const std::vector<PackedHit> &hits,
+		std::vector<Intersection> &its) const {
+	size_t offset = its.size();
+	its.resize(offset + hits.size());
+	for (size_t i=0; i<hits.size(); ++i) {
+		Intersection &rec = its[offset + i];
+		rec.t = hits[i].t;
+		rec.uv = hits[i].uv;
+		rec.mesh = m_meshes[m_packedIds[hits[i].slot]];
+		fillIntersection(m_packedIds[m_packedStride + hits[i].slot], rec);
+	}
+}
+
+/**
+ * \brief Find the point on a triangle that is closest to \c p
+ * ("Real-Time Collision Detection" by Christer Ericson, Section 5.1.5)
+ *
+ * \param uv
+ *     Receives the barycentric coordinates of the closest point with
+ *     respect to the second and third vertex
+ * \return The squared distance between \c p and the closest point
+ */
+static inline float closestPointTriangle(const Point3f &p, const Point3f &p0,
+		const Vector3f &edge1, const Vector3f &edge2, Point2f &uv) {
+	/* Check whether p lies in the Voronoi region of a vertex or an edge,
+	   in which case the closest point lies on its boundary */
+	Vector3f ap = p - p0;
+	float d1 = edge1.dot(ap), d2 = edge2.dot(ap);
+	if (d1 <= 0.0f && d2 <= 0.0f) {
+		uv = Point2f(0.0f, 0.0f);
+	} else {
+		Vector3f bp = ap - edge1;
+		float d3 = edge1.dot(bp), d4 = edge2.dot(bp);
+		Vector3f cp = ap - edge2;
+		float d5 = edge1.dot(cp), d6 = edge2.dot(cp);
+		float vc = d1*d4 - d3*d2, vb = d5*d2 - d1*d6, va = d3*d6 - d5*d4;
+
+		if (d3 >= 0.0f && d4 <= d3) {
+			uv = Point2f(1.0f, 0.0f);
+		} else if (d6 >= 0.0f && d5 <= d6) {
+			uv = Point2f(0.0f, 1.0f);
+		} else if (vc <= 0.0f && d1 >= 0.0f && d3 <= 0.0f) {
+			uv = Point2f(d1 / (d1 - d3), 0.0f);
+		} else if (vb <= 0.0f && d2 >= 0.0f && d6 <= 0.0f) {
+			uv = Point2f(0.0f, d2 / (d2 - d6));
+		} else if (va <= 0.0f && d4 - d3 >= 0.0f && d5 - d6 >= 0.0f) {
+			float w = (d4 - d3) / ((d4 - d3) + (d5 - d6));
+			uv = Point2f(1.0f - w, w);
+		} else {
+			/* Inside the face region (the NaNs produced by degenerate
+			   triangles fail all distance comparisons) */
+			float invDenom = 1.0f / (va + vb + vc);
+			uv = Point2f(vb * invDenom, vc * invDenom);
+		}
+	}
+
+	return (p0 + uv.x() * edge1 + uv.y() * edge2 - p).squaredNorm();
+}
+
+bool Accelerator::closestPacked(uint32_t start, uint32_t end, const Point3f &p,
+		float &maxDist2, uint32_t &slot, Point2f &uv) const {
+	const uint32_t stride = m_packedStride;
+	bool foundTriangle = false;
+
+	for (uint32_t k=start; k<end; ++k) {
+		const float *data = m_packed + k;
+		Point2f triUV;
+		float dist2 = closestPointTriangle(p,
+			Point3f(data[0], data[stride], data[2*stride]),
+			Vector3f(data[3*stride], data[4*stride], data[5*stride]),
+			Vector3f(data[6*stride], data[7*stride], data[8*stride]), triUV);
+		if (dist2 < maxDist2) {
+			maxDist2 = dist2;
+			slot = k;
+			uv = triUV;
+			foundTriangle = true;
+		}
+	}
+
+	return foundTriangle;
+}
+
+void Accelerator::collectPackedInRadius(uint32_t start, uint32_t end, const Point3f &p,
+		float radius2, std::vector<TriangleRef> &triangles) const {
+	const uint32_t stride = m_packedStride;
+
+	for (uint32_t k=start; k<end; ++k) {
+		const float *data = m_packed + k;
+		Point2f uv;
+		float dist2 = closestPointTriangle(p,
+			Point3f(data[0], data[stride], data[2*stride]),
+			Vector3f(data[3*stride], data[4*stride], data[5*stride]),
+			Vector3f(data[6*stride], data[7*stride], data[8*stride]), uv);
+		if (dist2 <= radius2)
+			triangles.push_back(TriangleRef(m_meshes[m_packedIds[k]], m_packedIds[stride + k]));
+	}
+}
+
+bool Accelerator::occluded(const Ray3f &ray, uint32_t leaf) const {
+	/* Use an adaptive ray epsilon */
+	float mint = ray.mint, maxt = ray.maxt;
+	if (mint == Epsilon)
+		mint = std::max(mint, mint * ray.o.array().abs().maxCoeff());
+
+	RayStatistics *stats = NULL;
+	if (m_statistics) {
+		stats = getStatisticsRecord();
+		++stats->shadowRays;
+	}
+
+	/* Shadow rays of neighboring pixels tend to be blocked by the
+	   same triangle, hence try the last occluder of this thread first */
+	uint32_t *lastOccluder = NULL;
+	if (m_shadowCache) {
+		if (!m_lastOccluder.hasLocalData())
+			m_lastOccluder.setLocalData(new uint32_t(NORI_NO_OCCLUDER));
+		lastOccluder = m_lastOccluder.localData();
+		if (*lastOccluder < m_packedStride) {
+			uint32_t slot;
+			bool hit = occludedPacked(*lastOccluder, *lastOccluder + 1, ray, mint, maxt, slot);
+			if (stats) {
+				++stats->triangleTests;
+				stats->hits += hit ? 1 : 0;
+			}
+			if (hit)
+				return true;
+		}
+	}
+
+	uint32_t slot = NORI_NO_OCCLUDER;
+	if (!findOccluder(ray, mint, maxt, leaf, slot))
+		return false;
+
+	if (stats)
+		++stats->hits;
+	if (lastOccluder)
+		*lastOccluder = slot;
+	return true;
+}
+
+bool Accelerator::findOccluder(const Ray3f &ray, float mint, float maxt,
+		uint32_t leaf, uint32_t &slot) const {
+	Q_UNUSED(mint);
+	Q_UNUSED(maxt);
+	Q_UNUSED(leaf);
+	Intersection its; /* Unused */
+	slot = NORI_NO_OCCLUDER;
+	return rayIntersect(ray, its, true);
+}
+
+uint32_t Accelerator::rayIntersectK(const Ray3f &ray, uint32_t k, Intersection *its) const {
+	if (k == 0)
+		return 0;
+
+	std::vector<Intersection> hits;
+	findHits(ray, k, hits);
+	std::copy(hits.begin(), hits.end(), its);
+	return (uint32_t) hits.size();
+}
+
+void Accelerator::rayIntersectAll(const Ray3f &ray, std::vector<Intersection> &its) const {
+	its.clear();
+	findHits(ray, std::numeric_limits<uint32_t>::max(), its);
+}
+
+void Accelerator::findHits(const Ray3f &ray, uint32_t k,
+		std::vector<Intersection> &its) const {
+	Ray3f r(ray);
+	Intersection rec;
+	for (uint32_t i=0; i<k; ++i) {
+		if (!rayIntersect(r, rec, false))
+			break;
+		its.push_back(rec);
+		/* Continue just past the intersection */
+		r.mint = nextafterf(rec.t, std::numeric_limits<float>::infinity());
+	}
+}
+
+bool Accelerator::closestPoint(const Point3f &p, float maxDist, Intersection &its) const {
+	float maxDist2 = maxDist * maxDist;
+	uint32_t foundPrimIndex = 0;
+	bool foundTriangle = false;
+
+	for (size_t i=0; i<m_meshes.size(); ++i) {
+		const Mesh *mesh = m_meshes[i];
+		const uint32_t *indices = mesh->getIndices();
+		const Point3f *positions = mesh->getVertexPositions();
+		for (uint32_t j=0; j<mesh->getTriangleCount(); ++j) {
+			const Point3f &p0 = positions[indices[3*j]];
+			Point2f uv;
+			float dist2 = closestPointTriangle(p, p0, positions[indices[3*j+1]] - p0,
+				positions[indices[3*j+2]] - p0, uv);
+			if (dist2 < maxDist2) {
+				maxDist2 = dist2;
+				its.uv = uv;
+				its.mesh = mesh;
+				foundPrimIndex = j;
+				foundTriangle = true;
+			}
+		}
+	}
+
+	if (foundTriangle) {
+		its.t = std::sqrt(maxDist2);
+		fillIntersection(foundPrimIndex, its);
+	}
+
+	return foundTriangle;
+}
+
+void Accelerator::trianglesInRadius(const Point3f &p, float radius,
+		std::vector<TriangleRef> &triangles) const {
+	const float radius2 = radius * radius;
+	triangles.clear();
+
+	for (size_t i=0; i<m_meshes.size(); ++i) {
+		const Mesh *mesh = m_meshes[i];
+		const uint32_t *indices = mesh->getIndices();
+		const Point3f *positions = mesh->getVertexPositions();
+		for (uint32_t j=0; j<mesh->getTriangleCount(); ++j) {
+			const Point3f &p0 = positions[indices[3*j]];
+			Point2f uv;
+			if (closestPointTriangle(p, p0, positions[indices[3*j+1]] - p0,
+					positions[indices[3*j+2]] - p0, uv) <= radius2)
+				triangles.push_back(TriangleRef(mesh, j));
+		}
+	}
+}
+
+bool Accelerator::rayIntersectFrom(uint32_t leaf, const Ray3f &ray, Intersection &its) const {
+	Q_UNUSED(leaf);
+	return rayIntersect(ray, its, false);
+}
+
+void Accelerator::rayIntersectPacket(const Ray3f *rays, uint32_t count,
+		Intersection *its, bool *hits, bool shadowRay) const {
+	for (uint32_t i=0; i<count; ++i)
+		hits[i] = rayIntersect(rays[i], its[i], shadowRay);
+}
+
+void Accelerator::rayIntersectStream(const Ray3f *rays, size_t count,
+		Intersection *its, bool *hits, bool shadowRay) const {
+	uint32_t order[NORI_STREAM_CHUNK], octantStart[9];
+	Ray3f packetRays[NORI_PACKET_SIZE];
+	Intersection packetIts[NORI_PACKET_SIZE];
+	bool packetHits[NORI_PACKET_SIZE];
+
+	for (size_t chunkStart=0; chunkStart<count; chunkStart += NORI_STREAM_CHUNK) {
+		uint32_t chunkSize = (uint32_t) std::min(count - chunkStart, (size_t) NORI_STREAM_CHUNK);
+		const Ray3f *chunk = rays + chunkStart;
+
+		/* Counting sort by direction octant, so that the rays of a
+		   packet agree on the signs of their direction components */
+		uint8_t octant[NORI_STREAM_CHUNK];
+		memset(octantStart, 0, sizeof(octantStart));
+		for (uint32_t i=0; i<chunkSize; ++i) {
+			const Vector3f &dRcp = chunk[i].dRcp;
+			octant[i] = (uint8_t) ((dRcp.x() < 0 ? 1 : 0) | (dRcp.y() < 0 ? 2 : 0) | (dRcp.z() < 0 ? 4 : 0));
+			octantStart[octant[i] + 1]++;
+		}
+		for (int i=0; i<8; ++i)
+			octantStart[i+1] += octantStart[i];
+		for (uint32_t i=0; i<chunkSize; ++i)
+			order[octantStart[octant[i]]++] = i;
+
+		/* Trace packets of rays, which never straddle two octants */
+		uint32_t packetStart = 0;
+		while (packetStart < chunkSize) {
+			uint32_t first = order[packetStart], packetSize = 0;
+			while (packetStart + packetSize < chunkSize && packetSize < NORI_PACKET_SIZE
+					&& octant[order[packetStart + packetSize]] == octant[first]) {
+				packetRays[packetSize] = chunk[order[packetStart + packetSize]];
+				++packetSize;
+			}
+
+			rayIntersectPacket(packetRays, packetSize, packetIts, packetHits, shadowRay);
+
+			for (uint32_t i=0; i<packetSize; ++i) {
+				size_t index = chunkStart + order[packetStart + i];
+				hits[index] = packetHits[i];
+				if (its && !shadowRay)
+					its[index] = packetIts[i];
+			}
+			packetStart += packetSize;
+		}
+	}
+}
+
+Accelerator *Accelerator::create(const QString &name) {
+	if (name == "kdtree")
+		return new KDTree();
+	else if (name == "bvh")
+		return new BVH(false);
+	else if (name == "bvh4")
+		return new BVH(true);
+	else
+		throw NoriException(QString("Unknown accelerator \"%1\" (expected "
+			"kdtree, bvh or bvh4)!").arg(name));
+}
+
+void Accelerator::benchmark(const Scene *scene) {
+	const char *names[] = { "kdtree", "bvh", "bvh4" };
+	const int accelCount = sizeof(names) / sizeof(names[0]);
+	const std::vector<Mesh *> &meshes = scene->getMeshes();
+
+	/* Generate one jittered primary ray per pixel */
+	const Camera *camera = scene->getCamera();
+	Vector2i size = camera->getOutputSize();
+	std::vector<Ray3f> primaryRays;
+	primaryRays.reserve(size.x() * size.y());
+	Random random;
+	for (int y=0; y<size.y(); ++y) {
+		for (int x=0; x<size.x(); ++x) {
+			Ray3f ray;
+			Point2f pixelSample(x + random.nextFloat(), y + random.nextFloat());
+			camera->sampleRay(ray, pixelSample, Point2f(0.5f, 0.5f));
+			primaryRays.push_back(ray);
+		}
+	}
+
+	std::vector<Accelerator *> accels;
+	std::vector<qint64> buildTimes;
+	for (int i=0; i<accelCount; ++i) {
+		Accelerator *accel = create(names[i]);
+		for (size_t j=0; j<meshes.size(); ++j)
+			accel->addMesh(meshes[j]);
+		QElapsedTimer timer;
+		timer.start();
+		accel->build();
+		buildTimes.push_back(timer.elapsed());
+		accels.push_back(accel);
+	}
+
+	/* Generate ambient occlusion-style shadow rays from the hit points of
+	   the primary rays, so that all accelerators trace the same rays */
+	std::vector<Ray3f> shadowRays;
+	shadowRays.reserve(primaryRays.size());
+	float aoLength = accels[0]->getBoundingBox().getExtents().norm() * 0.1f;
+	for (size_t i=0; i<primaryRays.size(); ++i) {
+		Intersection its;
+		if (!accels[0]->rayIntersect(primaryRays[i], its))
+			continue;
+		Point2f sample(random.nextFloat(), random.nextFloat());
+		Vector3f d = its.shFrame.toWorld(squareToCosineHemisphere(sample));
+		shadowRays.push_back(Ray3f(its.p, d, Epsilon, aoLength));
+	}
+
+	cout << endl << "Accelerator benchmark (" << primaryRays.size() << " primary rays, "
+		 << shadowRays.size() << " shadow rays, single-threaded)" << endl;
+	cout << "  Accelerator            Build (ms)   Memory (KiB)   Primary (Mrays/s)   Shadow (Mrays/s)" << endl;
+
+	for (int i=0; i<accelCount; ++i) {
+		const Accelerator *accel = accels[i];
+		QElapsedTimer timer;
+		Intersection its;
+		size_t hits = 0;
+
+		timer.start();
+		for (size_t j=0; j<primaryRays.size(); ++j)
+			hits += accel->rayIntersect(primaryRays[j], its) ? 1 : 0;
+		float primaryTime = std::max((qint64) 1, timer.elapsed()) / 1000.0f;
+
+		timer.start();
+		for (size_t j=0; j<shadowRays.size(); ++j)
+			hits += accel->rayIntersect(shadowRays[j], its, true) ? 1 : 0;
+		float shadowTime = std::max((qint64) 1, timer.elapsed()) / 1000.0f;
+
+		cout << "  " << qPrintable(accel->getName().leftJustified(20))
+			 << qPrintable(QString::number(buildTimes[i]).rightJustified(13))
+			 << qPrintable(QString::number(accel->getMemoryUsage() / 1024).rightJustified(15))
+			 << qPrintable(QString::number(primaryRays.size() / primaryTime * 1e-6f, 'f', 2).rightJustified(20))
+			 << qPrintable(QString::number(shadowRays.size() / shadowTime * 1e-6f, 'f', 2).rightJustified(19))
+			 << "  (" << hits << " hits)" << endl;
+	}
+
+	/* Compare the closest point and radius queries of the kd-tree against
+	   testing every triangle, using points scattered over the scene bounds */
+	const Accelerator *kdtree = accels[0];
+	const BoundingBox3f &bbox = kdtree->getBoundingBox();
+	const size_t pointCount = 1000;
+	const float radius = bbox.getExtents().norm() * 0.01f;
+	std::vector<Point3f> points;
+	points.reserve(pointCount);
+	for (size_t i=0; i<pointCount; ++i)
+		points.push_back(bbox.min + bbox.getExtents().cwiseProduct(Vector3f(
+			random.nextFloat(), random.nextFloat(), random.nextFloat())));
+
+	std::vector<float> distances(pointCount);
+	std::vector<size_t> counts(pointCount);
+	std::vector<TriangleRef> triangles;
+	qint64 times[4];
+	size_t mismatches[2] = { 0, 0 };
+	for (int bruteForce=0; bruteForce<2; ++bruteForce) {
+		QElapsedTimer timer;
+		timer.start();
+		for (size_t i=0; i<pointCount; ++i) {
+			Intersection its;
+			bool found = bruteForce ? kdtree->Accelerator::closestPoint(points[i],
+				std::numeric_limits<float>::infinity(), its) : kdtree->closestPoint(points[i],
+				std::numeric_limits<float>::infinity(), its);
+			float dist = found ? its.t : -1.0f;
+			if (!bruteForce)
+				distances[i] = dist;
+			else if (dist != distances[i])
+				++mismatches[0];
+		}
+		times[2*bruteForce] = std::max((qint64) 1, timer.elapsed());
+
+		timer.start();
+		for (size_t i=0; i<pointCount; ++i) {
+			if (bruteForce)
+				kdtree->Accelerator::trianglesInRadius(points[i], radius, triangles);
+			else
+				kdtree->trianglesInRadius(points[i], radius, triangles);
+			if (!bruteForce)
+				counts[i] = triangles.size();
+			else if (triangles.size() != counts[i])
+				++mismatches[1];
+		}
+		times[2*bruteForce+1] = std::max((qint64) 1, timer.elapsed());
+	}
+
+	cout << endl << "kd-tree point queries (" << pointCount << " points, single-threaded)" << endl;
+	cout << "  Query            kd-tree (ms)   Brute force (ms)   Speedup   Mismatches" << endl;
+	const char *queries[] = { "Closest point", "Radius (1%)" };
+	for (int i=0; i<2; ++i) {
+		cout << "  " << qPrintable(QString(queries[i]).leftJustified(14))
+			 << qPrintable(QString::number(times[i]).rightJustified(15))
+			 << qPrintable(QString::number(times[i+2]).rightJustified(19))
+			 << qPrintable(QString::number(times[i+2] / (double) times[i], 'f', 1).rightJustified(10))
+			 << qPrintable(QString::number(mismatches[i]).rightJustified(13))
+			 << endl;
+	}
+
+	for (int i=0; i<accelCount; ++i)
+		delete accels[i];
+
+	/* Measure how the kd-tree construction scales with the number of threads */
+	int maxThreads = getThreadCount();
+	uint32_t triangleCount = 0;
+	for (size_t j=0; j<meshes.size(); ++j)
+		triangleCount += meshes[j]->getTriangleCount();
+	cout << endl << "kd-tree build scaling (" << triangleCount << " triangles, "
+		 << maxThreads << " threads available)" << endl;
+	cout << "  Threads   Build (ms)   Speedup" << endl;
+
+	qint64 serialTime = 0;
+	for (int threads=1; ; threads = std::min(threads * 2, maxThreads)) {
+		setThreadCount(threads);
+		KDTree kdtree;
+		for (size_t j=0; j<meshes.size(); ++j)
+			kdtree.addMesh(meshes[j]);
+		QElapsedTimer timer;
+		timer.start();
+		kdtree.build();
+		qint64 buildTime = std::max((qint64) 1, timer.elapsed());
+		if (threads == 1)
+			serialTime = buildTime;
+
+		cout << "  " << qPrintable(QString::number(threads).rightJustified(7))
+			 << qPrintable(QString::number(buildTime).rightJustified(13))
+			 << qPrintable(QString::number(serialTime / (double) buildTime, 'f', 2).rightJustified(10))
+			 << endl;
+
+		if (threads == maxThreads)
+			break;
+	}
+	setThreadCount(maxThreads);
+}
+
+NORI_NAMESPACE_END
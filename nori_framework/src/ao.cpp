@@ -19,6 +19,8 @@
 #include <nori/integrator.h>
 #include <nori/sampler.h>
 #include <nori/scene.h>
+#include <valarray>
+#include <QThreadStorage>
 
 NORI_NAMESPACE_BEGIN
 
@@ -67,11 +69,65 @@ public:
 		return Color3f(scene->rayIntersect(shadowRay) ? 0.0f : 1.0f);
 	}
 
+	void LiBatch(const Scene *scene, Sampler *sampler, const Ray3f *rays,
+			Color3f *values, size_t count) const {
+		/* This is called for every pixel, hence reuse the buffers of the thread */
+		if (!m_buffers.hasLocalData())
+			m_buffers.setLocalData(new BatchBuffers());
+		BatchBuffers &buffers = *m_buffers.localData();
+		buffers.prepare(count);
+		std::vector<Intersection> &its = buffers.its;
+		std::vector<Ray3f> &shadowRays = buffers.shadowRays;
+		std::vector<uint32_t> &shadowRayIndices = buffers.shadowRayIndices;
+		bool *hits = &buffers.hits[0];
+
+		/* Find the visible surfaces of all rays together */
+		scene->rayIntersect(rays, count, &its[0], hits);
+
+		float length = m_length * scene->getBoundingBox().getExtents().norm();
+		for (size_t i=0; i<count; ++i) {
+			values[i] = Color3f(0.0f);
+			if (hits[i]) {
+				/* Same as in Li(), but defer the occlusion test */
+				Vector3f d = its[i].toWorld(hemisphereSampling(sampler->next2D()));
+				shadowRays.push_back(Ray3f(its[i].p, d, Epsilon, length));
+				shadowRayIndices.push_back((uint32_t) i);
+			}
+			sampler->advance();
+		}
+
+		/* Trace the shadow rays as packets as well */
+		if (!shadowRays.empty()) {
+			scene->rayIntersect(&shadowRays[0], shadowRays.size(), hits);
+			for (size_t i=0; i<shadowRays.size(); ++i)
+				values[shadowRayIndices[i]] = Color3f(hits[i] ? 0.0f : 1.0f);
+		}
+	}
+
 	QString toString() const {
 		return QString("AmbientOcclusion[length=%1]").arg(m_length);
 	}
 private:
+	/// Per-thread buffers of \ref LiBatch()
+	struct BatchBuffers {
+		std::vector<Intersection> its;
+		std::vector<Ray3f> shadowRays;
+		std::vector<uint32_t> shadowRayIndices;
+		/* Unlike std::vector<bool>, this stores the flags as an array of bool */
+		std::valarray<bool> hits;
+
+		/// Make room for \c count rays and forget the shadow rays of the last call
+		void prepare(size_t count) {
+			if (hits.size() < count)
+				hits.resize(count);
+			its.resize(count);
+			shadowRays.clear();
+			shadowRayIndices.clear();
+		}
+	};
+
 	float m_length;
+	mutable QThreadStorage<BatchBuffers *> m_buffers;
 };
 
 NORI_REGISTER_CLASS(AmbientOcclusion, "ao");
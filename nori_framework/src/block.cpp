@@ -24,11 +24,19 @@
 #include <nori/sampler.h>
 #include <nori/integrator.h>
 #include <nori/bbox.h>
+#include <QDataStream>
+#include <QFile>
+#include <ImfInputFile.h>
+#include <ImfOutputFile.h>
+#include <ImfChannelList.h>
+#include <ImfStringAttribute.h>
+#include <algorithm>
+#include <climits>
 
 NORI_NAMESPACE_BEGIN
 
 ImageBlock::ImageBlock(const Vector2i &size, const ReconstructionFilter *filter)
-		: m_offset(0), m_size(size) {
+		: m_offset(0), m_size(size), m_momentsWidth(0) {
 	/* Tabulate the image reconstruction filter for performance reasons */
 	m_filterRadius = filter->getRadius();
 	m_borderSize = (int) std::ceil(m_filterRadius - 0.5f);
@@ -44,14 +52,24 @@ ImageBlock::ImageBlock(const Vector2i &size, const ReconstructionFilter *filter)
 
 	/* Allocate space for pixels and border regions */
 	resize(size.y() + 2*m_borderSize, size.x() + 2*m_borderSize);
+	allocateStripes();
 }
 
-ImageBlock::ImageBlock(const Bitmap *image) : m_filter(NULL), m_weightsX(NULL), m_weightsY(NULL) {
+ImageBlock::ImageBlock(const Vector2i &size) : m_offset(0), m_size(size), m_borderSize(0),
+		m_filter(NULL), m_filterRadius(0), m_weightsX(NULL), m_weightsY(NULL),
+		m_lookupFactor(0), m_momentsWidth(0) {
+	resize(size.y(), size.x());
+	allocateStripes();
+}
+
+ImageBlock::ImageBlock(const Bitmap *image) : m_filter(NULL), m_weightsX(NULL), m_weightsY(NULL),
+		m_momentsWidth(0) {
 	m_size = Vector2i(image->cols(), image->rows());
 		m_borderSize = 0;
 
 	/* Allocate space for pixels and border regions */
 	resize(m_size.y() + 2*m_borderSize, m_size.x() + 2*m_borderSize);
+	allocateStripes();
 
 	// store pixels
 	for (int y=0; y<m_size.y(); ++y)
@@ -63,6 +81,196 @@ ImageBlock::~ImageBlock() {
 	if(m_filter != NULL) delete[] m_filter;
 	if(m_weightsX != NULL) delete[] m_weightsX;
 	if(m_weightsY != NULL) delete[] m_weightsY;
+	for (size_t i=0; i<m_stripes.size(); ++i)
+		delete m_stripes[i];
+}
+
+void ImageBlock::allocateStripes() {
+	int stripeCount = (int) (rows() + NORI_LOCK_STRIPE_SIZE - 1) / NORI_LOCK_STRIPE_SIZE;
+	m_stripes.reserve(stripeCount);
+	for (int i=0; i<stripeCount; ++i)
+		m_stripes.push_back(new QMutex());
+}
+
+void ImageBlock::enableMoments() {
+	m_momentsWidth = (int) cols() - 2*m_borderSize;
+	m_moments.resize(m_momentsWidth * (rows() - 2*m_borderSize), Vector3f::Zero());
+}
+
+void ImageBlock::clear() {
+	setConstant(Color4f());
+	std::fill(m_moments.begin(), m_moments.end(), Vector3f::Zero());
+	std::fill(m_costs.begin(), m_costs.end(), Vector2f::Zero());
+}
+
+void ImageBlock::putMoments(const Point2i &pixel, float sum, float sumSq, int count) {
+	Point2i pos = pixel - m_offset;
+	m_moments[pos.y() * m_momentsWidth + pos.x()] += Vector3f(sum, sumSq, (float) count);
+}
+
+int ImageBlock::getConverged(const ImageBlock &region, float threshold,
+		std::vector<bool> &converged) const {
+	Point2i offset = region.getOffset() - m_offset;
+	Vector2i size = region.getSize();
+	int count = 0, lockedStripe = -1;
+
+	converged.resize(size.x() * size.y());
+	for (int y=0; y<size.y(); ++y) {
+		int stripe = (offset.y() + y + m_borderSize) / NORI_LOCK_STRIPE_SIZE;
+		if (stripe != lockedStripe) {
+			if (lockedStripe >= 0)
+				m_stripes[lockedStripe]->unlock();
+			m_stripes[stripe]->lock();
+			lockedStripe = stripe;
+		}
+
+		for (int x=0; x<size.x(); ++x) {
+			const Vector3f &m = m_moments[(offset.y() + y) * m_momentsWidth + offset.x() + x];
+			bool result = false;
+			if (m.z() > 1) {
+				/* Relative standard error of the mean luminance */
+				float mean = m.x() / m.z();
+				float variance = std::max(0.0f, (m.y() - m.x() * mean) / (m.z() - 1));
+				float error = std::sqrt(variance / m.z());
+				result = error <= threshold * std::max(mean, NORI_ADAPTIVE_EPSILON);
+			}
+			converged[y * size.x() + x] = result;
+			count += result ? 1 : 0;
+		}
+	}
+	if (lockedStripe >= 0)
+		m_stripes[lockedStripe]->unlock();
+
+	return count;
+}
+
+float ImageBlock::getAverageSampleCount() const {
+	if (m_moments.empty())
+		return 0.0f;
+	double total = 0;
+	for (size_t i=0; i<m_moments.size(); ++i)
+		total += m_moments[i].z();
+	return (float) (total / m_moments.size());
+}
+
+void ImageBlock::enableCosts() {
+	m_momentsWidth = (int) cols() - 2*m_borderSize;
+	m_costs.resize(m_momentsWidth * (rows() - 2*m_borderSize), Vector2f::Zero());
+}
+
+void ImageBlock::putCost(const Point2i &pixel, float cost, int count) {
+	Point2i pos = pixel - m_offset;
+	m_costs[pos.y() * m_momentsWidth + pos.x()] += Vector2f(cost, (float) count);
+}
+
+Bitmap *ImageBlock::toCostBitmap() const {
+	Bitmap *result = new Bitmap(m_size);
+	for (int y=0; y<m_size.y(); ++y) {
+		for (int x=0; x<m_size.x(); ++x) {
+			const Vector2f &c = m_costs[y * m_momentsWidth + x];
+			result->coeffRef(y, x) = Color3f(c.y() > 0 ? c.x() / c.y() : 0.0f);
+		}
+	}
+	return result;
+}
+
+void ImageBlock::saveRaw(const QString &filename) const {
+	cout << "Writing a raw " << m_size.x() << "x" << m_size.y()
+		 << " OpenEXR file to \"" << qPrintable(filename) << "\"" << endl;
+
+	Imf::Header header(m_size.x(), m_size.y());
+	header.insert("comments", Imf::StringAttribute("Raw weighted film generated by Nori"));
+
+	Imf::ChannelList &channels = header.channels();
+	channels.insert("R", Imf::Channel(Imf::FLOAT));
+	channels.insert("G", Imf::Channel(Imf::FLOAT));
+	channels.insert("B", Imf::Channel(Imf::FLOAT));
+	channels.insert("W", Imf::Channel(Imf::FLOAT));
+
+	/* Directly reference the interior of the block (skipping the border) */
+	Imf::FrameBuffer frameBuffer;
+	size_t compStride = sizeof(float),
+	       pixelStride = 4 * compStride,
+	       rowStride = pixelStride * cols();
+
+	char *ptr = const_cast<char *>(reinterpret_cast<const char *>(
+		&coeff(m_borderSize, m_borderSize)));
+	frameBuffer.insert("R", Imf::Slice(Imf::FLOAT, ptr, pixelStride, rowStride)); ptr += compStride;
+	frameBuffer.insert("G", Imf::Slice(Imf::FLOAT, ptr, pixelStride, rowStride)); ptr += compStride;
+	frameBuffer.insert("B", Imf::Slice(Imf::FLOAT, ptr, pixelStride, rowStride)); ptr += compStride;
+	frameBuffer.insert("W", Imf::Slice(Imf::FLOAT, ptr, pixelStride, rowStride));
+
+	QByteArray filenameUtf8 = filename.toUtf8();
+	Imf::OutputFile file(filenameUtf8.data(), header);
+	file.setFrameBuffer(frameBuffer);
+	file.writePixels(m_size.y());
+}
+
+ImageBlock *ImageBlock::loadRaw(const QString &filename) {
+	if (!QFile::exists(filename))
+		throw NoriException(QString("EXR file \"%1\" does not exist!").arg(filename));
+
+	QByteArray filenameUtf8 = filename.toUtf8();
+	Imf::InputFile file(filenameUtf8.data());
+	const Imf::ChannelList &channels = file.header().channels();
+	const char *names[] = { "R", "G", "B", "W" };
+	for (int i=0; i<4; ++i) {
+		if (!channels.findChannel(names[i]))
+			throw NoriException(QString("\"%1\" is not a raw image (channel %2 is missing)!")
+				.arg(filename).arg(names[i]));
+	}
+
+	Imath::Box2i dw = file.header().dataWindow();
+	ImageBlock *block = new ImageBlock(Vector2i(dw.max.x - dw.min.x + 1, dw.max.y - dw.min.y + 1));
+
+	size_t compStride = sizeof(float),
+	       pixelStride = 4 * compStride,
+	       rowStride = pixelStride * block->cols();
+
+	/* The frame buffer is addressed using absolute data window coordinates */
+	char *ptr = reinterpret_cast<char *>(block->data())
+		- dw.min.x * pixelStride - dw.min.y * rowStride;
+
+	Imf::FrameBuffer frameBuffer;
+	for (int i=0; i<4; ++i)
+		frameBuffer.insert(names[i], Imf::Slice(Imf::FLOAT, ptr + i*compStride, pixelStride, rowStride));
+	file.setFrameBuffer(frameBuffer);
+	file.readPixels(dw.min.y, dw.max.y);
+	return block;
+}
+
+void ImageBlock::serialize(QDataStream &stream) const {
+	stream << (qint32) rows() << (qint32) cols() << (quint32) m_moments.size();
+	stream.writeRawData((const char *) data(), (int) (sizeof(Color4f) * size()));
+	if (!m_moments.empty())
+		stream.writeRawData((const char *) &m_moments[0],
+			(int) (sizeof(Vector3f) * m_moments.size()));
+}
+
+void ImageBlock::unserialize(QDataStream &stream) {
+	qint32 rowCount, colCount;
+	quint32 momentCount;
+	stream >> rowCount >> colCount >> momentCount;
+	if (rowCount != rows() || colCount != cols() || momentCount != m_moments.size())
+		throw NoriException("Invalid checkpoint: the image size does not match!");
+	int bytes = (int) (sizeof(Color4f) * size());
+	if (stream.readRawData((char *) data(), bytes) != bytes)
+		throw NoriException("Invalid checkpoint: unexpected end of file!");
+	if (!m_moments.empty()) {
+		bytes = (int) (sizeof(Vector3f) * m_moments.size());
+		if (stream.readRawData((char *) &m_moments[0], bytes) != bytes)
+			throw NoriException("Invalid checkpoint: unexpected end of file!");
+	}
+}
+
+void ImageBlock::lock() const {
+	for (size_t i=0; i<m_stripes.size(); ++i)
+		m_stripes[i]->lock();
+}
+
+void ImageBlock::unlock() const {
+	for (size_t i=m_stripes.size(); i-- > 0; )
+		m_stripes[i]->unlock();
 }
 
 Bitmap *ImageBlock::toBitmap() const {
@@ -108,8 +316,151 @@ void ImageBlock::put(const Point2f &_pos, const Color3f &value) {
 void ImageBlock::put(ImageBlock &b) {
 	Vector2i offset = b.getOffset() - m_offset;
 	Vector2i size   = b.getSize()   + Vector2i(2*b.getBorderSize());
-	block(offset.y(), offset.x(), size.y(), size.x())
-		+= b.topLeftCorner(size.y(), size.x());
+
+	/* Merge one stripe of rows at a time. Since at most one stripe
+	   lock is held at any point, this can never deadlock */
+	int rowEnd = offset.y() + size.y();
+	for (int row = offset.y(); row < rowEnd; ) {
+		int stripe = row / NORI_LOCK_STRIPE_SIZE;
+		int rowCount = std::min((stripe + 1) * NORI_LOCK_STRIPE_SIZE, rowEnd) - row;
+
+		m_stripes[stripe]->lock();
+		block(row, offset.x(), rowCount, size.x())
+			+= b.block(row - offset.y(), 0, rowCount, size.x());
+		m_stripes[stripe]->unlock();
+
+		row += rowCount;
+	}
+
+	bool moments = !m_moments.empty() && !b.m_moments.empty(),
+	     costs = !m_costs.empty() && !b.m_costs.empty();
+	if (!moments && !costs)
+		return;
+
+	/* Merge the per-pixel moments and costs (these have no border) */
+	Vector2i inner = b.getSize();
+	for (int y=0; y<inner.y(); ++y) {
+		int row = offset.y() + y;
+		int stripe = (row + m_borderSize) / NORI_LOCK_STRIPE_SIZE;
+		int targetIdx = row * m_momentsWidth + offset.x(),
+		    sourceIdx = y * b.m_momentsWidth;
+
+		m_stripes[stripe]->lock();
+		for (int x=0; x<inner.x(); ++x) {
+			if (moments)
+				m_moments[targetIdx + x] += b.m_moments[sourceIdx + x];
+			if (costs)
+				m_costs[targetIdx + x] += b.m_costs[sourceIdx + x];
+		}
+		m_stripes[stripe]->unlock();
+	}
+}
+
+/// Integer-valued contents of the i-th tile of \ref ImageBlock::stressTest()
+static Color4f tileValue(size_t i) {
+	return Color4f((float) (i % 13), (float) (i % 7), 1.0f, 1.0f);
+}
+
+/// Thread that repeatedly merges every n-th tile into a shared block (see \ref ImageBlock::stressTest())
+class TileMergeThread : public QThread {
+public:
+	TileMergeThread(ImageBlock *output, const ReconstructionFilter *filter,
+		const std::vector<Point2i> &offsets, const std::vector<Vector2i> &sizes,
+		int id, int threadCount, int passes)
+		: m_output(output), m_filter(filter), m_offsets(offsets), m_sizes(sizes),
+		  m_id(id), m_threadCount(threadCount), m_passes(passes) { }
+
+	void run() {
+		ImageBlock tile(Vector2i(NORI_BLOCK_SIZE, NORI_BLOCK_SIZE), m_filter);
+		for (int pass=0; pass<m_passes; ++pass) {
+			for (size_t i=m_id; i<m_offsets.size(); i += m_threadCount) {
+				tile.setConstant(tileValue(i));
+				tile.setOffset(m_offsets[i]);
+				tile.setSize(m_sizes[i]);
+				m_output->put(tile);
+			}
+		}
+	}
+private:
+	ImageBlock *m_output;
+	const ReconstructionFilter *m_filter;
+	const std::vector<Point2i> &m_offsets;
+	const std::vector<Vector2i> &m_sizes;
+	int m_id, m_threadCount, m_passes;
+};
+
+bool ImageBlock::stressTest(int threadCount) {
+	const Vector2i size(512, 384);
+	const int step = NORI_BLOCK_SIZE / 2, passes = 16;
+
+	ReconstructionFilter *filter = static_cast<ReconstructionFilter *>(
+		NoriObjectFactory::createInstance("gaussian", PropertyList()));
+	ImageBlock output(size, filter), reference(size, filter);
+	output.clear();
+	reference.clear();
+	int border = output.getBorderSize();
+
+	/* Tiles on a grid with half the block size as spacing, so that every
+	   pixel (and all filter borders) is covered by several tiles */
+	std::vector<Point2i> offsets;
+	std::vector<Vector2i> sizes;
+	double expectedWeight = 0;
+	for (int y=0; y<size.y(); y += step) {
+		for (int x=0; x<size.x(); x += step) {
+			Vector2i tileSize(std::min(NORI_BLOCK_SIZE, size.x() - x),
+				std::min(NORI_BLOCK_SIZE, size.y() - y));
+			offsets.push_back(Point2i(x, y));
+			sizes.push_back(tileSize);
+			expectedWeight += (double) (tileSize.x() + 2*border)
+				* (tileSize.y() + 2*border) * passes;
+		}
+	}
+
+	/* Single-threaded reference */
+	ImageBlock tile(Vector2i(NORI_BLOCK_SIZE, NORI_BLOCK_SIZE), filter);
+	for (int pass=0; pass<passes; ++pass) {
+		for (size_t i=0; i<offsets.size(); ++i) {
+			tile.setConstant(tileValue(i));
+			tile.setOffset(offsets[i]);
+			tile.setSize(sizes[i]);
+			reference.put(tile);
+		}
+	}
+
+	std::vector<TileMergeThread *> threads;
+	for (int i=0; i<threadCount; ++i)
+		threads.push_back(new TileMergeThread(&output, filter,
+			offsets, sizes, i, threadCount, passes));
+	QElapsedTimer timer;
+	timer.start();
+	for (int i=0; i<threadCount; ++i)
+		threads[i]->start();
+	for (int i=0; i<threadCount; ++i) {
+		threads[i]->wait();
+		delete threads[i];
+	}
+	qint64 elapsed = timer.elapsed();
+
+	/* The tile values are small integers, hence all sums are exact
+	   regardless of the order in which the tiles were merged */
+	double weight = 0;
+	int mismatches = 0;
+	for (int y=0; y<output.rows(); ++y) {
+		for (int x=0; x<output.cols(); ++x) {
+			weight += output(y, x).w();
+			if ((output(y, x) != reference(y, x)).any())
+				++mismatches;
+		}
+	}
+	delete filter;
+
+	bool passed = weight == expectedWeight && mismatches == 0;
+	cout << "ImageBlock merge stress test: " << offsets.size() * passes
+		<< " tiles merged by " << threadCount << " threads in " << elapsed
+		<< " ms, weight " << weight << " (expected " << expectedWeight << "), "
+		<< mismatches << " mismatching pixels -- " << (passed ? "passed" : "FAILED")
+		<< endl;
+	return passed;
 }
 
 QString ImageBlock::toString() const {
@@ -118,61 +469,557 @@ QString ImageBlock::toString() const {
 		.arg(m_size.toString());
 }
 
-BlockGenerator::BlockGenerator(const Vector2i &size, int blockSize)
-		: m_size(size), m_blockSize(blockSize) {
+/// Interleave the lower 16 bits of \c x and \c y (Morton/Z-order key)
+static uint32_t mortonKey(uint32_t x, uint32_t y) {
+	uint32_t key = 0;
+	for (int i=0; i<16; ++i)
+		key |= ((x >> i) & 1) << (2*i) | ((y >> i) & 1) << (2*i + 1);
+	return key;
+}
+
+/// Distance of the cell (x, y) along a Hilbert curve filling an n x n grid
+static uint32_t hilbertKey(uint32_t n, uint32_t x, uint32_t y) {
+	uint32_t key = 0;
+	for (uint32_t s = n/2; s > 0; s /= 2) {
+		uint32_t rx = (x & s) > 0, ry = (y & s) > 0;
+		key += s * s * ((3 * rx) ^ ry);
+		if (ry == 0) {
+			/* Rotate the quadrant */
+			if (rx == 1) {
+				x = s-1 - x;
+				y = s-1 - y;
+			}
+			std::swap(x, y);
+		}
+	}
+	return key;
+}
+
+/// Helper data structure for sorting blocks by an integer or float key
+template <typename T> struct BlockKey {
+	T key;
+	Point2i block;
+
+	inline bool operator<(const BlockKey &other) const {
+		return key < other.key;
+	}
+};
+
+BlockGenerator::BlockGenerator(const Vector2i &size, int blockSize,
+		int threadCount, EBlockOrder order)
+		: m_size(size), m_cropOffset(0, 0), m_cropSize(size), m_blockSize(blockSize),
+		  m_threadCount(std::max(threadCount, 1)), m_order(order),
+		  m_passCount(1), m_sampleCount(0), m_samplesPerPass(0), m_timeLimit(-1),
+		  m_adaptiveThreshold(-1.0f), m_minAdaptivePasses(INT_MAX),
+		  m_inFlight(0), m_paused(false), m_stopped(false), m_frame(0),
+		  m_threadsDone(m_threadCount), m_shutdown(false), m_timeOffset(0) {
+	if (blockSize < 1)
+		throw NoriException(QString("Invalid block size %1").arg(blockSize));
 	m_numBlocks = Vector2i(
 		(int) std::ceil(size.x() / (float) blockSize),
 		(int) std::ceil(size.y() / (float) blockSize));
-	m_blocksLeft = m_numBlocks.x() * m_numBlocks.y();
-	m_direction = ERight;
-	m_block = Point2i(m_numBlocks / 2);
-	m_stepsLeft = 1;
-	m_numSteps = 1;
+	m_costs.resize(m_numBlocks.x() * m_numBlocks.y(), 0.0f);
+	for (int i=0; i<m_threadCount; ++i)
+		m_queues.push_back(new WorkQueue());
+	reset();
+}
+
+BlockGenerator::~BlockGenerator() {
+	for (size_t i=0; i<m_queues.size(); ++i)
+		delete m_queues[i];
+}
+
+BlockGenerator::EBlockOrder BlockGenerator::parseOrder(const QString &name) {
+	QString value = name.toLower();
+	if (value == "spiral")
+		return ESpiral;
+	else if (value == "morton")
+		return EMorton;
+	else if (value == "hilbert")
+		return EHilbert;
+	else if (value == "cost")
+		return ECost;
+	throw NoriException(QString("Unknown block order \"%1\" (must be one "
+		"of spiral, morton, hilbert or cost)").arg(name));
+}
+
+void BlockGenerator::generateBlocks(std::vector<Point2i> &blocks) const {
+	int blockCount = m_numBlocks.x() * m_numBlocks.y();
+	blocks.clear();
+	blocks.reserve(blockCount);
+
+	bool haveCosts = false;
+	for (int i=0; i<blockCount; ++i)
+		haveCosts |= m_costs[i] > 0;
+
+	if (m_order == EMorton || m_order == EHilbert) {
+		uint32_t n = 1;
+		while (n < (uint32_t) m_numBlocks.maxCoeff())
+			n *= 2;
+		std::vector<BlockKey<uint32_t> > keys(blockCount);
+		for (int y=0, idx=0; y<m_numBlocks.y(); ++y) {
+			for (int x=0; x<m_numBlocks.x(); ++x, ++idx) {
+				keys[idx].block = Point2i(x, y);
+				keys[idx].key = m_order == EMorton ? mortonKey(x, y)
+					: hilbertKey(n, x, y);
+			}
+		}
+		std::sort(keys.begin(), keys.end());
+		for (int i=0; i<blockCount; ++i)
+			blocks.push_back(keys[i].block);
+		return;
+	} else if (m_order == ECost && haveCosts) {
+		std::vector<BlockKey<float> > keys(blockCount);
+		for (int y=0, idx=0; y<m_numBlocks.y(); ++y) {
+			for (int x=0; x<m_numBlocks.x(); ++x, ++idx) {
+				keys[idx].block = Point2i(x, y);
+				keys[idx].key = -m_costs[idx];
+			}
+		}
+		/* Stable, so that blocks of equal cost stay in scanline order */
+		std::stable_sort(keys.begin(), keys.end());
+		for (int i=0; i<blockCount; ++i)
+			blocks.push_back(keys[i].block);
+		return;
+	}
+
+	/* Spiral outwards, starting from the center of the image */
+	enum EDirection { ERight = 0, EDown, ELeft, EUp };
+	Point2i block(m_numBlocks / 2);
+	int direction = ERight, numSteps = 1, stepsLeft = 1;
+
+	while (true) {
+		blocks.push_back(block);
+		if ((int) blocks.size() == blockCount)
+			break;
+
+		do {
+			switch (direction) {
+				case ERight: ++block.x(); break;
+				case EDown:  ++block.y(); break;
+				case ELeft:  --block.x(); break;
+				case EUp:    --block.y(); break;
+			}
+
+			if (--stepsLeft == 0) {
+				direction = (direction + 1) % 4;
+				if (direction == ELeft || direction == ERight)
+					++numSteps;
+				stepsLeft = numSteps;
+			}
+		} while ((block.array() < 0).any() ||
+				 (block.array() >= m_numBlocks.array()).any());
+	}
+}
+
+void BlockGenerator::fill() {
+	std::vector<Point2i> blocks;
+	m_mutex.lock();
+	generateBlocks(blocks);
+	/* The costs of the previous pass were used to order this one */
+	std::fill(m_costs.begin(), m_costs.end(), 0.0f);
+	m_mutex.unlock();
+
+	/* Clip the blocks against the crop window */
+	Point2i cropEnd = m_cropOffset + m_cropSize;
+	std::vector<Block> clipped;
+	clipped.reserve(blocks.size());
+	for (size_t i=0; i<blocks.size(); ++i) {
+		Point2i start = (blocks[i] * m_blockSize).cwiseMax(m_cropOffset);
+		Point2i end = ((blocks[i] + Point2i(1, 1)) * m_blockSize).cwiseMin(cropEnd);
+		if ((end.array() > start.array()).all())
+			clipped.push_back(Block(start, end - start, m_pass));
+	}
+
+	/* Deal out the blocks round-robin so that every thread starts
+	   out with work near the front of the chosen order */
+	for (int i=0; i<m_threadCount; ++i) {
+		WorkQueue *queue = m_queues[i];
+		queue->mutex.lock();
+		for (size_t j=i; j<clipped.size(); j += m_threadCount) {
+			queue->blocks.push_back(clipped[j]);
+			m_blocksQueued.ref();
+		}
+		queue->mutex.unlock();
+	}
+	wakeIdle();
+}
+
+void BlockGenerator::wakeIdle() {
+	/* Taking the lock ensures that no thread is between checking
+	   m_blocksQueued and going to sleep in next() */
+	m_mutex.lock();
+	m_cond.wakeAll();
+	m_mutex.unlock();
+}
+
+void BlockGenerator::reset() {
+	for (int i=0; i<m_threadCount; ++i)
+		m_queues[i]->blocks.clear();
+	m_blocksQueued = 0;
+	m_pixelsDone = 0;
+	m_pass = 0;
+	m_stopped = false;
+	m_timeOffset = 0;
+	fill();
 	m_timer.start();
 }
 
-bool BlockGenerator::next(ImageBlock &block) {
+void BlockGenerator::pause() {
+	m_mutex.lock();
+	m_paused = true;
+	while (m_inFlight > 0)
+		m_cond.wait(&m_mutex);
+	m_mutex.unlock();
+}
+
+void BlockGenerator::resume() {
+	m_mutex.lock();
+	m_paused = false;
+	m_cond.wakeAll();
+	m_mutex.unlock();
+}
+
+void BlockGenerator::stop() {
+	m_passMutex.lock();
+	m_stopped = true;
+	for (int i=0; i<m_threadCount; ++i) {
+		WorkQueue *queue = m_queues[i];
+		queue->mutex.lock();
+		m_blocksQueued.fetchAndAddOrdered(-(int) queue->blocks.size());
+		queue->blocks.clear();
+		queue->mutex.unlock();
+	}
+	m_passMutex.unlock();
+}
+
+void BlockGenerator::startFrame() {
+	m_mutex.lock();
+	++m_frame;
+	m_threadsDone = 0;
+	m_cond.wakeAll();
+	m_mutex.unlock();
+}
+
+bool BlockGenerator::waitForFrame(int &frame) {
+	m_mutex.lock();
+	while (!m_shutdown && m_frame == frame)
+		m_cond.wait(&m_mutex);
+	frame = m_frame;
+	bool result = !m_shutdown;
+	m_mutex.unlock();
+	return result;
+}
+
+void BlockGenerator::frameFinished() {
+	m_mutex.lock();
+	++m_threadsDone;
+	m_cond.wakeAll();
+	m_mutex.unlock();
+}
+
+bool BlockGenerator::isFrameFinished() const {
+	m_mutex.lock();
+	bool result = m_threadsDone >= m_threadCount;
+	m_mutex.unlock();
+	return result;
+}
+
+void BlockGenerator::shutdown() {
 	m_mutex.lock();
+	m_shutdown = true;
+	m_cond.wakeAll();
+	m_mutex.unlock();
+}
+
+void BlockGenerator::serialize(QDataStream &stream) const {
+	stream << (qint32) m_size.x() << (qint32) m_size.y() << (qint32) m_blockSize
+		   << (qint32) m_cropOffset.x() << (qint32) m_cropOffset.y()
+		   << (qint32) m_cropSize.x() << (qint32) m_cropSize.y()
+		   << (qint32) m_sampleCount << (qint32) m_samplesPerPass
+		   << (qint32) m_pass << (qint32) m_passCount << (qint64) m_pixelsDone
+		   << (qint64) (m_timer.elapsed() + m_timeOffset);
+
+	stream << (quint32) m_costs.size();
+	for (size_t i=0; i<m_costs.size(); ++i)
+		stream << m_costs[i];
+
+	std::vector<Block> blocks;
+	for (int i=0; i<m_threadCount; ++i)
+		blocks.insert(blocks.end(), m_queues[i]->blocks.begin(), m_queues[i]->blocks.end());
+	stream << (quint32) blocks.size();
+	for (size_t i=0; i<blocks.size(); ++i) {
+		const Block &block = blocks[i];
+		stream << (qint32) block.offset.x() << (qint32) block.offset.y()
+			   << (qint32) block.size.x() << (qint32) block.size.y()
+			   << (qint32) block.pass;
+	}
+}
+
+void BlockGenerator::unserialize(QDataStream &stream) {
+	qint32 sizeX, sizeY, blockSize, cropX, cropY, cropWidth, cropHeight;
+	qint32 sampleCount, samplesPerPass, pass, passCount;
+	qint64 pixelsDone, elapsed;
+	stream >> sizeX >> sizeY >> blockSize >> cropX >> cropY >> cropWidth >> cropHeight
+		   >> sampleCount >> samplesPerPass >> pass >> passCount >> pixelsDone >> elapsed;
+
+	if (sizeX != m_size.x() || sizeY != m_size.y() || blockSize != m_blockSize
+			|| cropX != m_cropOffset.x() || cropY != m_cropOffset.y()
+			|| cropWidth != m_cropSize.x() || cropHeight != m_cropSize.y()
+			|| sampleCount != m_sampleCount || samplesPerPass != m_samplesPerPass)
+		throw NoriException(QString("The checkpoint was created with a different "
+			"configuration (%1x%2 pixels, block size %3, %4 spp in passes of %5)!")
+			.arg(sizeX).arg(sizeY).arg(blockSize).arg(sampleCount).arg(samplesPerPass));
+
+	m_pass = pass;
+	m_passCount = passCount;
+	m_pixelsDone = pixelsDone;
+	m_timeOffset = elapsed;
+	m_timer.start();
+
+	quint32 count;
+	stream >> count;
+	if (count != m_costs.size())
+		throw NoriException("Invalid checkpoint: block count mismatch!");
+	for (size_t i=0; i<m_costs.size(); ++i)
+		stream >> m_costs[i];
+
+	for (int i=0; i<m_threadCount; ++i)
+		m_queues[i]->blocks.clear();
+	stream >> count;
+	for (quint32 i=0; i<count; ++i) {
+		qint32 values[5];
+		for (int j=0; j<5; ++j)
+			stream >> values[j];
+		m_queues[i % m_threadCount]->blocks.push_back(Block(Point2i(values[0], values[1]),
+			Vector2i(values[2], values[3]), values[4]));
+	}
+	m_blocksQueued = (int) count;
+
+	if (stream.status() != QDataStream::Ok)
+		throw NoriException("Invalid checkpoint: unexpected end of file!");
+}
+
+void BlockGenerator::setPasses(int sampleCount, int samplesPerPass) {
+	if (sampleCount <= 0 || samplesPerPass <= 0)
+		throw NoriException("The number of samples per pixel and per pass must be positive!");
+	m_sampleCount = sampleCount;
+	m_samplesPerPass = std::min(samplesPerPass, sampleCount);
+	m_passCount = (sampleCount + m_samplesPerPass - 1) / m_samplesPerPass;
+}
+
+void BlockGenerator::setCropWindow(const Point2i &offset, const Vector2i &size) {
+	if ((offset.array() < 0).any() || (size.array() <= 0).any() ||
+			((offset + size).array() > m_size.array()).any())
+		throw NoriException(QString("Invalid crop window (offset %1, size %2) for a "
+			"%3x%4 image!").arg(offset.toString()).arg(size.toString())
+			.arg(m_size.x()).arg(m_size.y()));
+	m_cropOffset = offset;
+	m_cropSize = size;
+}
+
+void BlockGenerator::setAdaptive(float threshold, int minPasses) {
+	if (threshold <= 0 || minPasses < 1)
+		throw NoriException("The adaptive sampling threshold and the minimum "
+			"number of passes must be positive!");
+	m_adaptiveThreshold = threshold;
+	m_minAdaptivePasses = minPasses;
+}
+
+int BlockGenerator::getSampleCount(int pass) const {
+	if (m_samplesPerPass == 0)
+		return -1;
+	return std::min(m_samplesPerPass, m_sampleCount - pass * m_samplesPerPass);
+}
+
+int BlockGenerator::getSampleCount() const {
+	if (m_samplesPerPass == 0)
+		return -1;
+	return std::min(m_sampleCount, (m_pass + 1) * m_samplesPerPass);
+}
+
+bool BlockGenerator::nextPass() {
+	QMutexLocker locker(&m_passMutex);
+
+	/* Some other thread may have started the next pass in the meantime */
+	if ((int) m_blocksQueued > 0)
+		return true;
 
-	if (m_blocksLeft == 0) {
+	if (m_stopped || m_pass + 1 >= m_passCount)
+		return false;
+
+	if (m_timeLimit >= 0 && m_timer.elapsed() + m_timeOffset >= m_timeLimit) {
+		cout << "Time limit reached, stopping after pass " << m_pass + 1
+			 << " of " << m_passCount << endl;
+		m_mutex.lock();
+		m_passCount = m_pass + 1;
 		m_mutex.unlock();
 		return false;
 	}
 
-	Point2i pos = m_block * m_blockSize;
-	block.setOffset(pos);
-	block.setSize((m_size - pos).cwiseMin(Vector2i::Constant(m_blockSize)));
+	/* Under m_mutex, which finished() holds while comparing passes */
+	m_mutex.lock();
+	++m_pass;
+	m_mutex.unlock();
+	fill();
+	return true;
+}
 
-	if (--m_blocksLeft == 0) {
-		cout << "Rendering finished (took " << m_timer.elapsed() << " ms)" << endl;
-		m_mutex.unlock();
-		return true;
+bool BlockGenerator::pop(int thread, Block &block) {
+	WorkQueue *queue = m_queues[thread];
+	queue->mutex.lock();
+	if (queue->blocks.empty()) {
+		queue->mutex.unlock();
+		return false;
 	}
+	block = queue->blocks.front();
+	queue->blocks.pop_front();
+
+	/* Near the end of the render, split the block into quadrants so
+	   that the remaining work can be shared by the idle threads. The
+	   counter is only adjusted once by the net change, since idle threads
+	   would give up or go to sleep when it temporarily dropped to zero */
+	int pushed = 0;
+	if ((int) m_blocksQueued - 1 < m_threadCount) {
+		Vector2i half = block.size / 2;
+		bool splitX = half.x() >= NORI_MIN_BLOCK_SIZE,
+		     splitY = half.y() >= NORI_MIN_BLOCK_SIZE;
 
-	do {
-		switch (m_direction) {
-			case ERight: ++m_block.x(); break;
-			case EDown:  ++m_block.y(); break;
-			case ELeft:  --m_block.x(); break;
-			case EUp:    --m_block.y(); break;
+		if (splitX || splitY) {
+			Vector2i size(splitX ? half.x() : block.size.x(),
+			              splitY ? half.y() : block.size.y());
+			if (splitX) {
+				Point2i offset(block.offset.x() + size.x(), block.offset.y());
+				queue->blocks.push_front(Block(offset,
+					Vector2i(block.size.x() - size.x(), size.y()), block.pass));
+				++pushed;
+			}
+			if (splitY) {
+				Point2i offset(block.offset.x(), block.offset.y() + size.y());
+				queue->blocks.push_front(Block(offset,
+					Vector2i(size.x(), block.size.y() - size.y()), block.pass));
+				++pushed;
+			}
+			if (splitX && splitY) {
+				Point2i offset = block.offset + size;
+				queue->blocks.push_front(Block(offset, block.size - size, block.pass));
+				++pushed;
+			}
+			block.size = size;
 		}
+	}
+	m_blocksQueued.fetchAndAddOrdered(pushed - 1);
+	queue->mutex.unlock();
+
+	if (pushed > 0)
+		wakeIdle();
+	return true;
+}
+
+bool BlockGenerator::steal(int thread) {
+	for (int i=1; i<m_threadCount; ++i) {
+		WorkQueue *victim = m_queues[(thread + i) % m_threadCount];
+		victim->mutex.lock();
+		if (!victim->blocks.empty()) {
+			Block block = victim->blocks.back();
+			victim->blocks.pop_back();
+			victim->mutex.unlock();
 
-		if (--m_stepsLeft == 0) {
-			m_direction = (m_direction + 1) % 4;
-			if (m_direction == ELeft || m_direction == ERight)
-				++m_numSteps;
-			m_stepsLeft = m_numSteps;
+			/* Move the block into our own queue so that it can be split
+			   up further if it happens to be one of the last ones. It
+			   stays counted in m_blocksQueued while it is moved */
+			WorkQueue *queue = m_queues[thread];
+			queue->mutex.lock();
+			queue->blocks.push_front(block);
+			queue->mutex.unlock();
+			return true;
 		}
-	} while ((m_block.array() < 0).any() ||
-			 (m_block.array() >= m_numBlocks.array()).any());
+		victim->mutex.unlock();
+	}
+	return false;
+}
 
+bool BlockGenerator::next(ImageBlock &result, int thread, int *pass) {
+	thread %= m_threadCount;
+
+	/* Wait while a checkpoint is being taken */
+	m_mutex.lock();
+	while (m_paused)
+		m_cond.wait(&m_mutex);
+	++m_inFlight;
 	m_mutex.unlock();
+
+	Block block;
+	while (!pop(thread, block)) {
+		if ((int) m_blocksQueued == 0 && !nextPass()) {
+			/* There is nothing left to do for now. Blocks that are still
+			   being rendered elsewhere might get requeued though (e.g. when
+			   a remote worker is lost), hence wait until they are done */
+			m_mutex.lock();
+			if (--m_inFlight == 0)
+				m_cond.wakeAll();
+			while (m_paused || (m_inFlight > 0 && (int) m_blocksQueued == 0))
+				m_cond.wait(&m_mutex);
+			bool done = (int) m_blocksQueued == 0;
+			if (!done)
+				++m_inFlight;
+			m_mutex.unlock();
+			if (done)
+				return false;
+			continue;
+		}
+		steal(thread);
+	}
+
+	result.setOffset(block.offset);
+	result.setSize(block.size);
+	if (pass)
+		*pass = block.pass;
 	return true;
 }
 
+void BlockGenerator::requeue(const ImageBlock &block, int pass) {
+	m_passMutex.lock();
+	if (!m_stopped) {
+		WorkQueue *queue = m_queues[0];
+		queue->mutex.lock();
+		queue->blocks.push_front(Block(block.getOffset(), block.getSize(), pass));
+		m_blocksQueued.ref();
+		queue->mutex.unlock();
+	}
+	m_passMutex.unlock();
+
+	m_mutex.lock();
+	--m_inFlight;
+	m_cond.wakeAll();
+	m_mutex.unlock();
+}
+
+void BlockGenerator::finished(const ImageBlock &block, int pass, float time) {
+	Point2i cell = block.getOffset() / m_blockSize;
+	int area = block.getSize().x() * block.getSize().y();
+
+	m_mutex.lock();
+	/* The costs were cleared when the current pass started */
+	if (pass == m_pass)
+		m_costs[cell.y() * m_numBlocks.x() + cell.x()] += time;
+	m_pixelsDone += area;
+	if (--m_inFlight == 0)
+		m_cond.wakeAll();
+	m_mutex.unlock();
+}
+
+float BlockGenerator::getProgress() const {
+	m_mutex.lock();
+	float progress = m_pixelsDone / ((float) m_cropSize.x() * m_cropSize.y() * m_passCount);
+	m_mutex.unlock();
+	return progress;
+}
+
 BlockRenderThread::BlockRenderThread(const Scene *scene, Sampler *sampler,
-		BlockGenerator *blockGenerator, ImageBlock *output)
-	 : m_scene(scene), m_blockGenerator(blockGenerator), m_output(output) {
+		BlockGenerator *blockGenerator, ImageBlock *output, int id)
+	 : m_scene(scene), m_blockGenerator(blockGenerator), m_output(output),
+	   m_id(id) {
 	/* Create a new sample generator for the current thread */
 	m_sampler = sampler->clone();
 }
@@ -182,50 +1029,53 @@ BlockRenderThread::~BlockRenderThread() {
 }
 
 void BlockRenderThread::run() {
+	if (!pinCurrentThread(m_id))
+		cerr << "Warning: unable to pin render thread " << m_id << " to a CPU" << endl;
+
 	try {
-		const Integrator *integrator = m_scene->getIntegrator();
 		const Camera *camera = m_scene->getCamera();
 
 		/* Allocate a small image block local to this thread
 		   that will be used to accumulate radiance samples */
-		ImageBlock block(Vector2i(NORI_BLOCK_SIZE),
+		ImageBlock block(Vector2i(m_blockGenerator->getBlockSize()),
 			camera->getReconstructionFilter());
+		if (m_output->hasMoments())
+			block.enableMoments();
+		if (m_output->hasCosts())
+			block.enableCosts();
+		std::vector<bool> converged;
+		QElapsedTimer timer;
+
+		/* Render frames until the block generator is shut down */
+		int frame = 0;
+		while (m_blockGenerator->waitForFrame(frame)) {
+			/* Fetch a block to be rendered from the block generator */
+			int pass;
+			while (m_blockGenerator->next(block, m_id, &pass)) {
+				timer.start();
+
+				/* Number of pixel samples in the current pass */
+				int sampleCount = m_blockGenerator->getSampleCount(pass);
+				if (sampleCount < 0)
+					sampleCount = (int) m_sampler->getSampleCount();
 
-		/* Fetch a block to be rendered from the block generator */
-		while (m_blockGenerator->next(block)) {
-			Point2i offset = block.getOffset();
-			Vector2i size  = block.getSize();
-
-			/* Clear its contents */
-			block.clear();
-
-			/* For each pixel and pixel sample sample */
-			for (int y=0; y<size.y(); ++y) {
-				for (int x=0; x<size.x(); ++x) {
-					for (uint32_t i=0; i<m_sampler->getSampleCount(); ++i) {
-						Point2f pixelSample = Point2f(x + offset.x(), y + offset.y()) + m_sampler->next2D();
-						Point2f apertureSample = m_sampler->next2D();
-						/*if (std::abs(pixelSample.x()-200) > 1
-								|| std::abs(pixelSample.y()-250) > 10
-								|| i > 0) {
-							//continue;
-						}*/
-						/* Sample a ray from the camera */
-						Ray3f ray;
-						Color3f value = camera->sampleRay(ray, pixelSample, apertureSample);
-
-						/* Compute the incident radiance */
-						value *= integrator->Li(m_scene, m_sampler, ray);
-
-						/* Store in the image block */
-						block.put(pixelSample, value);
-					}
+				/* With adaptive sampling, skip pixels that have already converged */
+				float threshold = m_blockGenerator->getAdaptiveThreshold(pass);
+				bool adaptive = threshold > 0 && block.hasMoments();
+				if (adaptive && m_output->getConverged(block, threshold, converged)
+						== block.getSize().x() * block.getSize().y()) {
+					m_blockGenerator->finished(block, pass, (float) timer.elapsed());
+					continue;
 				}
-			}
 
-			/* The image block has been processed. Now add it to the "big"
-			   block that represents the entire image */
-			m_output->put(block);
+				renderBlock(block, sampleCount, adaptive ? &converged : NULL);
+
+				/* The image block has been processed. Now add it to the "big"
+				   block that represents the entire image */
+				m_output->put(block);
+				m_blockGenerator->finished(block, pass, (float) timer.elapsed());
+			}
+			m_blockGenerator->frameFinished();
 		}
 	} catch (const NoriException &ex) {
 		cerr << "Caught a critical exception within a rendering thread: " << qPrintable(ex.getReason()) << endl;
@@ -233,4 +1083,69 @@ void BlockRenderThread::run() {
 	}
 }
 
+void BlockRenderThread::renderBlock(ImageBlock &block, int sampleCount,
+		const std::vector<bool> *converged) {
+	const Integrator *integrator = m_scene->getIntegrator();
+	const Camera *camera = m_scene->getCamera();
+	const Accelerator *accel = m_scene->getAccelerator();
+	Point2i offset = block.getOffset();
+	Vector2i size  = block.getSize();
+
+	/* Clear its contents */
+	block.clear();
+
+	/* Film and aperture positions of all samples of the current pixel */
+	m_cameraSamples.resize(2 * sampleCount);
+	m_rays.resize(sampleCount);
+	m_pixelSamples.resize(sampleCount);
+	m_weights.resize(sampleCount);
+	m_values.resize(sampleCount);
+
+	/* For each pixel and pixel sample sample */
+	for (int y=0; y<size.y(); ++y) {
+		for (int x=0; x<size.x(); ++x) {
+			if (converged && (*converged)[y * size.x() + x])
+				continue;
+
+			m_sampler->generate();
+			m_sampler->fillPixel(&m_cameraSamples[0], sampleCount);
+
+			/* Sample a ray from the camera for each pixel sample */
+			for (int i=0; i<sampleCount; ++i) {
+				m_pixelSamples[i] = Point2f(x + offset.x(), y + offset.y()) + m_cameraSamples[2*i];
+				const Point2f &apertureSample = m_cameraSamples[2*i+1];
+				m_weights[i] = camera->sampleRay(m_rays[i], m_pixelSamples[i], apertureSample);
+			}
+
+			/* Compute the incident radiance along all of them at once,
+			   which lets the integrator trace them as packets */
+			RayStatistics before, after;
+			if (block.hasCosts())
+				accel->getThreadStatistics(before);
+			integrator->LiBatch(m_scene, m_sampler, &m_rays[0], &m_values[0], sampleCount);
+			if (block.hasCosts()) {
+				accel->getThreadStatistics(after);
+				block.putCost(Point2i(x + offset.x(), y + offset.y()),
+					(float) (after.getCost() - before.getCost()), sampleCount);
+			}
+
+			float sum = 0, sumSq = 0;
+			for (int i=0; i<sampleCount; ++i) {
+				Color3f value = m_weights[i] * m_values[i];
+
+				/* Store in the image block */
+				block.put(m_pixelSamples[i], value);
+
+				float luminance = value.getLuminance();
+				sum += luminance;
+				sumSq += luminance * luminance;
+			}
+
+			if (block.hasMoments())
+				block.putMoments(Point2i(x + offset.x(), y + offset.y()),
+					sum, sumSq, sampleCount);
+		}
+	}
+}
+
 NORI_NAMESPACE_END
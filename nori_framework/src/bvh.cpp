@@ -0,0 +1,632 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2012 by Wenzel Jakob and Steve Marschner.
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/bvh.h>
+#include <QElapsedTimer>
+
+#if defined(__SSE__)
+#include <xmmintrin.h>
+#endif
+
+NORI_NAMESPACE_BEGIN
+
+/// Maps the centroid of a triangle to one of the SAH bins along an axis
+struct BinMapping {
+	int axis;
+	float min, scale;
+
+	inline BinMapping(int axis, float min, float extent)
+		: axis(axis), min(min), scale(NORI_BVH_BINS * (1 - 1e-4f) / extent) { }
+
+	inline int operator()(const Point3f &centroid) const {
+		int bin = (int) ((centroid[axis] - min) * scale);
+		return std::max(0, std::min(bin, NORI_BVH_BINS - 1));
+	}
+};
+
+/// Partition predicate: is the triangle left of the chosen bin boundary?
+struct BinPredicate {
+	BinMapping mapping;
+	int split;
+
+	inline BinPredicate(const BinMapping &mapping, int split)
+		: mapping(mapping), split(split) { }
+
+	template <typename T> inline bool operator()(const T &prim) const {
+		return mapping(prim.centroid) < split;
+	}
+};
+
+/// Orders triangles by the position of their centroid along an axis
+struct CentroidOrder {
+	int axis;
+
+	inline CentroidOrder(int axis) : axis(axis) { }
+
+	template <typename T> inline bool operator()(const T &a, const T &b) const {
+		return a.centroid[axis] < b.centroid[axis];
+	}
+};
+
+/**
+ * \brief Slab test of a ray segment against a bounding box
+ *
+ * When a direction component is zero and the origin lies on the slab
+ * boundary, one of the slab distances is NaN and the other one is
+ * infinite with a sign that depends on the sign of the zero. Such rays
+ * (flagged once per ray by \c parallel) therefore use the robust but
+ * slower \ref BoundingBox::rayIntersect().
+ */
+static inline bool intersectBox(const BoundingBox3f &bbox, const Ray3f &ray,
+		float mint, float maxt, float &nearT, bool parallel) {
+	if (EXPECT_NOT_TAKEN(parallel)) {
+		float farT;
+		if (!bbox.rayIntersect(ray, nearT, farT))
+			return false;
+		nearT = std::max(nearT, mint);
+		return nearT <= std::min(farT, maxt);
+	}
+	for (int i=0; i<3; ++i) {
+		float t0 = (bbox.min[i] - ray.o[i]) * ray.dRcp[i],
+		      t1 = (bbox.max[i] - ray.o[i]) * ray.dRcp[i];
+		if (t0 > t1)
+			std::swap(t0, t1);
+		mint = std::max(mint, t0);
+		maxt = std::min(maxt, t1);
+	}
+	nearT = mint;
+	return mint <= maxt;
+}
+
+/// Does a ray have a zero direction component? (see \ref intersectBox())
+static inline bool isParallel(const Ray3f &ray) {
+	return ray.d.x() == 0 || ray.d.y() == 0 || ray.d.z() == 0;
+}
+
+#if defined(__SSE__)
+/**
+ * \brief Clip four ray segments <tt>[tNear, tFar]</tt> against one slab
+ * of four bounding boxes, given the distances \c t0 and \c t1 to the
+ * slab planes
+ *
+ * A zero direction component and an origin on the slab boundary produce
+ * a NaN distance (see \ref intersectBox()). Such lanes get a NaN slab
+ * interval (all bits set) as a whole, since reordering the operands of
+ * \c _mm_min_ps and \c _mm_max_ps only handles one sign of the zero
+ * direction component. The outer \c _mm_max_ps and \c _mm_min_ps then
+ * return their second operand and leave the segment unchanged.
+ */
+static inline void clipSlab(__m128 t0, __m128 t1, __m128 &tNear, __m128 &tFar) {
+	__m128 nan = _mm_cmpunord_ps(t0, t1);
+	tNear = _mm_max_ps(_mm_or_ps(_mm_min_ps(t0, t1), nan), tNear);
+	tFar  = _mm_min_ps(_mm_or_ps(_mm_max_ps(t0, t1), nan), tFar);
+}
+#endif
+
+BVH::BVH(bool wide) : m_wide(wide), m_nodes4(NULL), m_node4Count(0) { }
+
+BVH::~BVH() {
+	if (m_nodes4)
+		freeAligned(m_nodes4);
+}
+
+void BVH::build() {
+	cout << "Constructing a binned SAH " << (m_wide ? "BVH4" : "BVH") << " ("
+		 << m_primitiveCount << " triangles) .." << endl;
+
+	m_nodes.clear();
+	m_indices.clear();
+	m_bbox.reset();
+	if (m_nodes4) {
+		freeAligned(m_nodes4);
+		m_nodes4 = NULL;
+		m_node4Count = 0;
+	}
+
+	if (m_primitiveCount == 0) {
+		cout << "Warning: BVH contains no geometry!" << endl;
+		return;
+	}
+
+	QElapsedTimer timer;
+	timer.start();
+
+	std::vector<BuildPrim> prims(m_primitiveCount);
+	uint32_t index = 0;
+	for (size_t i=0; i<m_meshes.size(); ++i) {
+		const Mesh *mesh = m_meshes[i];
+		for (uint32_t j=0; j<mesh->getTriangleCount(); ++j) {
+			BuildPrim &prim = prims[index];
+			prim.bbox = mesh->getBoundingBox(j);
+			prim.centroid = prim.bbox.getCenter();
+			prim.index = index++;
+			m_bbox.expandBy(prim.bbox);
+		}
+	}
+
+	m_nodes.reserve(2 * m_primitiveCount);
+	buildRecursive(prims, 0, m_primitiveCount, 0);
+
+	m_indices.resize(m_primitiveCount);
+	for (uint32_t i=0; i<m_primitiveCount; ++i)
+		m_indices[i] = prims[i].index;
+	packTriangles(&m_indices[0], m_primitiveCount);
+
+	if (m_wide) {
+		std::vector<Node4> nodes4;
+		nodes4.reserve(m_nodes.size() / 2 + 1);
+		collapse(0, nodes4);
+
+		m_node4Count = (uint32_t) nodes4.size();
+		m_nodes4 = static_cast<Node4 *>(allocAligned(sizeof(Node4) * m_node4Count));
+		memcpy(m_nodes4, &nodes4[0], sizeof(Node4) * m_node4Count);
+
+		/* The binary nodes are no longer needed */
+		std::vector<Node>().swap(m_nodes);
+	}
+
+	cout << "Finished after " << timer.elapsed() << " ms" << endl
+		<< "The final BVH requires " << getMemoryUsage() / 1024 << " KiB of memory" << endl;
+}
+
+uint32_t BVH::buildRecursive(std::vector<BuildPrim> &prims, uint32_t start,
+		uint32_t end, int depth) {
+	uint32_t nodeIndex = (uint32_t) m_nodes.size();
+	m_nodes.push_back(Node());
+
+	BoundingBox3f bbox, centroidBBox;
+	for (uint32_t i=start; i<end; ++i) {
+		bbox.expandBy(prims[i].bbox);
+		centroidBBox.expandBy(prims[i].centroid);
+	}
+	m_nodes[nodeIndex].bbox = bbox;
+
+	uint32_t count = end - start;
+	float area = bbox.getSurfaceArea();
+	float invArea = area > 0 ? 1.0f / area : 1.0f;
+
+	/* Evaluate the SAH at the bin boundaries along all three axes */
+	float bestCost = std::numeric_limits<float>::infinity();
+	int bestAxis = -1, bestSplit = -1;
+	for (int axis=0; axis<3 && count > 1; ++axis) {
+		float extent = centroidBBox.max[axis] - centroidBBox.min[axis];
+		if (extent <= 0)
+			continue;
+
+		BinMapping mapping(axis, centroidBBox.min[axis], extent);
+		BoundingBox3f binBBox[NORI_BVH_BINS];
+		uint32_t binCount[NORI_BVH_BINS];
+		memset(binCount, 0, sizeof(binCount));
+
+		for (uint32_t i=start; i<end; ++i) {
+			int bin = mapping(prims[i].centroid);
+			binBBox[bin].expandBy(prims[i].bbox);
+			binCount[bin]++;
+		}
+
+		/* Sweep from the right to find the area and size of all right halves */
+		float rightArea[NORI_BVH_BINS];
+		uint32_t rightCount[NORI_BVH_BINS];
+		BoundingBox3f accum;
+		uint32_t accumCount = 0;
+		for (int i=NORI_BVH_BINS-1; i>0; --i) {
+			accum.expandBy(binBBox[i]);
+			accumCount += binCount[i];
+			rightArea[i] = accumCount > 0 ? accum.getSurfaceArea() : 0.0f;
+			rightCount[i] = accumCount;
+		}
+
+		/* .. and from the left to evaluate the cost of each split */
+		accum.reset();
+		accumCount = 0;
+		for (int i=0; i<NORI_BVH_BINS-1; ++i) {
+			accum.expandBy(binBBox[i]);
+			accumCount += binCount[i];
+			if (accumCount == 0 || rightCount[i+1] == 0)
+				continue;
+			float cost = NORI_BVH_TRAVERSAL_COST + invArea *
+				(accum.getSurfaceArea() * accumCount + rightArea[i+1] * rightCount[i+1]);
+			if (cost < bestCost) {
+				bestCost = cost;
+				bestAxis = axis;
+				bestSplit = i+1;
+			}
+		}
+	}
+
+	bool makeLeaf = count == 1 || (count <= NORI_BVH_MAX_LEAF_SIZE
+		&& (bestAxis < 0 || (float) count <= bestCost || depth >= NORI_BVH_MAXDEPTH/2));
+
+	if (makeLeaf) {
+		m_nodes[nodeIndex].offset = start;
+		m_nodes[nodeIndex].count = count;
+		return nodeIndex;
+	}
+
+	uint32_t mid;
+	if (bestAxis >= 0 && depth < NORI_BVH_MAXDEPTH/2) {
+		BinMapping mapping(bestAxis, centroidBBox.min[bestAxis],
+			centroidBBox.max[bestAxis] - centroidBBox.min[bestAxis]);
+		mid = (uint32_t) (std::partition(prims.begin() + start, prims.begin() + end,
+			BinPredicate(mapping, bestSplit)) - prims.begin());
+	} else {
+		/* The centroids could not be separated or the hierarchy is getting
+		   too deep -- split at the object median, which halves the
+		   triangle count and thus bounds the depth of the remaining subtree */
+		mid = start + count / 2;
+		std::nth_element(prims.begin() + start, prims.begin() + mid, prims.begin() + end,
+			CentroidOrder(centroidBBox.getMajorAxis()));
+	}
+
+	/* The first child directly follows its parent */
+	buildRecursive(prims, start, mid, depth + 1);
+	uint32_t right = buildRecursive(prims, mid, end, depth + 1);
+
+	m_nodes[nodeIndex].offset = right;
+	m_nodes[nodeIndex].count = 0;
+	return nodeIndex;
+}
+
+void BVH::refit(const Mesh * /* unused */) {
+	if (m_nodes.empty() && m_node4Count == 0)
+		return;
+
+	QElapsedTimer timer;
+	timer.start();
+
+	/* Both node layouts store the children of a node after it,
+	   hence a reverse sweep visits every child before its parent */
+	for (size_t i=m_nodes.size(); i-- > 0; ) {
+		Node &node = m_nodes[i];
+		if (node.isLeaf()) {
+			node.bbox = getTriangleBounds(node.offset, node.offset + node.count);
+		} else {
+			node.bbox = m_nodes[i + 1].bbox;
+			node.bbox.expandBy(m_nodes[node.offset].bbox);
+		}
+	}
+
+	for (uint32_t i=m_node4Count; i-- > 0; ) {
+		Node4 &node = m_nodes4[i];
+		for (int j=0; j<4; ++j) {
+			if (node.isUnused(j))
+				continue;
+			BoundingBox3f bbox;
+			if (node.count[j] > 0) {
+				bbox = getTriangleBounds(node.child[j], node.child[j] + node.count[j]);
+			} else {
+				const Node4 &child = m_nodes4[node.child[j]];
+				for (int k=0; k<4; ++k) {
+					if (child.isUnused(k))
+						continue;
+					bbox.expandBy(Point3f(child.minX[k], child.minY[k], child.minZ[k]));
+					bbox.expandBy(Point3f(child.maxX[k], child.maxY[k], child.maxZ[k]));
+				}
+			}
+			node.minX[j] = bbox.min.x(); node.maxX[j] = bbox.max.x();
+			node.minY[j] = bbox.min.y(); node.maxY[j] = bbox.max.y();
+			node.minZ[j] = bbox.min.z(); node.maxZ[j] = bbox.max.z();
+		}
+	}
+
+	m_bbox = getTriangleBounds(0, (uint32_t) m_indices.size());
+	packTriangles(&m_indices[0], (uint32_t) m_indices.size());
+
+	cout << "Refitted the " << (m_wide ? "BVH4" : "BVH") << " in "
+		 << timer.elapsed() << " ms" << endl;
+}
+
+BoundingBox3f BVH::getTriangleBounds(uint32_t start, uint32_t end) const {
+	BoundingBox3f result;
+	for (uint32_t i=start; i<end; ++i) {
+		uint32_t index = m_indices[i];
+		uint32_t meshIdx = findMesh(index);
+		result.expandBy(m_meshes[meshIdx]->getBoundingBox(index));
+	}
+	return result;
+}
+
+uint32_t BVH::collapse(uint32_t nodeIndex, std::vector<Node4> &nodes4) const {
+	/* Gather up to four children by repeatedly replacing the
+	   inner child with the largest surface area by its children */
+	uint32_t children[4];
+	int childCount = 0;
+	const Node &node = m_nodes[nodeIndex];
+	if (node.isLeaf()) {
+		/* Only happens when the entire hierarchy is a single leaf */
+		children[childCount++] = nodeIndex;
+	} else {
+		children[childCount++] = nodeIndex + 1;
+		children[childCount++] = node.offset;
+	}
+
+	while (childCount < 4) {
+		int best = -1;
+		float bestArea = -1;
+		for (int i=0; i<childCount; ++i) {
+			const Node &child = m_nodes[children[i]];
+			if (!child.isLeaf() && child.bbox.getSurfaceArea() > bestArea) {
+				bestArea = child.bbox.getSurfaceArea();
+				best = i;
+			}
+		}
+		if (best < 0)
+			break;
+		uint32_t inner = children[best];
+		children[best] = inner + 1;
+		children[childCount++] = m_nodes[inner].offset;
+	}
+
+	uint32_t index = (uint32_t) nodes4.size();
+	nodes4.push_back(Node4());
+
+	/* Convert the inner children first, since this may reallocate \c nodes4 */
+	uint32_t childIndex[4], primCount[4];
+	for (int i=0; i<childCount; ++i) {
+		const Node &child = m_nodes[children[i]];
+		if (child.isLeaf()) {
+			childIndex[i] = child.offset;
+			primCount[i] = child.count;
+		} else {
+			childIndex[i] = collapse(children[i], nodes4);
+			primCount[i] = 0;
+		}
+	}
+
+	Node4 &result = nodes4[index];
+	const float inf = std::numeric_limits<float>::infinity();
+	for (int i=0; i<4; ++i) {
+		if (i < childCount) {
+			const BoundingBox3f &bbox = m_nodes[children[i]].bbox;
+			result.minX[i] = bbox.min.x(); result.maxX[i] = bbox.max.x();
+			result.minY[i] = bbox.min.y(); result.maxY[i] = bbox.max.y();
+			result.minZ[i] = bbox.min.z(); result.maxZ[i] = bbox.max.z();
+			result.child[i] = childIndex[i];
+			result.count[i] = primCount[i];
+		} else {
+			result.minX[i] = result.minY[i] = result.minZ[i] = inf;
+			result.maxX[i] = result.maxY[i] = result.maxZ[i] = -inf;
+			result.child[i] = 0;
+			result.count[i] = 0;
+		}
+	}
+	return index;
+}
+
+size_t BVH::getMemoryUsage() const {
+	return m_nodes.size() * sizeof(Node) + m_node4Count * sizeof(Node4)
+		+ m_indices.size() * sizeof(uint32_t) + getPackedMemoryUsage();
+}
+
+bool BVH::rayIntersect(const Ray3f &ray, Intersection &its, bool shadowRay) const {
+	its.t = std::numeric_limits<float>::infinity();
+	if (m_nodes.empty() && m_node4Count == 0)
+		return false;
+
+	/* Use an adaptive ray epsilon */
+	float mint = ray.mint, maxt = ray.maxt;
+	if (mint == Epsilon)
+		mint = std::max(mint, mint * ray.o.array().abs().maxCoeff());
+
+	if (shadowRay) {
+		uint32_t slot;
+		return findOccluder(ray, mint, maxt, NORI_NO_LEAF, slot);
+	}
+
+	float bboxMinT, bboxMaxT;
+	if (!m_bbox.rayIntersect(ray, bboxMinT, bboxMaxT) ||
+		bboxMinT > maxt || bboxMaxT < mint)
+		return false;
+
+	uint32_t foundPrimIndex = 0;
+	bool foundIntersection = m_wide
+		? rayIntersectWide(ray, mint, maxt, its, false, foundPrimIndex)
+		: rayIntersectBinary(ray, mint, maxt, its, false, foundPrimIndex);
+
+	if (foundIntersection)
+		fillIntersection(foundPrimIndex, its);
+
+	return foundIntersection;
+}
+
+bool BVH::findOccluder(const Ray3f &ray, float mint, float maxt,
+		uint32_t leaf, uint32_t &slot) const {
+	Q_UNUSED(leaf);
+	if (m_nodes.empty() && m_node4Count == 0)
+		return false;
+
+	float bboxMinT, bboxMaxT;
+	if (!m_bbox.rayIntersect(ray, bboxMinT, bboxMaxT) ||
+		bboxMinT > maxt || bboxMaxT < mint)
+		return false;
+
+	Intersection its; /* Unused */
+	return m_wide
+		? rayIntersectWide(ray, mint, maxt, its, true, slot)
+		: rayIntersectBinary(ray, mint, maxt, its, true, slot);
+}
+
+bool BVH::rayIntersectBinary(const Ray3f &ray, float mint, float maxt,
+		Intersection &its, bool shadowRay, uint32_t &foundPrimIndex) const {
+	/// BVH traversal stack (far children and their entry distance)
+	struct {
+		uint32_t node;
+		float t;
+	} stack[NORI_BVH_MAXDEPTH];
+
+	uint32_t stackSize = 0, nodeIndex = 0;
+	bool foundIntersection = false, parallel = isParallel(ray);
+
+	while (true) {
+		const Node &node = m_nodes[nodeIndex];
+
+		if (node.isLeaf()) {
+			if (shadowRay) {
+				if (occludedPacked(node.offset, node.offset + node.count, ray,
+						mint, maxt, foundPrimIndex))
+					return true;
+			} else if (intersectPacked(node.offset, node.offset + node.count, ray,
+					mint, maxt, its, foundPrimIndex)) {
+				foundIntersection = true;
+			}
+		} else {
+			/* Visit the nearer child first */
+			uint32_t nearChild = nodeIndex + 1, farChild = node.offset;
+			float nearT, farT;
+			bool hitNear = intersectBox(m_nodes[nearChild].bbox, ray, mint, maxt, nearT, parallel);
+			bool hitFar  = intersectBox(m_nodes[farChild].bbox, ray, mint, maxt, farT, parallel);
+
+			if (hitNear && hitFar) {
+				if (farT < nearT) {
+					std::swap(nearChild, farChild);
+					std::swap(nearT, farT);
+				}
+				stack[stackSize].node = farChild;
+				stack[stackSize].t = farT;
+				++stackSize;
+				nodeIndex = nearChild;
+				continue;
+			} else if (hitNear) {
+				nodeIndex = nearChild;
+				continue;
+			} else if (hitFar) {
+				nodeIndex = farChild;
+				continue;
+			}
+		}
+
+		/* Pop the next node that may still contain a closer intersection */
+		bool popped = false;
+		while (stackSize > 0) {
+			--stackSize;
+			if (stack[stackSize].t <= maxt) {
+				nodeIndex = stack[stackSize].node;
+				popped = true;
+				break;
+			}
+		}
+		if (!popped)
+			break;
+	}
+
+	return foundIntersection;
+}
+
+bool BVH::rayIntersectWide(const Ray3f &ray, float mint, float maxt,
+		Intersection &its, bool shadowRay, uint32_t &foundPrimIndex) const {
+	/// BVH4 traversal stack (each visited node adds at most three entries)
+	struct {
+		uint32_t node;
+		float t;
+	} stack[3 * NORI_BVH_MAXDEPTH + 1];
+
+#if defined(__SSE__)
+	const __m128
+		ox = _mm_set1_ps(ray.o.x()), oy = _mm_set1_ps(ray.o.y()), oz = _mm_set1_ps(ray.o.z()),
+		rx = _mm_set1_ps(ray.dRcp.x()), ry = _mm_set1_ps(ray.dRcp.y()), rz = _mm_set1_ps(ray.dRcp.z());
+#else
+	const bool parallel = isParallel(ray);
+#endif
+
+	uint32_t stackSize = 0, nodeIndex = 0;
+	bool foundIntersection = false;
+
+	while (true) {
+		const Node4 &node = m_nodes4[nodeIndex];
+
+		/* Intersect the ray with all four child bounding boxes */
+		float nearT[4];
+		int mask = 0;
+#if defined(__SSE__)
+		__m128 tNear = _mm_set1_ps(mint), tFar = _mm_set1_ps(maxt);
+
+		clipSlab(_mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.minX), ox), rx),
+			_mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.maxX), ox), rx), tNear, tFar);
+		clipSlab(_mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.minY), oy), ry),
+			_mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.maxY), oy), ry), tNear, tFar);
+		clipSlab(_mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.minZ), oz), rz),
+			_mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.maxZ), oz), rz), tNear, tFar);
+
+		mask = _mm_movemask_ps(_mm_cmple_ps(tNear, tFar));
+		_mm_storeu_ps(nearT, tNear);
+#else
+		for (int i=0; i<4; ++i) {
+			BoundingBox3f bbox(
+				Point3f(node.minX[i], node.minY[i], node.minZ[i]),
+				Point3f(node.maxX[i], node.maxY[i], node.maxZ[i]));
+			if (intersectBox(bbox, ray, mint, maxt, nearT[i], parallel))
+				mask |= 1 << i;
+		}
+#endif
+
+		/* Intersect leaf children right away and collect the inner ones */
+		uint32_t innerNode[4];
+		float innerT[4];
+		int innerCount = 0;
+		for (int i=0; i<4; ++i) {
+			if (!(mask & (1 << i)) || node.isUnused(i))
+				continue;
+			if (node.count[i] > 0) {
+				if (nearT[i] > maxt)
+					continue;
+				if (shadowRay) {
+					if (occludedPacked(node.child[i], node.child[i] + node.count[i],
+							ray, mint, maxt, foundPrimIndex))
+						return true;
+				} else if (intersectPacked(node.child[i], node.child[i] + node.count[i],
+						ray, mint, maxt, its, foundPrimIndex)) {
+					foundIntersection = true;
+				}
+			} else {
+				/* Insertion sort by decreasing distance */
+				int j = innerCount++;
+				while (j > 0 && innerT[j-1] < nearT[i]) {
+					innerNode[j] = innerNode[j-1];
+					innerT[j] = innerT[j-1];
+					--j;
+				}
+				innerNode[j] = node.child[i];
+				innerT[j] = nearT[i];
+			}
+		}
+
+		/* Push the inner children so that the nearest one is on top */
+		for (int i=0; i<innerCount; ++i) {
+			stack[stackSize].node = innerNode[i];
+			stack[stackSize].t = innerT[i];
+			++stackSize;
+		}
+
+		/* Pop the next node that may still contain a closer intersection */
+		bool popped = false;
+		while (stackSize > 0) {
+			--stackSize;
+			if (stack[stackSize].t <= maxt) {
+				nodeIndex = stack[stackSize].node;
+				popped = true;
+				break;
+			}
+		}
+		if (!popped)
+			break;
+	}
+
+	return foundIntersection;
+}
+
+NORI_NAMESPACE_END
@@ -2,9 +2,17 @@
 #include <Eigen/Geometry>
 #include <Eigen/LU>
 #include <boost/math/special_functions/fpclassify.hpp>
+#include <QRegExp>
+#include <QStringList>
 
 #if defined(PLATFORM_LINUX)
 #include <malloc.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <pthread.h>
+#include <fstream>
+#include <sstream>
 #endif
 
 #if defined(PLATFORM_WINDOWS)
@@ -88,6 +96,26 @@ QString Transform::toLineString() const {
 	return QString(oss.str().c_str());
 }
 
+Transform Transform::fromLineString(const QString &str) {
+	QStringList rows = str.trimmed().split(QRegExp("\\s*;\\s*"));
+	if (rows.size() != 4)
+		throw NoriException(QString("Cannot parse transform \"%1\"!").arg(str));
+
+	Eigen::Matrix4f matrix;
+	for (int i=0; i<4; ++i) {
+		QStringList values = rows[i].trimmed().split(QRegExp("[\\s,]+"));
+		if (values.size() != 4)
+			throw NoriException(QString("Cannot parse transform row \"%1\"!").arg(rows[i]));
+		for (int j=0; j<4; ++j) {
+			bool ok;
+			matrix(i, j) = values[j].toFloat(&ok);
+			if (!ok)
+				throw NoriException(QString("Cannot parse transform value \"%1\"!").arg(values[j]));
+		}
+	}
+	return Transform(matrix);
+}
+
 Vector3f squareToUniformSphere(const Point2f &sample) {
 	float z = 1.0f - 2.0f * sample.y();
 	float r = std::sqrt(std::max((float) 0.0f, 1.0f - z*z));
@@ -226,6 +254,90 @@ void freeAligned(void *ptr) {
 #endif
 }
 
+#if defined(PLATFORM_LINUX)
+/// Parse a Linux CPU list such as "0-3,8-11"
+static std::vector<int> parseCPUList(const std::string &str) {
+	std::vector<int> result;
+	std::istringstream is(str);
+	std::string range;
+	while (std::getline(is, range, ',')) {
+		int first, last;
+		char dash;
+		std::istringstream rs(range);
+		if (!(rs >> first))
+			continue;
+		if (!(rs >> dash >> last))
+			last = first;
+		for (int i=first; i<=last; ++i)
+			result.push_back(i);
+	}
+	return result;
+}
+
+/// Read the first line of a (pseudo-) file, returns false on failure
+static bool readLine(const char *filename, std::string &line) {
+	std::ifstream is(filename);
+	return is.good() && std::getline(is, line);
+}
+
+/// Return the CPUs that this process is allowed to run on
+static std::vector<int> getAllowedCPUs() {
+	std::vector<int> result;
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	if (sched_getaffinity(0, sizeof(cpu_set_t), &set) == 0) {
+		for (int i=0; i<CPU_SETSIZE; ++i)
+			if (CPU_ISSET(i, &set))
+				result.push_back(i);
+	}
+	if (result.empty()) {
+		int count = (int) sysconf(_SC_NPROCESSORS_ONLN);
+		for (int i=0; i<count; ++i)
+			result.push_back(i);
+	}
+	return result;
+}
+
+/// Return the CPUs of each NUMA node
+static std::vector<std::vector<int> > getNumaNodes() {
+	std::vector<std::vector<int> > nodes;
+	for (int i=0; ; ++i) {
+		std::string line;
+		QString path = QString("/sys/devices/system/node/node%1/cpulist").arg(i);
+		if (!readLine(qPrintable(path), line))
+			break;
+		nodes.push_back(parseCPUList(line));
+	}
+	return nodes;
+}
+
+/**
+ * Return the CPU bandwidth quota of the control group of this process
+ * (in CPUs, rounded up), or 0 if there is no limit
+ */
+static int getCgroupCPULimit() {
+	std::string line;
+	long quota = -1, period = 0;
+
+	if (readLine("/sys/fs/cgroup/cpu.max", line)) {
+		/* cgroup v2: "<quota> <period>" or "max <period>" */
+		std::istringstream is(line);
+		std::string quotaStr;
+		if (is >> quotaStr >> period && quotaStr != "max")
+			quota = atol(quotaStr.c_str());
+	} else if (readLine("/sys/fs/cgroup/cpu/cpu.cfs_quota_us", line)) {
+		/* cgroup v1 */
+		quota = atol(line.c_str());
+		if (readLine("/sys/fs/cgroup/cpu/cpu.cfs_period_us", line))
+			period = atol(line.c_str());
+	}
+
+	if (quota <= 0 || period <= 0)
+		return 0;
+	return (int) ((quota + period - 1) / period);
+}
+#endif
+
 int getCoreCount() {
 #if defined(PLATFORM_WINDOWS)
 	SYSTEM_INFO sys_info;
@@ -238,7 +350,105 @@ int getCoreCount() {
 		throw NoriException("Could not detect the number of processors!");
 	return (int) nprocs;
 #else
-	return sysconf(_SC_NPROCESSORS_CONF);
+	int count = (int) getAllowedCPUs().size();
+	int limit = getCgroupCPULimit();
+	if (limit > 0)
+		count = std::min(count, limit);
+	return std::max(count, 1);
+#endif
+}
+
+static int threadCountOverride = 0;
+static EThreadPinning threadPinning = ENoPinning;
+
+int getThreadCount() {
+	return threadCountOverride > 0 ? threadCountOverride : getCoreCount();
+}
+
+void setThreadCount(int count) {
+	threadCountOverride = std::max(count, 0);
+}
+
+void setThreadPinning(EThreadPinning pinning) {
+	threadPinning = pinning;
+}
+
+EThreadPinning getThreadPinning() {
+	return threadPinning;
+}
+
+int getNumaNodeCount() {
+#if defined(PLATFORM_LINUX)
+	return std::max((int) getNumaNodes().size(), 1);
+#else
+	return 1;
+#endif
+}
+
+bool pinCurrentThread(int index) {
+	if (threadPinning == ENoPinning)
+		return true;
+#if defined(PLATFORM_LINUX)
+	std::vector<int> allowed = getAllowedCPUs();
+	std::vector<int> order;
+
+	if (threadPinning == EScatterPinning) {
+		/* Take one CPU from each NUMA node in turn */
+		std::vector<std::vector<int> > nodes = getNumaNodes();
+		for (size_t i=0; i<nodes.size(); ++i) {
+			std::vector<int> &cpus = nodes[i];
+			for (size_t j=0; j<cpus.size(); ) {
+				if (std::find(allowed.begin(), allowed.end(), cpus[j]) == allowed.end())
+					cpus.erase(cpus.begin() + j);
+				else
+					++j;
+			}
+		}
+		for (size_t j=0; order.size() < allowed.size(); ++j) {
+			bool found = false;
+			for (size_t i=0; i<nodes.size(); ++i) {
+				if (j < nodes[i].size()) {
+					order.push_back(nodes[i][j]);
+					found = true;
+				}
+			}
+			if (!found)
+				break;
+		}
+	}
+	if (order.size() != allowed.size())
+		order = allowed;
+
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(order[index % order.size()], &set);
+	return pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &set) == 0;
+#else
+	(void) index;
+	return false;
+#endif
+}
+
+bool setMemoryPlacement(EMemoryPlacement placement) {
+#if defined(PLATFORM_LINUX) && defined(SYS_set_mempolicy)
+	/* Constants from <numaif.h> (avoids a dependency on libnuma) */
+	const int MPOL_DEFAULT = 0, MPOL_INTERLEAVE = 3;
+
+	if (placement == EFirstTouch)
+		return syscall(SYS_set_mempolicy, MPOL_DEFAULT, NULL, 0) == 0;
+
+	int nodeCount = getNumaNodeCount();
+	if (nodeCount < 2)
+		return true;
+
+	const size_t bitsPerWord = sizeof(unsigned long) * 8;
+	std::vector<unsigned long> mask(nodeCount / bitsPerWord + 1, 0);
+	for (int i=0; i<nodeCount; ++i)
+		mask[i / bitsPerWord] |= 1UL << (i % bitsPerWord);
+	return syscall(SYS_set_mempolicy, MPOL_INTERLEAVE, &mask[0],
+		mask.size() * bitsPerWord) == 0;
+#else
+	return placement == EFirstTouch;
 #endif
 }
 
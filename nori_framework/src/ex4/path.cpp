@@ -48,6 +48,9 @@ public:
          * \param scene
          * the scene to work with
          *
+         * \param its
+         * the intersection at the reference point (where the shadow ray starts)
+         *
          * \param lRec
          * the luminaire information storage
          *
@@ -56,7 +59,7 @@ public:
          *
          * \return the sampled light radiance including its geometric, visibility and pdf weights
          */
-        inline Color3f sampleLights(const Scene *scene, LuminaireQueryRecord &lRec, const Point2f &_sample) const {
+        inline Color3f sampleLights(const Scene *scene, const Intersection &its, LuminaireQueryRecord &lRec, const Point2f &_sample) const {
                 Point2f sample(_sample);
                 const std::vector<Luminaire *> &luminaires = scene->getLuminaires();
 
@@ -86,7 +89,7 @@ public:
 
                 if (dp > 0) {
                         // 5. Check the visibility
-                        if (scene->rayIntersect(Ray3f(lRec.ref, lRec.d, Epsilon, lRec.dist * (1 - 1e-4f))))
+                        if (scene->rayIntersect(its, Ray3f(lRec.ref, lRec.d, Epsilon, lRec.dist * (1 - 1e-4f))))
                                 return Color3f(0.0f);
                         // 6. Geometry term on luminaire's side
                         // Visiblity + Geometric term on the luminaire's side
@@ -117,7 +120,8 @@ public:
 
                 while (true) {
                         // 1. Intersect our ray with something
-                        scene->rayIntersect(ray, its);
+                        //    (bounces can start the traversal at the leaf of the previous hit)
+                        scene->rayIntersect(its, ray, its);
 
                         // 1.b. if we hit nothing, hit the environment
                         //      luminaire if there is one, and stop the path
@@ -150,9 +154,13 @@ public:
                                 //       but in practice, our scene won't use further paths
                         }
 
+                        // Fetch the light and BSDF samples of this bounce at once
+                        Point2f bounceSamples[2];
+                        sampler->fill2D(bounceSamples, 2);
+
                         // 3. Direct illumination sampling
                         LuminaireQueryRecord lRec(its.p);
-                        Color3f direct = sampleLights(scene, lRec, sampler->next2D());
+                        Color3f direct = sampleLights(scene, its, lRec, bounceSamples[0]);
                         if ((direct.array() != 0).any()) {
                                 BSDFQueryRecord bRec(its.toLocal(-ray.d),
                                         its.toLocal(lRec.d), ESolidAngle);
@@ -167,7 +175,7 @@ public:
                         //   future contributions
                         // = stop here if the throughput is null
                         BSDFQueryRecord bRec(its.toLocal(-ray.d));
-                        Color3f bsdfWeight = bsdf->sample(bRec, sampler->next2D());
+                        Color3f bsdfWeight = bsdf->sample(bRec, bounceSamples[1]);
                         if ((bsdfWeight.array() == 0).all())
                                 break;
                         eta *= bRec.eta;
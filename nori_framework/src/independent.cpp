@@ -62,6 +62,27 @@ public:
 		);
 	}
 
+	void fill1D(float *dest, size_t count) {
+		m_random->nextFloats(dest, count);
+	}
+
+	void fill2D(Point2f *dest, size_t count) {
+		/* Fixed-size 2D points are stored as two consecutive floats */
+		m_random->nextFloats(dest[0].data(), 2 * count);
+	}
+
+	void seed(uint32_t value) {
+		m_random->seed(value);
+	}
+
+	void serialize(QDataStream &stream) const {
+		m_random->serialize(stream);
+	}
+
+	void unserialize(QDataStream &stream) {
+		m_random->unserialize(stream);
+	}
+
 	QString toString() const {
 		return QString("Independent[sampleCount=%1]").arg(m_sampleCount);
 	}
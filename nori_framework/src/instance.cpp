@@ -0,0 +1,65 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2012 by Wenzel Jakob and Steve Marschner.
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/instance.h>
+#include <nori/bsdf.h>
+#include <Eigen/LU>
+#include <QFileInfo>
+
+NORI_NAMESPACE_BEGIN
+
+Instance::Instance(const PropertyList &propList) : Mesh(propList), m_shape(NULL) {
+	m_filename = propList.getString("filename");
+	m_name = QFileInfo(m_filename).fileName();
+	setToWorld(propList.getTransform("toWorld", Transform()));
+}
+
+void Instance::setToWorld(const Transform &toWorld) {
+	m_toWorld = toWorld;
+	m_worldToObject = toWorld.inverse();
+	m_flipsOrientation = toWorld.getMatrix().topLeftCorner<3, 3>().determinant() < 0;
+}
+
+void Instance::activate() {
+	if (!m_bsdf) {
+		/* If no material was assigned, instantiate a diffuse BRDF */
+		m_bsdf = static_cast<BSDF *>(
+			NoriObjectFactory::createInstance("diffuse", PropertyList()));
+	}
+}
+
+void Instance::addChild(NoriObject *obj) {
+	if (obj->getClassType() == ELuminaire)
+		throw NoriException("Instance: area luminaires must be attached to regular meshes!");
+	Mesh::addChild(obj);
+}
+
+QString Instance::toString() const {
+	return QString(
+		"Instance[\n"
+		"  filename = \"%1\",\n"
+		"  toWorld = %2,\n"
+		"  bsdf = %3\n"
+		"]")
+	.arg(m_filename)
+	.arg(indent(m_toWorld.toString()))
+	.arg(indent(m_bsdf->toString()));
+}
+
+NORI_REGISTER_CLASS(Instance, "instance");
+NORI_NAMESPACE_END
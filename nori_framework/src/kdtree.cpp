@@ -17,30 +17,467 @@
 */
 
 #include <nori/kdtree.h>
+#include <nori/random.h>
+#include <nori/transform.h>
 #include <Eigen/Geometry>
+#include <QCryptographicHash>
+#include <QElapsedTimer>
+#include <QFileInfo>
+#include <QFile>
+#include <QDir>
+
+#if defined(__SSE__)
+#include <xmmintrin.h>
+#endif
 
 NORI_NAMESPACE_BEGIN
 
-KDTree::KDTree() : m_primitiveCount(0) {
-	m_sizeMap.push_back(0);
-}
+/// Header of a kd-tree cache file, followed by the node and index arrays
+struct KDTreeCacheHeader {
+	char magic[4];
+	uint32_t version;
+	/* Hash of the geometry and construction parameters */
+	char key[20];
+	uint32_t nodeCount, indexCount;
+	float bbox[6], tightBBox[6];
+};
+
+/* Reserve some space, and keep the node array 16-byte aligned */
+#define NORI_KD_CACHE_HEADER_SIZE 128
+BOOST_STATIC_ASSERT(sizeof(KDTreeCacheHeader) <= NORI_KD_CACHE_HEADER_SIZE);
+
+KDTree::KDTree() : m_cacheFile(NULL), m_useRopes(false) { }
 
 KDTree::~KDTree() {
-	for (size_t i=0; i<m_meshes.size(); ++i)
-		delete m_meshes[i];
+	release();
+}
+
+void KDTree::release() {
+	if (m_cacheFile) {
+		/* The nodes and indices belong to the mapping */
+		m_nodes = NULL;
+		m_indices = NULL;
+		m_cacheFile->close();
+		delete m_cacheFile;
+		m_cacheFile = NULL;
+	}
+	Parent::clear();
+	m_ropeIndex.clear();
+	m_ropes.clear();
 }
 
 void KDTree::build() {
+	/* Building again (e.g. after the meshes have moved) starts from scratch */
+	release();
+
 	SizeType primCount = getPrimitiveCount();
-	cout << "Constructing a SAH kd-tree (" << primCount << " triangles, "
-		 << getCoreCount() << " threads) .." << endl;
-	Parent::buildInternal();
+	QByteArray key;
+	QString filename;
+	if (primCount > 0 && !m_cacheDirectory.isEmpty()) {
+		key = getCacheKey();
+		filename = QDir(m_cacheDirectory).filePath(
+			QString("kdtree-%1.cache").arg(QString(key.toHex())));
+	}
+
+	if (filename.isEmpty() || !loadCache(filename, key)) {
+		cout << "Constructing a SAH kd-tree (" << primCount << " triangles, "
+			 << getThreadCount() << " threads) .." << endl;
+		Parent::buildInternal();
+		if (!filename.isEmpty())
+			saveCache(filename, key);
+	}
+
+	packTriangles(m_indices, (uint32_t) m_indexCount);
+
+	/* The ropes are cheap to compute, hence they are not cached */
+	if (m_useRopes && primCount > 0) {
+		QElapsedTimer timer;
+		timer.start();
+		uint32_t ropes[6];
+		for (int i=0; i<6; ++i)
+			ropes[i] = NORI_NO_ROPE;
+		m_ropeIndex.resize(m_nodeCount, NORI_NO_ROPE);
+		buildRopes(0, m_bbox, ropes);
+		cout << "Linked " << m_ropes.size() << " kd-tree leaves by ropes in "
+			 << timer.elapsed() << " ms" << endl;
+	}
+}
+
+void KDTree::refit(const Mesh * /* unused */) {
+	const QString cacheDirectory = m_cacheDirectory;
+	m_cacheDirectory = QString();
+	build();
+	m_cacheDirectory = cacheDirectory;
+}
+
+void KDTree::autotune(const std::vector<Ray3f> &cameraRays) {
+	/* The candidate trees are neither cached nor linked by ropes */
+	const QString cacheDirectory = m_cacheDirectory;
+	const bool useRopes = m_useRopes;
+	const SizeType maxDepth = getMaxDepth();
+	m_cacheDirectory = QString();
+	m_useRopes = false;
+
+	cout << "Autotuning the kd-tree construction parameters .." << endl;
+	build();
+
+	/* Complete the pilot set by a diffuse bounce at every hit point */
+	std::vector<Ray3f> rays(cameraRays);
+	Random random;
+	for (size_t i=0; i<cameraRays.size(); ++i) {
+		Intersection its;
+		if (!rayIntersect(cameraRays[i], its))
+			continue;
+		Point2f sample(random.nextFloat(), random.nextFloat());
+		rays.push_back(Ray3f(its.p, its.shFrame.toWorld(squareToCosineHemisphere(sample))));
+	}
+
+	float bestTraversalCost = getTraversalCost(), bestEmptySpaceBonus = getEmptySpaceBonus();
+	SizeType bestStopPrims = getStopPrims();
+	float bestTime = tracePilot(rays);
+	cout << "  " << rays.size() << " pilot rays. Traversal cost "
+		 << bestTraversalCost << ", empty space bonus " << bestEmptySpaceBonus
+		 << ", stop primitives " << bestStopPrims << ": " << bestTime << " ns/ray" << endl;
+
+	/* Vary one parameter at a time, starting from the best values so far */
+	for (int param=0; param<3; ++param) {
+		const float baseTraversalCost = bestTraversalCost, baseEmptySpaceBonus = bestEmptySpaceBonus;
+		const SizeType baseStopPrims = bestStopPrims;
+
+		for (int variant=0; variant<2; ++variant) {
+			float traversalCost = bestTraversalCost, emptySpaceBonus = bestEmptySpaceBonus;
+			SizeType stopPrims = bestStopPrims;
+			if (param == 0) {
+				traversalCost = baseTraversalCost * (variant == 0 ? 0.5f : 2.0f);
+			} else if (param == 1) {
+				emptySpaceBonus = variant == 0 ? 0.8f : 1.0f;
+				if (emptySpaceBonus == baseEmptySpaceBonus)
+					continue;
+			} else {
+				stopPrims = variant == 0 ? std::max((SizeType) 1, baseStopPrims / 2) : baseStopPrims * 2;
+				if (stopPrims == baseStopPrims)
+					continue;
+			}
+
+			setTraversalCost(traversalCost);
+			setEmptySpaceBonus(emptySpaceBonus);
+			setStopPrims(stopPrims);
+			setMaxDepth(maxDepth);
+			build();
+
+			float time = tracePilot(rays);
+			cout << "  Traversal cost " << traversalCost << ", empty space bonus "
+				 << emptySpaceBonus << ", stop primitives " << stopPrims << ": "
+				 << time << " ns/ray" << endl;
+
+			/* Ignore differences that are within the timing noise */
+			if (time < bestTime * NORI_KD_AUTOTUNE_GAIN) {
+				bestTime = time;
+				bestTraversalCost = traversalCost;
+				bestEmptySpaceBonus = emptySpaceBonus;
+				bestStopPrims = stopPrims;
+			}
+		}
+	}
+
+	cout << "Autotuning chose the following kd-tree parameters (set them on the "
+		 "scene instead of kdAutotune to pin them):" << endl
+		 << "  <float name=\"kdTraversalCost\" value=\"" << bestTraversalCost << "\"/>" << endl
+		 << "  <float name=\"kdEmptySpaceBonus\" value=\"" << bestEmptySpaceBonus << "\"/>" << endl
+		 << "  <integer name=\"kdStopPrims\" value=\"" << bestStopPrims << "\"/>" << endl;
+
+	setTraversalCost(bestTraversalCost);
+	setEmptySpaceBonus(bestEmptySpaceBonus);
+	setStopPrims(bestStopPrims);
+	setMaxDepth(maxDepth);
+	m_cacheDirectory = cacheDirectory;
+	m_useRopes = useRopes;
+	build();
+}
+
+float KDTree::tracePilot(const std::vector<Ray3f> &rays) const {
+	qint64 bestTime = std::numeric_limits<qint64>::max();
+	for (int pass=0; pass<NORI_KD_AUTOTUNE_PASSES; ++pass) {
+		QElapsedTimer timer;
+		timer.start();
+		Intersection its;
+		for (size_t i=0; i<rays.size(); ++i)
+			rayIntersect(rays[i], its);
+		bestTime = std::min(bestTime, timer.nsecsElapsed());
+	}
+	return bestTime / (float) std::max(rays.size(), (size_t) 1);
+}
+
+/// Small triangles scattered over the unit cube (see \ref KDTree::selfTest())
+class RandomTriangleMesh : public Mesh {
+public:
+	RandomTriangleMesh(uint32_t triangleCount, Random &random) : Mesh(PropertyList()) {
+		m_name = "random triangles";
+		m_triangleCount = triangleCount;
+		m_vertexCount = 3 * triangleCount;
+		m_vertexPositions = new Point3f[m_vertexCount];
+		m_indices = new uint32_t[m_vertexCount];
+		for (uint32_t i=0; i<triangleCount; ++i) {
+			Point3f center(random.nextFloat(), random.nextFloat(), random.nextFloat());
+			for (uint32_t j=3*i; j<3*i+3; ++j) {
+				m_vertexPositions[j] = center + 0.02f * Vector3f(random.nextFloat() - 0.5f,
+					random.nextFloat() - 0.5f, random.nextFloat() - 0.5f);
+				m_indices[j] = j;
+			}
+		}
+	}
+};
+
+/**
+ * \brief Build a tree over the given mesh from scratch, using the construction
+ * parameters of \c tree, and count the rays whose hits differ from those
+ * of \c tree (see \ref KDTree::selfTest())
+ */
+static size_t compareToFreshTree(const KDTree &tree, Mesh *mesh,
+		const std::vector<Ray3f> &rays, size_t &hitCount) {
+	KDTree fresh;
+	fresh.setCacheDirectory(QString());
+	fresh.setTraversalCost(tree.getTraversalCost());
+	fresh.setEmptySpaceBonus(tree.getEmptySpaceBonus());
+	fresh.setStopPrims(tree.getStopPrims());
+	fresh.setMaxDepth(tree.getMaxDepth());
+	fresh.addMesh(mesh);
+	fresh.build();
+
+	size_t mismatches = 0;
+	hitCount = 0;
+	for (size_t i=0; i<rays.size(); ++i) {
+		Intersection its, freshIts;
+		bool hit = tree.rayIntersect(rays[i], its),
+			 freshHit = fresh.rayIntersect(rays[i], freshIts);
+		if (freshHit)
+			++hitCount;
+		if (hit != freshHit || (hit && its.t != freshIts.t))
+			++mismatches;
+	}
+	return mismatches;
+}
+
+bool KDTree::selfTest() {
+	const uint32_t triangleCount = 100000;
+	const size_t rayCount = 20000;
+	const int threadCount = getThreadCount();
+
+	/* The subtrees are only handed to builder threads when there are several */
+	setThreadCount(std::max(threadCount, 4));
+
+	Random random;
+	RandomTriangleMesh mesh(triangleCount, random);
+	std::vector<Ray3f> rays;
+	rays.reserve(rayCount);
+	for (size_t i=0; i<rayCount; ++i) {
+		Point3f o(random.nextFloat() * 2 - 0.5f, random.nextFloat() * 2 - 0.5f,
+			random.nextFloat() * 2 - 0.5f);
+		Point3f target(random.nextFloat(), random.nextFloat(), random.nextFloat());
+		rays.push_back(Ray3f(o, (target - o).normalized()));
+	}
+
+	KDTree tree;
+	tree.setCacheDirectory(QString());
+	tree.addMesh(&mesh);
+	tree.build();
+	size_t hitCount, mismatches = compareToFreshTree(tree, &mesh, rays, hitCount);
+
+	/* Move the triangles and build the tree again, as in an animation */
+	Eigen::Affine3f motion(Eigen::Translation3f(0.0f, 0.25f, 0.0f)
+		* Eigen::AngleAxisf(0.3f, Vector3f(0.0f, 0.0f, 1.0f))
+		* Eigen::Scaling(1.0f, 0.5f, 1.0f));
+	mesh.applyTransform(Transform(motion.matrix()));
+	tree.refit(&mesh);
+	size_t movedHitCount;
+	mismatches += compareToFreshTree(tree, &mesh, rays, movedHitCount);
+
+	/* Autotuning builds the tree up to seven more times. The final tree
+	   must match one that is built once using the chosen parameters */
+	std::vector<Ray3f> cameraRays(rays.begin(), rays.begin() + rayCount / 4);
+	tree.autotune(cameraRays);
+	size_t tunedHitCount;
+	mismatches += compareToFreshTree(tree, &mesh, rays, tunedHitCount);
+
+	bool passed = mismatches == 0 && hitCount > 0 && movedHitCount > 0;
+	cout << "kd-tree rebuild test: " << triangleCount << " triangles built, moved, built "
+		<< "again and autotuned by " << getThreadCount() << " threads, " << rayCount
+		<< " rays (" << hitCount << " and " << movedHitCount << " hits), "
+		<< mismatches << " mismatching hits -- " << (passed ? "passed" : "FAILED") << endl;
+	setThreadCount(threadCount);
+	return passed;
+}
+
+void KDTree::buildRopes(uint32_t nodeIndex, const BoundingBox3f &bbox, const uint32_t *ropes) {
+	const KDNode *node = m_nodes + nodeIndex;
+
+	if (node->isLeaf()) {
+		Rope rope;
+		rope.bbox = bbox;
+		for (int face=0; face<6; ++face)
+			rope.neighbor[face] = optimizeRope(ropes[face], face, bbox);
+		m_ropeIndex[nodeIndex] = (uint32_t) m_ropes.size();
+		m_ropes.push_back(rope);
+		return;
+	}
+
+	const int axis = node->getAxis();
+	const float splitVal = (float) node->getSplit();
+	const uint32_t left = (uint32_t) (node->getLeft() - m_nodes), right = left + 1;
+	uint32_t childRopes[6];
+
+	/* The children are each other's neighbors across the split plane */
+	BoundingBox3f childBBox(bbox);
+	childBBox.max[axis] = splitVal;
+	for (int face=0; face<6; ++face)
+		childRopes[face] = ropes[face];
+	childRopes[2*axis+1] = right;
+	buildRopes(left, childBBox, childRopes);
+
+	childBBox = bbox;
+	childBBox.min[axis] = splitVal;
+	childRopes[2*axis+1] = ropes[2*axis+1];
+	childRopes[2*axis] = left;
+	buildRopes(right, childBBox, childRopes);
+}
+
+uint32_t KDTree::optimizeRope(uint32_t nodeIndex, int face, const BoundingBox3f &bbox) const {
+	const int faceAxis = face / 2;
+	const bool upper = (face & 1) != 0;
+
+	while (nodeIndex != NORI_NO_ROPE && !m_nodes[nodeIndex].isLeaf()) {
+		const KDNode *node = m_nodes + nodeIndex;
+		const int axis = node->getAxis();
+		const float splitVal = (float) node->getSplit();
+		const uint32_t left = (uint32_t) (node->getLeft() - m_nodes);
+
+		if (axis == faceAxis) {
+			/* Only the child facing the leaf is adjacent to it */
+			nodeIndex = upper ? left : left + 1;
+		} else if (splitVal >= bbox.max[axis]) {
+			nodeIndex = left;
+		} else if (splitVal <= bbox.min[axis]) {
+			nodeIndex = left + 1;
+		} else {
+			/* The face straddles the split plane */
+			break;
+		}
+	}
+	return nodeIndex;
+}
+
+QByteArray KDTree::getCacheKey() const {
+	QCryptographicHash hash(QCryptographicHash::Sha1);
+	uint32_t version = NORI_KD_CACHE_VERSION;
+	hash.addData((const char *) &version, sizeof(uint32_t));
+
+	/* Everything that influences the construction */
+	float costs[3] = { getTraversalCost(), getQueryCost(), getEmptySpaceBonus() };
+	uint32_t params[7] = { (uint32_t) getMaxDepth(), (uint32_t) getMinMaxBins(),
+		(uint32_t) getClip(), (uint32_t) getRetract(), (uint32_t) getMaxBadRefines(),
+		(uint32_t) getStopPrims(), (uint32_t) getExactPrimitiveThreshold() };
+	hash.addData((const char *) costs, sizeof(costs));
+	hash.addData((const char *) params, sizeof(params));
+	hashGeometry(hash);
+
+	return hash.result();
+}
+
+bool KDTree::loadCache(const QString &filename, const QByteArray &key) {
+	QFile *file = new QFile(filename);
+	if (!file->open(QIODevice::ReadOnly)) {
+		delete file;
+		return false;
+	}
+
+	QElapsedTimer timer;
+	timer.start();
+
+	qint64 size = file->size();
+	uchar *data = size >= NORI_KD_CACHE_HEADER_SIZE ? file->map(0, size) : NULL;
+	const KDTreeCacheHeader *header = (const KDTreeCacheHeader *) data;
+
+	if (!data || memcmp(header->magic, "NKDT", 4) != 0
+		|| header->version != NORI_KD_CACHE_VERSION
+		|| key.size() != 20 || memcmp(header->key, key.constData(), 20) != 0
+		|| size != (qint64) (NORI_KD_CACHE_HEADER_SIZE + (header->nodeCount + 1)
+			* sizeof(KDNode) + header->indexCount * sizeof(IndexType))) {
+		cerr << "Warning: ignoring the invalid kd-tree cache file \""
+			<< qPrintable(filename) << "\"" << endl;
+		file->close();
+		delete file;
+		return false;
+	}
+
+	/* Skip the padding node (+1 shift, see KDNode::getSibling) */
+	m_nodes = (KDNode *) (data + NORI_KD_CACHE_HEADER_SIZE) + 1;
+	m_indices = (IndexType *) (m_nodes + header->nodeCount);
+	m_nodeCount = header->nodeCount;
+	m_indexCount = header->indexCount;
+	for (int i=0; i<3; ++i) {
+		m_bbox.min[i] = header->bbox[i];
+		m_bbox.max[i] = header->bbox[i+3];
+		m_tightBBox.min[i] = header->tightBBox[i];
+		m_tightBBox.max[i] = header->tightBBox[i+3];
+	}
+	m_cacheFile = file;
+
+	cout << "Loaded a SAH kd-tree (" << getPrimitiveCount() << " triangles) from the cache after "
+		<< timer.elapsed() << " ms" << endl;
+	return true;
+}
+
+void KDTree::saveCache(const QString &filename, const QByteArray &key) const {
+	KDTreeCacheHeader header;
+	char buffer[NORI_KD_CACHE_HEADER_SIZE];
+	KDNode padding;
+
+	memset(&header, 0, sizeof(KDTreeCacheHeader));
+	memcpy(header.magic, "NKDT", 4);
+	header.version = NORI_KD_CACHE_VERSION;
+	memcpy(header.key, key.constData(), std::min(key.size(), 20));
+	header.nodeCount = (uint32_t) m_nodeCount;
+	header.indexCount = (uint32_t) m_indexCount;
+	for (int i=0; i<3; ++i) {
+		header.bbox[i] = m_bbox.min[i];
+		header.bbox[i+3] = m_bbox.max[i];
+		header.tightBBox[i] = m_tightBBox.min[i];
+		header.tightBBox[i+3] = m_tightBBox.max[i];
+	}
+	memset(buffer, 0, NORI_KD_CACHE_HEADER_SIZE);
+	memcpy(buffer, &header, sizeof(KDTreeCacheHeader));
+	memset(&padding, 0, sizeof(KDNode));
+
+	/* Write to a temporary file first, so that concurrent
+	   renders never see a partially written cache file */
+	QDir().mkpath(QFileInfo(filename).path());
+	QString tmpFilename = filename + ".tmp";
+	QFile file(tmpFilename);
+	bool success = file.open(QIODevice::WriteOnly | QIODevice::Truncate);
+	if (success) {
+		/* The node array is preceded by the padding node (see loadCache()) */
+		success &= file.write(buffer, NORI_KD_CACHE_HEADER_SIZE) == NORI_KD_CACHE_HEADER_SIZE;
+		success &= file.write((const char *) &padding, sizeof(KDNode)) == (qint64) sizeof(KDNode);
+		success &= file.write((const char *) m_nodes, m_nodeCount * sizeof(KDNode))
+			== (qint64) (m_nodeCount * sizeof(KDNode));
+		success &= file.write((const char *) m_indices, m_indexCount * sizeof(IndexType))
+			== (qint64) (m_indexCount * sizeof(IndexType));
+		file.close();
+		QFile::remove(filename);
+		success = success && QFile::rename(tmpFilename, filename);
+	}
+
+	if (!success) {
+		cerr << "Warning: could not write the kd-tree cache file \""
+			<< qPrintable(filename) << "\"" << endl;
+		QFile::remove(tmpFilename);
+	}
 }
 
-void KDTree::addMesh(Mesh *mesh) {
-	m_primitiveCount += mesh->getTriangleCount();
-	m_meshes.push_back(mesh);
-	m_sizeMap.push_back(m_sizeMap.back() + mesh->getTriangleCount());
+size_t KDTree::getMemoryUsage() const {
+	return m_nodeCount * sizeof(KDNode) + m_indexCount * sizeof(IndexType)
+		+ getPackedMemoryUsage() + m_ropeIndex.size() * sizeof(uint32_t)
+		+ m_ropes.size() * sizeof(Rope);
 }
 
 bool KDTree::rayIntersect(const Ray3f &ray, Intersection &its, bool shadowRay) const {
@@ -63,6 +500,21 @@ bool KDTree::rayIntersect(const Ray3f &ray, Intersection &its, bool shadowRay) c
 	if (mint == Epsilon) 
 		mint = std::max(mint, mint * ray.o.array().abs().maxCoeff());
 
+	RayStatistics *stats = m_statistics ? getStatisticsRecord() : NULL;
+
+	if (shadowRay) {
+		uint32_t slot;
+		bool hit = findOccluder(ray, mint, maxt, NORI_NO_LEAF, slot);
+		if (stats) {
+			++stats->shadowRays;
+			stats->hits += hit ? 1 : 0;
+		}
+		return hit;
+	}
+
+	if (stats)
+		++stats->closestHitRays;
+
 	float bboxMinT, bboxMaxT;
 	if (!m_bbox.rayIntersect(ray, bboxMinT, bboxMaxT))
 		return false;
@@ -86,12 +538,15 @@ bool KDTree::rayIntersect(const Ray3f &ray, Intersection &its, bool shadowRay) c
 
 	bool foundIntersection = false;
 	uint32_t foundPrimIndex = 0;
+	uint32_t innerNodes = 0, leaves = 0, triangleTests = 0;
 	const KDNode * __restrict currNode = m_nodes;
+	const KDNode * __restrict lastLeaf = m_nodes;
 	while (currNode != NULL) {
 		while (EXPECT_TAKEN(!currNode->isLeaf())) {
 			const float splitVal = (float) currNode->getSplit();
 			const int axis = currNode->getAxis();
 			const KDNode * __restrict farChild;
+			++innerNodes;
 
 			if (stack[enPt].p[axis] <= splitVal) {
 				if (stack[exPt].p[axis] <= splitVal) {
@@ -139,26 +594,14 @@ bool KDTree::rayIntersect(const Ray3f &ray, Intersection &its, bool shadowRay) c
 		}
 
 		/* Reached a leaf node */
-		for (IndexType entry=currNode->getPrimStart(),
-				last = currNode->getPrimEnd(); entry != last; entry++) {
-			IndexType primIndex = m_indices[entry];
-			IndexType meshIndex = findMesh(primIndex);
-			const Mesh *mesh = m_meshes[meshIndex];
-
-			float u, v, t;
-			bool success = mesh->rayIntersect(primIndex, ray, u, v, t);
-
-			if (success && t >= mint && t <= maxt) {
-				if (shadowRay)
-					return true;
-				maxt = t;
-				its.t = t;
-				its.uv = Point2f(u, v);
-				its.mesh = mesh;
-				foundPrimIndex = primIndex;
-				foundIntersection = true;
-			}
-		}
+		++leaves;
+		triangleTests += currNode->getPrimEnd() - currNode->getPrimStart();
+		if (intersectPacked(currNode->getPrimStart(), currNode->getPrimEnd(),
+				ray, mint, maxt, its, foundPrimIndex))
+			foundIntersection = true;
+
+		/* The closest intersection lies within the last visited leaf */
+		lastLeaf = currNode;
 
 		if (stack[exPt].t > maxt) 
 			break;
@@ -169,56 +612,607 @@ bool KDTree::rayIntersect(const Ray3f &ray, Intersection &its, bool shadowRay) c
 		exPt = stack[enPt].prev;
 	}
 
-	if (foundIntersection && !shadowRay) {
-		/* Find the barycentric coordinates */
-		Vector3f bary;
-		bary << 1-its.uv.sum(), its.uv;
-
-		/* Look up the vertex indices */
-		const Mesh *mesh = its.mesh;
-		const uint32_t *indices = mesh->getIndices(),
-				  idx0 = indices[3*foundPrimIndex+0],
-				  idx1 = indices[3*foundPrimIndex+1],
-				  idx2 = indices[3*foundPrimIndex+2];
-
-		const Point3f  *positions = mesh->getVertexPositions();
-		const Normal3f *normals   = mesh->getVertexNormals();
-		const Point2f  *texCoords = mesh->getVertexTexCoords();
-
-		Point3f p0 = positions[idx0],
-			p1 = positions[idx1],
-			p2 = positions[idx2];
-
-		/* Compute the intersection positon accurately 
-		   using barycentric coordinates */
-		its.p = bary.x() * p0 + bary.y() * p1 + bary.z() * p2;
-
-		/* Compute proper texture coordinates if provided by the mesh */
-		if (texCoords) 
-			its.uv = bary.x() * texCoords[idx0] +
-				bary.y() * texCoords[idx1] +
-				bary.z() * texCoords[idx2];
-
-		/* Compute the geometry frame */
-		its.geoFrame = Frame((p1-p0).cross(p2-p0).normalized());
-
-		if (normals) {
-			/* Compute the shading frame. Note that for simplicity,
-			   the current implementation doesn't attempt to provide
-			   tangents that are continuous across the surface. That
-			   means that this code will need to be modified to be able
-			   use anisotropic BRDFs, which need tangent continuity */
-
-			its.shFrame = Frame(
-				(bary.x() * normals[idx0] +
-				 bary.y() * normals[idx1] +
-				 bary.z() * normals[idx2]).normalized());
-		} else {
-			its.shFrame = its.geoFrame;
+	if (stats) {
+		stats->hits += foundIntersection ? 1 : 0;
+		stats->innerNodes += innerNodes;
+		stats->leaves += leaves;
+		stats->triangleTests += triangleTests;
+	}
+
+	if (foundIntersection) {
+		fillIntersection(foundPrimIndex, its);
+		if (m_useRopes)
+			its.leaf = (uint32_t) (lastLeaf - m_nodes);
+	}
+
+	return foundIntersection;
+}
+
+bool KDTree::rayIntersectFrom(uint32_t leaf, const Ray3f &ray, Intersection &its) const {
+	if (leaf >= m_ropeIndex.size() || m_ropeIndex[leaf] == NORI_NO_ROPE)
+		return rayIntersect(ray, its, false);
+
+	its.t = std::numeric_limits<float>::infinity();
+
+	/* Use an adaptive ray epsilon */
+	float mint = ray.mint, maxt = ray.maxt;
+	if (mint == Epsilon)
+		mint = std::max(mint, mint * ray.o.array().abs().maxCoeff());
+
+	uint32_t foundPrimIndex = 0, lastLeaf = leaf;
+	bool foundIntersection = traverseRopes(leaf, ray, mint, maxt, its,
+		false, foundPrimIndex, lastLeaf);
+
+	if (m_statistics) {
+		RayStatistics *stats = getStatisticsRecord();
+		++stats->closestHitRays;
+		stats->hits += foundIntersection ? 1 : 0;
+	}
+
+	if (foundIntersection) {
+		fillIntersection(foundPrimIndex, its);
+		its.leaf = lastLeaf;
+	}
+
+	return foundIntersection;
+}
+
+bool KDTree::traverseRopes(uint32_t leaf, const Ray3f &ray, float mint, float &maxt,
+		Intersection &its, bool shadowRay, uint32_t &primIndex, uint32_t &lastLeaf) const {
+	uint32_t innerNodes = 0, leaves = 0, triangleTests = 0;
+	bool foundIntersection = false;
+	uint32_t nodeIndex = leaf;
+	float t = mint;
+
+	while (true) {
+		/* A rope may lead to an inner node: descend to the
+		   leaf containing the point where the ray enters it */
+		const KDNode * __restrict node = m_nodes + nodeIndex;
+		if (!node->isLeaf()) {
+			const Point3f p = ray(t);
+			do {
+				const float splitVal = (float) node->getSplit();
+				const int axis = node->getAxis();
+				++innerNodes;
+				if (p[axis] < splitVal || (p[axis] == splitVal && ray.d[axis] <= 0))
+					node = node->getLeft();
+				else
+					node = node->getRight();
+			} while (!node->isLeaf());
+			nodeIndex = (uint32_t) (node - m_nodes);
+		}
+
+		const uint32_t primStart = node->getPrimStart(), primEnd = node->getPrimEnd();
+		++leaves;
+		triangleTests += primEnd - primStart;
+		lastLeaf = nodeIndex;
+
+		if (shadowRay) {
+			if (occludedPacked(primStart, primEnd, ray, mint, maxt, primIndex)) {
+				foundIntersection = true;
+				break;
+			}
+		} else if (intersectPacked(primStart, primEnd, ray, mint, maxt, its, primIndex)) {
+			foundIntersection = true;
+		}
+
+		/* Find the face through which the ray leaves the leaf */
+		const Rope &rope = m_ropes[m_ropeIndex[nodeIndex]];
+		float exitT = std::numeric_limits<float>::infinity();
+		int exitFace = -1;
+		for (int axis=0; axis<3; ++axis) {
+			float faceT;
+			if (ray.d[axis] > 0)
+				faceT = (rope.bbox.max[axis] - ray.o[axis]) * ray.dRcp[axis];
+			else if (ray.d[axis] < 0)
+				faceT = (rope.bbox.min[axis] - ray.o[axis]) * ray.dRcp[axis];
+			else
+				continue;
+			if (faceT < exitT) {
+				exitT = faceT;
+				exitFace = 2*axis + (ray.d[axis] > 0 ? 1 : 0);
+			}
 		}
+
+		/* Any closer intersection would have been found by now */
+		if (exitFace < 0 || exitT >= maxt)
+			break;
+
+		nodeIndex = rope.neighbor[exitFace];
+		if (nodeIndex == NORI_NO_ROPE)
+			break;
+		t = std::max(t, exitT);
+	}
+
+	if (m_statistics) {
+		RayStatistics *stats = getStatisticsRecord();
+		stats->innerNodes += innerNodes;
+		stats->leaves += leaves;
+		stats->triangleTests += triangleTests;
 	}
 
 	return foundIntersection;
 }
 
+bool KDTree::findOccluder(const Ray3f &ray, float mint, float maxt,
+		uint32_t leaf, uint32_t &slot) const {
+	if (leaf < m_ropeIndex.size() && m_ropeIndex[leaf] != NORI_NO_ROPE) {
+		/* Walk along the ropes, starting at the ray origin */
+		Intersection its; /* Unused */
+		uint32_t lastLeaf;
+		return traverseRopes(leaf, ray, mint, maxt, its, true, slot, lastLeaf);
+	}
+
+	/// Any-hit traversal stack
+	struct {
+		/* Far child */
+		const KDNode * __restrict node;
+		/* Ray interval overlapping it */
+		float tmin, tmax;
+	} stack[NORI_KD_MAXDEPTH];
+
+	float tmin, tmax;
+	if (!m_bbox.rayIntersect(ray, tmin, tmax))
+		return false;
+
+	tmin = std::max(mint, tmin);
+	tmax = std::min(maxt, tmax);
+
+	if (tmax < tmin)
+		return false;
+
+	uint32_t stackPos = 0;
+	uint32_t innerNodes = 0, leaves = 0, triangleTests = 0;
+	bool hit = false;
+	const KDNode * __restrict currNode = m_nodes;
+	while (true) {
+		while (EXPECT_TAKEN(!currNode->isLeaf())) {
+			const float splitVal = (float) currNode->getSplit();
+			const int axis = currNode->getAxis();
+			++innerNodes;
+			const float distToSplit = (splitVal - ray.o[axis]) * ray.dRcp[axis];
+
+			/* Visit the child containing the ray origin first, since
+			   nearby geometry is the most likely to block the ray */
+			const KDNode * __restrict nearChild, * __restrict farChild;
+			if (ray.o[axis] < splitVal || (ray.o[axis] == splitVal && ray.d[axis] <= 0)) {
+				nearChild = currNode->getLeft();
+				farChild = nearChild + 1; // getRight()
+			} else {
+				farChild = currNode->getLeft();
+				nearChild = farChild + 1; // getRight()
+			}
+
+			if (distToSplit > tmax || distToSplit <= 0) {
+				currNode = nearChild;
+			} else if (distToSplit < tmin) {
+				currNode = farChild;
+			} else {
+				stack[stackPos].node = farChild;
+				stack[stackPos].tmin = distToSplit;
+				stack[stackPos].tmax = tmax;
+				++stackPos;
+				currNode = nearChild;
+				tmax = distToSplit;
+			}
+		}
+
+		/* Reached a leaf node -- no need to find the closest hit
+		   within the node interval, any hit along the ray will do */
+		++leaves;
+		triangleTests += currNode->getPrimEnd() - currNode->getPrimStart();
+		if (occludedPacked(currNode->getPrimStart(), currNode->getPrimEnd(),
+				ray, mint, maxt, slot)) {
+			hit = true;
+			break;
+		}
+
+		if (stackPos == 0)
+			break;
+
+		--stackPos;
+		currNode = stack[stackPos].node;
+		tmin = stack[stackPos].tmin;
+		tmax = stack[stackPos].tmax;
+	}
+
+	/* The query itself is counted by the caller */
+	if (m_statistics) {
+		RayStatistics *stats = getStatisticsRecord();
+		stats->innerNodes += innerNodes;
+		stats->leaves += leaves;
+		stats->triangleTests += triangleTests;
+	}
+
+	return hit;
+}
+
+void KDTree::findHits(const Ray3f &ray, uint32_t k, std::vector<Intersection> &its) const {
+	/// Front-to-back traversal stack (see findOccluder())
+	struct {
+		/* Far child */
+		const KDNode * __restrict node;
+		/* Ray interval overlapping it */
+		float tmin, tmax;
+	} stack[NORI_KD_MAXDEPTH];
+
+	RayStatistics *stats = m_statistics ? getStatisticsRecord() : NULL;
+	if (stats)
+		++stats->closestHitRays;
+
+	/* Use an adaptive ray epsilon */
+	float mint = ray.mint, maxt = ray.maxt;
+	if (mint == Epsilon)
+		mint = std::max(mint, mint * ray.o.array().abs().maxCoeff());
+
+	float tmin, tmax;
+	if (!m_bbox.rayIntersect(ray, tmin, tmax))
+		return;
+
+	tmin = std::max(mint, tmin);
+	tmax = std::min(maxt, tmax);
+
+	if (tmax < tmin)
+		return;
+
+	std::vector<PackedHit> hits;
+	uint32_t stackPos = 0;
+	uint32_t innerNodes = 0, leaves = 0, triangleTests = 0;
+	const KDNode * __restrict currNode = m_nodes;
+	while (true) {
+		while (EXPECT_TAKEN(!currNode->isLeaf())) {
+			const float splitVal = (float) currNode->getSplit();
+			const int axis = currNode->getAxis();
+			++innerNodes;
+			const float distToSplit = (splitVal - ray.o[axis]) * ray.dRcp[axis];
+
+			/* The ray passes through the child containing its origin first */
+			const KDNode * __restrict nearChild, * __restrict farChild;
+			if (ray.o[axis] < splitVal || (ray.o[axis] == splitVal && ray.d[axis] <= 0)) {
+				nearChild = currNode->getLeft();
+				farChild = nearChild + 1; // getRight()
+			} else {
+				farChild = currNode->getLeft();
+				nearChild = farChild + 1; // getRight()
+			}
+
+			if (distToSplit > tmax || distToSplit <= 0) {
+				currNode = nearChild;
+			} else if (distToSplit < tmin) {
+				currNode = farChild;
+			} else {
+				stack[stackPos].node = farChild;
+				stack[stackPos].tmin = distToSplit;
+				stack[stackPos].tmax = tmax;
+				++stackPos;
+				currNode = nearChild;
+				tmax = distToSplit;
+			}
+		}
+
+		/* Reached a leaf node -- hits beyond its interval are kept as
+		   well, since the same triangles would be found again later */
+		++leaves;
+		triangleTests += currNode->getPrimEnd() - currNode->getPrimStart();
+		collectPacked(currNode->getPrimStart(), currNode->getPrimEnd(),
+			ray, mint, maxt, k, hits);
+
+		/* The pending subtrees are ordered by distance. Stop as soon
+		   as the next one lies beyond the k-th closest hit */
+		if (stackPos == 0 || stack[stackPos-1].tmin > maxt)
+			break;
+
+		--stackPos;
+		currNode = stack[stackPos].node;
+		tmin = stack[stackPos].tmin;
+		tmax = std::min(stack[stackPos].tmax, maxt);
+	}
+
+	if (stats) {
+		stats->hits += hits.empty() ? 0 : 1;
+		stats->innerNodes += innerNodes;
+		stats->leaves += leaves;
+		stats->triangleTests += triangleTests;
+	}
+
+	fillHits(hits, its);
+}
+
+bool KDTree::closestPoint(const Point3f &p, float maxDist, Intersection &its) const {
+	float maxDist2 = maxDist * maxDist;
+	uint32_t slot = 0;
+	Point2f uv;
+
+	if (!traversePoint(p, maxDist2, NULL, slot, uv))
+		return false;
+
+	its.t = std::sqrt(maxDist2);
+	its.uv = uv;
+	its.mesh = m_meshes[m_packedIds[slot]];
+	fillIntersection(m_packedIds[m_packedStride + slot], its);
+	return true;
+}
+
+void KDTree::trianglesInRadius(const Point3f &p, float radius,
+		std::vector<TriangleRef> &triangles) const {
+	float radius2 = radius * radius;
+	uint32_t slot;
+	Point2f uv;
+
+	triangles.clear();
+	traversePoint(p, radius2, &triangles, slot, uv);
+
+	/* Triangles that straddle a split plane are referenced by several leaves */
+	std::sort(triangles.begin(), triangles.end());
+	triangles.erase(std::unique(triangles.begin(), triangles.end()), triangles.end());
+}
+
+bool KDTree::traversePoint(const Point3f &p, float &maxDist2, std::vector<TriangleRef> *triangles,
+		uint32_t &slot, Point2f &uv) const {
+	/// Point query stack
+	struct {
+		/* Far child */
+		const KDNode * __restrict node;
+		/* Squared distance between p and its cell */
+		float dist2;
+		/* Distance between p and the cell along each axis */
+		Vector3f offset;
+	} stack[NORI_KD_MAXDEPTH];
+
+	/* Distance between p and the cell of the current node */
+	Vector3f offset;
+	for (int i=0; i<3; ++i)
+		offset[i] = std::max(std::max(m_bbox.min[i] - p[i], p[i] - m_bbox.max[i]), 0.0f);
+	float dist2 = offset.squaredNorm();
+
+	if (dist2 > maxDist2)
+		return false;
+
+	uint32_t stackPos = 0;
+	bool found = false;
+	const KDNode * __restrict currNode = m_nodes;
+	while (true) {
+		while (EXPECT_TAKEN(!currNode->isLeaf())) {
+			const float splitVal = (float) currNode->getSplit();
+			const int axis = currNode->getAxis();
+			const float distToSplit = p[axis] - splitVal;
+
+			const KDNode * __restrict nearChild, * __restrict farChild;
+			if (distToSplit <= 0) {
+				nearChild = currNode->getLeft();
+				farChild = nearChild + 1; // getRight()
+			} else {
+				farChild = currNode->getLeft();
+				nearChild = farChild + 1; // getRight()
+			}
+
+			/* The cell of the near child is as far away as that of its
+			   parent, while the far one lies beyond the split plane */
+			const float farDist2 = dist2 - offset[axis] * offset[axis]
+				+ distToSplit * distToSplit;
+			if (farDist2 <= maxDist2) {
+				stack[stackPos].node = farChild;
+				stack[stackPos].dist2 = farDist2;
+				stack[stackPos].offset = offset;
+				stack[stackPos].offset[axis] = std::abs(distToSplit);
+				++stackPos;
+			}
+			currNode = nearChild;
+		}
+
+		/* Reached a leaf node */
+		if (triangles) {
+			collectPackedInRadius(currNode->getPrimStart(), currNode->getPrimEnd(),
+				p, maxDist2, *triangles);
+		} else if (closestPacked(currNode->getPrimStart(), currNode->getPrimEnd(),
+				p, maxDist2, slot, uv)) {
+			found = true;
+		}
+
+		/* Pop the next cell that may still contain a closer triangle */
+		do {
+			if (stackPos == 0)
+				return triangles ? !triangles->empty() : found;
+			--stackPos;
+		} while (stack[stackPos].dist2 > maxDist2);
+
+		currNode = stack[stackPos].node;
+		dist2 = stack[stackPos].dist2;
+		offset = stack[stackPos].offset;
+	}
+}
+
+#if defined(__SSE__)
+void KDTree::rayIntersectPacket(const Ray3f *rays, uint32_t count,
+		Intersection *its, bool *hits, bool shadowRay) const {
+	/* Per-ray values in structure of arrays layout, four rays per register */
+	union Lanes {
+		__m128 v[NORI_PACKET_SIZE / 4];
+		float f[NORI_PACKET_SIZE];
+	};
+
+	/// Packet traversal stack
+	struct {
+		/* Far child */
+		const KDNode * __restrict node;
+		/* Ray intervals overlapping it */
+		Lanes tmin, tmax;
+	} stack[NORI_KD_MAXDEPTH];
+
+	/* All rays must visit the children of a node in the same order */
+	bool coherent = count > 1 && count <= NORI_PACKET_SIZE && m_primitiveCount > 0;
+	for (uint32_t i=1; i<count && coherent; ++i) {
+		for (int axis=0; axis<3; ++axis) {
+			if ((rays[i].dRcp[axis] < 0) != (rays[0].dRcp[axis] < 0))
+				coherent = false;
+		}
+	}
+
+	if (!coherent) {
+		Accelerator::rayIntersectPacket(rays, count, its, hits, shadowRay);
+		return;
+	}
+
+	const float inf = std::numeric_limits<float>::infinity();
+	const uint32_t groups = (count + 3) / 4;
+	Lanes o[3], dRcp[3], curMin, curMax, laneMint, laneMaxt;
+	uint32_t foundPrimIndex[NORI_PACKET_SIZE], lastLeaf[NORI_PACKET_SIZE];
+	bool dirIsNeg[3];
+
+	for (int axis=0; axis<3; ++axis)
+		dirIsNeg[axis] = rays[0].dRcp[axis] < 0;
+
+	for (uint32_t i=0; i<groups*4; ++i) {
+		if (i < count) {
+			const Ray3f &ray = rays[i];
+			/* Use an adaptive ray epsilon */
+			float mint = ray.mint;
+			if (mint == Epsilon)
+				mint = std::max(mint, mint * ray.o.array().abs().maxCoeff());
+			for (int axis=0; axis<3; ++axis) {
+				o[axis].f[i] = ray.o[axis];
+				dRcp[axis].f[i] = ray.dRcp[axis];
+			}
+			curMin.f[i] = mint;
+			curMax.f[i] = ray.maxt;
+			its[i].t = inf;
+			hits[i] = false;
+		} else {
+			/* Unused lanes have an empty interval */
+			for (int axis=0; axis<3; ++axis) {
+				o[axis].f[i] = 0.0f;
+				dRcp[axis].f[i] = 1.0f;
+			}
+			curMin.f[i] = inf;
+			curMax.f[i] = -inf;
+		}
+	}
+
+	/* Clip the rays against the bounding box of the tree (slab test) */
+	int activeMask = 0;
+	for (uint32_t g=0; g<groups; ++g) {
+		for (int axis=0; axis<3; ++axis) {
+			__m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(m_bbox.min[axis]), o[axis].v[g]), dRcp[axis].v[g]),
+			       t2 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(m_bbox.max[axis]), o[axis].v[g]), dRcp[axis].v[g]);
+			/* Rays that start on a slab plane parallel to them produce a NaN
+			   and an infinite distance, which may cull the lane. Since the
+			   bounding box of the tree is enlarged (see NORI_KD_BBOX_EPSILON),
+			   such rays cannot hit anything anyway */
+			curMin.v[g] = _mm_max_ps(_mm_min_ps(t1, t2), curMin.v[g]);
+			curMax.v[g] = _mm_min_ps(_mm_max_ps(t1, t2), curMax.v[g]);
+		}
+		laneMint.v[g] = curMin.v[g];
+		laneMaxt.v[g] = curMax.v[g];
+		activeMask |= _mm_movemask_ps(_mm_cmple_ps(curMin.v[g], curMax.v[g])) << (4*g);
+	}
+
+	/* Nodes are counted once per packet, triangle tests once per ray */
+	uint32_t stackPos = 0, innerNodes = 0, leaves = 0, triangleTests = 0;
+	const KDNode * __restrict currNode = activeMask ? m_nodes : NULL;
+	while (currNode != NULL) {
+		if (EXPECT_TAKEN(!currNode->isLeaf())) {
+			++innerNodes;
+			const __m128 splitVal = _mm_set1_ps((float) currNode->getSplit());
+			const int axis = currNode->getAxis();
+			Lanes distToSplit;
+			int nearMask = 0, farMask = 0;
+
+			/* Which rays overlap the near and far halves of the node? */
+			for (uint32_t g=0; g<groups; ++g) {
+				const __m128 active = _mm_cmple_ps(curMin.v[g], curMax.v[g]);
+				distToSplit.v[g] = _mm_mul_ps(_mm_sub_ps(splitVal, o[axis].v[g]), dRcp[axis].v[g]);
+				nearMask |= _mm_movemask_ps(_mm_andnot_ps(
+					_mm_cmplt_ps(distToSplit.v[g], curMin.v[g]), active)) << (4*g);
+				farMask |= _mm_movemask_ps(_mm_andnot_ps(
+					_mm_cmpgt_ps(distToSplit.v[g], curMax.v[g]), active)) << (4*g);
+			}
+
+			const KDNode * __restrict nearChild = currNode->getLeft();
+			const KDNode * __restrict farChild = nearChild + 1; // getRight()
+			if (dirIsNeg[axis])
+				std::swap(nearChild, farChild);
+
+			if (nearMask && farMask) {
+				/* Visit the near child first and remember the far one */
+				stack[stackPos].node = farChild;
+				for (uint32_t g=0; g<groups; ++g) {
+					stack[stackPos].tmin.v[g] = _mm_max_ps(distToSplit.v[g], curMin.v[g]);
+					stack[stackPos].tmax.v[g] = curMax.v[g];
+					curMax.v[g] = _mm_min_ps(distToSplit.v[g], curMax.v[g]);
+				}
+				++stackPos;
+				currNode = nearChild;
+				continue;
+			} else if (nearMask) {
+				currNode = nearChild;
+				continue;
+			} else if (farMask) {
+				currNode = farChild;
+				continue;
+			}
+		} else {
+			/* Reached a leaf node: intersect the active rays one at a time */
+			const uint32_t primStart = currNode->getPrimStart(),
+			               primEnd = currNode->getPrimEnd();
+			++leaves;
+
+			for (uint32_t i=0; i<count; ++i) {
+				if (!(curMin.f[i] <= curMax.f[i]))
+					continue;
+				triangleTests += primEnd - primStart;
+				lastLeaf[i] = (uint32_t) (currNode - m_nodes);
+				if (intersectPacked(primStart, primEnd, rays[i], laneMint.f[i],
+						laneMaxt.f[i], its[i], foundPrimIndex[i])) {
+					hits[i] = true;
+					/* Shadow rays are done after the first hit */
+					if (shadowRay)
+						laneMaxt.f[i] = -inf;
+				}
+			}
+		}
+
+		/* Pop from the stack until some ray still overlaps the node */
+		currNode = NULL;
+		while (stackPos > 0) {
+			--stackPos;
+			activeMask = 0;
+			for (uint32_t g=0; g<groups; ++g) {
+				curMin.v[g] = stack[stackPos].tmin.v[g];
+				curMax.v[g] = _mm_min_ps(stack[stackPos].tmax.v[g], laneMaxt.v[g]);
+				activeMask |= _mm_movemask_ps(_mm_cmple_ps(curMin.v[g], curMax.v[g]));
+			}
+			if (activeMask) {
+				currNode = stack[stackPos].node;
+				break;
+			}
+		}
+	}
+
+	if (m_statistics) {
+		RayStatistics *stats = getStatisticsRecord();
+		if (shadowRay)
+			stats->shadowRays += count;
+		else
+			stats->closestHitRays += count;
+		for (uint32_t i=0; i<count; ++i)
+			stats->hits += hits[i] ? 1 : 0;
+		stats->innerNodes += innerNodes;
+		stats->leaves += leaves;
+		stats->triangleTests += triangleTests;
+	}
+
+	if (!shadowRay) {
+		for (uint32_t i=0; i<count; ++i) {
+			if (!hits[i])
+				continue;
+			fillIntersection(foundPrimIndex[i], its[i]);
+			/* Leaves are visited front to back, hence the last one
+			   overlapped by a ray contains its closest intersection */
+			if (m_useRopes)
+				its[i].leaf = lastLeaf[i];
+		}
+	}
+}
+#endif
+
 NORI_NAMESPACE_END
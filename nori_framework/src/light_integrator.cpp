@@ -17,6 +17,8 @@
 #include <nori/scene.h>
 #include <nori/vector.h>
 #include <vector>
+#include <valarray>
+#include <QThreadStorage>
 
 NORI_NAMESPACE_BEGIN
 
@@ -38,6 +40,11 @@ public:
                 return mesh;
         }
 
+        /// Return the ray that determines the visibility of a sampled luminaire position
+        inline Ray3f shadowRay(const LuminaireQueryRecord &lRec) const {
+                return Ray3f(lRec.ref, lRec.d, Epsilon, lRec.dist * (1 - 1e-4f));
+        }
+
         /**
          * \brief Directly sample the lights, providing a sample weighted by 1/pdf
          * where pdf is the probability of sampling that given sample
@@ -51,9 +58,14 @@ public:
          * \param _sample
          * the 2d uniform sample
          * 
+         * \param testVisibility
+         * whether to trace a shadow ray; if not, the caller has to check
+         * the visibility along \ref shadowRay(lRec) itself
+         * 
          * \return the sampled light radiance including its geometric, visibility and pdf weights
          */
-        inline Color3f sampleLights(const Scene *scene, LuminaireQueryRecord &lRec, const Point2f &_sample) const {
+        inline Color3f sampleLights(const Scene *scene, LuminaireQueryRecord &lRec, const Point2f &_sample,
+                        bool testVisibility = true) const {
                 Point2f sample(_sample);
                 const std::vector<Luminaire *> &luminaires = scene->getLuminaires();
 
@@ -83,7 +95,7 @@ public:
                 
                 if (dp > 0) {
                         // 5. Check the visibility
-                        if (scene->rayIntersect(Ray3f(lRec.ref, lRec.d, Epsilon, lRec.dist * (1 - 1e-4f))))
+                        if (testVisibility && scene->rayIntersect(shadowRay(lRec)))
                                 return Color3f(0.0f);
                         // 6. Geometry term on luminaire's side
                         // Visiblity + Geometric term on the luminaire's side 
@@ -138,9 +150,100 @@ public:
                 return Color3f(0.0f);
         }
 
+        /**
+         * \brief Same as \ref Li(), but traces the camera rays and the
+         * shadow rays of all samples of a pixel as packets
+         */
+        void LiBatch(const Scene *scene, Sampler *sampler, const Ray3f *rays,
+                        Color3f *values, size_t count) const {
+                /* Media draw additional samples while evaluating the
+                   transmittance, which would change the sample order */
+                if (scene->getMedium()) {
+                        Integrator::LiBatch(scene, sampler, rays, values, count);
+                        return;
+                }
+
+                /* This is called for every pixel, hence reuse the buffers of the thread */
+                if (!m_buffers.hasLocalData())
+                        m_buffers.setLocalData(new BatchBuffers());
+                BatchBuffers &buffers = *m_buffers.localData();
+                buffers.prepare(count);
+                std::vector<Intersection> &its = buffers.its;
+                std::vector<Ray3f> &shadowRays = buffers.shadowRays;
+                std::vector<uint32_t> &shadowRayIndices = buffers.shadowRayIndices;
+                std::vector<Color3f> &direct = buffers.direct;
+                std::vector<Vector3f> &lightDirs = buffers.lightDirs;
+                bool *hits = &buffers.hits[0];
+
+                /* Find the surfaces that are visible along all rays */
+                scene->rayIntersect(rays, count, &its[0], hits);
+
+                for (size_t i=0; i<count; ++i) {
+                        values[i] = Color3f(0.0f);
+                        if (hits[i]) {
+                                const Mesh *mesh = its[i].mesh;
+                                if (mesh->isLuminaire()) {
+                                        /* We hit a luminaire, use its related color information */
+                                        const Luminaire *luminaire = mesh->getLuminaire();
+                                        LuminaireQueryRecord lRec(luminaire, rays[i].o, its[i].p, its[i].shFrame.n);
+                                        values[i] = luminaire->eval(lRec);
+                                } else {
+                                        /* Sample a luminaire, but defer the visibility test */
+                                        LuminaireQueryRecord lRec(its[i].p);
+                                        Color3f value = sampleLights(scene, lRec, sampler->next2D(), false);
+                                        if ((value.array() != 0).any()) {
+                                                shadowRays.push_back(shadowRay(lRec));
+                                                shadowRayIndices.push_back((uint32_t) i);
+                                                direct.push_back(value);
+                                                lightDirs.push_back(lRec.d);
+                                        }
+                                }
+                        }
+                        sampler->advance();
+                }
+
+                if (!shadowRays.empty()) {
+                        scene->rayIntersect(&shadowRays[0], shadowRays.size(), hits);
+
+                        for (size_t j=0; j<shadowRays.size(); ++j) {
+                                if (hits[j])
+                                        continue;
+                                uint32_t i = shadowRayIndices[j];
+                                BSDFQueryRecord bRec(its[i].toLocal(-rays[i].d),
+                                        its[i].toLocal(lightDirs[j]), ESolidAngle);
+                                values[i] = direct[j] * its[i].mesh->getBSDF()->eval(bRec)
+                                        * std::abs(Frame::cosTheta(bRec.wo));
+                        }
+                }
+        }
+
         QString toString() const {
                 return QString("LightIntegrator[]");
         }
+private:
+        /// Per-thread buffers of \ref LiBatch()
+        struct BatchBuffers {
+                std::vector<Intersection> its;
+                std::vector<Ray3f> shadowRays;
+                std::vector<uint32_t> shadowRayIndices;
+                std::vector<Color3f> direct;
+                std::vector<Vector3f> lightDirs;
+                /* Unlike std::vector<bool>, this stores the flags as an array of bool */
+                std::valarray<bool> hits;
+
+                /// Make room for \c count rays and forget the shadow rays of the last call
+                void prepare(size_t count) {
+                        if (hits.size() < count)
+                                hits.resize(count);
+                        its.resize(count);
+                        shadowRays.clear();
+                        shadowRayIndices.clear();
+                        direct.clear();
+                        lightDirs.clear();
+                }
+        };
+
+        mutable QThreadStorage<BatchBuffers *> m_buffers;
 };
 
 NORI_REGISTER_CLASS(LightIntegrator, "light");
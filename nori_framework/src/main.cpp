@@ -19,85 +19,367 @@
 #include <nori/parser.h>
 #include <nori/scene.h>
 #include <nori/camera.h>
+#include <nori/sampler.h>
 #include <nori/block.h>
+#include <nori/renderer.h>
 #include <nori/bitmap.h>
 #include <nori/integrator.h>
 #include <nori/gui.h>
+#include <nori/network.h>
+#include <nori/server.h>
 #include <nori/designer.h>
 #include <nori/object.h>
+#include <nori/kdtree.h>
 #include <boost/scoped_ptr.hpp>
 #include <QApplication>
 #include <string>
 
 using namespace nori;
 
-void render(Scene *scene, const QString &filename, int version) {
-	const Camera *camera = scene->getCamera();
-	Vector2i outputSize = camera->getOutputSize();
+/// Parse a duration such as "300s", "5m", "1.5h" or "300" (seconds) into milliseconds
+static qint64 parseDuration(const QString &str) {
+	QString value = str.trimmed().toLower();
+	double scale = 1000;
+	if (value.endsWith("ms")) {
+		scale = 1;
+		value.chop(2);
+	} else if (value.endsWith("s")) {
+		value.chop(1);
+	} else if (value.endsWith("m")) {
+		scale = 60 * 1000;
+		value.chop(1);
+	} else if (value.endsWith("h")) {
+		scale = 60 * 60 * 1000;
+		value.chop(1);
+	}
+	bool ok;
+	double result = value.toDouble(&ok);
+	if (!ok || result < 0)
+		throw NoriException(QString("Unable to parse the duration \"%1\"!").arg(str));
+	return (qint64) (result * scale);
+}
+
+/// Parse a strictly positive integer command line argument
+static int parsePositive(const char *name, const char *str) {
+	bool ok;
+	int result = QString(str).toInt(&ok);
+	if (!ok || result <= 0)
+		throw NoriException(QString("%1: expected a positive integer, got \"%2\"!").arg(name).arg(str));
+	return result;
+}
+
+/// Parse a crop window given as "x,y,width,height"
+static void parseCropWindow(const QString &str, Point2i &offset, Vector2i &size) {
+	QStringList values = str.split(",");
+	bool ok = values.count() == 4;
+	int result[4];
+	for (int i=0; ok && i<4; ++i)
+		result[i] = values.at(i).trimmed().toInt(&ok);
+	if (!ok)
+		throw NoriException(QString("--crop: expected x,y,width,height, got \"%1\"!").arg(str));
+	offset = Point2i(result[0], result[1]);
+	size = Vector2i(result[2], result[3]);
+}
 
-	/* Create a block generator (i.e. a work scheduler) */
-	BlockGenerator blockGenerator(outputSize, NORI_BLOCK_SIZE);
+/// Parse a shard specification given as "index/count" (e.g. 0/4)
+static void parseShard(const QString &str, int &index, int &count) {
+	QStringList values = str.split("/");
+	bool ok1 = false, ok2 = false;
+	if (values.count() == 2) {
+		index = values.at(0).toInt(&ok1);
+		count = values.at(1).toInt(&ok2);
+	}
+	if (!ok1 || !ok2 || count < 1 || index < 0 || index >= count)
+		throw NoriException(QString("--shard: expected index/count with 0 <= index < count, "
+			"got \"%1\"!").arg(str));
+}
 
-	/* Allocate memory for the entire output image */
-	ImageBlock result(outputSize, camera->getReconstructionFilter());
-	result.clear();
+/**
+ * \brief Combine the raw images (see ImageBlock::saveRaw()) of several
+ * shards of a frame into the final, normalized image
+ */
+static void mergeShards(const QString &outputName, const std::vector<QString> &shards) {
+	boost::scoped_ptr<ImageBlock> result(ImageBlock::loadRaw(shards[0]));
+	for (size_t i=1; i<shards.size(); ++i) {
+		boost::scoped_ptr<ImageBlock> shard(ImageBlock::loadRaw(shards[i]));
+		if (shard->getSize() != result->getSize())
+			throw NoriException(QString("\"%1\" has a different resolution (%2) than "
+				"\"%3\" (%4)!").arg(shards[i]).arg(shard->getSize().toString())
+				.arg(shards[0]).arg(result->getSize().toString()));
+		result->put(*shard);
+	}
 
-	/* Launch the GUI */
-	NoriWindow window(&result);
+	boost::scoped_ptr<Bitmap> bitmap(result->toBitmap());
+	bitmap->save(outputName);
+}
 
-	/* Launch one render thread per core */
-	int nCores = getCoreCount();
-	std::vector<BlockRenderThread *> threads;
-	for (int i=0; i<nCores; ++i) {
-		BlockRenderThread *thread = new BlockRenderThread(
-			scene, scene->getSampler(), &blockGenerator, &result);
-		thread->start();
-		threads.push_back(thread);
+/**
+ * \brief Render blocks on behalf of a remote coordinator (see 
+ * RemoteCoordinator) until it runs out of work
+ */
+static void renderWorker(Scene *scene, const QString &address) {
+	QString host = address;
+	int port = NORI_DEFAULT_PORT, separator = address.lastIndexOf(":");
+	if (separator >= 0) {
+		bool ok;
+		host = address.left(separator);
+		port = address.mid(separator + 1).toInt(&ok);
+		if (!ok || port <= 0 || port > 65535)
+			throw NoriException(QString("--worker: invalid port in \"%1\"!").arg(address));
 	}
 
-	window.startRefresh();
-	qApp->exec();
-	window.stopRefresh();
+	int nCores = getThreadCount();
+	cout << "Rendering for the coordinator at " << qPrintable(host) << ":" << port
+		 << " using " << nCores << " threads .." << endl;
 
-	/* Wait for them to finish */
+	std::vector<RemoteWorkerThread *> threads;
+	for (int i=0; i<nCores; ++i) {
+		threads.push_back(new RemoteWorkerThread(scene, scene->getSampler(),
+			host, (quint16) port, i));
+		threads[i]->start();
+	}
+
+	int blockCount = 0;
 	for (int i=0; i<nCores; ++i) {
 		threads[i]->wait();
+		blockCount += threads[i]->getBlockCount();
 		delete threads[i];
 	}
+	cout << "Worker finished (rendered " << blockCount << " blocks)" << endl;
+}
 
-	/* Now turn the rendered image block into
-	   a properly normalized bitmap */
-	Bitmap *bitmap = result.toBitmap();
-
-		/* Evaluate it if meaningful */
-		const Evaluator *ev = scene->getEvaluator();
-		if(ev) ev->evaluate(bitmap);
-
-	/* Determine the filename of the output bitmap */
-	QFileInfo inputInfo(filename);
-	QString outputName = inputInfo.path()
-		+ QDir::separator()
-		+ inputInfo.completeBaseName() + (version < 0 ? QString(".exr") : QString("_%1.exr").arg(version));
+/**
+ * \brief Render a scene loaded from \c filename, either as a single image
+ * or as an animation (see \ref RenderOptions::animation)
+ */
+static void render(Scene *scene, const QString &filename, int version, const RenderOptions &options) {
+	/* Determine the filename of the output bitmap (without extension) */
+	QString baseName;
+	if (!options.output.isEmpty()) {
+		baseName = options.output;
+		if (baseName.endsWith(".exr"))
+			baseName.chop(4);
+	} else {
+		QFileInfo inputInfo(filename);
+		baseName = inputInfo.path()
+			+ QDir::separator()
+			+ inputInfo.completeBaseName() + (version < 0 ? QString("") : QString("_%1").arg(version));
+		if (options.shardCount > 1)
+			baseName += QString("_shard%1").arg(options.shardIndex);
+	}
 
-	/* Save using the OpenEXR format */
-	bitmap->save(outputName);
+	/* Read the animation before spending time on rendering */
+	std::vector<AnimationFrame> frames;
+	if (!options.animation.isEmpty())
+		Renderer::loadAnimation(options.animation, frames);
 
-	delete bitmap;
+	/* The scene, its kd-tree and the render threads are shared by all frames */
+	Renderer renderer(scene, options);
+	if (frames.empty())
+		renderer.render(baseName);
+	else
+		renderer.renderAnimation(baseName, frames);
 }
 
 int main(int argc, char **argv) {
-	QApplication app(argc, argv);
+	/* Separate the command line options from the positional arguments */
+	RenderOptions options;
+	std::vector<char *> args;
+	bool merge = false, benchmark = false, selftest = false;
+	QString serverName, submitName, camera;
+	int priority = 0;
+	try {
+		for (int i=1; i<argc; ++i) {
+			if (strcmp(argv[i], "--headless") == 0) {
+				options.headless = true;
+			} else if (strcmp(argv[i], "--blocksize") == 0 && i+1 < argc) {
+				options.blockSize = parsePositive(argv[i], argv[i+1]); ++i;
+			} else if (strcmp(argv[i], "--progressive") == 0 && i+1 < argc) {
+				options.samplesPerPass = parsePositive(argv[i], argv[i+1]); ++i;
+			} else if (strcmp(argv[i], "--spp") == 0 && i+1 < argc) {
+				options.sampleCount = parsePositive(argv[i], argv[i+1]); ++i;
+			} else if (strcmp(argv[i], "--time") == 0 && i+1 < argc) {
+				options.timeLimit = parseDuration(argv[++i]);
+			} else if (strcmp(argv[i], "--adaptive") == 0 && i+1 < argc) {
+				bool ok;
+				options.adaptiveThreshold = QString(argv[++i]).toFloat(&ok);
+				if (!ok || options.adaptiveThreshold <= 0)
+					throw NoriException("--adaptive: expected a positive relative error threshold!");
+			} else if (strcmp(argv[i], "--adaptive-passes") == 0 && i+1 < argc) {
+				options.adaptiveMinPasses = parsePositive(argv[i], argv[i+1]); ++i;
+			} else if (strcmp(argv[i], "--checkpoint") == 0 && i+1 < argc) {
+				options.checkpointInterval = parseDuration(argv[++i]);
+			} else if (strcmp(argv[i], "--resume") == 0) {
+				options.resume = true;
+			} else if (strcmp(argv[i], "--crop") == 0 && i+1 < argc) {
+				parseCropWindow(argv[++i], options.cropOffset, options.cropSize);
+			} else if (strcmp(argv[i], "--shard") == 0 && i+1 < argc) {
+				parseShard(argv[++i], options.shardIndex, options.shardCount);
+			} else if (strcmp(argv[i], "--stats") == 0) {
+				options.statistics = true;
+			} else if (strcmp(argv[i], "--raw") == 0) {
+				options.raw = true;
+			} else if (strcmp(argv[i], "--output") == 0 && i+1 < argc) {
+				options.output = argv[++i];
+			} else if (strcmp(argv[i], "--coordinator") == 0 && i+1 < argc) {
+				options.coordinatorPort = parsePositive(argv[i], argv[i+1]); ++i;
+				if (options.coordinatorPort > 65535)
+					throw NoriException("--coordinator: invalid port number!");
+			} else if (strcmp(argv[i], "--worker") == 0 && i+1 < argc) {
+				options.worker = argv[++i];
+				options.headless = true;
+			} else if (strcmp(argv[i], "--animation") == 0 && i+1 < argc) {
+				options.animation = argv[++i];
+				options.headless = true;
+			} else if (strcmp(argv[i], "--server") == 0 && i+1 < argc) {
+				serverName = argv[++i];
+				options.headless = true;
+			} else if (strcmp(argv[i], "--submit") == 0 && i+1 < argc) {
+				submitName = argv[++i];
+				options.headless = true;
+			} else if (strcmp(argv[i], "--priority") == 0 && i+1 < argc) {
+				bool ok;
+				priority = QString(argv[++i]).toInt(&ok);
+				if (!ok)
+					throw NoriException("--priority: expected an integer!");
+			} else if (strcmp(argv[i], "--camera") == 0 && i+1 < argc) {
+				camera = argv[++i];
+			} else if (strcmp(argv[i], "--merge") == 0) {
+				merge = true;
+			} else if (strcmp(argv[i], "--benchmark") == 0) {
+				benchmark = true;
+			} else if (strcmp(argv[i], "--selftest") == 0) {
+				selftest = true;
+			} else if (strcmp(argv[i], "--threads") == 0 && i+1 < argc) {
+				setThreadCount(parsePositive(argv[i], argv[i+1])); ++i;
+			} else if (strcmp(argv[i], "--pin") == 0 && i+1 < argc) {
+				QString value = QString(argv[++i]).toLower();
+				if (value == "none")
+					setThreadPinning(ENoPinning);
+				else if (value == "compact")
+					setThreadPinning(ECompactPinning);
+				else if (value == "scatter")
+					setThreadPinning(EScatterPinning);
+				else
+					throw NoriException("--pin: expected none, compact or scatter!");
+			} else if (strcmp(argv[i], "--numa") == 0 && i+1 < argc) {
+				QString value = QString(argv[++i]).toLower();
+				if (value == "local")
+					options.memoryPlacement = EFirstTouch;
+				else if (value == "interleave")
+					options.memoryPlacement = EInterleave;
+				else
+					throw NoriException("--numa: expected local or interleave!");
+			} else if (strcmp(argv[i], "--order") == 0 && i+1 < argc) {
+				options.blockOrder = BlockGenerator::parseOrder(argv[++i]);
+			} else {
+				args.push_back(argv[i]);
+			}
+		}
+		/* Remote workers only know the camera of the scene file */
+		if (!options.animation.isEmpty() && options.coordinatorPort > 0)
+			throw NoriException("--animation cannot be combined with --coordinator!");
+	} catch (const NoriException &ex) {
+		cerr << qPrintable(ex.getReason()) << endl;
+		return -1;
+	}
+	bool headless = options.headless;
+
+	if (merge) {
+		/* Combine the raw outputs of several shards, no GUI required */
+		if (args.size() < 2) {
+			cerr << "Syntax: nori --merge <output.exr> <shard1.exr> [<shard2.exr> ..]" << endl;
+			return -1;
+		}
+		try {
+			mergeShards(args[0], std::vector<QString>(args.begin() + 1, args.end()));
+		} catch (const NoriException &ex) {
+			cerr << "Caught a critical exception: " << qPrintable(ex.getReason()) << endl;
+			return -1;
+		}
+		return 0;
+	}
+
+	if (selftest) {
+		/* Merge overlapping blocks from many more threads than cores */
+		bool passed = ImageBlock::stressTest(std::max(4 * getThreadCount(), 16));
+		passed = KDTree::selfTest() && passed;
+		return passed ? 0 : -1;
+	}
+
+	if (!submitName.isEmpty()) {
+		/* Send a job to a running render server, no GUI required */
+		if (args.size() != 1) {
+			cerr << "Syntax: nori --submit <socket> [--spp <n>] [--progressive <spp per pass>] "
+				"[--time <duration>]" << endl
+				 << "            [--camera <transform>] [--priority <n>] [--output <file.exr>] "
+				"<scene.xml>" << endl;
+			return -1;
+		}
+		QStringList request;
+		request << "scene " + QFileInfo(args[0]).absoluteFilePath();
+		if (!options.output.isEmpty())
+			request << "output " + QFileInfo(options.output).absoluteFilePath();
+		if (options.sampleCount > 0)
+			request << QString("spp %1").arg(options.sampleCount);
+		if (options.samplesPerPass > 0)
+			request << QString("progressive %1").arg(options.samplesPerPass);
+		if (options.timeLimit >= 0)
+			request << QString("time %1").arg(options.timeLimit);
+		if (!camera.isEmpty())
+			request << "camera " + camera;
+		request << QString("priority %1").arg(priority);
+		try {
+			return RenderServer::submit(submitName, request) ? 0 : -1;
+		} catch (const NoriException &ex) {
+			cerr << qPrintable(ex.getReason()) << endl;
+			return -1;
+		}
+	}
+
+	/* In batch mode, don't require a connection to a display server */
+	QApplication app(argc, argv, !headless);
 	Q_INIT_RESOURCE(resources);
 
-		if (argc != 2 && argc != 3) {
-				cerr << "Syntax: nori <scene.xml>" << endl;
+	if (!serverName.isEmpty()) {
+		/* Keep scenes in memory and render the jobs sent by "nori --submit" */
+		try {
+			RenderServer server(serverName, options);
+			server.run();
+		} catch (const NoriException &ex) {
+			cerr << "Caught a critical exception: " << qPrintable(ex.getReason()) << endl;
+			return -1;
+		}
+		return 0;
+	}
+
+		if (args.size() != 1 && args.size() != 2) {
+				cerr << "Syntax: nori [--headless] [--blocksize <n>] "
+					"[--order spiral|morton|hilbert|cost]" << endl
+				 << "            [--progressive <spp per pass>] [--spp <n>] "
+					"[--time <duration, e.g. 300s>]" << endl
+				 << "            [--adaptive <rel. error> [--adaptive-passes <n>]]" << endl
+				 << "            [--threads <n>] [--pin none|compact|scatter] "
+					"[--numa local|interleave]" << endl
+				 << "            [--checkpoint <interval, e.g. 10m>] [--resume]" << endl
+				 << "            [--crop x,y,w,h] [--shard <i>/<n>] [--raw] "
+					"[--output <file.exr>]" << endl
+				 << "            [--coordinator <port> | --worker <host>[:<port>]] "
+					"[--animation <animation file>]" << endl
+				 << "            [--stats] <scene.xml>" << endl
+				 << "       nori --server <socket> [options]" << endl
+				 << "       nori --submit <socket> [--spp <n>] [--camera <transform>] "
+					"[--priority <n>] [--output <file.exr>] <scene.xml>" << endl
+				 << "       nori --merge <output.exr> <shard1.exr> [<shard2.exr> ..]" << endl
+				 << "       nori --benchmark <scene.xml>" << endl
+				 << "       nori --selftest [--threads <n>]" << endl;
 				return -1;
 		}
 
 		// hidden version number
 		int version = -1;
-		if (argc == 3) {
-				version = atoi(argv[2]);
+		if (args.size() == 2) {
+				version = atoi(args[1]);
 				if(version < 0){
 						cerr << "The version should be positive or null!\n";
 						return -2;
@@ -108,15 +390,23 @@ int main(int argc, char **argv) {
 		}else   cout << "Using default version (0)\n";
 
 		// the file name
-		QString filename(argv[1]);
+		QString filename(args[0]);
 
 	try {
 			if(filename == "--designer"){
+				if (headless) {
+					cerr << "The designer cannot be used in headless mode!" << endl;
+					return -1;
+				}
 				// designer mode
 				Designer design;
 				return qApp->exec();
 
 			} else if (filename.endsWith(".exr")) {
+				if (headless) {
+					cerr << "The image viewer cannot be used in headless mode!" << endl;
+					return -1;
+				}
 				// image mode
 				boost::scoped_ptr<Bitmap> bitmap(new Bitmap(filename));
 				ImageBlock image(bitmap.get());
@@ -127,11 +417,27 @@ int main(int argc, char **argv) {
 
 			} else {
 				// rendering mode
+
+				/* The scene is shared by all render threads. If requested,
+				   spread its memory (geometry, kd-tree) over all NUMA nodes
+				   so that no single memory controller becomes a bottleneck */
+				if (options.memoryPlacement == EInterleave && !setMemoryPlacement(EInterleave))
+					cerr << "Warning: unable to interleave the scene memory" << endl;
 				boost::scoped_ptr<NoriObject> root(loadScene(filename));
 
-		if (root->getClassType() == NoriObject::EScene) {
+				/* Per-thread buffers are best allocated on the local node */
+				if (options.memoryPlacement == EInterleave)
+					setMemoryPlacement(EFirstTouch);
+
+		if (root->getClassType() == NoriObject::EScene && benchmark) {
+			/* Compare the build time, memory usage and speed of all accelerators */
+			Accelerator::benchmark(static_cast<Scene *>(root.get()));
+		} else if (root->getClassType() == NoriObject::EScene && !options.worker.isEmpty()) {
+			/* Render blocks of this scene for a remote coordinator */
+			renderWorker(static_cast<Scene *>(root.get()), options.worker);
+		} else if (root->getClassType() == NoriObject::EScene) {
 			/* The root object is a scene! Start rendering it.. */
-			render(static_cast<Scene *>(root.get()), filename, version);
+			render(static_cast<Scene *>(root.get()), filename, version, options);
 		}
 			}
 	} catch (const NoriException &ex) {
@@ -46,6 +46,16 @@ Mesh::~Mesh() {
 }
 
 void Mesh::activate() {
+	updateDistribution();
+
+	if (!m_bsdf) {
+		/* If no material was assigned, instantiate a diffuse BRDF */
+		m_bsdf = static_cast<BSDF *>(
+			NoriObjectFactory::createInstance("diffuse", PropertyList()));
+	}
+}
+
+void Mesh::updateDistribution() {
 	/* Create a discrete distribution for sampling triangles
 	   with respect to their surface area */
 	m_distr.clear();
@@ -53,12 +63,19 @@ void Mesh::activate() {
 	for (uint32_t i=0; i<m_triangleCount; ++i)
 		m_distr.append(surfaceArea(i));
 	m_distr.normalize();
+}
 
-	if (!m_bsdf) {
-		/* If no material was assigned, instantiate a diffuse BRDF */
-		m_bsdf = static_cast<BSDF *>(
-			NoriObjectFactory::createInstance("diffuse", PropertyList()));
+void Mesh::applyTransform(const Transform &trafo) {
+	for (uint32_t i=0; i<m_vertexCount; ++i)
+		m_vertexPositions[i] = trafo * m_vertexPositions[i];
+
+	if (m_vertexNormals) {
+		for (uint32_t i=0; i<m_vertexCount; ++i)
+			m_vertexNormals[i] = (trafo * m_vertexNormals[i]).normalized();
 	}
+
+	/* The triangle areas change unless the transformation is rigid */
+	updateDistribution();
 }
 
 void Mesh::samplePosition(const Point2f &_sample, Point3f &p, Normal3f &n) const {
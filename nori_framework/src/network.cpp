@@ -0,0 +1,457 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2012 by Wenzel Jakob and Steve Marschner.
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/network.h>
+#include <nori/scene.h>
+#include <nori/camera.h>
+#include <nori/sampler.h>
+#include <QTcpServer>
+#include <QTcpSocket>
+#include <QDataStream>
+
+/* Protocol identification ("NORR") and version */
+#define NORI_REMOTE_MAGIC 0x4E4F5252
+#define NORI_REMOTE_VERSION 1
+
+/* Max. time (in ms) for connecting and for the initial handshake */
+#define NORI_REMOTE_HANDSHAKE_TIMEOUT 30000
+
+/* Max. size (in bytes) of a message that holds no pixel data, e.g. during
+   the handshake. Also added to the size of the pixel data to bound the
+   size of tile and result messages */
+#define NORI_REMOTE_MESSAGE_SLACK 4096
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * Messages exchanged between the coordinator and a worker. Each message
+ * is sent as a 32-bit length followed by a QDataStream-encoded payload,
+ * whose first byte is the message type.
+ */
+enum ERemoteMessage {
+	/// Worker -> coordinator: protocol version and image configuration
+	EHello = 0,
+	/// Coordinator -> worker: connection id and block size
+	EConfig,
+	/// Worker -> coordinator: request a block
+	ERequest,
+	/// Coordinator -> worker: block position, sample count, converged pixels
+	ETile,
+	/// Worker -> coordinator: rendered block including the border region
+	EResult,
+	/// Coordinator -> worker: no more blocks
+	EDone,
+	/// Coordinator -> worker: the connection was refused
+	EError
+};
+
+static bool writeMessage(QTcpSocket &socket, const QByteArray &payload) {
+	QByteArray header;
+	QDataStream stream(&header, QIODevice::WriteOnly);
+	stream << (quint32) payload.size();
+	if (socket.write(header) != header.size() || socket.write(payload) != payload.size())
+		return false;
+	while (socket.bytesToWrite() > 0) {
+		if (!socket.waitForBytesWritten(NORI_REMOTE_TIMEOUT))
+			return false;
+	}
+	return true;
+}
+
+static bool readBytes(QTcpSocket &socket, char *data, qint64 size, int timeout) {
+	while (size > 0) {
+		if (socket.bytesAvailable() == 0 && !socket.waitForReadyRead(timeout))
+			return false;
+		qint64 count = socket.read(data, size);
+		if (count < 0)
+			return false;
+		data += count;
+		size -= count;
+	}
+	return true;
+}
+
+/**
+ * \brief Receive a message of at most \c maxSize bytes
+ *
+ * Longer messages (e.g. from a peer that does not speak this protocol)
+ * are rejected before any memory is allocated for them.
+ */
+static bool readMessage(QTcpSocket &socket, QByteArray &payload, int timeout, quint32 maxSize) {
+	char header[4];
+	if (!readBytes(socket, header, 4, timeout))
+		return false;
+	quint32 size;
+	QDataStream stream(QByteArray(header, 4));
+	stream >> size;
+	if (size > maxSize) {
+		cerr << "Rejecting a message of " << size << " bytes (the limit is "
+			 << maxSize << " bytes)" << endl;
+		return false;
+	}
+	payload.resize((int) size);
+	return readBytes(socket, payload.data(), size, timeout);
+}
+
+/// Return the max. size of a message holding a block of the given size (see \ref readMessage())
+static quint32 getMaxMessageSize(int blockSize, int borderSize) {
+	quint64 pixelCount = (quint64) (blockSize + 2*borderSize) * (blockSize + 2*borderSize);
+	quint64 size = pixelCount * (sizeof(Color4f) + sizeof(Vector3f)) + NORI_REMOTE_MESSAGE_SLACK;
+	return (quint32) std::min(size, (quint64) std::numeric_limits<int>::max());
+}
+
+/// Create a message payload stream whose first entry is the message type
+#define NORI_MESSAGE(name, type) \
+	QByteArray name; \
+	QDataStream name##Stream(&name, QIODevice::WriteOnly); \
+	name##Stream.setVersion(QDataStream::Qt_4_6); \
+	name##Stream << (quint8) type
+
+/**
+ * \brief TCP server that forwards new connections to the coordinator
+ *
+ * Only the socket descriptor is passed on, so that the socket can be
+ * created by the thread that uses it.
+ */
+class RemoteServer : public QTcpServer {
+public:
+	RemoteServer(RemoteCoordinator *coordinator) : m_coordinator(coordinator) { }
+protected:
+	void incomingConnection(int socketDescriptor) {
+		m_coordinator->addConnection(socketDescriptor);
+	}
+private:
+	RemoteCoordinator *m_coordinator;
+};
+
+/// Serves blocks to a single worker thread
+class RemoteConnection : public QThread {
+public:
+	RemoteConnection(const Scene *scene, BlockGenerator *blockGenerator,
+			ImageBlock *output, int socketDescriptor, int id)
+		: m_scene(scene), m_blockGenerator(blockGenerator), m_output(output),
+		  m_socketDescriptor(socketDescriptor), m_id(id) { }
+
+	void run() {
+		QTcpSocket socket;
+		if (!socket.setSocketDescriptor(m_socketDescriptor))
+			return;
+		socket.setSocketOption(QAbstractSocket::KeepAliveOption, 1);
+		m_peer = socket.peerAddress().toString();
+
+		ImageBlock block(Vector2i(m_blockGenerator->getBlockSize()),
+			m_scene->getCamera()->getReconstructionFilter());
+		if (m_output->hasMoments())
+			block.enableMoments();
+
+		if (!handshake(socket, block))
+			return;
+
+		std::vector<bool> converged;
+		QByteArray message;
+		quint32 maxSize = getMaxMessageSize(m_blockGenerator->getBlockSize(),
+			block.getBorderSize());
+		int pass;
+
+		while (true) {
+			/* Wait until the worker asks for a block */
+			if (!readMessage(socket, message, NORI_REMOTE_TIMEOUT, maxSize)) {
+				cerr << "Lost the connection to worker " << m_id << " ("
+					 << qPrintable(m_peer) << ")" << endl;
+				return;
+			}
+
+			/* Fetch the next block that isn't fully converged */
+			int sampleCount = 0;
+			bool adaptive = false, found = false;
+			while (m_blockGenerator->next(block, m_id, &pass)) {
+				sampleCount = m_blockGenerator->getSampleCount(pass);
+				float threshold = m_blockGenerator->getAdaptiveThreshold(pass);
+				adaptive = threshold > 0 && block.hasMoments();
+				if (adaptive && m_output->getConverged(block, threshold, converged)
+						== block.getSize().x() * block.getSize().y()) {
+					m_blockGenerator->finished(block, pass);
+					continue;
+				}
+				found = true;
+				break;
+			}
+
+			if (!found) {
+				NORI_MESSAGE(done, EDone);
+				writeMessage(socket, done);
+				socket.disconnectFromHost();
+				if (socket.state() != QAbstractSocket::UnconnectedState)
+					socket.waitForDisconnected(NORI_REMOTE_HANDSHAKE_TIMEOUT);
+				return;
+			}
+
+			NORI_MESSAGE(tile, ETile);
+			tileStream << (qint32) block.getOffset().x() << (qint32) block.getOffset().y()
+			           << (qint32) block.getSize().x() << (qint32) block.getSize().y()
+			           << (qint32) sampleCount;
+			QByteArray mask;
+			if (adaptive) {
+				mask.resize((int) converged.size());
+				for (size_t i=0; i<converged.size(); ++i)
+					mask[(int) i] = converged[i] ? 1 : 0;
+			}
+			tileStream << mask;
+
+			float time;
+			if (!writeMessage(socket, tile) || !readMessage(socket, message,
+					NORI_REMOTE_TIMEOUT, maxSize) || !readResult(message, block, time)) {
+				cerr << "Lost worker " << m_id << " (" << qPrintable(m_peer)
+					 << "), requeueing its block" << endl;
+				m_blockGenerator->requeue(block, pass);
+				return;
+			}
+
+			m_output->put(block);
+			m_blockGenerator->finished(block, pass, time);
+		}
+	}
+protected:
+	/// Validate the hello message of the worker and send the configuration
+	bool handshake(QTcpSocket &socket, const ImageBlock &block) {
+		QByteArray message;
+		if (!readMessage(socket, message, NORI_REMOTE_HANDSHAKE_TIMEOUT,
+				NORI_REMOTE_MESSAGE_SLACK))
+			return false;
+
+		QDataStream stream(message);
+		stream.setVersion(QDataStream::Qt_4_6);
+		quint8 type;
+		quint32 magic, version;
+		qint32 width, height, borderSize;
+		stream >> type >> magic >> version >> width >> height >> borderSize;
+
+		QString error;
+		Vector2i size = m_scene->getCamera()->getOutputSize();
+		if (stream.status() != QDataStream::Ok || type != EHello || magic != NORI_REMOTE_MAGIC)
+			error = "Invalid handshake";
+		else if (version != NORI_REMOTE_VERSION)
+			error = QString("Protocol version mismatch (coordinator: %1, worker: %2)")
+				.arg(NORI_REMOTE_VERSION).arg(version);
+		else if (width != size.x() || height != size.y() || borderSize != block.getBorderSize())
+			error = QString("Scene mismatch (coordinator: %1x%2 pixels with a %3 pixel filter "
+				"border, worker: %4x%5 pixels with a %6 pixel border)")
+				.arg(size.x()).arg(size.y()).arg(block.getBorderSize())
+				.arg(width).arg(height).arg(borderSize);
+
+		if (!error.isEmpty()) {
+			cerr << "Refusing worker " << qPrintable(m_peer) << ": " << qPrintable(error) << endl;
+			NORI_MESSAGE(reply, EError);
+			replyStream << error;
+			writeMessage(socket, reply);
+			return false;
+		}
+
+		NORI_MESSAGE(reply, EConfig);
+		replyStream << (qint32) m_id << (qint32) m_blockGenerator->getBlockSize()
+		            << (quint8) (block.hasMoments() ? 1 : 0);
+		if (!writeMessage(socket, reply))
+			return false;
+
+		cout << "Worker " << m_id << " (" << qPrintable(m_peer) << ") connected" << endl;
+		return true;
+	}
+
+	/// Parse a result message into the given block
+	bool readResult(const QByteArray &message, ImageBlock &block, float &time) {
+		QDataStream stream(message);
+		stream.setVersion(QDataStream::Qt_4_6);
+		quint8 type;
+		stream >> type >> time;
+		if (type != EResult)
+			return false;
+		try {
+			block.unserialize(stream);
+		} catch (const NoriException &ex) {
+			cerr << "Invalid result from worker " << m_id << ": "
+				 << qPrintable(ex.getReason()) << endl;
+			return false;
+		}
+		return stream.status() == QDataStream::Ok;
+	}
+private:
+	const Scene *m_scene;
+	BlockGenerator *m_blockGenerator;
+	ImageBlock *m_output;
+	int m_socketDescriptor;
+	int m_id;
+	QString m_peer;
+};
+
+RemoteCoordinator::RemoteCoordinator(const Scene *scene, BlockGenerator *blockGenerator,
+		ImageBlock *output, quint16 port)
+	: m_scene(scene), m_blockGenerator(blockGenerator), m_output(output),
+	  m_port(port), m_stop(false) {
+}
+
+RemoteCoordinator::~RemoteCoordinator() {
+	for (size_t i=0; i<m_connections.size(); ++i)
+		delete m_connections[i];
+}
+
+void RemoteCoordinator::run() {
+	RemoteServer server(this);
+	if (!server.listen(QHostAddress::Any, m_port)) {
+		cerr << "Coordinator: unable to listen on port " << m_port << ": "
+			 << qPrintable(server.errorString()) << endl;
+		return;
+	}
+	cout << "Coordinator: waiting for workers on port " << server.serverPort() << endl;
+
+	while (true) {
+		m_mutex.lock();
+		bool stop = m_stop;
+		m_mutex.unlock();
+		if (stop)
+			break;
+		server.waitForNewConnection(100);
+	}
+	server.close();
+}
+
+void RemoteCoordinator::addConnection(int socketDescriptor) {
+	m_mutex.lock();
+	RemoteConnection *connection = new RemoteConnection(m_scene, m_blockGenerator,
+		m_output, socketDescriptor, (int) m_connections.size());
+	m_connections.push_back(connection);
+	connection->start();
+	m_mutex.unlock();
+}
+
+void RemoteCoordinator::stop() {
+	m_mutex.lock();
+	m_stop = true;
+	m_mutex.unlock();
+	wait();
+
+	/* Connections only finish once the block generator has run out
+	   of blocks, or when their worker was lost */
+	for (size_t i=0; i<m_connections.size(); ++i)
+		m_connections[i]->wait();
+}
+
+RemoteWorkerThread::RemoteWorkerThread(const Scene *scene, Sampler *sampler,
+		const QString &host, quint16 port, int id)
+	: BlockRenderThread(scene, sampler, NULL, NULL, id), m_host(host),
+	  m_port(port), m_blockCount(0) {
+}
+
+void RemoteWorkerThread::run() {
+	if (!pinCurrentThread(m_id))
+		cerr << "Warning: unable to pin worker thread " << m_id << " to a CPU" << endl;
+
+	QTcpSocket socket;
+	socket.connectToHost(m_host, m_port);
+	if (!socket.waitForConnected(NORI_REMOTE_HANDSHAKE_TIMEOUT)) {
+		cerr << "Worker: unable to connect to " << qPrintable(m_host) << ":" << m_port
+			 << ": " << qPrintable(socket.errorString()) << endl;
+		return;
+	}
+	socket.setSocketOption(QAbstractSocket::KeepAliveOption, 1);
+
+	try {
+		const ReconstructionFilter *filter = m_scene->getCamera()->getReconstructionFilter();
+		Vector2i size = m_scene->getCamera()->getOutputSize();
+		int borderSize = ImageBlock(Vector2i(1), filter).getBorderSize();
+
+		NORI_MESSAGE(hello, EHello);
+		helloStream << (quint32) NORI_REMOTE_MAGIC << (quint32) NORI_REMOTE_VERSION
+		            << (qint32) size.x() << (qint32) size.y() << (qint32) borderSize;
+		QByteArray message;
+		if (!writeMessage(socket, hello) || !readMessage(socket, message,
+				NORI_REMOTE_HANDSHAKE_TIMEOUT, NORI_REMOTE_MESSAGE_SLACK))
+			throw NoriException("The handshake with the coordinator failed!");
+
+		QDataStream config(message);
+		config.setVersion(QDataStream::Qt_4_6);
+		quint8 type, moments;
+		qint32 id, blockSize;
+		config >> type;
+		if (type == EError) {
+			QString reason;
+			config >> reason;
+			throw NoriException(QString("The coordinator refused the connection: %1").arg(reason));
+		} else if (type != EConfig) {
+			throw NoriException("Unexpected reply from the coordinator!");
+		}
+		config >> id >> blockSize >> moments;
+		if (config.status() != QDataStream::Ok || blockSize <= 0)
+			throw NoriException("Invalid configuration from the coordinator!");
+		quint32 maxSize = getMaxMessageSize(blockSize, borderSize);
+
+		/* Every connection must use a different random number sequence */
+		m_sampler->seed(NORI_REMOTE_SEED + (uint32_t) id);
+
+		ImageBlock block(Vector2i(blockSize), filter);
+		if (moments)
+			block.enableMoments();
+		std::vector<bool> converged;
+		QElapsedTimer timer;
+
+		while (true) {
+			NORI_MESSAGE(request, ERequest);
+			/* The coordinator may take a long time to reply, e.g. when
+			   waiting for other workers to finish the last blocks */
+			if (!writeMessage(socket, request) || !readMessage(socket, message, -1, maxSize))
+				throw NoriException("Lost the connection to the coordinator!");
+
+			QDataStream tile(message);
+			tile.setVersion(QDataStream::Qt_4_6);
+			tile >> type;
+			if (type == EDone)
+				break;
+			else if (type != ETile)
+				throw NoriException("Unexpected message from the coordinator!");
+
+			qint32 offsetX, offsetY, sizeX, sizeY, sampleCount;
+			QByteArray mask;
+			tile >> offsetX >> offsetY >> sizeX >> sizeY >> sampleCount >> mask;
+			/* The block only has room for tiles of up to blockSize^2 pixels */
+			if (tile.status() != QDataStream::Ok || sizeX <= 0 || sizeY <= 0
+					|| sizeX > blockSize || sizeY > blockSize || offsetX < 0 || offsetY < 0
+					|| offsetX + sizeX > size.x() || offsetY + sizeY > size.y() || sampleCount < 0
+					|| (!mask.isEmpty() && mask.size() != sizeX * sizeY))
+				throw NoriException("Invalid tile from the coordinator!");
+			block.setOffset(Point2i(offsetX, offsetY));
+			block.setSize(Vector2i(sizeX, sizeY));
+			converged.resize(mask.size());
+			for (int i=0; i<mask.size(); ++i)
+				converged[i] = mask[i] != 0;
+
+			timer.start();
+			renderBlock(block, sampleCount, mask.isEmpty() ? NULL : &converged);
+			++m_blockCount;
+
+			NORI_MESSAGE(result, EResult);
+			resultStream << (float) timer.elapsed();
+			block.serialize(resultStream);
+			if (!writeMessage(socket, result))
+				throw NoriException("Lost the connection to the coordinator!");
+		}
+	} catch (const NoriException &ex) {
+		cerr << "Worker thread " << m_id << ": " << qPrintable(ex.getReason()) << endl;
+	}
+	socket.disconnectFromHost();
+}
+
+NORI_NAMESPACE_END
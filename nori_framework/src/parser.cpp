@@ -43,6 +43,7 @@ public:
 		ETest                 = NoriObject::ETest,
                 EEvaluator            = NoriObject::EEvaluator,
 		EReconstructionFilter = NoriObject::EReconstructionFilter,
+		EInstance             = NoriObject::EInstance,
 
 		/* Properties */
 		EBoolean = NoriObject::EClassTypeCount,
@@ -72,6 +73,7 @@ public:
 		m_tags["sampler"]    = ESampler;
 		m_tags["rfilter"]    = EReconstructionFilter;
 		m_tags["test"]       = ETest;
+		m_tags["instance"]   = EInstance;
         m_tags["evaluator"]  = EEvaluator;
 		m_tags["boolean"]    = EBoolean;
 		m_tags["integer"]    = EInteger;
@@ -141,6 +143,8 @@ public:
 			m_transform.setIdentity();
 		else if (name == "scene")
 			ctx.attr.append("type", "", "type", "scene");
+		else if (name == "instance")
+			ctx.attr.append("type", "", "type", "instance");
 
 		m_context.push_back(ctx);
 		return true;
@@ -148,6 +148,10 @@ public:
         virtual Transform getTransform() const {
                 return m_cameraToWorld;
         }
+
+	void setTransform(const Transform &trafo) {
+		m_cameraToWorld = trafo;
+	}
         
 	/// Return a human-readable summary
 	QString toString() const {
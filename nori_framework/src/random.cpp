@@ -45,6 +45,7 @@
 */
 
 #include <nori/random.h>
+#include <QDataStream>
 
 NORI_NAMESPACE_BEGIN
 
@@ -102,52 +103,92 @@ void Random::seed(Random *random) {
 	seed(buf, MT_N);
 }
 
-/* generates a random number on [0,0xffffffff]-interval */
-uint32_t Random::nextUInt() {
+/* generates MT_N words at one time */
+void Random::refill() {
 	uint32_t y;
 	static uint32_t mag01[2]={0x0UL, MT_MATRIX_A};
 	/* mag01[x] = x * MT_MATRIX_A  for x=0,1 */
+	int kk;
 
-	if (m_mti >= MT_N) { /* generate MT_N words at one time */
-		int kk;
-
-		if (m_mti == MT_N+1)   /* if seed() has not been called, */
-			seed(5489UL);   /* a default initial seed is used */
-
-		for (kk=0;kk<MT_N-MT_M;kk++) {
-			y = (m_mt[kk] & MT_UPPER_MASK)|(m_mt[kk+1] & MT_LOWER_MASK);
-			m_mt[kk] = m_mt[kk+MT_M] ^ (y >> 1) ^ mag01[y & 0x1UL];
-		}
-		for (;kk<MT_N-1;kk++) {
-			y = (m_mt[kk] & MT_UPPER_MASK)|(m_mt[kk+1] & MT_LOWER_MASK);
-			m_mt[kk] = m_mt[kk+(MT_M-MT_N)] ^ (y >> 1) ^ mag01[y & 0x1UL];
-		}
-		y = (m_mt[MT_N-1] & MT_UPPER_MASK)|(m_mt[0] & MT_LOWER_MASK);
-		m_mt[MT_N-1] = m_mt[MT_M-1] ^ (y >> 1) ^ mag01[y & 0x1UL];
+	if (m_mti == MT_N+1)   /* if seed() has not been called, */
+		seed(5489UL);   /* a default initial seed is used */
 
-		m_mti = 0;
+	for (kk=0;kk<MT_N-MT_M;kk++) {
+		y = (m_mt[kk] & MT_UPPER_MASK)|(m_mt[kk+1] & MT_LOWER_MASK);
+		m_mt[kk] = m_mt[kk+MT_M] ^ (y >> 1) ^ mag01[y & 0x1UL];
 	}
-  
-	y = m_mt[m_mti++];
+	for (;kk<MT_N-1;kk++) {
+		y = (m_mt[kk] & MT_UPPER_MASK)|(m_mt[kk+1] & MT_LOWER_MASK);
+		m_mt[kk] = m_mt[kk+(MT_M-MT_N)] ^ (y >> 1) ^ mag01[y & 0x1UL];
+	}
+	y = (m_mt[MT_N-1] & MT_UPPER_MASK)|(m_mt[0] & MT_LOWER_MASK);
+	m_mt[MT_N-1] = m_mt[MT_M-1] ^ (y >> 1) ^ mag01[y & 0x1UL];
+
+	m_mti = 0;
+}
 
-	/* Tempering */
+/* Tempering */
+static inline uint32_t temper(uint32_t y) {
 	y ^= (y >> 11);
 	y ^= (y << 7) & 0x9d2c5680UL;
 	y ^= (y << 15) & 0xefc60000UL;
 	y ^= (y >> 18);
-
 	return y;
 }
 
-float Random::nextFloat() {
-	/* Trick from MTGP: generate an uniformly distributed 
-	   single precision number in [1,2) and subtract 1. */
+/* Trick from MTGP: generate an uniformly distributed 
+   single precision number in [1,2) and subtract 1. */
+static inline float toFloat(uint32_t value) {
 	union {
 		uint32_t u;
 		float f;
 	} x;
-	x.u = (nextUInt() >> 9) | 0x3f800000UL;
+	x.u = (value >> 9) | 0x3f800000UL;
 	return x.f - 1.0f;
 }
 
+/* generates a random number on [0,0xffffffff]-interval */
+uint32_t Random::nextUInt() {
+	if (m_mti >= MT_N)
+		refill();
+	return temper(m_mt[m_mti++]);
+}
+
+float Random::nextFloat() {
+	return toFloat(nextUInt());
+}
+
+void Random::nextFloats(float *dest, size_t count) {
+	/* Consume the state vector in runs, which
+	   keeps the inner loop free of branches */
+	while (count > 0) {
+		if (m_mti >= MT_N)
+			refill();
+		size_t n = std::min(count, (size_t) (MT_N - m_mti));
+		const uint32_t *mt = m_mt + m_mti;
+		for (size_t i=0; i<n; ++i)
+			dest[i] = toFloat(temper(mt[i]));
+		m_mti += (int) n;
+		dest += n;
+		count -= n;
+	}
+}
+
+void Random::serialize(QDataStream &stream) const {
+	for (int i=0; i<MT_N; ++i)
+		stream << (quint32) m_mt[i];
+	stream << (qint32) m_mti;
+}
+
+void Random::unserialize(QDataStream &stream) {
+	for (int i=0; i<MT_N; ++i) {
+		quint32 value;
+		stream >> value;
+		m_mt[i] = value;
+	}
+	qint32 mti;
+	stream >> mti;
+	m_mti = mti;
+}
+
 NORI_NAMESPACE_END
@@ -0,0 +1,479 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2012 by Wenzel Jakob and Steve Marschner.
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/renderer.h>
+#include <nori/scene.h>
+#include <nori/camera.h>
+#include <nori/instance.h>
+#include <nori/sampler.h>
+#include <nori/bitmap.h>
+#include <nori/integrator.h>
+#include <nori/gui.h>
+#include <nori/network.h>
+#include <boost/scoped_ptr.hpp>
+#include <QApplication>
+#include <QDataStream>
+#include <QTextStream>
+#include <csignal>
+#include <cstdio>
+#include <set>
+
+NORI_NAMESPACE_BEGIN
+
+/// Set by the signal handler when SIGINT or SIGTERM is received
+static volatile sig_atomic_t terminationRequested = 0;
+
+static void handleTermination(int signal) {
+	terminationRequested = 1;
+	/* A second signal terminates the process immediately */
+	::signal(signal, SIG_DFL);
+}
+
+/**
+ * \brief Watches over the render threads during a frame: reports the
+ * progress (in headless mode), writes periodic checkpoints and handles
+ * SIGINT/SIGTERM
+ */
+class RenderMonitor : public QThread {
+public:
+	RenderMonitor(Renderer &renderer, const QString &checkpointName)
+		: m_renderer(renderer), m_checkpointName(checkpointName) { }
+
+	void run() {
+		BlockGenerator *blockGenerator = m_renderer.m_blockGenerator;
+		const RenderOptions &options = m_renderer.m_options;
+		int lastPercent = -1;
+		QElapsedTimer checkpointTimer;
+		checkpointTimer.start();
+
+		while (!blockGenerator->isFrameFinished()) {
+			msleep(NORI_PROGRESS_INTERVAL);
+
+			if (options.headless) {
+				int percent = (int) (100 * blockGenerator->getProgress());
+				if (percent != lastPercent) {
+					cout << "Rendering .. " << percent << "%" << endl;
+					lastPercent = percent;
+				}
+			}
+
+			if (terminationRequested) {
+				cout << "Received a termination request, writing a checkpoint .." << endl;
+				blockGenerator->pause();
+				checkpoint();
+				blockGenerator->stop();
+				blockGenerator->resume();
+				if (!options.headless)
+					QMetaObject::invokeMethod(qApp, "quit", Qt::QueuedConnection);
+				break;
+			} else if (options.checkpointInterval >= 0 &&
+					checkpointTimer.elapsed() >= options.checkpointInterval) {
+				blockGenerator->pause();
+				checkpoint();
+				blockGenerator->resume();
+				checkpointTimer.restart();
+			}
+		}
+	}
+protected:
+	void checkpoint() {
+		try {
+			QElapsedTimer timer;
+			timer.start();
+			m_renderer.saveCheckpoint(m_checkpointName);
+			cout << "Wrote checkpoint \"" << qPrintable(m_checkpointName) << "\" ("
+				 << timer.elapsed() << " ms)" << endl;
+		} catch (const NoriException &ex) {
+			cerr << "Warning: checkpointing failed: " << qPrintable(ex.getReason()) << endl;
+		}
+	}
+private:
+	Renderer &m_renderer;
+	QString m_checkpointName;
+};
+
+Renderer::Renderer(Scene *scene, const RenderOptions &options)
+		: m_scene(scene), m_options(options), m_window(NULL) {
+	const Camera *camera = scene->getCamera();
+	Vector2i outputSize = camera->getOutputSize();
+	int nCores = getThreadCount();
+
+	/* Create a block generator (i.e. a work scheduler) */
+	m_blockGenerator = new BlockGenerator(outputSize, options.blockSize,
+		nCores, options.blockOrder);
+
+	/* Allocate memory for the entire output image */
+	m_result = new ImageBlock(outputSize, camera->getReconstructionFilter());
+	if (options.adaptiveThreshold > 0)
+		m_result->enableMoments();
+	if (options.statistics) {
+		m_result->enableCosts();
+		scene->getAccelerator()->setStatistics(true);
+	}
+
+	/* Sample range shards use an independent random number sequence */
+	if (options.shardCount > 1)
+		scene->getSampler()->seed(NORI_SHARD_SEED + (uint32_t) options.shardIndex);
+
+	try {
+		configure(options);
+	} catch (...) {
+		delete m_result;
+		delete m_blockGenerator;
+		throw;
+	}
+
+	/* Create one render thread per core. They wait
+	   until the first frame is started */
+	for (int i=0; i<nCores; ++i) {
+		m_threads.push_back(new BlockRenderThread(
+			scene, scene->getSampler(), m_blockGenerator, m_result, i));
+		m_threads[i]->start();
+	}
+
+	/* Launch the GUI (unless running in batch mode) */
+	if (!options.headless)
+		m_window = new NoriWindow(m_result);
+}
+
+Renderer::~Renderer() {
+	m_blockGenerator->shutdown();
+	for (size_t i=0; i<m_threads.size(); ++i) {
+		m_threads[i]->wait();
+		delete m_threads[i];
+	}
+	delete m_window;
+	delete m_result;
+	delete m_blockGenerator;
+}
+
+void Renderer::configure(const RenderOptions &options) {
+	if ((options.adaptiveThreshold > 0) != m_result->hasMoments())
+		throw NoriException("Adaptive sampling cannot be switched on or off "
+			"after the renderer has been created!");
+	if (options.statistics != m_result->hasCosts())
+		throw NoriException("Ray statistics cannot be switched on or off "
+			"after the renderer has been created!");
+	m_options = options;
+
+	/* Split the samples into passes when rendering progressively */
+	int sampleCount = options.sampleCount > 0 ? options.sampleCount
+		: (int) m_scene->getSampler()->getSampleCount();
+
+	/* When rendering a sample range shard, take this shard's share of the samples */
+	if (options.shardCount > 1) {
+		int shardSamples = sampleCount / options.shardCount
+			+ (options.shardIndex < sampleCount % options.shardCount ? 1 : 0);
+		if (shardSamples == 0)
+			throw NoriException(QString("Cannot split %1 samples per pixel into %2 shards!")
+				.arg(sampleCount).arg(options.shardCount));
+		cout << "Rendering shard " << options.shardIndex << "/" << options.shardCount
+			 << " (" << shardSamples << " of " << sampleCount << " samples per pixel)" << endl;
+		sampleCount = shardSamples;
+	}
+
+	int samplesPerPass = options.samplesPerPass;
+	if (samplesPerPass == 0 && options.adaptiveThreshold > 0)
+		samplesPerPass = NORI_ADAPTIVE_PASS_SIZE;
+	if (samplesPerPass == 0 && options.timeLimit >= 0)
+		samplesPerPass = 1;
+	if (samplesPerPass == 0)
+		samplesPerPass = sampleCount;
+	m_blockGenerator->setPasses(sampleCount, samplesPerPass);
+	m_blockGenerator->setTimeLimit(options.timeLimit);
+	if (options.adaptiveThreshold > 0)
+		m_blockGenerator->setAdaptive(options.adaptiveThreshold, options.adaptiveMinPasses);
+	if (options.cropSize.x() > 0)
+		m_blockGenerator->setCropWindow(options.cropOffset, options.cropSize);
+	else
+		m_blockGenerator->setCropWindow(Point2i(0, 0), m_result->getSize());
+}
+
+bool Renderer::render(const QString &baseName) {
+	QString outputName = baseName + ".exr";
+	QString checkpointName = baseName + ".checkpoint";
+
+	m_blockGenerator->reset();
+	m_result->clear();
+	if (m_options.statistics)
+		m_scene->getAccelerator()->resetStatistics();
+	QElapsedTimer timer;
+	timer.start();
+
+	/* Continue from a previous checkpoint if requested */
+	if (m_options.resume) {
+		if (QFile::exists(checkpointName)) {
+			loadCheckpoint(checkpointName);
+			cout << "Resuming from \"" << qPrintable(checkpointName) << "\" ("
+				 << (int) (100 * m_blockGenerator->getProgress()) << "% done)" << endl;
+		} else {
+			cout << "No checkpoint found, starting from scratch" << endl;
+		}
+	}
+
+	terminationRequested = 0;
+	signal(SIGINT, handleTermination);
+	signal(SIGTERM, handleTermination);
+
+	m_blockGenerator->startFrame();
+
+	/* Let remote workers help out if requested */
+	boost::scoped_ptr<RemoteCoordinator> coordinator;
+	if (m_options.coordinatorPort > 0) {
+		coordinator.reset(new RemoteCoordinator(m_scene, m_blockGenerator,
+			m_result, (quint16) m_options.coordinatorPort));
+		coordinator->start();
+	}
+
+	RenderMonitor monitor(*this, checkpointName);
+	monitor.start();
+
+	if (!m_window) {
+		/* No preview: the monitor reports the progress on stdout */
+		monitor.wait();
+	} else {
+		m_window->startRefresh();
+		qApp->exec();
+		m_window->stopRefresh();
+	}
+
+	/* Wait for the render threads to finish the frame */
+	monitor.wait();
+	if (coordinator)
+		coordinator->stop();
+	signal(SIGINT, SIG_DFL);
+	signal(SIGTERM, SIG_DFL);
+
+	bool interrupted = terminationRequested != 0;
+	if (interrupted) {
+		cout << "Rendering interrupted, writing a partial image (use --resume to continue)" << endl;
+	} else {
+		cout << "Rendering finished (took " << timer.elapsed() << " ms, "
+			 << m_blockGenerator->getSampleCount() << " samples per pixel)" << endl;
+		if (m_result->hasMoments())
+			cout << "Adaptive sampling: " << m_result->getAverageSampleCount()
+				 << " samples per pixel on average" << endl;
+
+		/* The checkpoint is obsolete now */
+		if (QFile::exists(checkpointName))
+			QFile::remove(checkpointName);
+	}
+
+	if (m_options.statistics) {
+		RayStatistics stats;
+		m_scene->getAccelerator()->getStatistics(stats);
+		cout << qPrintable(stats.toString()) << endl;
+
+		QString costName = baseName + "_cost.exr";
+		cout << "Writing the traversal cost per sample to \"" << qPrintable(costName) << "\"" << endl;
+		boost::scoped_ptr<Bitmap> costs(m_result->toCostBitmap());
+		costs->save(costName);
+	}
+
+	/* Shards are merged later on, save the unnormalized film */
+	if (m_options.raw) {
+		m_result->saveRaw(outputName);
+		return !interrupted;
+	}
+
+	/* Now turn the rendered image block into
+	   a properly normalized bitmap */
+	boost::scoped_ptr<Bitmap> bitmap(m_result->toBitmap());
+
+	/* Evaluate it if meaningful */
+	const Evaluator *ev = m_scene->getEvaluator();
+	if (ev) ev->evaluate(bitmap.get());
+
+	/* Save using the OpenEXR format */
+	bitmap->save(outputName);
+	return !interrupted;
+}
+
+bool Renderer::renderAnimation(const QString &baseName, const std::vector<AnimationFrame> &frames) {
+	Camera *camera = const_cast<Camera *>(m_scene->getCamera());
+	const std::vector<Mesh *> &meshes = m_scene->getMeshes();
+	const std::vector<Instance *> &instances = m_scene->getInstances();
+
+	/* Check the object indices before spending time on rendering */
+	for (size_t i=0; i<frames.size(); ++i) {
+		for (size_t j=0; j<frames[i].instances.size(); ++j) {
+			int index = frames[i].instances[j].first;
+			if (index < 0 || index >= (int) instances.size())
+				throw NoriException(QString("Frame %1 moves instance %2, but the scene "
+					"only contains %3 instances!").arg((int) i).arg(index).arg((int) instances.size()));
+		}
+		for (size_t j=0; j<frames[i].meshes.size(); ++j) {
+			int index = frames[i].meshes[j].first;
+			if (index < 0 || index >= (int) meshes.size())
+				throw NoriException(QString("Frame %1 moves mesh %2, but the scene "
+					"only contains %3 meshes!").arg((int) i).arg(index).arg((int) meshes.size()));
+		}
+	}
+
+	QElapsedTimer timer;
+	timer.start();
+
+	/* Objects that moved since the acceleration data structure was last updated */
+	std::set<Mesh *> movedMeshes;
+	std::set<Instance *> movedInstances;
+
+	int rendered = 0;
+	for (size_t i=0; i<frames.size(); ++i) {
+		const AnimationFrame &frame = frames[i];
+		QString frameName = QString("%1_%2").arg(baseName).arg((int) i, 4, 10, QChar('0'));
+
+		/* The motion of skipped frames must be applied as well, since
+		   meshes are moved relative to their previous placement */
+		for (size_t j=0; j<frame.instances.size(); ++j) {
+			Instance *instance = instances[frame.instances[j].first];
+			instance->setToWorld(frame.instances[j].second);
+			movedInstances.insert(instance);
+		}
+		for (size_t j=0; j<frame.meshes.size(); ++j) {
+			Mesh *mesh = meshes[frame.meshes[j].first];
+			mesh->applyTransform(frame.meshes[j].second);
+			movedMeshes.insert(mesh);
+		}
+
+		/* When resuming, skip the frames that are already done */
+		if (m_options.resume && QFile::exists(frameName + ".exr")
+				&& !QFile::exists(frameName + ".checkpoint"))
+			continue;
+
+		/* A single moved mesh allows a partial update, several ones
+		   are handled at once. Moving an instance only requires
+		   rebuilding the top level of a two-level hierarchy */
+		if (movedMeshes.size() == 1)
+			m_scene->update(*movedMeshes.begin());
+		else if (movedMeshes.size() > 1)
+			m_scene->update(NULL);
+		for (std::set<Instance *>::iterator it = movedInstances.begin();
+				it != movedInstances.end(); ++it)
+			m_scene->update(*it);
+		movedMeshes.clear();
+		movedInstances.clear();
+
+		cout << "Rendering frame " << (i+1) << "/" << frames.size() << " .." << endl;
+		camera->setTransform(frame.camera);
+		if (!render(frameName))
+			return false;
+		++rendered;
+	}
+
+	cout << "Animation finished (rendered " << rendered << " frames in "
+		 << timer.elapsed() << " ms)" << endl;
+	return true;
+}
+
+void Renderer::loadAnimation(const QString &filename, std::vector<AnimationFrame> &frames) {
+	QFile file(filename);
+	if (!file.open(QIODevice::ReadOnly | QIODevice::Text))
+		throw NoriException(QString("Unable to open the animation \"%1\"!").arg(filename));
+
+	QTextStream stream(&file);
+	int lineNumber = 0;
+	AnimationFrame frame;
+	while (!stream.atEnd()) {
+		QString line = stream.readLine().trimmed();
+		++lineNumber;
+		if (line.isEmpty() || line.startsWith("#"))
+			continue;
+		try {
+			if (line.startsWith("instance ") || line.startsWith("mesh ")) {
+				/* Object motion of the next frame: "<type> <index> <transform>" */
+				QString type = line.section(' ', 0, 0),
+					index = line.section(' ', 1, 1, QString::SectionSkipEmpty);
+				bool ok;
+				int value = index.toInt(&ok);
+				if (!ok || value < 0)
+					throw NoriException(QString("Invalid %1 index \"%2\"!").arg(type).arg(index));
+				std::pair<int, Transform> motion(value,
+					Transform::fromLineString(line.section(' ', 2, -1, QString::SectionSkipEmpty)));
+				if (type == "instance")
+					frame.instances.push_back(motion);
+				else
+					frame.meshes.push_back(motion);
+			} else {
+				frame.camera = Transform::fromLineString(line);
+				frames.push_back(frame);
+				frame = AnimationFrame();
+			}
+		} catch (const NoriException &ex) {
+			throw NoriException(QString("%1 (line %2): %3").arg(filename)
+				.arg(lineNumber).arg(ex.getReason()));
+		}
+	}
+
+	if (!frame.instances.empty() || !frame.meshes.empty())
+		throw NoriException(QString("The animation \"%1\" ends with object motion "
+			"that is not followed by a camera transform!").arg(filename));
+	if (frames.empty())
+		throw NoriException(QString("The animation \"%1\" is empty!").arg(filename));
+}
+
+void Renderer::saveCheckpoint(const QString &filename) const {
+	QString tempName = filename + ".tmp";
+	QFile file(tempName);
+	if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate))
+		throw NoriException(QString("Unable to write the checkpoint \"%1\"!").arg(tempName));
+
+	QDataStream stream(&file);
+	stream.setVersion(QDataStream::Qt_4_6);
+	stream << (quint32) NORI_CHECKPOINT_MAGIC << (quint32) NORI_CHECKPOINT_VERSION;
+	m_blockGenerator->serialize(stream);
+	m_result->serialize(stream);
+	stream << (quint32) m_threads.size();
+	for (size_t i=0; i<m_threads.size(); ++i)
+		m_threads[i]->getSampler()->serialize(stream);
+	file.close();
+
+	/* Atomically replace the previous checkpoint */
+	if (std::rename(qPrintable(tempName), qPrintable(filename)) != 0)
+		throw NoriException(QString("Unable to rename \"%1\"!").arg(tempName));
+}
+
+void Renderer::loadCheckpoint(const QString &filename) {
+	QFile file(filename);
+	if (!file.open(QIODevice::ReadOnly))
+		throw NoriException(QString("Unable to read the checkpoint \"%1\"!").arg(filename));
+
+	QDataStream stream(&file);
+	stream.setVersion(QDataStream::Qt_4_6);
+	quint32 magic, version, threadCount;
+	stream >> magic >> version;
+	if (magic != NORI_CHECKPOINT_MAGIC || version != NORI_CHECKPOINT_VERSION)
+		throw NoriException(QString("\"%1\" is not a valid checkpoint!").arg(filename));
+	m_blockGenerator->unserialize(stream);
+	m_result->unserialize(stream);
+
+	/* If the number of threads changed, the additional
+	   threads simply keep their freshly seeded samplers */
+	stream >> threadCount;
+	for (quint32 i=0; i<threadCount; ++i) {
+		if (i < m_threads.size()) {
+			m_threads[i]->getSampler()->unserialize(stream);
+		} else {
+			boost::scoped_ptr<Sampler> dummy(m_threads[0]->getSampler()->clone());
+			dummy->unserialize(stream);
+		}
+	}
+	if (stream.status() != QDataStream::Ok)
+		throw NoriException(QString("The checkpoint \"%1\" is truncated!").arg(filename));
+}
+
+NORI_NAMESPACE_END
@@ -23,17 +23,51 @@
 #include <nori/camera.h>
 #include <nori/luminaire.h>
 #include <nori/medium.h>
+#include <nori/instance.h>
+#include <nori/kdtree.h>
+#include <nori/twolevel.h>
+#include <nori/obj.h>
+#include <nori/random.h>
+#include <QDir>
 
 NORI_NAMESPACE_BEGIN
 
-Scene::Scene(const PropertyList &) 
+Scene::Scene(const PropertyList &propList) 
 	: m_integrator(NULL), m_sampler(NULL), m_camera(NULL), 
 	  m_medium(NULL), m_envLuminaire(NULL), m_evaluator(NULL) {
-	m_kdtree = new KDTree();
+	m_accelName = propList.getString("accelerator", NORI_DEFAULT_ACCELERATOR);
+	m_accel = Accelerator::create(m_accelName);
+	/* Cache built acceleration data structures across runs (empty: disabled) */
+	m_accel->setCacheDirectory(propList.getString("cacheDirectory",
+		QDir(QDir::tempPath()).filePath("nori-cache")));
+	/* Test the last occluder of each thread before traversing shadow rays
+	   (not supported in scenes with instances, see TwoLevelAccel) */
+	m_accel->setShadowCache(propList.getBoolean("shadowCache", true));
+	/* Let rays leaving a surface walk along the ropes of the kd-tree */
+	bool ropes = propList.getBoolean("ropes", false);
+	/* Pick the kd-tree construction parameters using pilot rays (see KDTree::autotune()) */
+	m_autotune = propList.getBoolean("kdAutotune", false);
+	if (KDTree *kdtree = dynamic_cast<KDTree *>(m_accel)) {
+		kdtree->setRopes(ropes);
+		/* SAH kd-tree construction parameters (see GenericKDTree) */
+		kdtree->setTraversalCost(propList.getFloat("kdTraversalCost", kdtree->getTraversalCost()));
+		kdtree->setQueryCost(propList.getFloat("kdQueryCost", kdtree->getQueryCost()));
+		kdtree->setEmptySpaceBonus(propList.getFloat("kdEmptySpaceBonus", kdtree->getEmptySpaceBonus()));
+		kdtree->setStopPrims(propList.getInteger("kdStopPrims", (int) kdtree->getStopPrims()));
+		kdtree->setMinMaxBins(propList.getInteger("kdMinMaxBins", (int) kdtree->getMinMaxBins()));
+		kdtree->setExactPrimitiveThreshold(propList.getInteger("kdExactPrimThreshold",
+			(int) kdtree->getExactPrimitiveThreshold()));
+	}
 }
 
 Scene::~Scene() {
-	delete m_kdtree;
+	delete m_accel;
+	for (size_t i=0; i<m_meshes.size(); ++i)
+		delete m_meshes[i];
+	for (size_t i=0; i<m_instances.size(); ++i)
+		delete m_instances[i];
+	for (std::map<QString, Mesh *>::iterator it = m_shapes.begin(); it != m_shapes.end(); ++it)
+		delete it->second;
 	if (m_sampler)
 		delete m_sampler;
 	if (m_camera)
@@ -89,7 +123,38 @@ Color3f Scene::evalTransmittance(const Ray3f &ray, Sampler *sampler) const {
 }
 
 void Scene::activate() {
-	m_kdtree->build();
+	if (!m_instances.empty()) {
+		/* Trace the regular meshes and all instances through a two-level hierarchy */
+		TwoLevelAccel *accel = new TwoLevelAccel(m_accel, m_accelName);
+		for (size_t i=0; i<m_instances.size(); ++i)
+			accel->addInstance(m_instances[i]);
+		m_accel = accel;
+	}
+
+	KDTree *kdtree = dynamic_cast<KDTree *>(m_accel);
+	if (m_autotune && kdtree && m_camera) {
+		/* Pilot set: a jittered grid of camera rays covering the image */
+		Vector2i size = m_camera->getOutputSize();
+		std::vector<Ray3f> cameraRays;
+		cameraRays.reserve(NORI_KD_AUTOTUNE_RESOLUTION * NORI_KD_AUTOTUNE_RESOLUTION);
+		Random random;
+		for (int y=0; y<NORI_KD_AUTOTUNE_RESOLUTION; ++y) {
+			for (int x=0; x<NORI_KD_AUTOTUNE_RESOLUTION; ++x) {
+				Ray3f ray;
+				Point2f pixelSample(
+					(x + random.nextFloat()) * size.x() / NORI_KD_AUTOTUNE_RESOLUTION,
+					(y + random.nextFloat()) * size.y() / NORI_KD_AUTOTUNE_RESOLUTION);
+				m_camera->sampleRay(ray, pixelSample, Point2f(0.5f, 0.5f));
+				cameraRays.push_back(ray);
+			}
+		}
+		kdtree->autotune(cameraRays);
+	} else {
+		if (m_autotune)
+			cout << "Warning: kd-tree autotuning requires a kd-tree accelerator "
+				"without instances, building with the given parameters" << endl;
+		m_accel->build();
+	}
 
 	if (!m_integrator)
 		throw NoriException("No integrator was specified!");
@@ -111,13 +176,26 @@ void Scene::addChild(NoriObject *obj) {
 	switch (obj->getClassType()) {
 		case EMesh: {
 				Mesh *mesh = static_cast<Mesh *>(obj);
-				m_kdtree->addMesh(mesh);
+				m_accel->addMesh(mesh);
 				m_meshes.push_back(mesh);
 				if (mesh->isLuminaire())
 					m_luminaires.push_back(mesh->getLuminaire());
 			}
 			break;
 		
+		case EInstance: {
+				Instance *instance = static_cast<Instance *>(obj);
+				/* Every referenced file is only loaded once */
+				Mesh *&shape = m_shapes[instance->getFilename()];
+				if (!shape) {
+					shape = loadOBJFile(instance->getFilename());
+					shape->activate();
+				}
+				instance->setShape(shape);
+				m_instances.push_back(instance);
+			}
+			break;
+
 		case ELuminaire: {
 				Luminaire *luminaire = static_cast<Luminaire *>(obj);
 				if (!luminaire->isEnvironmentLuminaire())
@@ -169,9 +247,12 @@ void Scene::addChild(NoriObject *obj) {
 
 QString Scene::toString() const {
 	QString meshes;
-	for (size_t i=0; i<m_meshes.size(); ++i) {
-		meshes += QString("  ") + indent(m_meshes[i]->toString(), 2);
-		if (i + 1 < m_meshes.size())
+	size_t meshCount = m_meshes.size() + m_instances.size();
+	for (size_t i=0; i<meshCount; ++i) {
+		const Mesh *mesh = i < m_meshes.size() ? m_meshes[i]
+			: m_instances[i - m_meshes.size()];
+		meshes += QString("  ") + indent(mesh->toString(), 2);
+		if (i + 1 < meshCount)
 			meshes += ",";
 		meshes += "\n";
 	}
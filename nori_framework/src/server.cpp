@@ -0,0 +1,421 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2012 by Wenzel Jakob and Steve Marschner.
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/server.h>
+#include <nori/parser.h>
+#include <nori/scene.h>
+#include <nori/camera.h>
+#include <QDir>
+#include <QFileInfo>
+#include <QLocalServer>
+#include <QLocalSocket>
+
+NORI_NAMESPACE_BEGIN
+
+/// Write a single line to a client socket
+static bool writeLine(QLocalSocket &socket, const QString &line) {
+	QByteArray data = (line + "\n").toUtf8();
+	if (socket.write(data) != data.size())
+		return false;
+	return socket.waitForBytesWritten(NORI_SERVER_TIMEOUT);
+}
+
+/// Serves a single client: reads its request and reports the result
+class ServerConnection : public QThread {
+public:
+	ServerConnection(RenderServer *server, quintptr socketDescriptor)
+		: m_server(server), m_socketDescriptor(socketDescriptor) { }
+
+	void run() {
+		QLocalSocket socket;
+		if (!socket.setSocketDescriptor(m_socketDescriptor))
+			return;
+
+		/* Read "key value" lines up to the first empty line */
+		QStringList lines;
+		while (true) {
+			if (!socket.canReadLine() && !socket.waitForReadyRead(NORI_SERVER_TIMEOUT))
+				return;
+			if (!socket.canReadLine())
+				continue;
+			QString line = QString::fromUtf8(socket.readLine()).trimmed();
+			if (line.isEmpty())
+				break;
+			lines << line;
+		}
+
+		RenderJob job;
+		try {
+			job = RenderJob::parse(lines);
+		} catch (const NoriException &ex) {
+			writeLine(socket, "error " + ex.getReason());
+			socket.disconnectFromServer();
+			return;
+		}
+
+		int position = m_server->enqueue(&job);
+		writeLine(socket, QString("queued %1 %2").arg(job.id).arg(position));
+		m_server->waitFor(&job);
+		writeLine(socket, job.result);
+		socket.disconnectFromServer();
+	}
+private:
+	RenderServer *m_server;
+	quintptr m_socketDescriptor;
+};
+
+/// Local socket server that hands new connections to a \ref ServerConnection
+class LocalServer : public QLocalServer {
+public:
+	LocalServer(ServerListener *listener) : m_listener(listener) { }
+protected:
+	void incomingConnection(quintptr socketDescriptor);
+private:
+	ServerListener *m_listener;
+};
+
+/// Accepts connections in the background while the server is rendering
+class ServerListener : public QThread {
+public:
+	ServerListener(RenderServer *server, const QString &name)
+		: m_server(server), m_name(name), m_stop(false), m_listening(false) { }
+
+	~ServerListener() {
+		for (size_t i=0; i<m_connections.size(); ++i) {
+			m_connections[i]->wait();
+			delete m_connections[i];
+		}
+	}
+
+	void run() {
+		LocalServer server(this);
+
+		/* Remove a stale socket left behind by a server that crashed */
+		QLocalServer::removeServer(m_name);
+		bool listening = server.listen(m_name);
+		m_mutex.lock();
+		m_listening = listening;
+		m_error = server.errorString();
+		m_cond.wakeAll();
+		m_mutex.unlock();
+		if (!listening)
+			return;
+
+		while (true) {
+			m_mutex.lock();
+			bool stop = m_stop;
+			m_mutex.unlock();
+			if (stop)
+				break;
+			server.waitForNewConnection(100);
+			collectFinished();
+		}
+		server.close();
+	}
+
+	/// Wait until the socket is being listened on, throws an exception on failure
+	void waitUntilListening() {
+		m_mutex.lock();
+		while (!m_listening && isRunning())
+			m_cond.wait(&m_mutex, 100);
+		bool listening = m_listening;
+		m_mutex.unlock();
+		if (!listening)
+			throw NoriException(QString("Unable to listen on \"%1\": %2")
+				.arg(m_name).arg(m_error));
+	}
+
+	/// Stop accepting connections
+	void stop() {
+		m_mutex.lock();
+		m_stop = true;
+		m_mutex.unlock();
+		wait();
+	}
+
+	void addConnection(quintptr socketDescriptor) {
+		ServerConnection *connection = new ServerConnection(m_server, socketDescriptor);
+		m_connections.push_back(connection);
+		connection->start();
+	}
+protected:
+	/// Release the connections whose client has been served
+	void collectFinished() {
+		std::vector<ServerConnection *> active;
+		for (size_t i=0; i<m_connections.size(); ++i) {
+			if (m_connections[i]->isFinished())
+				delete m_connections[i];
+			else
+				active.push_back(m_connections[i]);
+		}
+		m_connections.swap(active);
+	}
+private:
+	RenderServer *m_server;
+	QString m_name, m_error;
+	std::vector<ServerConnection *> m_connections;
+	QMutex m_mutex;
+	QWaitCondition m_cond;
+	bool m_stop, m_listening;
+};
+
+void LocalServer::incomingConnection(quintptr socketDescriptor) {
+	m_listener->addConnection(socketDescriptor);
+}
+
+RenderJob RenderJob::parse(const QStringList &lines) {
+	RenderJob job;
+	for (int i=0; i<lines.size(); ++i) {
+		int separator = lines[i].indexOf(' ');
+		QString key = lines[i].left(separator).toLower(),
+		        value = separator < 0 ? QString() : lines[i].mid(separator + 1).trimmed();
+		bool ok = true;
+
+		if (key == "scene") {
+			job.scene = value;
+		} else if (key == "output") {
+			job.output = value;
+		} else if (key == "spp") {
+			job.sampleCount = value.toInt(&ok);
+			ok = ok && job.sampleCount > 0;
+		} else if (key == "progressive") {
+			job.samplesPerPass = value.toInt(&ok);
+			ok = ok && job.samplesPerPass > 0;
+		} else if (key == "time") {
+			job.timeLimit = value.toLongLong(&ok);
+			ok = ok && job.timeLimit >= 0;
+		} else if (key == "priority") {
+			job.priority = value.toInt(&ok);
+		} else if (key == "camera") {
+			job.camera = Transform::fromLineString(value);
+			job.hasCamera = true;
+		} else {
+			throw NoriException(QString("Unknown request key \"%1\"!").arg(key));
+		}
+		if (!ok)
+			throw NoriException(QString("Invalid value \"%1\" for \"%2\"!").arg(value).arg(key));
+	}
+	if (job.scene.isEmpty())
+		throw NoriException("The request does not specify a scene!");
+	return job;
+}
+
+RenderServer::RenderServer(const QString &name, const RenderOptions &options)
+	: m_name(name), m_options(options), m_useCount(0), m_nextId(1) {
+	m_options.headless = true;
+	m_listener = new ServerListener(this, name);
+}
+
+RenderServer::~RenderServer() {
+	m_listener->stop();
+	delete m_listener;
+	for (size_t i=0; i<m_cache.size(); ++i) {
+		delete m_cache[i].renderer;
+		delete m_cache[i].root;
+	}
+}
+
+int RenderServer::enqueue(RenderJob *job) {
+	QMutexLocker locker(&m_mutex);
+	job->id = m_nextId++;
+	int position = 0;
+	for (size_t i=0; i<m_queue.size(); ++i)
+		if (m_queue[i]->priority >= job->priority)
+			++position;
+	m_queue.push_back(job);
+	m_queueCond.wakeAll();
+	return position;
+}
+
+void RenderServer::waitFor(const RenderJob *job) {
+	QMutexLocker locker(&m_mutex);
+	while (!job->done)
+		m_doneCond.wait(&m_mutex);
+}
+
+void RenderServer::run() {
+	m_listener->start();
+	m_listener->waitUntilListening();
+	cout << "Render server: waiting for jobs on \"" << qPrintable(m_name) << "\"" << endl;
+
+	while (true) {
+		/* Take the job with the highest priority (the oldest one among equals) */
+		m_mutex.lock();
+		while (m_queue.empty())
+			m_queueCond.wait(&m_mutex);
+		size_t best = 0;
+		for (size_t i=1; i<m_queue.size(); ++i)
+			if (m_queue[i]->priority > m_queue[best]->priority)
+				best = i;
+		RenderJob *job = m_queue[best];
+		m_queue.erase(m_queue.begin() + best);
+		m_mutex.unlock();
+
+		bool interrupted = !process(job);
+
+		m_mutex.lock();
+		job->done = true;
+		m_doneCond.wakeAll();
+		m_mutex.unlock();
+
+		if (interrupted)
+			break;
+	}
+
+	/* Reject the remaining jobs */
+	m_mutex.lock();
+	for (size_t i=0; i<m_queue.size(); ++i) {
+		m_queue[i]->result = "error The render server was shut down";
+		m_queue[i]->done = true;
+	}
+	m_queue.clear();
+	m_doneCond.wakeAll();
+	m_mutex.unlock();
+}
+
+RenderServer::CachedScene &RenderServer::getScene(const QString &filename) {
+	QFileInfo info(filename);
+	if (!info.exists())
+		throw NoriException(QString("The scene \"%1\" does not exist!").arg(filename));
+
+	for (size_t i=0; i<m_cache.size(); ++i) {
+		CachedScene &entry = m_cache[i];
+		if (entry.filename != filename)
+			continue;
+		if (entry.lastModified == info.lastModified()) {
+			entry.lastUsed = ++m_useCount;
+			return entry;
+		}
+		/* The scene has changed on disk */
+		cout << "Render server: reloading \"" << qPrintable(filename) << "\"" << endl;
+		delete entry.renderer;
+		delete entry.root;
+		m_cache.erase(m_cache.begin() + i);
+		break;
+	}
+
+	/* Make room by evicting the least recently used scene */
+	if (m_cache.size() >= NORI_SERVER_CACHE_SIZE) {
+		size_t oldest = 0;
+		for (size_t i=1; i<m_cache.size(); ++i)
+			if (m_cache[i].lastUsed < m_cache[oldest].lastUsed)
+				oldest = i;
+		delete m_cache[oldest].renderer;
+		delete m_cache[oldest].root;
+		m_cache.erase(m_cache.begin() + oldest);
+	}
+
+	NoriObject *root = loadScene(filename);
+	if (root->getClassType() != NoriObject::EScene) {
+		delete root;
+		throw NoriException(QString("\"%1\" does not contain a scene!").arg(filename));
+	}
+	Scene *scene = static_cast<Scene *>(root);
+
+	CachedScene entry;
+	entry.filename = filename;
+	entry.lastModified = info.lastModified();
+	entry.root = root;
+	try {
+		entry.renderer = new Renderer(scene, m_options);
+	} catch (...) {
+		delete root;
+		throw;
+	}
+	entry.cameraToWorld = scene->getCamera()->getTransform();
+	entry.cameraModified = false;
+	entry.lastUsed = ++m_useCount;
+	m_cache.push_back(entry);
+	return m_cache.back();
+}
+
+bool RenderServer::process(RenderJob *job) {
+	cout << "Render server: job " << job->id << " (\"" << qPrintable(job->scene)
+		 << "\", priority " << job->priority << ")" << endl;
+
+	try {
+		QElapsedTimer timer;
+		timer.start();
+		CachedScene &entry = getScene(job->scene);
+		Scene *scene = static_cast<Scene *>(entry.root);
+
+		/* Apply the camera override, or undo the one of a previous job */
+		Camera *camera = const_cast<Camera *>(scene->getCamera());
+		if (job->hasCamera) {
+			camera->setTransform(job->camera);
+			entry.cameraModified = true;
+		} else if (entry.cameraModified) {
+			camera->setTransform(entry.cameraToWorld);
+			entry.cameraModified = false;
+		}
+
+		RenderOptions options = m_options;
+		options.sampleCount = job->sampleCount;
+		options.samplesPerPass = job->samplesPerPass;
+		options.timeLimit = job->timeLimit;
+		entry.renderer->configure(options);
+
+		QString baseName = job->output;
+		if (baseName.isEmpty()) {
+			QFileInfo info(job->scene);
+			baseName = info.path() + QDir::separator() + info.completeBaseName();
+		} else if (baseName.endsWith(".exr")) {
+			baseName.chop(4);
+		}
+
+		if (!entry.renderer->render(baseName)) {
+			job->result = "error Rendering was interrupted";
+			return false;
+		}
+		job->result = QString("done %1.exr %2").arg(baseName).arg(timer.elapsed());
+	} catch (const NoriException &ex) {
+		cerr << "Render server: job " << job->id << " failed: "
+			 << qPrintable(ex.getReason()) << endl;
+		job->result = "error " + ex.getReason();
+	}
+	return true;
+}
+
+bool RenderServer::submit(const QString &name, const QStringList &request) {
+	QLocalSocket socket;
+	socket.connectToServer(name);
+	if (!socket.waitForConnected(NORI_SERVER_TIMEOUT))
+		throw NoriException(QString("Unable to connect to the render server \"%1\": %2")
+			.arg(name).arg(socket.errorString()));
+
+	for (int i=0; i<request.size(); ++i)
+		writeLine(socket, request[i]);
+	writeLine(socket, "");
+
+	/* Print the replies until the server closes the connection */
+	bool success = false;
+	while (socket.state() == QLocalSocket::ConnectedState || socket.bytesAvailable() > 0) {
+		if (!socket.canReadLine()) {
+			if (!socket.waitForReadyRead(-1) && !socket.canReadLine())
+				break;
+			continue;
+		}
+		QString line = QString::fromUtf8(socket.readLine()).trimmed();
+		cout << qPrintable(line) << endl;
+		if (line.startsWith("done "))
+			success = true;
+	}
+	return success;
+}
+
+NORI_NAMESPACE_END
@@ -0,0 +1,373 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2012 by Wenzel Jakob and Steve Marschner.
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/twolevel.h>
+#include <nori/instance.h>
+#include <QElapsedTimer>
+
+NORI_NAMESPACE_BEGIN
+
+/// Orders top-level objects by the center of their bounding box along an axis
+struct ObjectOrder {
+	int axis;
+
+	inline ObjectOrder(int axis) : axis(axis) { }
+
+	template <typename T> inline bool operator()(const T &a, const T &b) const {
+		return a.bbox.getCenter()[axis] < b.bbox.getCenter()[axis];
+	}
+};
+
+/// Does a ray segment overlap a bounding box? Returns the entry distance in \c nearT
+static inline bool intersectBox(const BoundingBox3f &bbox, const Ray3f &ray, float &nearT) {
+	float farT;
+	if (!bbox.rayIntersect(ray, nearT, farT))
+		return false;
+	nearT = std::max(nearT, ray.mint);
+	return nearT <= std::min(farT, ray.maxt);
+}
+
+TwoLevelAccel::TwoLevelAccel(Accelerator *flat, const QString &bottomLevel)
+	: m_flat(flat), m_bottomLevel(bottomLevel) {
+	m_cacheDirectory = flat->getCacheDirectory();
+	/* A single cached slot cannot identify a triangle of the flat
+	   accelerator or of a particular instance (see findOccluder()) */
+	m_shadowCache = false;
+}
+
+TwoLevelAccel::~TwoLevelAccel() {
+	delete m_flat;
+	for (std::map<const Mesh *, Accelerator *>::iterator it = m_shapes.begin();
+			it != m_shapes.end(); ++it)
+		delete it->second;
+}
+
+void TwoLevelAccel::addMesh(Mesh *mesh) {
+	m_flat->addMesh(mesh);
+}
+
+void TwoLevelAccel::addInstance(Instance *instance) {
+	Mesh *shape = instance->getShape();
+	if (!shape)
+		throw NoriException(QString("TwoLevelAccel: the instance of \"%1\" "
+			"has no shape!").arg(instance->getFilename()));
+
+	if (m_shapes.find(shape) == m_shapes.end()) {
+		Accelerator *accel = Accelerator::create(m_bottomLevel);
+		accel->setCacheDirectory(m_cacheDirectory);
+		accel->addMesh(shape);
+		m_shapes[shape] = accel;
+	}
+	m_instances.push_back(instance);
+}
+
+void TwoLevelAccel::build() {
+	if (m_flat->getPrimitiveCount() > 0)
+		m_flat->build();
+
+	for (std::map<const Mesh *, Accelerator *>::iterator it = m_shapes.begin();
+			it != m_shapes.end(); ++it)
+		it->second->build();
+
+	buildTopLevel();
+}
+
+void TwoLevelAccel::refit(const Mesh *mesh) {
+	if (mesh == NULL) {
+		if (m_flat->getPrimitiveCount() > 0)
+			m_flat->refit();
+		for (std::map<const Mesh *, Accelerator *>::iterator it = m_shapes.begin();
+				it != m_shapes.end(); ++it)
+			it->second->refit();
+	} else if (mesh->getClassType() != NoriObject::EInstance) {
+		/* Only update the structure that contains the mesh. Nothing
+		   needs to be done below the top level when an instance moved */
+		std::map<const Mesh *, Accelerator *>::iterator it = m_shapes.find(mesh);
+		if (it != m_shapes.end())
+			it->second->refit(mesh);
+		else
+			m_flat->refit(mesh);
+	}
+
+	buildTopLevel();
+}
+
+void TwoLevelAccel::buildTopLevel() {
+	m_objects.clear();
+	m_nodes.clear();
+	m_bbox.reset();
+	m_primitiveCount = 0;
+
+	if (m_flat->getPrimitiveCount() > 0) {
+		Object obj;
+		obj.bbox = m_flat->getBoundingBox();
+		obj.accel = m_flat;
+		obj.instance = NULL;
+		m_objects.push_back(obj);
+		m_primitiveCount += m_flat->getPrimitiveCount();
+	}
+
+	cout << "Constructing a two-level hierarchy (" << m_instances.size()
+		 << " instances of " << m_shapes.size() << " shapes) .." << endl;
+
+	QElapsedTimer timer;
+	timer.start();
+
+	for (size_t i=0; i<m_instances.size(); ++i) {
+		const Instance *instance = m_instances[i];
+		const Accelerator *accel = m_shapes[instance->getShape()];
+		if (accel->getPrimitiveCount() == 0)
+			continue;
+
+		/* Bound the transformed corners of the object space bounding box */
+		const BoundingBox3f &bbox = accel->getBoundingBox();
+		Object obj;
+		obj.bbox.reset();
+		for (int j=0; j<8; ++j)
+			obj.bbox.expandBy(instance->getToWorld() * bbox.getCorner(j));
+		obj.accel = accel;
+		obj.instance = instance;
+		m_objects.push_back(obj);
+		m_primitiveCount += accel->getPrimitiveCount();
+	}
+
+	for (size_t i=0; i<m_objects.size(); ++i)
+		m_bbox.expandBy(m_objects[i].bbox);
+
+	if (m_objects.empty()) {
+		cout << "Warning: two-level hierarchy contains no geometry!" << endl;
+		return;
+	}
+
+	m_nodes.reserve(2 * m_objects.size());
+	buildRecursive(0, (uint32_t) m_objects.size());
+
+	cout << "Finished after " << timer.elapsed() << " ms" << endl
+		<< "The final two-level hierarchy references " << m_primitiveCount
+		<< " triangles and requires " << getMemoryUsage() / 1024 << " KiB of memory" << endl;
+}
+
+uint32_t TwoLevelAccel::buildRecursive(uint32_t start, uint32_t end) {
+	uint32_t nodeIndex = (uint32_t) m_nodes.size();
+	m_nodes.push_back(Node());
+
+	BoundingBox3f bbox, centroidBBox;
+	for (uint32_t i=start; i<end; ++i) {
+		bbox.expandBy(m_objects[i].bbox);
+		centroidBBox.expandBy(m_objects[i].bbox.getCenter());
+	}
+	m_nodes[nodeIndex].bbox = bbox;
+
+	uint32_t count = end - start;
+	if (count <= NORI_TOPLEVEL_MAX_LEAF_SIZE) {
+		m_nodes[nodeIndex].offset = start;
+		m_nodes[nodeIndex].count = count;
+		return nodeIndex;
+	}
+
+	/* There are few objects, hence simply split at the object
+	   median, which also bounds the depth of the hierarchy */
+	uint32_t mid = start + count / 2;
+	std::nth_element(m_objects.begin() + start, m_objects.begin() + mid,
+		m_objects.begin() + end, ObjectOrder(centroidBBox.getMajorAxis()));
+
+	/* The first child directly follows its parent */
+	buildRecursive(start, mid);
+	uint32_t right = buildRecursive(mid, end);
+
+	m_nodes[nodeIndex].offset = right;
+	m_nodes[nodeIndex].count = 0;
+	return nodeIndex;
+}
+
+void TwoLevelAccel::setStatistics(bool enabled) {
+	Accelerator::setStatistics(enabled);
+	m_flat->setStatistics(enabled);
+	for (std::map<const Mesh *, Accelerator *>::iterator it = m_shapes.begin();
+			it != m_shapes.end(); ++it)
+		it->second->setStatistics(enabled);
+}
+
+void TwoLevelAccel::getStatistics(RayStatistics &stats) const {
+	Accelerator::getStatistics(stats);
+	m_flat->getStatistics(stats);
+	for (std::map<const Mesh *, Accelerator *>::const_iterator it = m_shapes.begin();
+			it != m_shapes.end(); ++it)
+		it->second->getStatistics(stats);
+}
+
+void TwoLevelAccel::getThreadStatistics(RayStatistics &stats) const {
+	Accelerator::getThreadStatistics(stats);
+	m_flat->getThreadStatistics(stats);
+	for (std::map<const Mesh *, Accelerator *>::const_iterator it = m_shapes.begin();
+			it != m_shapes.end(); ++it)
+		it->second->getThreadStatistics(stats);
+}
+
+void TwoLevelAccel::resetStatistics() {
+	Accelerator::resetStatistics();
+	m_flat->resetStatistics();
+	for (std::map<const Mesh *, Accelerator *>::iterator it = m_shapes.begin();
+			it != m_shapes.end(); ++it)
+		it->second->resetStatistics();
+}
+
+size_t TwoLevelAccel::getMemoryUsage() const {
+	size_t result = m_nodes.size() * sizeof(Node) + m_objects.size() * sizeof(Object);
+	if (m_flat->getPrimitiveCount() > 0)
+		result += m_flat->getMemoryUsage();
+	for (std::map<const Mesh *, Accelerator *>::const_iterator it = m_shapes.begin();
+			it != m_shapes.end(); ++it)
+		result += it->second->getMemoryUsage();
+	return result;
+}
+
+QString TwoLevelAccel::getName() const {
+	return QString("two-level %1").arg(m_flat->getName());
+}
+
+bool TwoLevelAccel::rayIntersect(const Ray3f &ray, Intersection &its, bool shadowRay) const {
+	its.t = std::numeric_limits<float>::infinity();
+	return traverse(ray, its, shadowRay);
+}
+
+bool TwoLevelAccel::closestPoint(const Point3f &p, float maxDist, Intersection &its) const {
+	if (!m_instances.empty())
+		throw NoriException("Closest point queries are not supported in scenes with instances!");
+	return m_flat->closestPoint(p, maxDist, its);
+}
+
+void TwoLevelAccel::trianglesInRadius(const Point3f &p, float radius,
+		std::vector<TriangleRef> &triangles) const {
+	if (!m_instances.empty())
+		throw NoriException("Radius queries are not supported in scenes with instances!");
+	m_flat->trianglesInRadius(p, radius, triangles);
+}
+
+bool TwoLevelAccel::findOccluder(const Ray3f &ray, float mint, float maxt,
+		uint32_t leaf, uint32_t &slot) const {
+	Q_UNUSED(leaf);
+	Intersection its; /* Unused */
+	slot = NORI_NO_OCCLUDER; /* The shadow cache is disabled */
+	return traverse(Ray3f(ray, mint, maxt), its, true);
+}
+
+bool TwoLevelAccel::traverse(const Ray3f &_ray, Intersection &its, bool shadowRay) const {
+	/// Top-level traversal stack (far children and their entry distance)
+	struct {
+		uint32_t node;
+		float t;
+	} stack[NORI_TOPLEVEL_MAXDEPTH];
+
+	float nearT;
+	if (m_nodes.empty() || !intersectBox(m_nodes[0].bbox, _ray, nearT))
+		return false;
+
+	/* The extent of the ray shrinks whenever a closer intersection is found */
+	Ray3f ray(_ray);
+
+	/* Use an adaptive ray epsilon that depends on the world space origin.
+	   The distance along the ray is the same in object space, hence the
+	   bottom-level accelerators can reuse it */
+	if (ray.mint == Epsilon)
+		ray.mint = std::max(ray.mint, ray.mint * ray.o.array().abs().maxCoeff());
+	const Object *foundObject = NULL;
+	uint32_t stackSize = 0, nodeIndex = 0;
+
+	while (true) {
+		const Node &node = m_nodes[nodeIndex];
+
+		if (node.isLeaf()) {
+			for (uint32_t i=node.offset; i<node.offset + node.count; ++i) {
+				const Object &obj = m_objects[i];
+				Intersection objIts;
+				bool hit = obj.instance
+					? obj.accel->rayIntersect(obj.instance->getWorldToObject() * ray, objIts, shadowRay)
+					: obj.accel->rayIntersect(ray, objIts, shadowRay);
+				if (!hit)
+					continue;
+				if (shadowRay)
+					return true;
+				its = objIts;
+				ray.maxt = objIts.t;
+				foundObject = &obj;
+			}
+		} else {
+			/* Visit the nearer child first */
+			uint32_t nearChild = nodeIndex + 1, farChild = node.offset;
+			float farT;
+			bool hitNear = intersectBox(m_nodes[nearChild].bbox, ray, nearT);
+			bool hitFar  = intersectBox(m_nodes[farChild].bbox, ray, farT);
+
+			if (hitNear && hitFar) {
+				if (farT < nearT) {
+					std::swap(nearChild, farChild);
+					std::swap(nearT, farT);
+				}
+				stack[stackSize].node = farChild;
+				stack[stackSize].t = farT;
+				++stackSize;
+				nodeIndex = nearChild;
+				continue;
+			} else if (hitNear) {
+				nodeIndex = nearChild;
+				continue;
+			} else if (hitFar) {
+				nodeIndex = farChild;
+				continue;
+			}
+		}
+
+		/* Pop the next node that may still contain a closer intersection */
+		bool popped = false;
+		while (stackSize > 0) {
+			--stackSize;
+			if (stack[stackSize].t <= ray.maxt) {
+				nodeIndex = stack[stackSize].node;
+				popped = true;
+				break;
+			}
+		}
+		if (!popped)
+			break;
+	}
+
+	if (foundObject && foundObject->instance) {
+		/* Transform the intersection record into world space */
+		const Instance *instance = foundObject->instance;
+		const Transform &toWorld = instance->getToWorld();
+		Vector3f n = (toWorld * its.geoFrame.n).normalized();
+		if (instance->flipsOrientation())
+			n = -n; /* Matches the winding of the transformed triangle */
+
+		its.p = toWorld * its.p;
+		its.geoFrame = Frame(n);
+		if (instance->getShape()->getVertexNormals())
+			its.shFrame = Frame(Vector3f((toWorld * its.shFrame.n).normalized()));
+		else
+			its.shFrame = its.geoFrame;
+		its.mesh = instance;
+	}
+
+	/* Leaves of the flat and bottom-level kd-trees are meaningless here */
+	its.leaf = NORI_NO_LEAF;
+
+	return foundObject != NULL;
+}
+
+NORI_NAMESPACE_END